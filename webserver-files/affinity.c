@@ -0,0 +1,216 @@
+#define _GNU_SOURCE // sched_getaffinity, pthread_attr_setaffinity_np
+#include "affinity.h"
+#include <sched.h>
+
+#define AFFINITY_MAX_NODES 64 // Node directories looked for under /sys/devices/system/node.
+
+struct affinity
+{
+    int cpu_count;
+    int node_count;
+    int *cpus;  // In worker order: round the nodes.
+    int *nodes; // The node of cpus[i], dense.
+};
+
+/**
+ * Add the CPUs of list ("0-3,8,10-11", may end with a newline) to set.
+ * Return false if list is malformed.
+ */
+static bool affinityParseList(const char *list, cpu_set_t *set)
+{
+    const char *p = list;
+    while(*p && *p != '\n')
+    {
+        char *end = NULL;
+        long first = strtol(p, &end, 10), last = first;
+        if(end == p || first < 0)
+        {
+            return false;
+        }
+        if(*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if(end == p || last < first)
+            {
+                return false;
+            }
+        }
+        if(last >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        for(long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, set);
+        }
+        p = end;
+        if(*p == ',')
+        {
+            p++;
+        }
+        else if(*p && *p != '\n')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Set cpu_node[cpu] to the NUMA node of every CPU listed under /sys, leave the others at -1.
+ */
+static void affinityReadNodes(int *cpu_node)
+{
+    for(int node = 0; node < AFFINITY_MAX_NODES; node++)
+    {
+        char path[64], list[MAXLINE];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if(!file)
+        {
+            continue; // Node ids may have holes.
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if(fgets(list, sizeof(list), file) && affinityParseList(list, &set))
+        {
+            for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if(CPU_ISSET(cpu, &set))
+                {
+                    cpu_node[cpu] = node;
+                }
+            }
+        }
+        fclose(file);
+    }
+}
+
+Affinity affinityCreate(const char *cpus)
+{
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        return NULL;
+    }
+    if(cpus && strcmp(cpus, "cores"))
+    {
+        cpu_set_t requested;
+        CPU_ZERO(&requested);
+        if(!affinityParseList(cpus, &requested))
+        {
+            return NULL;
+        }
+        CPU_AND(&set, &set, &requested);
+    }
+    int count = CPU_COUNT(&set);
+    if(count == 0)
+    {
+        return NULL;
+    }
+
+    Affinity affinity = calloc(1, sizeof(*affinity));
+    int *cpu_node = malloc(CPU_SETSIZE * sizeof(*cpu_node));
+    int *node_index = malloc(AFFINITY_MAX_NODES * sizeof(*node_index));
+    int *node_left = calloc(AFFINITY_MAX_NODES, sizeof(*node_left));
+    if(!affinity || !cpu_node || !node_index || !node_left ||
+       !(affinity->cpus = malloc(count * sizeof(*affinity->cpus))) ||
+       !(affinity->nodes = malloc(count * sizeof(*affinity->nodes))))
+    {
+        if(affinity)
+        {
+            free(affinity->cpus);
+        }
+        free(affinity);
+        free(cpu_node);
+        free(node_index);
+        free(node_left);
+        return NULL;
+    }
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        cpu_node[cpu] = -1;
+    }
+    affinityReadNodes(cpu_node);
+
+    // Number the nodes of the set densely, CPUs of no known node count as the first node:
+    for(int node = 0; node < AFFINITY_MAX_NODES; node++)
+    {
+        node_index[node] = -1;
+    }
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if(CPU_ISSET(cpu, &set))
+        {
+            cpu_node[cpu] = cpu_node[cpu] < 0 ? 0 : cpu_node[cpu];
+            if(node_index[cpu_node[cpu]] < 0)
+            {
+                node_index[cpu_node[cpu]] = affinity->node_count++;
+            }
+            node_left[node_index[cpu_node[cpu]]]++;
+        }
+    }
+
+    // Take the CPUs round the nodes, in order within each node:
+    int next_cpu[AFFINITY_MAX_NODES] = {0};
+    while(affinity->cpu_count < count)
+    {
+        for(int node = 0; node < affinity->node_count; node++)
+        {
+            if(node_left[node] == 0)
+            {
+                continue;
+            }
+            int cpu = next_cpu[node];
+            while(!CPU_ISSET(cpu, &set) || node_index[cpu_node[cpu]] != node)
+            {
+                cpu++;
+            }
+            next_cpu[node] = cpu + 1;
+            node_left[node]--;
+            affinity->cpus[affinity->cpu_count] = cpu;
+            affinity->nodes[affinity->cpu_count++] = node;
+        }
+    }
+    free(cpu_node);
+    free(node_index);
+    free(node_left);
+    return affinity;
+}
+
+int affinityCpuCount(Affinity affinity)
+{
+    return affinity->cpu_count;
+}
+
+int affinityNodeCount(Affinity affinity)
+{
+    return affinity->node_count;
+}
+
+int affinityWorkerCpu(Affinity affinity, int worker)
+{
+    return affinity->cpus[worker % affinity->cpu_count];
+}
+
+int affinityWorkerNode(Affinity affinity, int worker)
+{
+    return affinity->nodes[worker % affinity->cpu_count];
+}
+
+bool affinityApply(Affinity affinity, pthread_attr_t *attr, int worker)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(affinityWorkerCpu(affinity, worker), &set);
+    return pthread_attr_setaffinity_np(attr, sizeof(set), &set) == 0;
+}
+
+bool affinityPinSelf(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
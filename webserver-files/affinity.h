@@ -0,0 +1,58 @@
+#ifndef _AFFINITY_INC
+#define _AFFINITY_INC
+
+#include "segel.h"
+#include <stdbool.h>
+
+// ********** CPU Affinity ********** //
+// With --affinity every worker thread is pinned to one CPU of the set (all the CPUs the server
+// may use, or a given list such as 0-7,16-23), from its creation on: its stack, its ThreadStats
+// and everything it allocates first (its records in the content and metadata caches) are then
+// on the memory of its own NUMA node, by the first-touch policy of the kernel.
+// The workers go round the NUMA nodes (worker 0 on the first CPU of node 0, worker 1 on the first
+// of node 1, ...), so that any number of them, e.g. the active ones under --autoscale, is spread
+// evenly. The topology is read from /sys/devices/system/node, a machine without it is one node.
+typedef struct affinity* Affinity;
+
+// Where the worker threads run, NULL unless --affinity is set.
+extern Affinity affinity;
+
+/**
+ * Read the topology of cpus: a CPU list ("0-3,8,10-11"), or "cores" for all the CPUs the process
+ * may use. CPUs outside the affinity mask of the process are left out.
+ * Return NULL if none remain, the list is malformed, or allocation failed.
+ */
+Affinity affinityCreate(const char *cpus);
+
+/**
+ * Return the number of CPUs in the set.
+ */
+int affinityCpuCount(Affinity affinity);
+
+/**
+ * Return the number of NUMA nodes the CPUs of the set belong to.
+ */
+int affinityNodeCount(Affinity affinity);
+
+/**
+ * Return the CPU of worker.
+ */
+int affinityWorkerCpu(Affinity affinity, int worker);
+
+/**
+ * Return the NUMA node of worker, numbered from 0 to affinityNodeCount() - 1.
+ */
+int affinityWorkerNode(Affinity affinity, int worker);
+
+/**
+ * Pin the threads created with attr to the CPU of worker.
+ * Return false if the attribute could not be set.
+ */
+bool affinityApply(Affinity affinity, pthread_attr_t *attr, int worker);
+
+/**
+ * Pin the calling thread to cpu. Return false on failure.
+ */
+bool affinityPinSelf(int cpu);
+
+#endif
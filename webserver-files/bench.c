@@ -0,0 +1,1426 @@
+/*
+ * bench.c: Micro benchmarks for the server building blocks.
+ *
+ * To run:
+ *      ./bench queue [producers] [consumers] [items] [capacity]
+ *      ./bench pool [workers] [items] [capacity]
+ *      ./bench http <port> <uri>[,<uri>...] [connections] [requests] [idle] [keepalive]
+ *      ./bench copy [rounds] [max-kb]
+ *      ./bench spawn [rounds] [max-mb]
+ *      ./bench drop [q-size] [rounds] [workers]
+ *      ./bench numa [mb] [items] [workers]
+ *      ./bench clock [reads]
+ *
+ * queue - Compares the dispatch path the server used to have
+ *         (connPushTail/connPopHead on a ConnectionList guarded by one mutex
+ *         and a condition variable) with the lock-free MpmcQueue + semaphore.
+ *         Every producer pushes items/producers entries and the consumers
+ *         drain them, the wall time of the whole run is reported.
+ *
+ * pool  - Replays the record life cycle of the server: one acceptor thread
+ *         allocates a ConnectionStruct per item and hands it to a worker,
+ *         which frees it. Compares malloc/free with the ConnPool, and prints
+ *         the pool hit/miss/high-water counters.
+ *
+ * http  - A load generator for a server on this host. Keeps <connections>
+ *         requests for <uri> open at the same time (one connection each)
+ *         until <requests> were answered, all from one epoll thread.
+ *         If [idle] is given, that many extra connections are opened first
+ *         and never send anything (slow clients) for the whole run.
+ *         If [keepalive] is more than 1, requests are sent as HTTP/1.1 and up
+ *         to that many go one after the other on each connection (the response
+ *         is framed by its Content-Length), the TCP handshakes saved are reported.
+ *         Prints the throughput and the latency percentiles, so the same run
+ *         can be repeated against --engine=threads and --engine=epoll.
+ *         With several uris the requests go to them in turn, and the latency
+ *         percentiles of each are printed as well (e.g. to compare --dispatch=sjf
+ *         with the FIFO modes on a mix of small and large files).
+ *
+ * copy  - Sends a file of 4 KB, 16 KB, ... up to [max-kb] over a loopback
+ *         TCP connection [rounds] times, opening it every time like a static
+ *         request does, with mmap+write (the old static path), read+write,
+ *         sendfile and splice (zerocopy.h). Prints the throughput of each, to
+ *         pick --zero-copy and --zero-copy-min.
+ *
+ * spawn - Starts /bin/true and waits for it [rounds] times with fork+exec,
+ *         vfork+exec and posix_spawn (spawn.h, what the server runs CGI
+ *         programs with), while the benchmark holds 0 MB, 16 MB, 64 MB, ...
+ *         up to [max-mb] of touched memory, like a server with full caches.
+ *         Prints the average latency of each, in microseconds.
+ *
+ * drop  - Times the random overload policy: fills a queue of [q-size] requests and
+ *         drops a quarter of them at random, [rounds] times. Compares the list the server
+ *         used to have (connGetIthElement + connRemoveById, srand on every pick) with the
+ *         Dispatcher in both modes ([workers] deques for steal), the way randomPolicy()
+ *         calls it. Prints the average time of one drop, in microseconds.
+ *
+ * numa  - Shows what crossing NUMA nodes costs (affinity.h). First a thread pinned to
+ *         node A reads and rewrites [mb] MB first touched by a thread of node B, for
+ *         every pair of nodes, and prints the GB/s of each. Then [items] requests go
+ *         through a steal Dispatcher to [workers] workers that read 4 KB of their own
+ *         1 MB working set (the files they serve) per request: unpinned with the working
+ *         sets allocated by main(), pinned with the same, and pinned with node-local
+ *         working sets and stealing within the node (--affinity=cores --numa=on).
+ *         Prints the requests per second and the share of stolen ones. On a machine
+ *         with one node the runs only show what pinning itself costs or saves.
+ *
+ * clock - Reads the clock [reads] times in a row with gettimeofday() (what the requests
+ *         were stamped with) and with timingNow() on every --clock (timing.h). Prints the
+ *         cost of a read in nanoseconds, the smallest step seen (the resolution), and how
+ *         often the clock went back.
+ */
+
+#define _GNU_SOURCE // strcasestr
+#include "segel.h"
+#include "connection.h"
+#include "mpmc.h"
+#include "pool.h"
+#include "zerocopy.h"
+#include "spawn.h"
+#include "dispatch.h"
+#include "affinity.h"
+#include "timing.h"
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <limits.h>
+
+#define DEFAULT_PRODUCERS 1
+#define DEFAULT_CONSUMERS 4
+#define DEFAULT_ITEMS 1000000
+#define DEFAULT_CAPACITY 1024
+
+typedef struct bench_queue_args
+{
+    int items;    // Items to push (producer) or pop (consumer).
+    int capacity;
+    long checksum; // Sum of the job ids popped by a consumer.
+} BenchQueueArgs;
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// ********** List + mutex ********** //
+static pthread_mutex_t list_m = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t list_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t list_not_full = PTHREAD_COND_INITIALIZER;
+static ConnectionList list;
+
+static void* listProducer(void* args)
+{
+    BenchQueueArgs* b_args = (BenchQueueArgs*)args;
+    struct connection_struct cd;
+    memset(&cd, 0, sizeof(cd));
+
+    for(int i = 0; i < b_args->items; i++)
+    {
+        cd.job_id = i;
+        pthread_mutex_lock(&list_m);
+        while(connGetSize(list) >= b_args->capacity)
+        {
+            pthread_cond_wait(&list_not_full, &list_m);
+        }
+        connPushTail(list, &cd);
+        pthread_cond_signal(&list_not_empty);
+        pthread_mutex_unlock(&list_m);
+    }
+    return NULL;
+}
+
+static void* listConsumer(void* args)
+{
+    BenchQueueArgs* b_args = (BenchQueueArgs*)args;
+    for(int i = 0; i < b_args->items; i++)
+    {
+        pthread_mutex_lock(&list_m);
+        while(connGetSize(list) == 0)
+        {
+            pthread_cond_wait(&list_not_empty, &list_m);
+        }
+        b_args->checksum += connGetFirst(list)->job_id;
+        connPopHead(list, true);
+        pthread_cond_signal(&list_not_full);
+        pthread_mutex_unlock(&list_m);
+    }
+    return NULL;
+}
+
+// ********** MPMC + semaphore ********** //
+static MpmcQueue mpmc;
+static sem_t mpmc_items;
+static sem_t mpmc_slots;
+
+static void* mpmcProducer(void* args)
+{
+    BenchQueueArgs* b_args = (BenchQueueArgs*)args;
+    // The server hands out heap entries by reference, do the same here.
+    ConnectionStruct entries = (ConnectionStruct)malloc(b_args->items * sizeof(*entries));
+    if(!entries)
+    {
+        unix_error("bench: entries allocation failed");
+    }
+
+    for(int i = 0; i < b_args->items; i++)
+    {
+        entries[i].job_id = i;
+        while(sem_wait(&mpmc_slots) != 0);
+        mpmcEnqueue(mpmc, &entries[i]);
+        sem_post(&mpmc_items);
+    }
+    return entries; // Freed by the caller once the consumers are done.
+}
+
+static void* mpmcConsumer(void* args)
+{
+    BenchQueueArgs* b_args = (BenchQueueArgs*)args;
+    ConnectionStruct res = NULL;
+    for(int i = 0; i < b_args->items; i++)
+    {
+        while(sem_wait(&mpmc_items) != 0);
+        while(!(res = mpmcDequeue(mpmc))); // A slot was published but its store may still be in flight.
+        b_args->checksum += res->job_id;
+        sem_post(&mpmc_slots);
+    }
+    return NULL;
+}
+
+static double runQueueBench(void* (*producer)(void*), void* (*consumer)(void*),
+                            int producers, int consumers, int items, int capacity, long* checksum)
+{
+    pthread_t threads[producers + consumers];
+    BenchQueueArgs args[producers + consumers];
+    void* to_free[producers];
+
+    for(int i = 0; i < producers + consumers; i++)
+    {
+        bool is_producer = i < producers;
+        int share = is_producer ? items / producers : items / consumers;
+        int count = is_producer ? producers : consumers;
+        int idx = is_producer ? i : i - producers;
+        args[i].items = share + (idx < (items % count) ? 1 : 0);
+        args[i].capacity = capacity;
+        args[i].checksum = 0;
+    }
+
+    double start = nowSeconds();
+    for(int i = 0; i < producers + consumers; i++)
+    {
+        if(pthread_create(&threads[i], NULL, i < producers ? producer : consumer, &args[i]) != 0)
+        {
+            posix_error(errno, "bench: pthread_create failed");
+        }
+    }
+    *checksum = 0;
+    for(int i = 0; i < producers + consumers; i++)
+    {
+        void* ret = NULL;
+        pthread_join(threads[i], &ret);
+        if(i < producers)
+        {
+            to_free[i] = ret;
+        }
+        *checksum += args[i].checksum;
+    }
+    double elapsed = nowSeconds() - start;
+
+    for(int i = 0; i < producers; i++)
+    {
+        free(to_free[i]);
+    }
+    return elapsed;
+}
+
+static void benchQueue(int argc, char *argv[])
+{
+    int producers = argc > 2 ? atoi(argv[2]) : DEFAULT_PRODUCERS;
+    int consumers = argc > 3 ? atoi(argv[3]) : DEFAULT_CONSUMERS;
+    int items = argc > 4 ? atoi(argv[4]) : DEFAULT_ITEMS;
+    int capacity = argc > 5 ? atoi(argv[5]) : DEFAULT_CAPACITY;
+    long checksum = 0;
+    if(producers <= 0 || consumers <= 0 || items <= 0 || capacity <= 0)
+    {
+        app_error("bench: all the queue arguments must be positive integers");
+    }
+
+    printf("queue: %d producer(s), %d consumer(s), %d items, capacity %d\n", producers, consumers, items, capacity);
+
+    if(!(list = connCreateList()))
+    {
+        unix_error("bench: connCreateList failed");
+    }
+    double t_list = runQueueBench(listProducer, listConsumer, producers, consumers, items, capacity, &checksum);
+    printf("  %-28s %8.3f s  %12.0f ops/s  (checksum %ld)\n", "list + global mutex", t_list, items / t_list, checksum);
+    connDestroyList(list);
+
+    if(!(mpmc = mpmcCreateQueue(capacity)))
+    {
+        unix_error("bench: mpmcCreateQueue failed");
+    }
+    sem_init(&mpmc_items, 0, 0);
+    sem_init(&mpmc_slots, 0, capacity);
+    double t_mpmc = runQueueBench(mpmcProducer, mpmcConsumer, producers, consumers, items, capacity, &checksum);
+    printf("  %-28s %8.3f s  %12.0f ops/s  (checksum %ld)\n", "lock-free mpmc + semaphore", t_mpmc, items / t_mpmc, checksum);
+    mpmcDestroyQueue(mpmc);
+    sem_destroy(&mpmc_items);
+    sem_destroy(&mpmc_slots);
+
+    printf("  speedup: %.2fx\n", t_list / t_mpmc);
+}
+
+// ********** Record allocation ********** //
+static ConnPool pool;
+
+static ConnectionStruct recordAlloc(bool use_pool)
+{
+    return use_pool ? poolAlloc(pool) : (ConnectionStruct)malloc(sizeof(struct connection_struct));
+}
+
+static void recordFree(bool use_pool, ConnectionStruct info)
+{
+    if(use_pool)
+    {
+        poolFree(pool, info);
+    }
+    else
+    {
+        free(info);
+    }
+}
+
+typedef struct bench_pool_args
+{
+    bool use_pool;
+    int items;
+} BenchPoolArgs;
+
+static void* poolAcceptor(void* args)
+{
+    BenchPoolArgs* b_args = (BenchPoolArgs*)args;
+    for(int i = 0; i < b_args->items; i++)
+    {
+        ConnectionStruct info = recordAlloc(b_args->use_pool);
+        if(!info)
+        {
+            unix_error("bench: record allocation failed");
+        }
+        info->job_id = i;
+        while(sem_wait(&mpmc_slots) != 0);
+        mpmcEnqueue(mpmc, info);
+        sem_post(&mpmc_items);
+    }
+    return NULL;
+}
+
+static void* poolWorker(void* args)
+{
+    BenchPoolArgs* b_args = (BenchPoolArgs*)args;
+    ConnectionStruct res = NULL;
+    for(int i = 0; i < b_args->items; i++)
+    {
+        while(sem_wait(&mpmc_items) != 0);
+        while(!(res = mpmcDequeue(mpmc)));
+        sem_post(&mpmc_slots);
+        recordFree(b_args->use_pool, res);
+    }
+    return NULL;
+}
+
+static double runPoolBench(bool use_pool, int workers, int items)
+{
+    pthread_t threads[workers + 1];
+    BenchPoolArgs args[workers + 1];
+
+    args[0].use_pool = use_pool;
+    args[0].items = items;
+    for(int i = 1; i <= workers; i++)
+    {
+        args[i].use_pool = use_pool;
+        args[i].items = items / workers + (i - 1 < items % workers ? 1 : 0);
+    }
+
+    double start = nowSeconds();
+    for(int i = 0; i <= workers; i++)
+    {
+        if(pthread_create(&threads[i], NULL, i == 0 ? poolAcceptor : poolWorker, &args[i]) != 0)
+        {
+            posix_error(errno, "bench: pthread_create failed");
+        }
+    }
+    for(int i = 0; i <= workers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    return nowSeconds() - start;
+}
+
+static void benchPool(int argc, char *argv[])
+{
+    int workers = argc > 2 ? atoi(argv[2]) : DEFAULT_CONSUMERS;
+    int items = argc > 3 ? atoi(argv[3]) : DEFAULT_ITEMS;
+    int capacity = argc > 4 ? atoi(argv[4]) : DEFAULT_CAPACITY;
+    PoolStats stats;
+    if(workers <= 0 || items <= 0 || capacity <= 0)
+    {
+        app_error("bench: all the pool arguments must be positive integers");
+    }
+
+    printf("pool: 1 acceptor, %d worker(s), %d items, queue capacity %d\n", workers, items, capacity);
+    if(!(mpmc = mpmcCreateQueue(capacity)))
+    {
+        unix_error("bench: mpmcCreateQueue failed");
+    }
+    sem_init(&mpmc_items, 0, 0);
+    sem_init(&mpmc_slots, 0, capacity);
+
+    double t_malloc = runPoolBench(false, workers, items);
+    printf("  %-28s %8.3f s  %12.0f ops/s\n", "malloc/free", t_malloc, items / t_malloc);
+
+    if(!(pool = poolCreate(poolCapacityFor(workers, capacity))))
+    {
+        unix_error("bench: poolCreate failed");
+    }
+    double t_pool = runPoolBench(true, workers, items);
+    printf("  %-28s %8.3f s  %12.0f ops/s\n", "ConnPool", t_pool, items / t_pool);
+    poolGetStats(pool, &stats);
+    printf("  pool: %ld hits, %ld misses, high-water %ld, capacity %ld\n",
+           stats.hits, stats.misses, stats.high_water, stats.capacity);
+    printf("  speedup: %.2fx\n", t_malloc / t_pool);
+
+    poolDestroy(pool);
+    mpmcDestroyQueue(mpmc);
+    sem_destroy(&mpmc_items);
+    sem_destroy(&mpmc_slots);
+}
+
+// ********** HTTP load ********** //
+#define HTTP_TIMEOUT_SEC 30.0
+#define HTTP_MAX_URIS 16
+
+typedef struct http_conn
+{
+    int fd;
+    bool sent;
+    double start;
+    size_t received;
+    int served;          // Responses received on this connection (keep-alive).
+    int target;          // The uri of the current request.
+    char head[MAXBUF];   // The response headers as received so far (keep-alive).
+    size_t head_len;
+    long body_left;      // Body bytes still expected, -1 until the headers are complete.
+    bool closing;        // The server said Connection: close.
+} HttpConn;
+
+static int compareDoubles(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sort the count latencies (in seconds) and print their percentiles after label.
+ */
+static void httpPrintLatency(const char* label, double* latencies, int count)
+{
+    qsort(latencies, count, sizeof(*latencies), compareDoubles);
+    printf("  %s: p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", label,
+           latencies[count / 2] * 1e3, latencies[(int)(count * 0.9)] * 1e3,
+           latencies[(int)(count * 0.99)] * 1e3, latencies[count - 1] * 1e3);
+}
+
+/**
+ * Start a non-blocking connection in conn and register it. Return false on failure.
+ */
+static bool httpConnect(int epfd, HttpConn* conn, struct sockaddr_in* addr, int target)
+{
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(conn->fd < 0)
+    {
+        return false;
+    }
+    conn->sent = false;
+    conn->received = 0;
+    conn->served = 0;
+    conn->target = target;
+    conn->head_len = 0;
+    conn->body_left = -1;
+    conn->closing = false;
+    conn->start = nowSeconds();
+    if(connect(conn->fd, (SA*)addr, sizeof(*addr)) < 0 && errno != EINPROGRESS)
+    {
+        close(conn->fd);
+        return false;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+    return true;
+}
+
+/**
+ * Account for len bytes of a keep-alive response. Return true once the whole response arrived.
+ */
+static bool httpConsume(HttpConn* conn, const char* data, size_t len)
+{
+    if(conn->body_left < 0)
+    {
+        size_t room = sizeof(conn->head) - 1 - conn->head_len;
+        size_t take = len < room ? len : room;
+        memcpy(conn->head + conn->head_len, data, take);
+        conn->head_len += take;
+        conn->head[conn->head_len] = '\0';
+        char* end = strstr(conn->head, "\r\n\r\n");
+        if(!end)
+        {
+            return false;
+        }
+        size_t head_size = end + 4 - conn->head;
+        char* length = strcasestr(conn->head, "\r\nContent-Length:");
+        conn->body_left = length && length < end ? atol(length + 17) : 0;
+        conn->closing = strcasestr(conn->head, "\r\nConnection: close") != NULL;
+        // What came after the headers (in this read) is body:
+        conn->body_left -= (long)(conn->head_len - head_size) + (long)(len - take);
+    }
+    else
+    {
+        conn->body_left -= len;
+    }
+    return conn->body_left <= 0;
+}
+
+static void benchHttp(int argc, char *argv[])
+{
+    if(argc < 4)
+    {
+        app_error("bench: http needs <port> <uri>");
+    }
+    int port = atoi(argv[2]);
+    char* uri = argv[3];
+    char* uris[HTTP_MAX_URIS];
+    int uri_count = 0;
+    int connections = argc > 4 ? atoi(argv[4]) : 100;
+    int requests = argc > 5 ? atoi(argv[5]) : 10000;
+    int idle = argc > 6 ? atoi(argv[6]) : 0;
+    int keepalive = argc > 7 ? atoi(argv[7]) : 1;
+    if(port <= 0 || connections <= 0 || requests <= 0 || idle < 0 || keepalive <= 0)
+    {
+        app_error("bench: port, connections and requests must be positive integers");
+    }
+    if(connections > requests)
+    {
+        connections = requests;
+    }
+
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    char requests_buf[HTTP_MAX_URIS][MAXLINE];
+    int request_lens[HTTP_MAX_URIS];
+    char* uri_list = strdup(uri);
+    for(char* next = strtok(uri_list, ","); next && uri_count < HTTP_MAX_URIS; next = strtok(NULL, ","))
+    {
+        uris[uri_count] = next;
+        request_lens[uri_count] = sprintf(requests_buf[uri_count], "GET %.4096s HTTP/1.%d\r\nHost: localhost\r\n\r\n",
+                                          next, keepalive > 1);
+        uri_count++;
+    }
+    if(uri_count == 0)
+    {
+        app_error("bench: http needs <port> <uri>");
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    HttpConn* conns = calloc(connections, sizeof(*conns));
+    int* idle_fds = malloc((idle + 1) * sizeof(*idle_fds));
+    double* latencies = malloc(requests * sizeof(*latencies));
+    int* targets = malloc(requests * sizeof(*targets)); // The uri of every latency.
+    struct epoll_event* events = malloc(connections * sizeof(*events));
+    int epfd = epoll_create1(0);
+    if(!conns || !idle_fds || !latencies || !targets || !events || epfd < 0)
+    {
+        unix_error("bench: http setup failed");
+    }
+
+    for(int i = 0; i < idle; i++)
+    {
+        idle_fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+        if(idle_fds[i] < 0 || connect(idle_fds[i], (SA*)&addr, sizeof(addr)) < 0)
+        {
+            unix_error("bench: idle connection failed");
+        }
+    }
+
+    printf("http: %s on port %d, %d concurrent connections, %d requests, %d idle connections, %d requests per connection\n",
+           uri, port, connections, requests, idle, keepalive);
+    int started = 0, done = 0, errors = 0, open_conns = 0, handshakes = connections;
+    size_t bytes = 0;
+    double begin = nowSeconds();
+    for(int i = 0; i < connections; i++)
+    {
+        if(httpConnect(epfd, &conns[i], &addr, started % uri_count))
+        {
+            open_conns++;
+        }
+        else
+        {
+            errors++;
+        }
+        started++;
+    }
+
+    char buf[MAXBUF];
+    while(open_conns > 0)
+    {
+        int n = epoll_wait(epfd, events, connections, 1000);
+        double now = nowSeconds();
+        for(int i = 0; i < n; i++)
+        {
+            HttpConn* conn = (HttpConn*)events[i].data.ptr;
+            bool finished = false, failed = false;
+            if(!conn->sent && (events[i].events & EPOLLOUT))
+            {
+                // Tiny request, it always fits in the socket buffer at once.
+                if(write(conn->fd, requests_buf[conn->target], request_lens[conn->target]) != request_lens[conn->target])
+                {
+                    failed = true;
+                }
+                conn->sent = true;
+            }
+            while(!failed && conn->sent && !finished)
+            {
+                ssize_t r = read(conn->fd, buf, sizeof(buf));
+                if(r > 0)
+                {
+                    conn->received += r;
+                    if(keepalive > 1 && httpConsume(conn, buf, r))
+                    {
+                        // A whole response: send the next request on the same connection if allowed.
+                        targets[done] = conn->target;
+                        latencies[done++] = now - conn->start;
+                        bytes += conn->received;
+                        if(++conn->served == keepalive || conn->closing || started == requests)
+                        {
+                            finished = true;
+                            conn->received = 0; // Already counted.
+                            break;
+                        }
+                        conn->target = started++ % uri_count;
+                        conn->received = 0;
+                        conn->head_len = 0;
+                        conn->body_left = -1;
+                        conn->start = now;
+                        if(write(conn->fd, requests_buf[conn->target], request_lens[conn->target]) != request_lens[conn->target])
+                        {
+                            failed = true;
+                        }
+                    }
+                }
+                else if(r == 0)
+                {
+                    // HTTP/1.0: the response ends with the connection. With keep-alive a request was lost.
+                    finished = keepalive == 1;
+                    failed = keepalive > 1;
+                }
+                else if(errno != EAGAIN && errno != EINTR)
+                {
+                    failed = true;
+                }
+                else if(errno == EAGAIN)
+                {
+                    break;
+                }
+            }
+            if(!finished && !failed)
+            {
+                continue;
+            }
+
+            close(conn->fd);
+            conn->fd = -1;
+            open_conns--;
+            if(finished && conn->received > 0)
+            {
+                targets[done] = conn->target;
+                latencies[done++] = now - conn->start;
+                bytes += conn->received;
+            }
+            else if(!finished)
+            {
+                errors++;
+            }
+            if(started < requests)
+            {
+                handshakes++;
+                if(httpConnect(epfd, conn, &addr, started++ % uri_count))
+                {
+                    open_conns++;
+                }
+                else
+                {
+                    errors++;
+                }
+            }
+        }
+
+        // Give up on connections that hang (e.g. dropped by an overload policy without a RST).
+        if(n == 0)
+        {
+            for(int i = 0; i < connections; i++)
+            {
+                if(conns[i].fd > 0 && now - conns[i].start > HTTP_TIMEOUT_SEC)
+                {
+                    close(conns[i].fd);
+                    conns[i].fd = -1;
+                    open_conns--;
+                    errors++;
+                }
+            }
+        }
+    }
+    double elapsed = nowSeconds() - begin;
+
+    printf("  %d ok, %d errors in %.3f s: %.0f req/s, %.1f MB/s\n", done, errors, elapsed, done / elapsed, bytes / elapsed / 1e6);
+    printf("  %d connections: %.2f requests per connection, %d TCP handshakes saved\n",
+           handshakes, (double)done / handshakes, done - handshakes > 0 ? done - handshakes : 0);
+    // The latencies of every uri, the whole run is sorted last:
+    double* by_uri = malloc((done + 1) * sizeof(*by_uri));
+    for(int u = 0; uri_count > 1 && by_uri && u < uri_count; u++)
+    {
+        int count = 0;
+        for(int i = 0; i < done; i++)
+        {
+            if(targets[i] == u)
+            {
+                by_uri[count++] = latencies[i];
+            }
+        }
+        if(count > 0)
+        {
+            char label[MAXLINE];
+            snprintf(label, sizeof(label), "%.64s (%d)", uris[u], count);
+            httpPrintLatency(label, by_uri, count);
+        }
+    }
+    free(by_uri);
+    if(done > 0)
+    {
+        httpPrintLatency("latency", latencies, done);
+    }
+    for(int i = 0; i < idle; i++)
+    {
+        close(idle_fds[i]);
+    }
+    free(idle_fds);
+    close(epfd);
+    free(conns);
+    free(latencies);
+    free(targets);
+    free(events);
+    free(uri_list);
+}
+
+// ********** Static file copy ********** //
+#define COPY_ROUNDS 200
+#define COPY_MAX_KB (16 * 1024)
+#define COPY_READ_BUF (64 * 1024)
+
+typedef enum CopyMethod_t
+{
+    COPY_MMAP = 0, // What the server did for every file: mmap, write, munmap.
+    COPY_READ,     // read() into a buffer, write() it.
+    COPY_SENDFILE,
+    COPY_SPLICE,
+    COPY_METHODS
+} CopyMethod;
+
+static const char* copy_names[COPY_METHODS] = {"mmap+write", "read+write", "sendfile", "splice"};
+static atomic_long copy_received; // Bytes the drain thread read so far.
+
+/**
+ * Read and throw away everything that arrives on the receiving end, like a fast client.
+ */
+static void* copyDrain(void* args)
+{
+    int fd = *(int*)args;
+    char* buf = malloc(1 << 18);
+    ssize_t n;
+    while((n = read(fd, buf, 1 << 18)) > 0)
+    {
+        atomic_fetch_add(&copy_received, n);
+    }
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Send the whole file at path to sockfd the given way, opening and closing it like a request does.
+ */
+static void copyFile(CopyMethod method, const char* path, size_t size, int sockfd, char* buf)
+{
+    int fd = Open((char*)path, O_RDONLY, 0);
+    if(method == COPY_MMAP)
+    {
+        char* data = Mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        Rio_writen(sockfd, data, size);
+        Munmap(data, size);
+    }
+    else if(method == COPY_READ)
+    {
+        ssize_t n;
+        while((n = read(fd, buf, COPY_READ_BUF)) > 0)
+        {
+            Rio_writen(sockfd, buf, n);
+        }
+    }
+    else if(!zcopySendAll(sockfd, fd, size, method == COPY_SPLICE ? ZERO_COPY_SPLICE : ZERO_COPY_SENDFILE))
+    {
+        unix_error("bench: zero-copy send failed");
+    }
+    Close(fd);
+}
+
+static void benchCopy(int argc, char *argv[])
+{
+    int rounds = argc > 2 ? atoi(argv[2]) : COPY_ROUNDS;
+    int max_kb = argc > 3 ? atoi(argv[3]) : COPY_MAX_KB;
+    if(rounds <= 0 || max_kb < 4)
+    {
+        app_error("bench: rounds must be positive and max-kb at least 4");
+    }
+
+    // A loopback TCP connection, the receiving end is drained by another thread:
+    int listenfd = Open_listenfd(0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listenfd, (SA*)&addr, &addr_len);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int sockfd = Socket(AF_INET, SOCK_STREAM, 0);
+    Connect(sockfd, (SA*)&addr, sizeof(addr));
+    int drainfd = Accept(listenfd, NULL, NULL);
+    pthread_t drain;
+    atomic_init(&copy_received, 0);
+    pthread_create(&drain, NULL, copyDrain, &drainfd);
+
+    char path[] = "/tmp/bench-copy-XXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0)
+    {
+        unix_error("bench: mkstemp failed");
+    }
+    char* buf = malloc(COPY_READ_BUF);
+    memset(buf, 'x', COPY_READ_BUF);
+    long sent = 0;
+
+    printf("Sending a file %d times over loopback TCP (MB/s):\n", rounds);
+    printf("  %10s", "size");
+    for(int m = 0; m < COPY_METHODS; m++)
+    {
+        printf(" %12s", copy_names[m]);
+    }
+    printf("\n");
+    for(size_t size = 4096; size <= (size_t)max_kb * 1024; size *= 4)
+    {
+        for(size_t done = lseek(fd, 0, SEEK_END); done < size; done += COPY_READ_BUF)
+        {
+            Rio_writen(fd, buf, COPY_READ_BUF < size - done ? COPY_READ_BUF : size - done);
+        }
+        printf("  %8zu K", size / 1024);
+        for(int m = 0; m < COPY_METHODS; m++)
+        {
+            double begin = nowSeconds();
+            for(int r = 0; r < rounds; r++)
+            {
+                copyFile(m, path, size, sockfd, buf);
+            }
+            sent += (long)size * rounds;
+            while(atomic_load(&copy_received) < sent)
+            {
+                sched_yield(); // Until the last byte arrived.
+            }
+            double elapsed = nowSeconds() - begin;
+            printf(" %12.0f", (double)size * rounds / elapsed / 1e6);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    close(sockfd);
+    pthread_join(drain, NULL);
+    close(drainfd);
+    close(listenfd);
+    close(fd);
+    unlink(path);
+    free(buf);
+}
+
+// ********** Program launching ********** //
+#define SPAWN_ROUNDS 200
+#define SPAWN_MAX_MB 1024
+#define SPAWN_PROGRAM "/bin/true"
+
+typedef enum SpawnMethod_t
+{
+    SPAWN_FORK = 0, // What the server did for every CGI request.
+    SPAWN_VFORK,
+    SPAWN_POSIX,    // spawnProgram().
+    SPAWN_METHODS
+} SpawnMethod;
+
+static const char* spawn_names[SPAWN_METHODS] = {"fork+exec", "vfork+exec", "posix_spawn"};
+
+/**
+ * Start SPAWN_PROGRAM the given way, with fd as its stdout like a CGI program, and wait for it.
+ */
+static void spawnOnce(SpawnMethod method, int fd)
+{
+    char* argv[] = {SPAWN_PROGRAM, NULL};
+    pid_t pid = -1;
+    if(method == SPAWN_POSIX)
+    {
+        pid = spawnProgram(SPAWN_PROGRAM, argv, environ, fd, STDOUT_FILENO);
+    }
+    else if((pid = method == SPAWN_FORK ? fork() : vfork()) == 0)
+    {
+        dup2(fd, STDOUT_FILENO);
+        execve(SPAWN_PROGRAM, argv, environ);
+        _exit(127);
+    }
+    if(pid < 0)
+    {
+        unix_error("bench: spawn failed");
+    }
+    int status;
+    if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        app_error("bench: " SPAWN_PROGRAM " failed");
+    }
+}
+
+static void benchSpawn(int argc, char *argv[])
+{
+    int rounds = argc > 2 ? atoi(argv[2]) : SPAWN_ROUNDS;
+    int max_mb = argc > 3 ? atoi(argv[3]) : SPAWN_MAX_MB;
+    if(rounds <= 0 || max_mb < 0)
+    {
+        app_error("bench: rounds must be positive and max-mb not negative");
+    }
+
+    int fd = Open("/dev/null", O_WRONLY | O_CLOEXEC, 0);
+    char* memory = NULL;
+    size_t touched = 0;
+    if(max_mb > 0 && (memory = mmap(NULL, (size_t)max_mb << 20, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+        unix_error("bench: mmap failed");
+    }
+
+    printf("Starting %s %d times and waiting for it (average microseconds):\n", SPAWN_PROGRAM, rounds);
+    printf("  %10s", "RSS");
+    for(int m = 0; m < SPAWN_METHODS; m++)
+    {
+        printf(" %12s", spawn_names[m]);
+    }
+    printf("\n");
+    for(size_t mb = 0; mb <= (size_t)max_mb; mb = mb ? mb * 4 : 16)
+    {
+        memset(memory + touched, 'x', (mb << 20) - touched); // Every page mapped, like a filled cache.
+        touched = mb << 20;
+        printf("  %7zu MB", mb);
+        for(int m = 0; m < SPAWN_METHODS; m++)
+        {
+            double begin = nowSeconds();
+            for(int r = 0; r < rounds; r++)
+            {
+                spawnOnce(m, fd);
+            }
+            printf(" %12.1f", (nowSeconds() - begin) / rounds * 1e6);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    if(memory)
+    {
+        munmap(memory, (size_t)max_mb << 20);
+    }
+    close(fd);
+}
+
+// ********** Random drop ********** //
+#define DROP_Q_SIZE 10000
+#define DROP_ROUNDS 20
+#define DROP_WORKERS 8
+
+typedef enum DropMethod_t
+{
+    DROP_LIST = 0, // What randomPolicy() did on the ConnectionList.
+    DROP_SHARED,
+    DROP_STEAL,
+    DROP_METHODS
+} DropMethod;
+
+static const char* drop_names[DROP_METHODS] = {"list", "dispatch shared", "dispatch steal"};
+
+/**
+ * The random numbers the list policy used, reseeded on every call.
+ */
+static int legacyRandInt(int max)
+{
+    static int feed = 251640;
+    srand(time(NULL)*(++feed));
+    return abs((rand()*feed) % (max + 1));
+}
+
+/**
+ * Fill a queue with q_size records, time one drop of a quarter of them and empty it again.
+ * Return the time of the drop in seconds.
+ */
+static double dropOnce(DropMethod method, int q_size, int workers, ConnectionStruct records, ConnectionStruct *victims)
+{
+    int to_remove = (q_size + 3) / 4;
+    double begin = 0, elapsed = 0;
+    if(method == DROP_LIST)
+    {
+        ConnectionList queue = connCreateList();
+        for(int i = 0; i < q_size; i++)
+        {
+            connPushTail(queue, &records[i]); // Copied by the list.
+        }
+        begin = nowSeconds();
+        for(int i = 0; i < to_remove; i++)
+        {
+            ConnectionStruct victim = connGetIthElement(queue, legacyRandInt(connGetSize(queue) - 1));
+            connRemoveById(queue, victim->job_id);
+        }
+        elapsed = nowSeconds() - begin;
+        connDestroyList(queue);
+        return elapsed;
+    }
+
+    Dispatcher dispatcher = dispatchCreate(method == DROP_SHARED ? DISPATCH_SHARED : DISPATCH_STEAL,
+                                           PLACEMENT_ROUND_ROBIN, workers, q_size);
+    if(!dispatcher)
+    {
+        app_error("bench: dispatchCreate failed");
+    }
+    for(int i = 0; i < q_size; i++)
+    {
+        dispatchPush(dispatcher, &records[i]);
+    }
+    begin = nowSeconds();
+    if(dispatchDropRandom(dispatcher, to_remove, victims) != to_remove)
+    {
+        app_error("bench: dispatchDropRandom dropped too few");
+    }
+    elapsed = nowSeconds() - begin;
+    while(dispatchDropOldest(dispatcher));
+    dispatchDestroy(dispatcher);
+    return elapsed;
+}
+
+static void benchDrop(int argc, char *argv[])
+{
+    int q_size = argc > 2 ? atoi(argv[2]) : DROP_Q_SIZE;
+    int rounds = argc > 3 ? atoi(argv[3]) : DROP_ROUNDS;
+    int workers = argc > 4 ? atoi(argv[4]) : DROP_WORKERS;
+    if(q_size <= 0 || rounds <= 0 || workers <= 0)
+    {
+        app_error("bench: all the drop arguments must be positive integers");
+    }
+
+    ConnectionStruct records = calloc(q_size, sizeof(*records));
+    ConnectionStruct* victims = malloc(q_size * sizeof(*victims));
+    if(!records || !victims)
+    {
+        app_error("bench: out of memory");
+    }
+    for(int i = 0; i < q_size; i++)
+    {
+        records[i].job_id = i;
+    }
+
+    printf("drop: a quarter of %d queued requests at random, %d rounds, %d workers (average microseconds):\n",
+           q_size, rounds, workers);
+    for(int m = 0; m < DROP_METHODS; m++)
+    {
+        double total = 0;
+        for(int r = 0; r < rounds; r++)
+        {
+            total += dropOnce(m, q_size, workers, records, victims);
+        }
+        printf("  %-16s %12.1f\n", drop_names[m], total / rounds * 1e6);
+        fflush(stdout);
+    }
+    free(records);
+    free(victims);
+}
+
+// ********** NUMA ********** //
+#define NUMA_MB 256
+#define NUMA_ITEMS 1000000
+#define NUMA_WORKERS 8
+#define NUMA_ROUNDS 4                      // Passes over the buffer of the memory test.
+#define NUMA_CAPACITY 1024
+#define NUMA_WORKING_SET (1024 * 1024)     // Bytes of every worker's working set.
+#define NUMA_CHUNK 4096                    // Bytes of it read per request.
+
+typedef enum NumaMethod_t
+{
+    NUMA_UNPINNED = 0, // Workers float, working sets allocated by main().
+    NUMA_PINNED,       // Workers pinned, working sets still allocated by main().
+    NUMA_LOCAL,        // Workers pinned, working sets first touched by their workers, stealing by node.
+    NUMA_METHODS
+} NumaMethod;
+
+static const char* numa_names[NUMA_METHODS] = {"unpinned", "pinned", "pinned + node-local"};
+
+typedef struct numa_touch_args
+{
+    int cpu;
+    unsigned long *buf;
+    size_t words;
+    int rounds;     // 0: first touch the buffer only.
+    unsigned long sum;
+} NumaTouchArgs;
+
+static void* numaTouch(void* args)
+{
+    NumaTouchArgs* touch = (NumaTouchArgs*)args;
+    affinityPinSelf(touch->cpu);
+    if(touch->rounds == 0)
+    {
+        memset(touch->buf, 1, touch->words * sizeof(*touch->buf));
+        return NULL;
+    }
+    for(int r = 0; r < touch->rounds; r++)
+    {
+        for(size_t i = 0; i < touch->words; i++)
+        {
+            touch->sum += touch->buf[i]++;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Run numaTouch() on cpu and wait for it.
+ */
+static void numaTouchOn(NumaTouchArgs* touch)
+{
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, numaTouch, touch) != 0)
+    {
+        posix_error(errno, "bench: pthread_create failed");
+    }
+    pthread_join(thread, NULL);
+}
+
+/**
+ * Return the first CPU of node in the set.
+ */
+static int numaNodeCpu(Affinity topology, int node)
+{
+    for(int i = 0; i < affinityCpuCount(topology); i++)
+    {
+        if(affinityWorkerNode(topology, i) == node)
+        {
+            return affinityWorkerCpu(topology, i);
+        }
+    }
+    return affinityWorkerCpu(topology, 0);
+}
+
+typedef struct numa_worker_args
+{
+    Dispatcher dispatcher;
+    Affinity topology; // NULL: unpinned.
+    int worker_id;
+    char *working_set; // NULL: allocated and first touched by the worker itself.
+    long handled;
+    long stolen;
+    unsigned long sum;
+} NumaWorkerArgs;
+
+static void* numaWorker(void* args)
+{
+    NumaWorkerArgs* worker = (NumaWorkerArgs*)args;
+    bool local = worker->working_set == NULL;
+    if(local)
+    {
+        if(!(worker->working_set = malloc(NUMA_WORKING_SET)))
+        {
+            app_error("bench: out of memory");
+        }
+        memset(worker->working_set, 1, NUMA_WORKING_SET);
+    }
+    size_t offset = 0;
+    while(1)
+    {
+        bool stolen = false;
+        ConnectionStruct info = dispatchPop(worker->dispatcher, worker->worker_id, &stolen);
+        if(info->job_id < 0)
+        {
+            break;
+        }
+        for(size_t i = 0; i < NUMA_CHUNK; i += sizeof(unsigned long))
+        {
+            worker->sum += *(unsigned long*)(worker->working_set + offset + i);
+        }
+        offset = (offset + NUMA_CHUNK) % NUMA_WORKING_SET;
+        worker->handled++;
+        worker->stolen += stolen;
+    }
+    if(local)
+    {
+        free(worker->working_set);
+        worker->working_set = NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Push items requests through a steal dispatcher to workers threads.
+ * Return the wall time in seconds, and set *stolen to the number of stolen requests.
+ */
+static double numaDispatch(NumaMethod method, Affinity topology, int items, int workers, long *stolen)
+{
+    Dispatcher dispatcher = dispatchCreate(DISPATCH_STEAL, PLACEMENT_SHORTEST, workers, NUMA_CAPACITY);
+    ConnectionStruct records = calloc(NUMA_CAPACITY + 1, sizeof(*records));
+    char *working_sets = method == NUMA_LOCAL ? NULL : malloc((size_t)workers * NUMA_WORKING_SET);
+    pthread_t threads[workers];
+    NumaWorkerArgs args[workers];
+    if(!dispatcher || !records || (method != NUMA_LOCAL && !working_sets))
+    {
+        app_error("bench: out of memory");
+    }
+    if(working_sets)
+    {
+        memset(working_sets, 1, (size_t)workers * NUMA_WORKING_SET); // All on the node of main().
+    }
+    if(method == NUMA_LOCAL)
+    {
+        int nodes[workers];
+        for(int i = 0; i < workers; i++)
+        {
+            nodes[i] = affinityWorkerNode(topology, i);
+        }
+        dispatchSetNodes(dispatcher, nodes);
+    }
+    records[NUMA_CAPACITY].job_id = -1; // Stops a worker.
+
+    double start = nowSeconds();
+    for(int i = 0; i < workers; i++)
+    {
+        args[i] = (NumaWorkerArgs){dispatcher, method == NUMA_UNPINNED ? NULL : topology, i,
+                                   working_sets ? working_sets + (size_t)i * NUMA_WORKING_SET : NULL, 0, 0, 0};
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(args[i].topology)
+        {
+            affinityApply(topology, &attr, i);
+        }
+        if(pthread_create(&threads[i], &attr, numaWorker, &args[i]) != 0)
+        {
+            posix_error(errno, "bench: pthread_create failed");
+        }
+        pthread_attr_destroy(&attr);
+    }
+    // The records are reused: a full dispatcher holds at most NUMA_CAPACITY of them.
+    for(int i = 0; i < items + workers; i++)
+    {
+        ConnectionStruct info = i < items ? &records[i % NUMA_CAPACITY] : &records[NUMA_CAPACITY];
+        while(dispatchPush(dispatcher, info) != CONNECTION_SUCCESS)
+        {
+            sched_yield();
+        }
+    }
+    *stolen = 0;
+    for(int i = 0; i < workers; i++)
+    {
+        pthread_join(threads[i], NULL);
+        *stolen += args[i].stolen;
+    }
+    double elapsed = nowSeconds() - start;
+
+    dispatchDestroy(dispatcher);
+    free(records);
+    free(working_sets);
+    return elapsed;
+}
+
+static void benchNuma(int argc, char *argv[])
+{
+    int mb = argc > 2 ? atoi(argv[2]) : NUMA_MB;
+    int items = argc > 3 ? atoi(argv[3]) : NUMA_ITEMS;
+    int workers = argc > 4 ? atoi(argv[4]) : NUMA_WORKERS;
+    if(mb <= 0 || items <= 0 || workers <= 0)
+    {
+        app_error("bench: all the numa arguments must be positive integers");
+    }
+    Affinity topology = affinityCreate("cores");
+    if(!topology)
+    {
+        unix_error("bench: affinityCreate failed");
+    }
+    int nodes = affinityNodeCount(topology);
+    printf("numa: %d CPUs in %d node(s)\n", affinityCpuCount(topology), nodes);
+
+    size_t words = (size_t)mb * 1024 * 1024 / sizeof(unsigned long);
+    printf("  memory, %d MB %d times (GB/s):\n", mb, NUMA_ROUNDS);
+    for(int from = 0; from < nodes; from++)
+    {
+        for(int to = 0; to < nodes; to++)
+        {
+            NumaTouchArgs touch = {numaNodeCpu(topology, to), malloc(words * sizeof(unsigned long)), words, 0, 0};
+            if(!touch.buf)
+            {
+                app_error("bench: out of memory");
+            }
+            numaTouchOn(&touch); // Its pages are now on node to.
+            touch.cpu = numaNodeCpu(topology, from);
+            touch.rounds = NUMA_ROUNDS;
+            double start = nowSeconds();
+            numaTouchOn(&touch);
+            double elapsed = nowSeconds() - start;
+            printf("    node %d -> memory of node %d %10.2f%s\n", from, to,
+                   (double)words * sizeof(unsigned long) * NUMA_ROUNDS / elapsed / 1e9, from == to ? "" : "  (remote)");
+            free(touch.buf);
+        }
+    }
+
+    printf("  dispatch, %d requests to %d steal workers:\n", items, workers);
+    for(int m = 0; m < NUMA_METHODS; m++)
+    {
+        long stolen = 0;
+        double elapsed = numaDispatch(m, topology, items, workers, &stolen);
+        printf("    %-20s %8.3f s  %12.0f req/s  %5.1f%% stolen\n", numa_names[m], elapsed, items / elapsed,
+               100.0 * stolen / items);
+        fflush(stdout);
+    }
+}
+
+// ********** Clocks ********** //
+#define STAMP_READS 10000000
+
+static const char* stamp_names[] = {"monotonic", "coarse", "tsc"};
+
+static long long stampGettimeofday()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec * 1000000 + tv.tv_usec) * TIMING_NS_PER_US;
+}
+
+/**
+ * Read the clock of read reads times and print what it costs.
+ */
+static void stampRun(const char *name, long long (*read)(), long reads)
+{
+    long long last = read(), step = LLONG_MAX;
+    long backward = 0;
+    double start = nowSeconds();
+    for(long i = 0; i < reads; i++)
+    {
+        long long now = read();
+        if(now < last)
+        {
+            backward++;
+        }
+        else if(now > last && now - last < step)
+        {
+            step = now - last;
+        }
+        last = now;
+    }
+    double elapsed = nowSeconds() - start;
+    printf("  %-14s %8.1f ns/read %12lld ns step %8ld backward\n", name, elapsed * 1e9 / reads,
+           step == LLONG_MAX ? 0 : step, backward);
+}
+
+static void benchClock(int argc, char *argv[])
+{
+    long reads = argc > 2 ? atol(argv[2]) : STAMP_READS;
+    if(reads <= 0)
+    {
+        app_error("bench: the number of reads must be a positive integer");
+    }
+    printf("clock: %ld reads in a row\n", reads);
+    stampRun("gettimeofday", stampGettimeofday, reads);
+    for(int mode = TIMING_MONOTONIC; mode <= TIMING_TSC; mode++)
+    {
+        if(!timingInit(mode))
+        {
+            printf("  %-14s unavailable (not an invariant TSC the kernel clock runs on)\n", stamp_names[mode]);
+            continue;
+        }
+        stampRun(stamp_names[mode], timingNow, reads);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "Usage: %s queue [producers] [consumers] [items] [capacity]\n", argv[0]);
+        fprintf(stderr, "       %s pool [workers] [items] [capacity]\n", argv[0]);
+        fprintf(stderr, "       %s http <port> <uri> [connections] [requests] [idle] [keepalive]\n", argv[0]);
+        fprintf(stderr, "       %s copy [rounds] [max-kb]\n", argv[0]);
+        fprintf(stderr, "       %s spawn [rounds] [max-mb]\n", argv[0]);
+        fprintf(stderr, "       %s drop [q-size] [rounds] [workers]\n", argv[0]);
+        fprintf(stderr, "       %s numa [mb] [items] [workers]\n", argv[0]);
+        fprintf(stderr, "       %s clock [reads]\n", argv[0]);
+        exit(1);
+    }
+
+    if(!strcmp(argv[1], "queue"))
+    {
+        benchQueue(argc, argv);
+    }
+    else if(!strcmp(argv[1], "pool"))
+    {
+        benchPool(argc, argv);
+    }
+    else if(!strcmp(argv[1], "http"))
+    {
+        benchHttp(argc, argv);
+    }
+    else if(!strcmp(argv[1], "copy"))
+    {
+        benchCopy(argc, argv);
+    }
+    else if(!strcmp(argv[1], "spawn"))
+    {
+        benchSpawn(argc, argv);
+    }
+    else if(!strcmp(argv[1], "drop"))
+    {
+        benchDrop(argc, argv);
+    }
+    else if(!strcmp(argv[1], "numa"))
+    {
+        benchNuma(argc, argv);
+    }
+    else if(!strcmp(argv[1], "clock"))
+    {
+        benchClock(argc, argv);
+    }
+    else
+    {
+        fprintf(stderr, "Error: unknown benchmark %s\n", argv[1]);
+        exit(1);
+    }
+    return 0;
+}
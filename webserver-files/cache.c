@@ -0,0 +1,442 @@
+#include "cache.h"
+#include <stdatomic.h>
+
+#define CACHE_SHARDS 16
+#define CACHE_BUCKETS 64       // Hash chains per shard.
+#define CACHE_HEADERS_LEN 128
+
+typedef enum CacheState_t
+{
+    CACHE_LOADING = 0, // A miss is reading the file, the threads that find the entry wait.
+    CACHE_READY,
+    CACHE_FAILED       // The file could not be read, the entry is already unlinked.
+} CacheState;
+
+struct cache_entry
+{
+    char *path;               // Normalized, the key.
+    unsigned long hash;
+    CacheState state;         // Changes under the shard lock.
+    bool linked;              // In the table and the LRU list of its shard.
+    atomic_int refs;          // One for the table while linked, and one per user.
+    char *data;
+    size_t size;
+    size_t cost;              // What the entry counts against the size limit.
+    char headers[CACHE_HEADERS_LEN];
+    int headers_len;
+    struct cache_entry *chain_next;
+    struct cache_entry *lru_prev; // Toward the most recently used.
+    struct cache_entry *lru_next; // Toward the least recently used.
+};
+
+typedef struct cache_shard
+{
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;     // Broadcast whenever a load of this shard completes.
+    CacheEntry buckets[CACHE_BUCKETS];
+    struct cache_entry lru;    // Sentinel: lru.lru_next is the most recently used entry.
+    size_t bytes;
+    size_t limit;
+    long entries;
+    long coalesced;
+    long evictions;
+    long invalidations;
+    atomic_long hits;          // Written under the lock, also read without it by cacheHitRatio().
+    atomic_long misses;
+} CacheShard;
+
+struct content_cache
+{
+    CacheShard shards[CACHE_SHARDS];
+    size_t max_file;
+};
+
+// ********** Entries ********** //
+
+static unsigned long cacheHash(const char *key)
+{
+    unsigned long hash = 14695981039346656037UL; // FNV-1a
+    for(; *key; key++)
+    {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211UL;
+    }
+    return hash;
+}
+
+static CacheShard* cacheShardOf(ContentCache cache, unsigned long hash)
+{
+    return &cache->shards[hash % CACHE_SHARDS];
+}
+
+static CacheEntry* cacheBucketOf(CacheShard *shard, unsigned long hash)
+{
+    return &shard->buckets[(hash / CACHE_SHARDS) % CACHE_BUCKETS];
+}
+
+static CacheEntry cacheFind(CacheShard *shard, const char *key, unsigned long hash)
+{
+    for(CacheEntry entry = *cacheBucketOf(shard, hash); entry; entry = entry->chain_next)
+    {
+        if(entry->hash == hash && !strcmp(entry->path, key))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void cacheLruPushFront(CacheShard *shard, CacheEntry entry)
+{
+    entry->lru_prev = &shard->lru;
+    entry->lru_next = shard->lru.lru_next;
+    shard->lru.lru_next->lru_prev = entry;
+    shard->lru.lru_next = entry;
+}
+
+static void cacheLruRemove(CacheEntry entry)
+{
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+/**
+ * Put a new entry in the table of its shard, as the most recently used one. Under the shard lock.
+ */
+static void cacheLink(CacheShard *shard, CacheEntry entry)
+{
+    CacheEntry *bucket = cacheBucketOf(shard, entry->hash);
+    entry->chain_next = *bucket;
+    *bucket = entry;
+    cacheLruPushFront(shard, entry);
+    entry->linked = true;
+    shard->entries++;
+}
+
+/**
+ * Take an entry out of the table of its shard and drop the reference of the table.
+ * Under the shard lock.
+ */
+static void cacheUnlink(CacheShard *shard, CacheEntry entry)
+{
+    CacheEntry *link = cacheBucketOf(shard, entry->hash);
+    while(*link != entry)
+    {
+        link = &(*link)->chain_next;
+    }
+    *link = entry->chain_next;
+    cacheLruRemove(entry);
+    entry->linked = false;
+    shard->entries--;
+    if(entry->state == CACHE_READY)
+    {
+        shard->bytes -= entry->cost;
+    }
+    cacheRelease(entry);
+}
+
+/**
+ * Drop the least recently used entries until the shard is within its limit. Under the shard lock.
+ */
+static void cacheEvict(CacheShard *shard)
+{
+    CacheEntry victim = shard->lru.lru_prev;
+    while(shard->bytes > shard->limit && victim != &shard->lru)
+    {
+        CacheEntry prev = victim->lru_prev;
+        if(victim->state == CACHE_READY) // A loading entry does not count yet.
+        {
+            cacheUnlink(shard, victim);
+            shard->evictions++;
+        }
+        victim = prev;
+    }
+}
+
+/**
+ * Read the file of entry into memory and format its headers. Without any lock.
+ * Return false if it could not be read or is too large after all.
+ */
+static bool cacheLoad(ContentCache cache, CacheEntry entry, const char *filetype)
+{
+    struct stat sbuf;
+    int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        return false;
+    }
+    if(fstat(fd, &sbuf) < 0 || (size_t)sbuf.st_size > cache->max_file ||
+       !(entry->data = malloc(sbuf.st_size > 0 ? sbuf.st_size : 1)))
+    {
+        close(fd);
+        return false;
+    }
+    entry->size = sbuf.st_size;
+    for(size_t done = 0; done < entry->size; )
+    {
+        ssize_t n = pread(fd, entry->data + done, entry->size - done, done);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            close(fd);
+            return false; // The file shrank or broke, it is freed with the entry.
+        }
+        done += n;
+    }
+    close(fd);
+
+    entry->headers_len = snprintf(entry->headers, sizeof(entry->headers),
+                                  "Content-Length: %zu\r\nContent-Type: %s\r\n", entry->size, filetype);
+    entry->cost = sizeof(*entry) + strlen(entry->path) + 1 + entry->size;
+    return entry->headers_len < (int)sizeof(entry->headers);
+}
+
+CacheEntry cacheAcquire(ContentCache cache, const char *path, size_t filesize, const char *filetype)
+{
+    char key[MAXLINE];
+    if(!watchNormalize(path, key, sizeof(key)))
+    {
+        return NULL;
+    }
+    unsigned long hash = cacheHash(key);
+    CacheShard *shard = cacheShardOf(cache, hash);
+    if(filesize > cache->max_file || filesize > shard->limit)
+    {
+        atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    // <CRITICAL>
+    CacheEntry entry = cacheFind(shard, key, hash);
+    if(entry && entry->state == CACHE_READY && entry->size != filesize)
+    {
+        cacheUnlink(shard, entry); // The file changed and its event did not arrive yet.
+        shard->invalidations++;
+        entry = NULL;
+    }
+    if(entry)
+    {
+        atomic_fetch_add(&entry->refs, 1);
+        if(entry->state == CACHE_LOADING)
+        {
+            shard->coalesced++;
+            while(entry->state == CACHE_LOADING)
+            {
+                pthread_cond_wait(&shard->loaded, &shard->lock);
+            }
+        }
+        if(entry->state == CACHE_READY)
+        {
+            if(entry->linked)
+            {
+                cacheLruRemove(entry);
+                cacheLruPushFront(shard, entry);
+            }
+            atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+            pthread_mutex_unlock(&shard->lock);
+            return entry;
+        }
+        atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&shard->lock);
+        cacheRelease(entry); // The load failed.
+        return NULL;
+    }
+
+    atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+    entry = calloc(1, sizeof(*entry));
+    if(entry && !(entry->path = strdup(key)))
+    {
+        free(entry);
+        entry = NULL;
+    }
+    if(entry)
+    {
+        entry->hash = hash;
+        entry->state = CACHE_LOADING;
+        atomic_init(&entry->refs, 2); // The table and this thread.
+        cacheLink(shard, entry);
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&shard->lock);
+    if(!entry)
+    {
+        return NULL;
+    }
+
+    bool loaded = cacheLoad(cache, entry, filetype);
+
+    pthread_mutex_lock(&shard->lock);
+    // <CRITICAL>
+    entry->state = loaded ? CACHE_READY : CACHE_FAILED;
+    if(entry->linked) // Not invalidated while loading.
+    {
+        if(loaded)
+        {
+            shard->bytes += entry->cost;
+            cacheEvict(shard);
+        }
+        else
+        {
+            cacheUnlink(shard, entry);
+        }
+    }
+    pthread_cond_broadcast(&shard->loaded);
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&shard->lock);
+
+    if(!loaded)
+    {
+        cacheRelease(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+void cacheRelease(CacheEntry entry)
+{
+    if(atomic_fetch_sub(&entry->refs, 1) == 1)
+    {
+        free(entry->data);
+        free(entry->path);
+        free(entry);
+    }
+}
+
+const char* cacheEntryData(CacheEntry entry, size_t *size)
+{
+    *size = entry->size;
+    return entry->data;
+}
+
+const char* cacheEntryHeaders(CacheEntry entry, int *len)
+{
+    *len = entry->headers_len;
+    return entry->headers;
+}
+
+void cacheInvalidate(ContentCache cache, const char *path)
+{
+    char key[MAXLINE];
+    if(!watchNormalize(path, key, sizeof(key)))
+    {
+        return;
+    }
+    unsigned long hash = cacheHash(key);
+    CacheShard *shard = cacheShardOf(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    // <CRITICAL>
+    CacheEntry entry = cacheFind(shard, key, hash);
+    if(entry)
+    {
+        cacheUnlink(shard, entry);
+        shard->invalidations++;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Drop every entry, when it is not known which files changed.
+ */
+static void cacheInvalidateAll(ContentCache cache)
+{
+    for(int i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        // <CRITICAL>
+        while(shard->lru.lru_next != &shard->lru)
+        {
+            cacheUnlink(shard, shard->lru.lru_next);
+            shard->invalidations++;
+        }
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void cacheGetStats(ContentCache cache, CacheStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for(int i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        // <CRITICAL>
+        stats->hits += atomic_load(&shard->hits);
+        stats->misses += atomic_load(&shard->misses);
+        stats->coalesced += shard->coalesced;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        stats->limit += shard->limit;
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+double cacheHitRatio(ContentCache cache)
+{
+    long hits = 0, lookups = 0;
+    for(int i = 0; i < CACHE_SHARDS; i++)
+    {
+        long shard_hits = atomic_load_explicit(&cache->shards[i].hits, memory_order_relaxed);
+        hits += shard_hits;
+        lookups += shard_hits + atomic_load_explicit(&cache->shards[i].misses, memory_order_relaxed);
+    }
+    return lookups ? (double)hits / lookups : 0;
+}
+
+// ********** Invalidation ********** //
+
+/**
+ * Drop the entry of the changed file, see watch.h.
+ */
+static void cacheOnChange(void *owner, const char *path)
+{
+    ContentCache cache = (ContentCache)owner;
+    if(path)
+    {
+        cacheInvalidate(cache, path);
+    }
+    else
+    {
+        cacheInvalidateAll(cache);
+    }
+}
+
+ContentCache cacheCreate(FileWatcher watcher, size_t limit, size_t max_file)
+{
+    // Without invalidation the cache would serve changed files, so it is all or nothing:
+    if(!watcher)
+    {
+        return NULL;
+    }
+    ContentCache cache = calloc(1, sizeof(*cache));
+    if(!cache)
+    {
+        return NULL;
+    }
+    cache->max_file = max_file;
+    for(int i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->loaded, NULL);
+        shard->lru.lru_prev = shard->lru.lru_next = &shard->lru;
+        shard->limit = limit / CACHE_SHARDS;
+        atomic_init(&shard->hits, 0);
+        atomic_init(&shard->misses, 0);
+    }
+    if(!watchAddHandler(watcher, cacheOnChange, cache))
+    {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
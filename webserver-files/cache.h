@@ -0,0 +1,82 @@
+#ifndef _CACHE_INC
+#define _CACHE_INC
+
+#include "segel.h"
+#include "watch.h"
+#include <stdbool.h>
+
+// ********** Content Cache ********** //
+// Keeps the bytes of the hot static files (and their Content-Length and Content-Type
+// headers) in memory, so a hit is answered without open/mmap/munmap.
+//  - The entries are spread over shards by the hash of their path, every shard has
+//    its own lock, hash table and LRU list, and gets an equal part of the size limit.
+//  - A miss loads the file while the entry is marked as loading, other threads that
+//    miss on the same file meanwhile wait for that load instead of reading it again.
+//  - The file watcher (see watch.h) drops the entries of the files that change,
+//    are replaced or are deleted.
+//  - Entries are reference counted: one that is evicted or invalidated while it is
+//    being sent stays valid until its last user releases it.
+typedef struct content_cache* ContentCache;
+typedef struct cache_entry* CacheEntry;
+
+typedef struct cache_stats
+{
+    long hits;          // Lookups answered from memory (including the ones that waited for a load).
+    long misses;        // Lookups that had to read the file, or could not cache it.
+    long coalesced;     // Hits that waited for the load of a concurrent miss.
+    long evictions;     // Entries dropped to stay within the size limit.
+    long invalidations; // Entries dropped because their file changed.
+    long entries;       // Entries currently cached.
+    long bytes;         // Bytes currently cached.
+    long limit;         // The size limit.
+} CacheStats;
+
+// The cache of the server, NULL when it is off (--cache=0).
+extern ContentCache content_cache;
+
+/**
+ * Create a cache of the files under the root of watcher (which must be the prefix of the cached
+ * paths), holding at most limit bytes, and files of at most max_file bytes.
+ * Return NULL on failure (including when watcher is NULL: nothing would invalidate the entries).
+ */
+ContentCache cacheCreate(FileWatcher watcher, size_t limit, size_t max_file);
+
+/**
+ * Return the entry of the file at path, loading it on a miss. filesize is the size stat() just
+ * found, an entry of another size is stale and is loaded again. filetype is its Content-Type.
+ * Return NULL if the file is not cacheable (too large) or could not be read: serve it from disk.
+ * The entry must be released with cacheRelease().
+ */
+CacheEntry cacheAcquire(ContentCache cache, const char *path, size_t filesize, const char *filetype);
+
+/**
+ * Release an entry returned by cacheAcquire(). Any thread may release it.
+ */
+void cacheRelease(CacheEntry entry);
+
+/**
+ * Return the file bytes of entry, and their number in size.
+ */
+const char* cacheEntryData(CacheEntry entry, size_t *size);
+
+/**
+ * Return the Content-Length and Content-Type header lines of entry, and their length in len.
+ */
+const char* cacheEntryHeaders(CacheEntry entry, int *len);
+
+/**
+ * Drop the entry of path if there is one (e.g. the file changed).
+ */
+void cacheInvalidate(ContentCache cache, const char *path);
+
+/**
+ * Fill stats with a snapshot of the cache counters.
+ */
+void cacheGetStats(ContentCache cache, CacheStats *stats);
+
+/**
+ * Return hits / (hits + misses) so far, or 0 before the first lookup. Does not lock.
+ */
+double cacheHitRatio(ContentCache cache);
+
+#endif
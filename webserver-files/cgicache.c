@@ -0,0 +1,650 @@
+#include "cgicache.h"
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+
+#define CGI_CACHE_SHARDS 8
+#define CGI_CACHE_BUCKETS 64          // Hash chains per shard.
+#define CGI_CACHE_MAX_OUTPUT (1 << 20) // Larger output is never kept, whatever the size limit.
+#define CGI_CACHE_REFRESH_QUEUE 64     // Refreshes waiting for the refresher thread, more are skipped.
+
+struct cgi_entry
+{
+    char *key;                 // "filename?cgiargs", the filename normalized (a filename has no '?').
+    size_t filename_len;
+    unsigned long hash;        // Of the whole key.
+    char *uri;                 // Of the request that made the output, for its refresh.
+    bool linked;               // In the table and the LRU list of its shard.
+    atomic_int refs;           // One for the table while linked, and one per user.
+    atomic_bool refreshing;    // A refresh was handed to the refresher thread.
+    char *data;
+    size_t size;
+    size_t cost;               // What the entry counts against the size limit.
+    long long made_ms;
+    long long fresh_until_ms;
+    long long stale_until_ms;  // Dropped from then on.
+    struct cgi_entry *chain_next;
+    struct cgi_entry *lru_prev; // Toward the most recently used.
+    struct cgi_entry *lru_next; // Toward the least recently used.
+};
+
+typedef struct cgi_cache_shard
+{
+    pthread_mutex_t lock;
+    CgiEntry buckets[CGI_CACHE_BUCKETS];
+    struct cgi_entry lru;      // Sentinel: lru.lru_next is the most recently used entry.
+    size_t bytes;
+    size_t limit;
+    long entries;
+    long stale_hits;
+    long uncacheable;
+    long evictions;
+    long expirations;
+    long invalidations;
+    atomic_long hits;          // Written under the lock, also read without it by cgiCacheHitRatio().
+    atomic_long misses;
+} CgiCacheShard;
+
+struct cgi_cache
+{
+    CgiCacheShard shards[CGI_CACHE_SHARDS];
+    int ttl_sec;
+    int stale_sec;
+    CgiRunner runner;
+
+    pthread_mutex_t refresh_lock;  // Protects the refresh queue.
+    pthread_cond_t refresh_ready;
+    CgiEntry refresh_queue[CGI_CACHE_REFRESH_QUEUE];
+    int refresh_head;
+    int refresh_size;
+    long refreshes;
+    pthread_t refresher;
+};
+
+// ********** Entries ********** //
+
+static long long cgiCacheNowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned long cgiCacheHash(const char *key, size_t len)
+{
+    unsigned long hash = 14695981039346656037UL; // FNV-1a
+    for(size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211UL;
+    }
+    return hash;
+}
+
+/**
+ * The entries of one program share a shard, so dropping them all looks at that shard only.
+ */
+static CgiCacheShard* cgiCacheShardOf(CgiCache cache, const char *filename, size_t filename_len)
+{
+    return &cache->shards[cgiCacheHash(filename, filename_len) % CGI_CACHE_SHARDS];
+}
+
+static CgiEntry* cgiCacheBucketOf(CgiCacheShard *shard, unsigned long hash)
+{
+    return &shard->buckets[hash % CGI_CACHE_BUCKETS];
+}
+
+/**
+ * Build the key of filename run with cgiargs into key. Return false if it does not fit.
+ */
+static bool cgiCacheKey(const char *filename, const char *cgiargs, char *key, size_t size, size_t *filename_len)
+{
+    if(!watchNormalize(filename, key, size))
+    {
+        return false;
+    }
+    *filename_len = strlen(key);
+    return snprintf(key + *filename_len, size - *filename_len, "?%s", cgiargs) < (int)(size - *filename_len);
+}
+
+static CgiEntry cgiCacheFind(CgiCacheShard *shard, const char *key, unsigned long hash)
+{
+    for(CgiEntry entry = *cgiCacheBucketOf(shard, hash); entry; entry = entry->chain_next)
+    {
+        if(entry->hash == hash && !strcmp(entry->key, key))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void cgiCacheLruPushFront(CgiCacheShard *shard, CgiEntry entry)
+{
+    entry->lru_prev = &shard->lru;
+    entry->lru_next = shard->lru.lru_next;
+    shard->lru.lru_next->lru_prev = entry;
+    shard->lru.lru_next = entry;
+}
+
+static void cgiCacheLruRemove(CgiEntry entry)
+{
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+/**
+ * Put a new entry in the table of its shard, as the most recently used one. Under the shard lock.
+ */
+static void cgiCacheLink(CgiCacheShard *shard, CgiEntry entry)
+{
+    CgiEntry *bucket = cgiCacheBucketOf(shard, entry->hash);
+    entry->chain_next = *bucket;
+    *bucket = entry;
+    cgiCacheLruPushFront(shard, entry);
+    entry->linked = true;
+    shard->entries++;
+    shard->bytes += entry->cost;
+}
+
+/**
+ * Take an entry out of the table of its shard and drop the reference of the table.
+ * Under the shard lock.
+ */
+static void cgiCacheUnlink(CgiCacheShard *shard, CgiEntry entry)
+{
+    CgiEntry *link = cgiCacheBucketOf(shard, entry->hash);
+    while(*link != entry)
+    {
+        link = &(*link)->chain_next;
+    }
+    *link = entry->chain_next;
+    cgiCacheLruRemove(entry);
+    entry->linked = false;
+    shard->entries--;
+    shard->bytes -= entry->cost;
+    cgiCacheRelease(entry);
+}
+
+/**
+ * Drop the least recently used entries until the shard is within its limit. Under the shard lock.
+ */
+static void cgiCacheEvict(CgiCacheShard *shard)
+{
+    while(shard->bytes > shard->limit && shard->lru.lru_prev != &shard->lru)
+    {
+        cgiCacheUnlink(shard, shard->lru.lru_prev);
+        shard->evictions++;
+    }
+}
+
+void cgiCacheRelease(CgiEntry entry)
+{
+    if(atomic_fetch_sub(&entry->refs, 1) == 1)
+    {
+        free(entry->data);
+        free(entry->uri);
+        free(entry->key);
+        free(entry);
+    }
+}
+
+const char* cgiCacheEntryData(CgiEntry entry, size_t *size)
+{
+    *size = entry->size;
+    return entry->data;
+}
+
+// ********** Output ********** //
+
+void cgiCacheOutputInit(CgiCache cache, CgiOutput *output)
+{
+    output->data = NULL;
+    output->len = output->cap = 0;
+    output->max = cache->shards[0].limit < CGI_CACHE_MAX_OUTPUT ? cache->shards[0].limit : CGI_CACHE_MAX_OUTPUT;
+    output->dropped = false;
+}
+
+bool cgiCacheOutputAppend(CgiOutput *output, const char *buf, size_t len)
+{
+    if(output->dropped)
+    {
+        return false;
+    }
+    if(len > output->max - output->len)
+    {
+        output->dropped = true;
+        return false;
+    }
+    if(output->len + len > output->cap)
+    {
+        size_t cap = output->cap ? output->cap : 4096;
+        while(cap < output->len + len)
+        {
+            cap *= 2;
+        }
+        char *data = realloc(output->data, cap);
+        if(!data)
+        {
+            output->dropped = true;
+            return false;
+        }
+        output->data = data;
+        output->cap = cap;
+    }
+    memcpy(output->data + output->len, buf, len);
+    output->len += len;
+    return true;
+}
+
+void cgiCacheOutputFree(CgiOutput *output)
+{
+    free(output->data);
+    output->data = NULL;
+    output->len = output->cap = 0;
+}
+
+// ********** Cache-Control ********** //
+
+/**
+ * Parse the non-negative number of seconds after "name=" in directive into *value, if it is that one.
+ */
+static bool cgiCacheSeconds(const char *directive, const char *name, int *value)
+{
+    size_t len = strlen(name);
+    if(strncasecmp(directive, name, len) || directive[len] != '=')
+    {
+        return false;
+    }
+    long seconds = strtol(directive + len + 1, NULL, 10);
+    *value = seconds < 0 ? 0 : seconds > INT_MAX ? INT_MAX : (int)seconds;
+    return true;
+}
+
+/**
+ * Apply the directives of a Cache-Control header (NUL-terminated value) to the policy.
+ * Return false if the output may not be kept.
+ */
+static bool cgiCacheControl(char *value, int *fresh_sec, int *stale_sec)
+{
+    int shared_max_age = -1;
+    for(char *save = NULL, *directive = strtok_r(value, ",", &save); directive;
+        directive = strtok_r(NULL, ",", &save))
+    {
+        while(*directive == ' ' || *directive == '\t')
+        {
+            directive++;
+        }
+        directive[strcspn(directive, " \t")] = '\0';
+        if(!strcasecmp(directive, "no-store") || !strcasecmp(directive, "no-cache") ||
+           !strcasecmp(directive, "private"))
+        {
+            return false;
+        }
+        if(!cgiCacheSeconds(directive, "max-age", fresh_sec) &&
+           !cgiCacheSeconds(directive, "s-maxage", &shared_max_age))
+        {
+            cgiCacheSeconds(directive, "stale-while-revalidate", stale_sec);
+        }
+    }
+    if(shared_max_age >= 0)
+    {
+        *fresh_sec = shared_max_age; // Meant for shared caches, like this one.
+    }
+    return true;
+}
+
+/**
+ * Read the headers at the start of a CGI output (up to the empty line) for how long it may be kept.
+ * Return false if it may not be kept at all.
+ */
+static bool cgiCachePolicy(const char *data, size_t size, int *fresh_sec, int *stale_sec)
+{
+    char line[MAXLINE];
+    const char *end = data + size;
+    for(const char *p = data; p < end; )
+    {
+        const char *eol = memchr(p, '\n', end - p);
+        if(!eol)
+        {
+            return false; // No empty line: not a CGI output.
+        }
+        size_t len = eol - p;
+        if(len > 0 && p[len - 1] == '\r')
+        {
+            len--;
+        }
+        if(len == 0)
+        {
+            return *fresh_sec + *stale_sec > 0;
+        }
+        if(len >= sizeof(line))
+        {
+            len = sizeof(line) - 1;
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+        if(!strncasecmp(line, "Set-Cookie:", 11))
+        {
+            return false; // Meant for one client.
+        }
+        if(!strncasecmp(line, "Cache-Control:", 14) && !cgiCacheControl(line + 14, fresh_sec, stale_sec))
+        {
+            return false;
+        }
+        p = eol + 1;
+    }
+    return false;
+}
+
+// ********** Lookups ********** //
+
+/**
+ * Hand a refresh of entry (its reference included) to the refresher thread.
+ */
+static void cgiCacheScheduleRefresh(CgiCache cache, CgiEntry entry)
+{
+    bool queued = false;
+    pthread_mutex_lock(&cache->refresh_lock);
+    // <CRITICAL>
+    if(cache->refresh_size < CGI_CACHE_REFRESH_QUEUE)
+    {
+        cache->refresh_queue[(cache->refresh_head + cache->refresh_size) % CGI_CACHE_REFRESH_QUEUE] = entry;
+        cache->refresh_size++;
+        pthread_cond_signal(&cache->refresh_ready);
+        queued = true;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&cache->refresh_lock);
+    if(!queued)
+    {
+        atomic_store(&entry->refreshing, false); // A later hit asks again.
+        cgiCacheRelease(entry);
+    }
+}
+
+CgiEntry cgiCacheAcquire(CgiCache cache, const char *filename, const char *cgiargs, long *age)
+{
+    char key[MAXLINE];
+    size_t filename_len;
+    if(!cgiCacheKey(filename, cgiargs, key, sizeof(key), &filename_len))
+    {
+        return NULL;
+    }
+    unsigned long hash = cgiCacheHash(key, strlen(key));
+    CgiCacheShard *shard = cgiCacheShardOf(cache, key, filename_len);
+    long long now = cgiCacheNowMs();
+    bool refresh = false;
+
+    pthread_mutex_lock(&shard->lock);
+    // <CRITICAL>
+    CgiEntry entry = cgiCacheFind(shard, key, hash);
+    if(entry && entry->stale_until_ms <= now)
+    {
+        cgiCacheUnlink(shard, entry);
+        shard->expirations++;
+        entry = NULL;
+    }
+    if(entry)
+    {
+        atomic_fetch_add(&entry->refs, 1);
+        cgiCacheLruRemove(entry);
+        cgiCacheLruPushFront(shard, entry);
+        atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+        if(entry->fresh_until_ms <= now)
+        {
+            shard->stale_hits++;
+            refresh = !atomic_exchange(&entry->refreshing, true);
+        }
+    }
+    else
+    {
+        atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&shard->lock);
+
+    if(!entry)
+    {
+        return NULL;
+    }
+    if(refresh)
+    {
+        atomic_fetch_add(&entry->refs, 1); // For the refresher.
+        cgiCacheScheduleRefresh(cache, entry);
+    }
+    *age = (now - entry->made_ms) / 1000;
+    return entry;
+}
+
+void cgiCacheStore(CgiCache cache, const char *filename, const char *cgiargs, const char *uri, CgiOutput *output)
+{
+    char key[MAXLINE];
+    size_t filename_len;
+    if(!cgiCacheKey(filename, cgiargs, key, sizeof(key), &filename_len))
+    {
+        return;
+    }
+    CgiCacheShard *shard = cgiCacheShardOf(cache, key, filename_len);
+    int fresh_sec = cache->ttl_sec, stale_sec = cache->stale_sec;
+    bool keep = !output->dropped && cgiCachePolicy(output->data, output->len, &fresh_sec, &stale_sec);
+
+    CgiEntry entry = NULL;
+    if(keep && (entry = calloc(1, sizeof(*entry))) && (!(entry->key = strdup(key)) || !(entry->uri = strdup(uri))))
+    {
+        free(entry->key);
+        free(entry);
+        entry = NULL;
+    }
+    if(entry)
+    {
+        entry->filename_len = filename_len;
+        entry->hash = cgiCacheHash(key, strlen(key));
+        atomic_init(&entry->refs, 1); // The table.
+        atomic_init(&entry->refreshing, false);
+        entry->data = output->data;
+        entry->size = output->len;
+        entry->cost = sizeof(*entry) + strlen(key) + strlen(uri) + 2 + output->cap;
+        entry->made_ms = cgiCacheNowMs();
+        entry->fresh_until_ms = entry->made_ms + fresh_sec * 1000LL;
+        entry->stale_until_ms = entry->fresh_until_ms + stale_sec * 1000LL;
+        output->data = NULL;
+        output->len = output->cap = 0;
+    }
+
+    unsigned long hash = cgiCacheHash(key, strlen(key));
+    pthread_mutex_lock(&shard->lock);
+    // <CRITICAL>
+    CgiEntry old = cgiCacheFind(shard, key, hash);
+    if(old)
+    {
+        cgiCacheUnlink(shard, old); // Replaced, or no longer allowed.
+    }
+    if(!keep)
+    {
+        shard->uncacheable++;
+    }
+    if(entry)
+    {
+        cgiCacheLink(shard, entry);
+        cgiCacheEvict(shard);
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// ********** Refreshes ********** //
+
+static void* cgiCacheRefresher(void *arg)
+{
+    CgiCache cache = (CgiCache)arg;
+    while(1)
+    {
+        pthread_mutex_lock(&cache->refresh_lock);
+        // <CRITICAL>
+        while(cache->refresh_size == 0)
+        {
+            pthread_cond_wait(&cache->refresh_ready, &cache->refresh_lock);
+        }
+        CgiEntry entry = cache->refresh_queue[cache->refresh_head];
+        cache->refresh_head = (cache->refresh_head + 1) % CGI_CACHE_REFRESH_QUEUE;
+        cache->refresh_size--;
+        cache->refreshes++;
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&cache->refresh_lock);
+
+        // The key holds the normalized filename, a runnable path all the same:
+        char filename[MAXLINE];
+        memcpy(filename, entry->key, entry->filename_len);
+        filename[entry->filename_len] = '\0';
+        const char *cgiargs = entry->key + entry->filename_len + 1;
+
+        CgiOutput output;
+        cgiCacheOutputInit(cache, &output);
+        if(cache->runner(filename, cgiargs, entry->uri, &output) && !output.dropped)
+        {
+            cgiCacheStore(cache, filename, cgiargs, entry->uri, &output);
+        }
+        else
+        {
+            atomic_store(&entry->refreshing, false); // Still stale, a later hit tries again.
+        }
+        cgiCacheOutputFree(&output);
+        cgiCacheRelease(entry);
+    }
+    return NULL;
+}
+
+// ********** Invalidation ********** //
+
+void cgiCacheInvalidate(CgiCache cache, const char *filename)
+{
+    char key[MAXLINE];
+    if(!watchNormalize(filename, key, sizeof(key)))
+    {
+        return;
+    }
+    size_t filename_len = strlen(key);
+    CgiCacheShard *shard = cgiCacheShardOf(cache, key, filename_len);
+
+    pthread_mutex_lock(&shard->lock);
+    // <CRITICAL>
+    for(CgiEntry entry = shard->lru.lru_next; entry != &shard->lru; )
+    {
+        CgiEntry next = entry->lru_next;
+        if(entry->filename_len == filename_len && !strncmp(entry->key, key, filename_len))
+        {
+            cgiCacheUnlink(shard, entry);
+            shard->invalidations++;
+        }
+        entry = next;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Drop every entry, when it is not known which files changed.
+ */
+static void cgiCacheInvalidateAll(CgiCache cache)
+{
+    for(int i = 0; i < CGI_CACHE_SHARDS; i++)
+    {
+        CgiCacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        // <CRITICAL>
+        while(shard->lru.lru_next != &shard->lru)
+        {
+            cgiCacheUnlink(shard, shard->lru.lru_next);
+            shard->invalidations++;
+        }
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**
+ * Drop the entries of the changed program, see watch.h.
+ */
+static void cgiCacheOnChange(void *owner, const char *path)
+{
+    CgiCache cache = (CgiCache)owner;
+    if(path)
+    {
+        cgiCacheInvalidate(cache, path);
+    }
+    else
+    {
+        cgiCacheInvalidateAll(cache);
+    }
+}
+
+void cgiCacheGetStats(CgiCache cache, CgiCacheStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for(int i = 0; i < CGI_CACHE_SHARDS; i++)
+    {
+        CgiCacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        // <CRITICAL>
+        stats->hits += atomic_load(&shard->hits);
+        stats->misses += atomic_load(&shard->misses);
+        stats->stale_hits += shard->stale_hits;
+        stats->uncacheable += shard->uncacheable;
+        stats->evictions += shard->evictions;
+        stats->expirations += shard->expirations;
+        stats->invalidations += shard->invalidations;
+        stats->entries += shard->entries;
+        stats->bytes += shard->bytes;
+        stats->limit += shard->limit;
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&shard->lock);
+    }
+    pthread_mutex_lock(&cache->refresh_lock);
+    stats->refreshes = cache->refreshes;
+    pthread_mutex_unlock(&cache->refresh_lock);
+}
+
+double cgiCacheHitRatio(CgiCache cache)
+{
+    long hits = 0, lookups = 0;
+    for(int i = 0; i < CGI_CACHE_SHARDS; i++)
+    {
+        long shard_hits = atomic_load_explicit(&cache->shards[i].hits, memory_order_relaxed);
+        hits += shard_hits;
+        lookups += shard_hits + atomic_load_explicit(&cache->shards[i].misses, memory_order_relaxed);
+    }
+    return lookups ? (double)hits / lookups : 0;
+}
+
+CgiCache cgiCacheCreate(FileWatcher watcher, size_t limit, int ttl_sec, int stale_sec, CgiRunner runner)
+{
+    CgiCache cache = calloc(1, sizeof(*cache));
+    if(!cache)
+    {
+        return NULL;
+    }
+    cache->ttl_sec = ttl_sec;
+    cache->stale_sec = stale_sec;
+    cache->runner = runner;
+    for(int i = 0; i < CGI_CACHE_SHARDS; i++)
+    {
+        CgiCacheShard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->lru.lru_prev = shard->lru.lru_next = &shard->lru;
+        shard->limit = limit / CGI_CACHE_SHARDS;
+        atomic_init(&shard->hits, 0);
+        atomic_init(&shard->misses, 0);
+    }
+    pthread_mutex_init(&cache->refresh_lock, NULL);
+    pthread_cond_init(&cache->refresh_ready, NULL);
+    if(pthread_create(&cache->refresher, NULL, cgiCacheRefresher, cache) != 0)
+    {
+        free(cache);
+        return NULL;
+    }
+    if(watcher)
+    {
+        watchAddHandler(watcher, cgiCacheOnChange, cache); // Without it the entries only age out.
+    }
+    return cache;
+}
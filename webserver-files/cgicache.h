@@ -0,0 +1,122 @@
+#ifndef _CGICACHE_INC
+#define _CGICACHE_INC
+
+#include "segel.h"
+#include "watch.h"
+#include <stdbool.h>
+
+// ********** CGI Response Cache ********** //
+// Keeps the whole output of CGI programs (their headers, the empty line and their body), keyed
+// by the program and its QUERY_STRING, so a repeated query is answered without running it again.
+// It is opt-in (--cgi-cache=SECONDS): only idempotent programs should be served this way.
+//  - The program decides with its own Cache-Control header: no-store, no-cache and private keep
+//    the output out of the cache, max-age (or s-maxage) replaces the default freshness, and
+//    stale-while-revalidate the default stale window (--cgi-cache-stale). An output that sets
+//    a cookie, fails or is too large is never kept.
+//  - A stale entry inside its window is still served, and the first request that finds it hands
+//    a refresh to the refresher thread, so a hot query never waits for a run of the program.
+//    Past the window the entry is dropped and the next request runs the program itself.
+//  - Concurrent misses of one query each run the program (an output is only known at its end).
+//  - Entries are sharded by their program, and the file watcher (when there is one) drops
+//    the entries of a program that changes. Entries are reference counted like in cache.h.
+typedef struct cgi_cache* CgiCache;
+typedef struct cgi_entry* CgiEntry;
+
+// The output of one run of a program, as it is collected for the cache.
+typedef struct cgi_output
+{
+    char *data;
+    size_t len;
+    size_t cap;
+    size_t max;   // Larger output is not collected.
+    bool dropped; // Too large, cut or failed: not to be cached.
+} CgiOutput;
+
+/**
+ * Runs the program at filename for a refresh, collecting its whole output into output.
+ * Return false if it could not be run.
+ */
+typedef bool (*CgiRunner)(const char *filename, const char *cgiargs, const char *uri, CgiOutput *output);
+
+typedef struct cgi_cache_stats
+{
+    long hits;          // Requests answered from the cache (the stale ones included).
+    long stale_hits;    // Hits on a stale entry, each of them asked for at most one refresh.
+    long misses;        // Requests that ran the program.
+    long refreshes;     // Refreshes the refresher thread ran.
+    long uncacheable;   // Outputs not kept (Cache-Control, a cookie, too large or failed).
+    long evictions;     // Entries dropped to stay within the size limit.
+    long expirations;   // Entries dropped at the end of their stale window.
+    long invalidations; // Entries dropped because their program changed.
+    long entries;       // Entries currently cached.
+    long bytes;         // Bytes currently cached.
+    long limit;         // The size limit.
+} CgiCacheStats;
+
+// The CGI response cache of the server, NULL when it is off (--cgi-cache=0).
+extern CgiCache cgi_cache;
+
+/**
+ * Create a cache holding at most limit bytes of output, fresh for ttl_sec and then served stale
+ * for stale_sec more, unless a program says otherwise. runner refreshes the stale entries.
+ * watcher may be NULL, the entries of a program that changes then only age out.
+ * Return NULL on failure.
+ */
+CgiCache cgiCacheCreate(FileWatcher watcher, size_t limit, int ttl_sec, int stale_sec, CgiRunner runner);
+
+/**
+ * Return the entry of the program at filename run with cgiargs, or NULL on a miss: the caller
+ * runs the program, collecting its output for cgiCacheStore(). A stale entry is refreshed in the
+ * background. age is set to the seconds since the output was made.
+ * The entry must be released with cgiCacheRelease().
+ */
+CgiEntry cgiCacheAcquire(CgiCache cache, const char *filename, const char *cgiargs, long *age);
+
+/**
+ * Release an entry returned by cgiCacheAcquire(). Any thread may release it.
+ */
+void cgiCacheRelease(CgiEntry entry);
+
+/**
+ * Return the output kept in entry, and its length in size.
+ */
+const char* cgiCacheEntryData(CgiEntry entry, size_t *size);
+
+/**
+ * Keep (or replace) the output of a complete run of the program at filename with cgiargs, if its
+ * headers allow it. An output that may not be kept drops the previous one. Takes output->data.
+ * uri is the one of the request, its refreshes pass it on to the program.
+ */
+void cgiCacheStore(CgiCache cache, const char *filename, const char *cgiargs, const char *uri, CgiOutput *output);
+
+/**
+ * Prepare output to collect at most as much as one entry of cache can hold.
+ */
+void cgiCacheOutputInit(CgiCache cache, CgiOutput *output);
+
+/**
+ * Add len bytes of buf to output, or drop it if they do not fit. Return false once it is dropped.
+ */
+bool cgiCacheOutputAppend(CgiOutput *output, const char *buf, size_t len);
+
+/**
+ * Free what output collected.
+ */
+void cgiCacheOutputFree(CgiOutput *output);
+
+/**
+ * Drop the entries of the program at filename (e.g. the program changed).
+ */
+void cgiCacheInvalidate(CgiCache cache, const char *filename);
+
+/**
+ * Fill stats with a snapshot of the cache counters.
+ */
+void cgiCacheGetStats(CgiCache cache, CgiCacheStats *stats);
+
+/**
+ * Return hits / (hits + misses) so far, or 0 before the first lookup. Does not lock.
+ */
+double cgiCacheHitRatio(CgiCache cache);
+
+#endif
@@ -0,0 +1,118 @@
+#include "codel.h"
+#include "timing.h"
+#include <math.h>
+
+#define CODEL_RESTART_INTERVALS 16 // A new episode this soon after the last one resumes its drop rate.
+
+struct codel
+{
+    pthread_mutex_t lock;  // Every dispatch takes it, only for a few comparisons.
+    long long target_us;
+    long long interval_us;
+    long long first_above_us; // When the sojourn time has been above target for an interval, 0 if below.
+    long long drop_next_us;   // When the next drop is due while dropping.
+    bool dropping;
+    long count;               // Drops in the current episode, they set the drop rate.
+    long last_count;          // count when the last episode started.
+    CodelStats stats;
+};
+
+/**
+ * The time of the next drop: interval / sqrt(count) after t. Under the lock.
+ */
+static long long codelControlLaw(Codel codel, long long t)
+{
+    return t + (long long)(codel->interval_us / sqrt((double)codel->count));
+}
+
+/**
+ * Return true if the sojourn time has stayed above the target for a whole interval. Under the lock.
+ */
+static bool codelOkToDrop(Codel codel, long long sojourn_us, long long now_us, int queued)
+{
+    // Below the target, or nothing left waiting behind it: not a standing queue.
+    if(sojourn_us < codel->target_us || queued == 0)
+    {
+        codel->first_above_us = 0;
+        return false;
+    }
+    if(codel->first_above_us == 0)
+    {
+        codel->first_above_us = now_us + codel->interval_us;
+        return false;
+    }
+    return now_us >= codel->first_above_us;
+}
+
+Codel codelCreate(int target_ms, int interval_ms)
+{
+    Codel codel = calloc(1, sizeof(*codel));
+    if(!codel)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&codel->lock, NULL);
+    codel->target_us = (long long)target_ms * 1000;
+    codel->interval_us = (long long)interval_ms * 1000;
+    codel->stats.target_us = codel->target_us;
+    codel->stats.interval_us = codel->interval_us;
+    return codel;
+}
+
+bool codelShouldDrop(Codel codel, long long arrival_ns, long long dispatch_ns, int queued)
+{
+    long long now_us = dispatch_ns / TIMING_NS_PER_US;
+    long long sojourn_us = (dispatch_ns - arrival_ns) / TIMING_NS_PER_US;
+    bool drop = false;
+
+    pthread_mutex_lock(&codel->lock);
+    // <CRITICAL>
+    bool ok_to_drop = codelOkToDrop(codel, sojourn_us, now_us, queued);
+    if(codel->dropping)
+    {
+        if(!ok_to_drop)
+        {
+            codel->dropping = false; // Back under the target.
+        }
+        else if(now_us >= codel->drop_next_us)
+        {
+            drop = true;
+            codel->count++;
+            codel->drop_next_us = codelControlLaw(codel, codel->drop_next_us);
+        }
+    }
+    else if(ok_to_drop)
+    {
+        drop = true;
+        codel->dropping = true;
+        codel->stats.episodes++;
+        // Right after the last episode, go on at about the drop rate it ended with:
+        long delta = codel->count - codel->last_count;
+        bool recent = now_us - codel->drop_next_us < CODEL_RESTART_INTERVALS * codel->interval_us;
+        codel->count = delta > 1 && recent ? delta : 1;
+        codel->last_count = codel->count;
+        codel->drop_next_us = codelControlLaw(codel, now_us);
+    }
+    codel->stats.dropping = codel->dropping;
+    codel->stats.last_sojourn_us = sojourn_us;
+    if(drop)
+    {
+        codel->stats.dropped++;
+    }
+    else
+    {
+        codel->stats.accepted++;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&codel->lock);
+    return drop;
+}
+
+void codelGetStats(Codel codel, CodelStats *stats)
+{
+    pthread_mutex_lock(&codel->lock);
+    // <CRITICAL>
+    *stats = codel->stats;
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&codel->lock);
+}
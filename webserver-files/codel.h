@@ -0,0 +1,49 @@
+#ifndef _CODEL_INC
+#define _CODEL_INC
+
+#include "segel.h"
+#include <stdbool.h>
+
+// ********** CoDel Overload Policy ********** //
+// The "codel" schedalg sheds load by queueing delay instead of queue length (after RFC 8289).
+// Every request a worker takes from the queue has a sojourn time: from its arrival to its
+// dispatch. While requests keep leaving the queue faster than the target, nothing is dropped,
+// however long the queue gets during a burst. Once the sojourn time stays above the target for
+// a whole interval (a standing queue), the request is dropped, and the next drops come at
+// interval / sqrt(drops) apart until a request leaves the queue under the target again.
+// A queue that reaches q_size still drops the newest request, like dt.
+typedef struct codel* Codel;
+
+typedef struct codel_stats
+{
+    long accepted;          // Requests that went on to a worker.
+    long dropped;           // Requests dropped at dispatch.
+    long episodes;          // Times the policy started dropping.
+    bool dropping;          // Currently dropping.
+    long last_sojourn_us;   // Of the last request taken from the queue.
+    long target_us;
+    long interval_us;
+} CodelStats;
+
+// The policy of the server, NULL unless the schedalg is codel.
+extern Codel codel;
+
+/**
+ * Create the policy state with the given target sojourn time and interval.
+ * Return NULL if allocation failed.
+ */
+Codel codelCreate(int target_ms, int interval_ms);
+
+/**
+ * Decide about a request just taken from the queue: it arrived at arrival_ns, was dispatched
+ * at dispatch_ns (timestamps of timing.h), and queued requests are still waiting behind it.
+ * Return true if it is to be dropped.
+ */
+bool codelShouldDrop(Codel codel, long long arrival_ns, long long dispatch_ns, int queued);
+
+/**
+ * Fill stats with a snapshot of the policy counters.
+ */
+void codelGetStats(Codel codel, CodelStats *stats);
+
+#endif
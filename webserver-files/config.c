@@ -0,0 +1,386 @@
+#include "config.h"
+#include <limits.h>
+
+ServerConfig server_config;
+
+static void configSetDefaults(ServerConfig *config)
+{
+    config->dispatch = DISPATCH_STEAL;
+    config->placement = PLACEMENT_SHORTEST;
+    config->engine = ENGINE_THREADS;
+    config->loops = 1;
+    config->keepalive_max = 1;
+    config->keepalive_timeout_ms = 5000;
+    config->cache_kb = 0;
+    config->cache_max_file_kb = 1024;
+    config->meta_entries = 0;
+    config->meta_negative_ttl_ms = 1000;
+    config->zero_copy = ZERO_COPY_OFF;
+    config->zero_copy_min_kb = 64;
+    config->stat_headers = true;
+    config->cgi_pool = 0;
+    config->cgi_cache_ttl = 0;
+    config->cgi_cache_stale = 0;
+    config->cgi_cache_kb = 16 * 1024;
+    config->cgi_async = false;
+    config->codel_target_ms = 5;
+    config->codel_interval_ms = 100;
+    config->sjf_max_wait_ms = 1000;
+    config->deadline_ms = 5000;
+    config->autoscale = false;
+    config->threads_min = 1;
+    config->threads_max = 0;
+    config->autoscale_target_ms = 10;
+    config->affinity = NULL;
+    config->numa = false;
+    config->clock = TIMING_MONOTONIC;
+}
+
+/**
+ * If arg is --name=value return a pointer to value, otherwise return NULL.
+ */
+static char* configMatch(char *arg, const char *name)
+{
+    size_t len = strlen(name);
+    if(strncmp(arg, "--", 2) || strncmp(arg + 2, name, len) || arg[len + 2] != '=')
+    {
+        return NULL;
+    }
+    return arg + len + 3;
+}
+
+static void configBadValue(const char *name, const char *value, const char *expected)
+{
+    fprintf(stderr, "Error: bad value for --%s: %s (expected %s)\n", name, value, expected);
+    exit(1);
+}
+
+/**
+ * Parse value as an integer that is at least min, or exit with an error.
+ */
+static int configParseInt(const char *name, const char *value, int min)
+{
+    char *end = NULL;
+    long res = strtol(value, &end, 10);
+    if(*value == '\0' || *end != '\0' || res < min || res > INT_MAX)
+    {
+        char expected[64];
+        sprintf(expected, "an integer >= %d", min);
+        configBadValue(name, value, expected);
+    }
+    return (int)res;
+}
+
+void configParseOptions(int argc, char *argv[], int first)
+{
+    char *value = NULL;
+    configSetDefaults(&server_config);
+
+    for(int i = first; i < argc; i++)
+    {
+        if((value = configMatch(argv[i], "dispatch")))
+        {
+            if(!strcmp(value, "shared"))
+            {
+                server_config.dispatch = DISPATCH_SHARED;
+            }
+            else if(!strcmp(value, "steal"))
+            {
+                server_config.dispatch = DISPATCH_STEAL;
+            }
+            else if(!strcmp(value, "sjf"))
+            {
+                server_config.dispatch = DISPATCH_SJF;
+            }
+            else if(!strcmp(value, "edf"))
+            {
+                server_config.dispatch = DISPATCH_EDF;
+            }
+            else
+            {
+                configBadValue("dispatch", value, "shared|steal|sjf|edf");
+            }
+        }
+        else if((value = configMatch(argv[i], "placement")))
+        {
+            if(!strcmp(value, "shortest"))
+            {
+                server_config.placement = PLACEMENT_SHORTEST;
+            }
+            else if(!strcmp(value, "rr"))
+            {
+                server_config.placement = PLACEMENT_ROUND_ROBIN;
+            }
+            else
+            {
+                configBadValue("placement", value, "shortest|rr");
+            }
+        }
+        else if((value = configMatch(argv[i], "engine")))
+        {
+            if(!strcmp(value, "threads"))
+            {
+                server_config.engine = ENGINE_THREADS;
+            }
+            else if(!strcmp(value, "epoll"))
+            {
+                server_config.engine = ENGINE_EPOLL;
+            }
+            else if(!strcmp(value, "uring"))
+            {
+                server_config.engine = ENGINE_URING;
+            }
+            else
+            {
+                configBadValue("engine", value, "threads|epoll|uring");
+            }
+        }
+        else if((value = configMatch(argv[i], "loops")))
+        {
+            server_config.loops = configParseInt("loops", value, 1);
+        }
+        else if((value = configMatch(argv[i], "keepalive")))
+        {
+            server_config.keepalive_max = configParseInt("keepalive", value, 1);
+        }
+        else if((value = configMatch(argv[i], "keepalive-timeout")))
+        {
+            server_config.keepalive_timeout_ms = configParseInt("keepalive-timeout", value, 1);
+        }
+        else if((value = configMatch(argv[i], "cache")))
+        {
+            server_config.cache_kb = configParseInt("cache", value, 0);
+        }
+        else if((value = configMatch(argv[i], "cache-max-file")))
+        {
+            server_config.cache_max_file_kb = configParseInt("cache-max-file", value, 1);
+        }
+        else if((value = configMatch(argv[i], "meta-cache")))
+        {
+            server_config.meta_entries = configParseInt("meta-cache", value, 0);
+        }
+        else if((value = configMatch(argv[i], "meta-negative-ttl")))
+        {
+            server_config.meta_negative_ttl_ms = configParseInt("meta-negative-ttl", value, 0);
+        }
+        else if((value = configMatch(argv[i], "zero-copy")))
+        {
+            if(!strcmp(value, "sendfile"))
+            {
+                server_config.zero_copy = ZERO_COPY_SENDFILE;
+            }
+            else if(!strcmp(value, "splice"))
+            {
+                server_config.zero_copy = ZERO_COPY_SPLICE;
+            }
+            else if(!strcmp(value, "off"))
+            {
+                server_config.zero_copy = ZERO_COPY_OFF;
+            }
+            else
+            {
+                configBadValue("zero-copy", value, "sendfile|splice|off");
+            }
+        }
+        else if((value = configMatch(argv[i], "zero-copy-min")))
+        {
+            server_config.zero_copy_min_kb = configParseInt("zero-copy-min", value, 0);
+        }
+        else if((value = configMatch(argv[i], "cgi-pool")))
+        {
+            server_config.cgi_pool = configParseInt("cgi-pool", value, 0);
+        }
+        else if((value = configMatch(argv[i], "cgi-cache")))
+        {
+            server_config.cgi_cache_ttl = configParseInt("cgi-cache", value, 0);
+        }
+        else if((value = configMatch(argv[i], "cgi-cache-stale")))
+        {
+            server_config.cgi_cache_stale = configParseInt("cgi-cache-stale", value, 0);
+        }
+        else if((value = configMatch(argv[i], "cgi-cache-size")))
+        {
+            server_config.cgi_cache_kb = configParseInt("cgi-cache-size", value, 1);
+        }
+        else if((value = configMatch(argv[i], "cgi-async")))
+        {
+            if(!strcmp(value, "on"))
+            {
+                server_config.cgi_async = true;
+            }
+            else if(!strcmp(value, "off"))
+            {
+                server_config.cgi_async = false;
+            }
+            else
+            {
+                configBadValue("cgi-async", value, "on|off");
+            }
+        }
+        else if((value = configMatch(argv[i], "codel-target")))
+        {
+            server_config.codel_target_ms = configParseInt("codel-target", value, 1);
+        }
+        else if((value = configMatch(argv[i], "codel-interval")))
+        {
+            server_config.codel_interval_ms = configParseInt("codel-interval", value, 1);
+        }
+        else if((value = configMatch(argv[i], "sjf-max-wait")))
+        {
+            server_config.sjf_max_wait_ms = configParseInt("sjf-max-wait", value, 0);
+        }
+        else if((value = configMatch(argv[i], "deadline")))
+        {
+            server_config.deadline_ms = configParseInt("deadline", value, 0);
+        }
+        else if((value = configMatch(argv[i], "autoscale")))
+        {
+            if(!strcmp(value, "on"))
+            {
+                server_config.autoscale = true;
+            }
+            else if(!strcmp(value, "off"))
+            {
+                server_config.autoscale = false;
+            }
+            else
+            {
+                configBadValue("autoscale", value, "on|off");
+            }
+        }
+        else if((value = configMatch(argv[i], "threads-min")))
+        {
+            server_config.threads_min = configParseInt("threads-min", value, 1);
+        }
+        else if((value = configMatch(argv[i], "threads-max")))
+        {
+            server_config.threads_max = configParseInt("threads-max", value, 1);
+        }
+        else if((value = configMatch(argv[i], "autoscale-target")))
+        {
+            server_config.autoscale_target_ms = configParseInt("autoscale-target", value, 1);
+        }
+        else if((value = configMatch(argv[i], "affinity")))
+        {
+            if(!strcmp(value, "off"))
+            {
+                server_config.affinity = NULL;
+            }
+            else if(!strcmp(value, "cores") || (*value >= '0' && *value <= '9'))
+            {
+                server_config.affinity = value; // A CPU list is checked when the topology is read.
+            }
+            else
+            {
+                configBadValue("affinity", value, "off|cores|<cpu list>");
+            }
+        }
+        else if((value = configMatch(argv[i], "numa")))
+        {
+            if(!strcmp(value, "on"))
+            {
+                server_config.numa = true;
+            }
+            else if(!strcmp(value, "off"))
+            {
+                server_config.numa = false;
+            }
+            else
+            {
+                configBadValue("numa", value, "on|off");
+            }
+        }
+        else if((value = configMatch(argv[i], "clock")))
+        {
+            if(!strcmp(value, "monotonic"))
+            {
+                server_config.clock = TIMING_MONOTONIC;
+            }
+            else if(!strcmp(value, "coarse"))
+            {
+                server_config.clock = TIMING_COARSE;
+            }
+            else if(!strcmp(value, "tsc"))
+            {
+                server_config.clock = TIMING_TSC;
+            }
+            else
+            {
+                configBadValue("clock", value, "monotonic|coarse|tsc");
+            }
+        }
+        else if((value = configMatch(argv[i], "stat-headers")))
+        {
+            if(!strcmp(value, "on"))
+            {
+                server_config.stat_headers = true;
+            }
+            else if(!strcmp(value, "off"))
+            {
+                server_config.stat_headers = false;
+            }
+            else
+            {
+                configBadValue("stat-headers", value, "on|off");
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+            configPrintUsage(stderr);
+            exit(1);
+        }
+    }
+    if(server_config.numa && !server_config.affinity)
+    {
+        server_config.affinity = "cores"; // The nodes of the workers are the nodes of their CPUs.
+    }
+}
+
+void configPrintUsage(FILE *stream)
+{
+    fprintf(stream, "Options:\n");
+    fprintf(stream, "  --dispatch=shared|steal|sjf|edf\n");
+    fprintf(stream, "                             one shared queue, a deque per worker with stealing, the shortest\n");
+    fprintf(stream, "                             estimated job first, or the earliest deadline first (default: steal)\n");
+    fprintf(stream, "  --placement=shortest|rr    how the acceptor picks a worker deque (default: shortest)\n");
+    fprintf(stream, "  --engine=threads|epoll|uring\n");
+    fprintf(stream, "                             blocking worker per connection, or epoll / io_uring event loops (default: threads)\n");
+    fprintf(stream, "  --loops=N                  number of event loop threads for --engine=epoll|uring (default: 1)\n");
+    fprintf(stream, "  --keepalive=N              most requests per connection, 1 closes after every response (default: 1)\n");
+    fprintf(stream, "  --keepalive-timeout=MS     close a connection idle for this long (default: 5000)\n");
+    fprintf(stream, "  --cache=KB                 size of the in-memory static content cache, 0 turns it off (default: 0)\n");
+    fprintf(stream, "  --cache-max-file=KB        larger files are not cached (default: 1024)\n");
+    fprintf(stream, "  --meta-cache=N             paths whose stat() and open file are kept, at most a quarter\n");
+    fprintf(stream, "                             of the open files limit, 0 turns it off (default: 0)\n");
+    fprintf(stream, "  --meta-negative-ttl=MS     how long a missing path is remembered (default: 1000)\n");
+    fprintf(stream, "  --zero-copy=sendfile|splice|off\n");
+    fprintf(stream, "                             send the files read from disk without copying them (default: off)\n");
+    fprintf(stream, "  --zero-copy-min=KB         smaller files are memory-mapped instead (default: 64)\n");
+    fprintf(stream, "  --cgi-pool=N               keep N processes of every *.fcgi program to serve its requests,\n");
+    fprintf(stream, "                             0 runs them with a fork per request like *.cgi (default: 0)\n");
+    fprintf(stream, "  --cgi-cache=SECONDS        keep CGI outputs this long unless their Cache-Control says otherwise,\n");
+    fprintf(stream, "                             0 turns the CGI response cache off (default: 0)\n");
+    fprintf(stream, "  --cgi-cache-stale=SECONDS  then serve them stale while they are refreshed (default: 0)\n");
+    fprintf(stream, "  --cgi-cache-size=KB        size of the CGI response cache (default: 16384)\n");
+    fprintf(stream, "  --cgi-async=on|off         workers go back to the queue while their CGI programs run (default: off)\n");
+    fprintf(stream, "  --codel-target=MS          the codel schedalg drops once requests wait longer than this (default: 5)\n");
+    fprintf(stream, "  --codel-interval=MS        for a whole interval of this length (default: 100)\n");
+    fprintf(stream, "  --sjf-max-wait=MS          with --dispatch=sjf, no request waits behind later ones for longer (default: 1000)\n");
+    fprintf(stream, "  --deadline=MS              with --dispatch=edf, the deadline of requests without X-Request-Deadline,\n");
+    fprintf(stream, "                             0 for none (default: 5000)\n");
+    fprintf(stream, "  --autoscale=on|off         grow and shrink the worker pool by queueing delay and utilization,\n");
+    fprintf(stream, "                             <threads> is its initial size (default: off)\n");
+    fprintf(stream, "  --threads-min=N            smallest pool with --autoscale=on (default: 1)\n");
+    fprintf(stream, "  --threads-max=N            largest pool with --autoscale=on (default: 4 per CPU of the cgroup quota,\n");
+    fprintf(stream, "                             at least <threads>)\n");
+    fprintf(stream, "  --autoscale-target=MS      grow once requests wait in the queue longer than this (default: 10)\n");
+    fprintf(stream, "  --affinity=off|cores|LIST  pin every worker to one CPU of all the usable ones, or of a list\n");
+    fprintf(stream, "                             such as 0-7,16-23, spread over the NUMA nodes (default: off)\n");
+    fprintf(stream, "  --numa=on|off              with --dispatch=steal, idle workers steal from the workers of their\n");
+    fprintf(stream, "                             own NUMA node first, implies --affinity=cores (default: off)\n");
+    fprintf(stream, "  --clock=monotonic|coarse|tsc\n");
+    fprintf(stream, "                             the clock of the request timestamps: CLOCK_MONOTONIC, the coarse one\n");
+    fprintf(stream, "                             (as fine as the kernel tick), or the calibrated TSC (default: monotonic)\n");
+    fprintf(stream, "  --stat-headers=on|off      add the Stat-* headers to the responses (default: on)\n");
+}
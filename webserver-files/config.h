@@ -0,0 +1,93 @@
+#ifndef _CONFIG_INC
+#define _CONFIG_INC
+
+#include "segel.h"
+#include <stdbool.h>
+
+// ********** Server Options *********** //
+// Optional settings given after the mandatory <schedalg> argument,
+// each one in the form --name=value (e.g. --dispatch=shared).
+
+typedef enum DispatchMode_t
+{
+    DISPATCH_SHARED = 0, // One lock-free queue shared by all the workers.
+    DISPATCH_STEAL,      // A deque per worker, idle workers steal from their peers.
+    DISPATCH_SJF,        // One queue ordered by estimated service time, see sjf.h.
+    DISPATCH_EDF         // One queue ordered by deadline, expired requests are not served, see edf.h.
+} DispatchMode;
+
+typedef enum PlacementMode_t
+{
+    PLACEMENT_SHORTEST = 0, // The acceptor pushes to the worker with the shortest deque.
+    PLACEMENT_ROUND_ROBIN   // The acceptor pushes to the workers in turn.
+} PlacementMode;
+
+typedef enum EngineMode_t
+{
+    ENGINE_THREADS = 0, // A worker thread serves a connection from the first read to the close.
+    ENGINE_EPOLL,       // Event loops do all the socket I/O, workers only run the blocking steps (CGI).
+    ENGINE_URING        // Like ENGINE_EPOLL, but the loops batch their I/O through io_uring.
+} EngineMode;
+
+typedef enum ZeroCopyMode_t
+{
+    ZERO_COPY_OFF = 0,  // Large files are memory-mapped and written like small ones.
+    ZERO_COPY_SENDFILE, // sendfile() from the page cache to the socket.
+    ZERO_COPY_SPLICE    // splice() through a pipe (the event loops use sendfile() instead).
+} ZeroCopyMode;
+
+typedef enum TimingMode_t
+{
+    TIMING_MONOTONIC = 0, // clock_gettime(CLOCK_MONOTONIC), from the vDSO.
+    TIMING_COARSE,        // CLOCK_MONOTONIC_COARSE: cheaper, but only as fine as the kernel tick.
+    TIMING_TSC            // The calibrated CPU time stamp counter, if it is invariant (x86 only).
+} TimingMode;
+
+typedef struct server_config
+{
+    DispatchMode dispatch;
+    PlacementMode placement;
+    EngineMode engine;
+    int loops; // Number of event loop threads (ENGINE_EPOLL and ENGINE_URING).
+    int keepalive_max;        // Most requests served on one connection, 1 turns keep-alive off.
+    int keepalive_timeout_ms; // How long an idle connection waits for its next request.
+    int cache_kb;             // Size limit of the static content cache, 0 turns it off.
+    int cache_max_file_kb;    // Larger files are always served from disk.
+    int meta_entries;         // Paths kept by the metadata cache, 0 turns it off.
+    int meta_negative_ttl_ms; // How long a missing path is remembered, 0 forgets it at once.
+    ZeroCopyMode zero_copy;   // How files served from disk are sent, from zero_copy_min_kb on.
+    int zero_copy_min_kb;
+    bool stat_headers;        // Add the Stat-* section to the responses.
+    int cgi_pool;             // Processes per pooled (*.fcgi) program, 0 runs them as classic CGI.
+    int cgi_cache_ttl;        // Seconds a CGI output stays fresh by default, 0 turns the CGI response cache off.
+    int cgi_cache_stale;      // Seconds it is then served stale while it is refreshed, by default.
+    int cgi_cache_kb;         // Size limit of the CGI response cache.
+    bool cgi_async;           // Workers hand running CGI programs to the reaper instead of waiting for them.
+    int codel_target_ms;      // The codel schedalg drops once the queueing delay stays above this...
+    int codel_interval_ms;    // ...for this long.
+    int sjf_max_wait_ms;      // Under --dispatch=sjf, no request is passed by ones that arrived this much later.
+    int deadline_ms;          // Under --dispatch=edf, the deadline of requests that do not give one, 0 for none.
+    bool autoscale;           // Resize the worker pool by load between threads_min and threads_max, see scale.h.
+    int threads_min;
+    int threads_max;          // 0: SCALE_THREADS_PER_CPU per CPU of the cgroup quota, at least <threads>.
+    int autoscale_target_ms;  // Grow the pool once requests wait longer than this.
+    const char *affinity;     // Pin the workers to the CPUs of this list, or "cores" for all of them, NULL: off.
+    bool numa;                // Under --dispatch=steal, idle workers steal within their NUMA node first.
+    TimingMode clock;         // The clock of the request timestamps, see timing.h.
+} ServerConfig;
+
+// The options of this server instance, set once by configParseOptions().
+extern ServerConfig server_config;
+
+/**
+ * Fill server_config with the defaults and then parse argv[first..argc-1].
+ * Print an error and exit(1) on an unknown option or a bad value.
+ */
+void configParseOptions(int argc, char *argv[], int first);
+
+/**
+ * Print the list of the supported options to stream.
+ */
+void configPrintUsage(FILE *stream);
+
+#endif
@@ -5,12 +5,31 @@
 #include <stdbool.h>
 
 // ******* Statistics & Structs ******** //
+// Intrusive link of an idle (kept-alive) connection, see idle.h.
+typedef struct idle_node
+{
+    struct idle_node* prev;
+    struct idle_node* next;
+    long long deadline; // Monotonic time (ms) at which the idle connection is closed.
+    void* owner;        // The structure this node is embedded in.
+} IdleNode;
+
 typedef struct connection_struct
 {
     int connfd; // The connection fd
     int job_id; // The unique id of this connection.
-    struct timeval arrival; // The time signature the task arrived to the main thread.
-    struct timeval dispatch; // The time signature the task arrived to the worker thread.
+    int conn_requests; // Requests received on this connection so far, including this one (keep-alive).
+    long long arrival_ns; // When the request arrived to the main thread (or its event loop), see timing.h.
+    long long dispatch_ns; // When a worker thread (or its event loop) took the request.
+    struct request_info* request; // The parsed request if it was already read (event loop engine), otherwise NULL.
+    rio_t* rio; // Bytes the client already sent after the current request (pipelining), otherwise NULL.
+    pid_t cgi_pid; // The CGI program still writing the response (see reaper.h), otherwise 0.
+    int cgi_pipe;  // The output of that program, when the reaper copies it to the client, otherwise -1.
+    long long dispatch_key; // Dispatch order under --dispatch=sjf|edf, the smallest first (see sjf.h and edf.h).
+    int sjf_class;          // Its SjfClass, or -1 if it was not classified.
+    long long deadline_us;  // When its client stops waiting for the response (see edf.h), 0 if never.
+    struct connection_struct* pool_next; // Intrusive link, used by the ConnPool while the record is free.
+    IdleNode idle; // Intrusive link, used by the IdleWatcher while the connection waits for its next request.
 } *ConnectionStruct;
 
 typedef struct thread_stats
@@ -19,6 +38,9 @@ typedef struct thread_stats
     int thread_count;
     int thread_static;
     int thread_dynamic;
+    int thread_local_hits; // Requests taken from this thread's own deque.
+    int thread_steals;     // Requests stolen from the deques of other threads.
+    int thread_reused;     // Requests that came on a kept-alive connection (a TCP handshake saved).
 } *ThreadStats;
 
 // ********** Connection List ********** //
@@ -27,6 +49,7 @@ typedef enum ConnectionRes_t
     CONNECTION_SUCCESS = 0,
     CONNECTION_OUT_OF_MEMORY,
     CONNECTION_EMPTY,
+    CONNECTION_FULL,
     CONNECTION_NOT_FOUND = 404
 } ConnectionRes;
 
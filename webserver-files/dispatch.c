@@ -0,0 +1,645 @@
+#include "dispatch.h"
+#include "mpmc.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+
+// A worker's deque: a ring of references protected by its own lock.
+// Only the owner (head) and the occasional thief or dropper (tail) touch it,
+// so unlike the old global_m this lock is almost never contended.
+typedef struct run_queue
+{
+    pthread_mutex_t lock;
+    ConnectionStruct* ring;
+    int capacity;
+    int head;
+    int size;
+    atomic_int approx_size; // Mirrors size, read by the acceptor without the lock.
+} __attribute__((aligned(CACHE_LINE))) RunQueue;
+
+struct dispatcher
+{
+    DispatchMode mode;
+    PlacementMode placement;
+    int workers;
+    int capacity;
+    sem_t items;        // Counts pushed requests, workers sleep on it.
+    atomic_int size;    // Number of waiting requests. Changed under the deque or heap lock, except for DISPATCH_SHARED.
+    pthread_mutex_t push_lock; // Producers take turns, workers never take it.
+    MpmcQueue shared;   // DISPATCH_SHARED only.
+    ConnectionStruct* drained; // DISPATCH_SHARED only, scratch space to drain the queue into.
+    RunQueue* deques;   // DISPATCH_STEAL only, one per worker.
+    pthread_mutex_t heap_lock; // DISPATCH_SJF and DISPATCH_EDF only, protects the heap.
+    ConnectionStruct* heap;    // DISPATCH_SJF and DISPATCH_EDF only, a binary min-heap on dispatch_key.
+    int heap_size;
+    int next_worker;    // Round robin cursor, only used under push_lock.
+    atomic_int active;  // DISPATCH_STEAL only, requests are placed on the deques of workers [0, active).
+    int* nodes;         // DISPATCH_STEAL only, the NUMA node of every worker, NULL: steal from anyone in turn.
+};
+
+// ********** Run Queue ********** //
+
+static void rqPushTail(RunQueue* rq, ConnectionStruct info)
+{
+    rq->ring[(rq->head + rq->size) % rq->capacity] = info;
+    rq->size++;
+    atomic_store_explicit(&rq->approx_size, rq->size, memory_order_relaxed);
+}
+
+static ConnectionStruct rqPopHead(RunQueue* rq)
+{
+    if(rq->size == 0)
+    {
+        return NULL;
+    }
+    ConnectionStruct res = rq->ring[rq->head];
+    rq->head = (rq->head + 1) % rq->capacity;
+    rq->size--;
+    atomic_store_explicit(&rq->approx_size, rq->size, memory_order_relaxed);
+    return res;
+}
+
+static ConnectionStruct rqPopTail(RunQueue* rq)
+{
+    if(rq->size == 0)
+    {
+        return NULL;
+    }
+    rq->size--;
+    atomic_store_explicit(&rq->approx_size, rq->size, memory_order_relaxed);
+    return rq->ring[(rq->head + rq->size) % rq->capacity];
+}
+
+/**
+ * Remove the entry at index (counting from the head) in O(1): the tail entry takes its place,
+ * so it is served earlier than the ones it skipped. Only the random drops use it, it happens
+ * under overload and while every deque is locked.
+ */
+static ConnectionStruct rqSwapRemove(RunQueue* rq, int index)
+{
+    int slot = (rq->head + index) % rq->capacity;
+    ConnectionStruct res = rq->ring[slot];
+    rq->ring[slot] = rqPopTail(rq); // res itself if it was the tail.
+    return res;
+}
+
+// ********** Dispatch Key Heap ********** //
+
+static void heapSwap(ConnectionStruct* heap, int i, int j)
+{
+    ConnectionStruct tmp = heap[i];
+    heap[i] = heap[j];
+    heap[j] = tmp;
+}
+
+static void heapSiftUp(ConnectionStruct* heap, int i)
+{
+    while(i > 0 && heap[(i - 1) / 2]->dispatch_key > heap[i]->dispatch_key)
+    {
+        heapSwap(heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heapSiftDown(ConnectionStruct* heap, int size, int i)
+{
+    while(1)
+    {
+        int smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if(left < size && heap[left]->dispatch_key < heap[smallest]->dispatch_key)
+        {
+            smallest = left;
+        }
+        if(right < size && heap[right]->dispatch_key < heap[smallest]->dispatch_key)
+        {
+            smallest = right;
+        }
+        if(smallest == i)
+        {
+            return;
+        }
+        heapSwap(heap, i, smallest);
+        i = smallest;
+    }
+}
+
+/**
+ * Remove the entry at index of the heap of dispatcher, in O(log n). Under heap_lock.
+ */
+static ConnectionStruct heapRemoveAt(Dispatcher dispatcher, int index)
+{
+    ConnectionStruct* heap = dispatcher->heap;
+    ConnectionStruct res = heap[index];
+    heap[index] = heap[--dispatcher->heap_size];
+    if(index < dispatcher->heap_size)
+    {
+        heapSiftDown(heap, dispatcher->heap_size, index);
+        heapSiftUp(heap, index);
+    }
+    return res;
+}
+
+// ********** Random Numbers ********** //
+// xorshift64* with a state per thread: no lock, and seeded once instead of on every call.
+static __thread uint64_t rand_state = 0;
+
+static uint32_t randNext()
+{
+    if(rand_state == 0)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        // The address of the state tells the threads apart.
+        rand_state = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ (uint64_t)(uintptr_t)&rand_state;
+        rand_state = rand_state ? rand_state : 1;
+    }
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return (uint32_t)((rand_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/**
+ * Return a random integer between 0 and max (inclusive).
+ */
+static int randInt(int max)
+{
+    // Scale instead of taking a remainder, which would favor the low numbers.
+    return (int)(((uint64_t)randNext() * ((uint64_t)max + 1)) >> 32);
+}
+
+// ********** Dispatcher ********** //
+
+static bool dispatchIsHeap(Dispatcher dispatcher)
+{
+    return dispatcher->mode == DISPATCH_SJF || dispatcher->mode == DISPATCH_EDF;
+}
+
+Dispatcher dispatchCreate(DispatchMode mode, PlacementMode placement, int workers, int capacity)
+{
+    Dispatcher dispatcher = malloc(sizeof(*dispatcher));
+    if(!dispatcher)
+    {
+        return NULL;
+    }
+    dispatcher->mode = mode;
+    dispatcher->placement = placement;
+    dispatcher->workers = workers;
+    dispatcher->capacity = capacity;
+    dispatcher->shared = NULL;
+    dispatcher->deques = NULL;
+    dispatcher->drained = NULL;
+    dispatcher->heap = NULL;
+    dispatcher->heap_size = 0;
+    dispatcher->next_worker = 0;
+    dispatcher->nodes = NULL;
+    atomic_init(&dispatcher->active, workers);
+    atomic_init(&dispatcher->size, 0);
+    sem_init(&dispatcher->items, 0, 0);
+    pthread_mutex_init(&dispatcher->push_lock, NULL);
+
+    if(mode == DISPATCH_SHARED)
+    {
+        dispatcher->shared = mpmcCreateQueue(capacity);
+        dispatcher->drained = dispatcher->shared ? malloc(mpmcGetCapacity(dispatcher->shared) * sizeof(ConnectionStruct)) : NULL;
+        if(!dispatcher->shared || !dispatcher->drained)
+        {
+            mpmcDestroyQueue(dispatcher->shared);
+            pthread_mutex_destroy(&dispatcher->push_lock);
+            free(dispatcher);
+            return NULL;
+        }
+        return dispatcher;
+    }
+    if(mode == DISPATCH_SJF || mode == DISPATCH_EDF)
+    {
+        if(!(dispatcher->heap = malloc(capacity * sizeof(*dispatcher->heap))))
+        {
+            free(dispatcher);
+            return NULL;
+        }
+        pthread_mutex_init(&dispatcher->heap_lock, NULL);
+        return dispatcher;
+    }
+
+    if(posix_memalign((void**)&dispatcher->deques, CACHE_LINE, workers * sizeof(RunQueue)) != 0)
+    {
+        pthread_mutex_destroy(&dispatcher->push_lock);
+        free(dispatcher);
+        return NULL;
+    }
+    for(int i = 0; i < workers; i++)
+    {
+        RunQueue* rq = &dispatcher->deques[i];
+        // Any single deque may end up holding every admitted request.
+        if(!(rq->ring = malloc(capacity * sizeof(*rq->ring))))
+        {
+            while(i--)
+            {
+                free(dispatcher->deques[i].ring);
+                pthread_mutex_destroy(&dispatcher->deques[i].lock);
+            }
+            free(dispatcher->deques);
+            pthread_mutex_destroy(&dispatcher->push_lock);
+            free(dispatcher);
+            return NULL;
+        }
+        pthread_mutex_init(&rq->lock, NULL);
+        rq->capacity = capacity;
+        rq->head = rq->size = 0;
+        atomic_init(&rq->approx_size, 0);
+    }
+    return dispatcher;
+}
+
+void dispatchDestroy(Dispatcher dispatcher)
+{
+    if(dispatcher == NULL)
+    {
+        return;
+    }
+    if(dispatcher->mode == DISPATCH_SHARED)
+    {
+        mpmcDestroyQueue(dispatcher->shared);
+        free(dispatcher->drained);
+    }
+    else if(dispatchIsHeap(dispatcher))
+    {
+        free(dispatcher->heap);
+        pthread_mutex_destroy(&dispatcher->heap_lock);
+    }
+    else
+    {
+        for(int i = 0; i < dispatcher->workers; i++)
+        {
+            free(dispatcher->deques[i].ring);
+            pthread_mutex_destroy(&dispatcher->deques[i].lock);
+        }
+        free(dispatcher->deques);
+        free(dispatcher->nodes);
+    }
+    sem_destroy(&dispatcher->items);
+    pthread_mutex_destroy(&dispatcher->push_lock);
+    free(dispatcher);
+}
+
+static int dispatchPickWorker(Dispatcher dispatcher)
+{
+    int active = atomic_load_explicit(&dispatcher->active, memory_order_relaxed);
+    if(dispatcher->next_worker >= active)
+    {
+        dispatcher->next_worker = 0; // The pool shrank.
+    }
+    if(dispatcher->placement == PLACEMENT_ROUND_ROBIN)
+    {
+        int res = dispatcher->next_worker;
+        dispatcher->next_worker = (dispatcher->next_worker + 1) % active;
+        return res;
+    }
+
+    // Shortest deque. Start the scan where the last one ended so that ties are spread out.
+    int best = dispatcher->next_worker;
+    int best_size = atomic_load_explicit(&dispatcher->deques[best].approx_size, memory_order_relaxed);
+    for(int i = 1; i < active && best_size > 0; i++)
+    {
+        int idx = (dispatcher->next_worker + i) % active;
+        int size = atomic_load_explicit(&dispatcher->deques[idx].approx_size, memory_order_relaxed);
+        if(size < best_size)
+        {
+            best = idx;
+            best_size = size;
+        }
+    }
+    dispatcher->next_worker = (best + 1) % active;
+    return best;
+}
+
+ConnectionRes dispatchPush(Dispatcher dispatcher, ConnectionStruct info)
+{
+    ConnectionRes res = CONNECTION_SUCCESS;
+    // Producers take turns: the shared queue then publishes its slots in the order they are claimed,
+    // so a woken worker always finds the head published, and the placement cursor needs no atomics.
+    pthread_mutex_lock(&dispatcher->push_lock);
+    if(dispatcher->mode == DISPATCH_SHARED)
+    {
+        // Count it first so a fast worker never drives the size below zero.
+        atomic_fetch_add(&dispatcher->size, 1);
+        if((res = mpmcEnqueue(dispatcher->shared, info)) != CONNECTION_SUCCESS)
+        {
+            atomic_fetch_sub(&dispatcher->size, 1);
+        }
+    }
+    else if(dispatchIsHeap(dispatcher))
+    {
+        pthread_mutex_lock(&dispatcher->heap_lock);
+        if(dispatcher->heap_size == dispatcher->capacity)
+        {
+            res = CONNECTION_FULL;
+        }
+        else
+        {
+            dispatcher->heap[dispatcher->heap_size] = info;
+            heapSiftUp(dispatcher->heap, dispatcher->heap_size++);
+            atomic_fetch_add(&dispatcher->size, 1);
+        }
+        pthread_mutex_unlock(&dispatcher->heap_lock);
+    }
+    else
+    {
+        RunQueue* rq = &dispatcher->deques[dispatchPickWorker(dispatcher)];
+        pthread_mutex_lock(&rq->lock);
+        if(rq->size == rq->capacity)
+        {
+            res = CONNECTION_FULL;
+        }
+        else
+        {
+            rqPushTail(rq, info);
+            atomic_fetch_add(&dispatcher->size, 1);
+        }
+        pthread_mutex_unlock(&rq->lock);
+    }
+    pthread_mutex_unlock(&dispatcher->push_lock);
+    if(res == CONNECTION_SUCCESS)
+    {
+        sem_post(&dispatcher->items); // Only once the request can be taken.
+    }
+    return res;
+}
+
+/**
+ * Pop from the head of our own deque, then try to steal from the tails of the others.
+ * Return NULL if every deque is empty.
+ */
+static ConnectionStruct dispatchTryPop(Dispatcher dispatcher, int worker_id, bool *stolen)
+{
+    ConnectionStruct res = NULL;
+    RunQueue* own = &dispatcher->deques[worker_id];
+
+    if(atomic_load_explicit(&own->approx_size, memory_order_relaxed) > 0)
+    {
+        pthread_mutex_lock(&own->lock);
+        if((res = rqPopHead(own)))
+        {
+            atomic_fetch_sub(&dispatcher->size, 1);
+        }
+        pthread_mutex_unlock(&own->lock);
+        if(res)
+        {
+            *stolen = false;
+            return res;
+        }
+    }
+
+    // With NUMA nodes, steal from the workers of our own node first (the requests, their records
+    // and the deque cache lines stay on it), and only then from the other nodes:
+    for(int pass = 0; pass < (dispatcher->nodes ? 2 : 1); pass++)
+    {
+        for(int i = 1; i < dispatcher->workers; i++)
+        {
+            int idx = (worker_id + i) % dispatcher->workers;
+            if(dispatcher->nodes && (dispatcher->nodes[idx] == dispatcher->nodes[worker_id]) != (pass == 0))
+            {
+                continue;
+            }
+            RunQueue* victim = &dispatcher->deques[idx];
+            if(atomic_load_explicit(&victim->approx_size, memory_order_relaxed) == 0)
+            {
+                continue; // Do not even touch the lock of an empty deque.
+            }
+            pthread_mutex_lock(&victim->lock);
+            if((res = rqPopTail(victim)))
+            {
+                atomic_fetch_sub(&dispatcher->size, 1);
+            }
+            pthread_mutex_unlock(&victim->lock);
+            if(res)
+            {
+                *stolen = true;
+                return res;
+            }
+        }
+    }
+    return NULL;
+}
+
+ConnectionStruct dispatchPop(Dispatcher dispatcher, int worker_id, bool *stolen)
+{
+    ConnectionStruct res = NULL;
+    bool dummy = false;
+    if(stolen == NULL)
+    {
+        stolen = &dummy;
+    }
+
+    while(1)
+    {
+        while(sem_wait(&dispatcher->items) != 0); // Retry if interrupted by a signal.
+        // A wake-up without a request means an overload policy dropped the request we were woken for.
+        if(dispatcher->mode == DISPATCH_SHARED)
+        {
+            // The producers publish in order (see dispatchPush), so NULL really means an empty queue.
+            *stolen = false;
+            if((res = mpmcDequeue(dispatcher->shared)))
+            {
+                atomic_fetch_sub(&dispatcher->size, 1);
+            }
+        }
+        else if(dispatchIsHeap(dispatcher))
+        {
+            *stolen = false;
+            pthread_mutex_lock(&dispatcher->heap_lock);
+            if(dispatcher->heap_size > 0)
+            {
+                res = heapRemoveAt(dispatcher, 0);
+                atomic_fetch_sub(&dispatcher->size, 1);
+            }
+            pthread_mutex_unlock(&dispatcher->heap_lock);
+        }
+        else
+        {
+            // The wake-ups are not tied to deques and the scan is not atomic: a worker woken for a request
+            // pushed behind our scan may have taken ours. The size only changes under the deque locks,
+            // so while it is positive a request is still waiting somewhere and a new scan finds it.
+            while(!(res = dispatchTryPop(dispatcher, worker_id, stolen)) && atomic_load(&dispatcher->size) > 0);
+        }
+        if(res)
+        {
+            return res;
+        }
+    }
+}
+
+ConnectionStruct dispatchDropOldest(Dispatcher dispatcher)
+{
+    ConnectionStruct res = NULL;
+    if(dispatcher->mode == DISPATCH_SHARED)
+    {
+        if((res = mpmcDequeue(dispatcher->shared)))
+        {
+            atomic_fetch_sub(&dispatcher->size, 1);
+        }
+    }
+    else if(dispatchIsHeap(dispatcher))
+    {
+        // The heap is not ordered by arrival: look for the lowest job id (only the dh policy, under overload).
+        pthread_mutex_lock(&dispatcher->heap_lock);
+        int oldest = -1;
+        for(int i = 0; i < dispatcher->heap_size; i++)
+        {
+            if(oldest < 0 || dispatcher->heap[i]->job_id < dispatcher->heap[oldest]->job_id)
+            {
+                oldest = i;
+            }
+        }
+        if(oldest >= 0)
+        {
+            res = heapRemoveAt(dispatcher, oldest);
+            atomic_fetch_sub(&dispatcher->size, 1);
+        }
+        pthread_mutex_unlock(&dispatcher->heap_lock);
+    }
+    else
+    {
+        // Job ids grow with arrival, so the oldest request is the lowest id among the heads.
+        for(int i = 0; i < dispatcher->workers; i++)
+        {
+            pthread_mutex_lock(&dispatcher->deques[i].lock);
+        }
+        RunQueue* oldest = NULL;
+        for(int i = 0; i < dispatcher->workers; i++)
+        {
+            RunQueue* rq = &dispatcher->deques[i];
+            if(rq->size > 0 && (!oldest || rq->ring[rq->head]->job_id < oldest->ring[oldest->head]->job_id))
+            {
+                oldest = rq;
+            }
+        }
+        if(oldest && (res = rqPopHead(oldest)))
+        {
+            atomic_fetch_sub(&dispatcher->size, 1);
+        }
+        for(int i = dispatcher->workers - 1; i >= 0; i--)
+        {
+            pthread_mutex_unlock(&dispatcher->deques[i].lock);
+        }
+    }
+
+    if(res)
+    {
+        sem_trywait(&dispatcher->items); // Consume the wake-up posted for it if nobody took it yet.
+    }
+    return res;
+}
+
+static int dispatchDropRandomShared(Dispatcher dispatcher, int to_remove, ConnectionStruct *victims)
+{
+    // The lock-free queue has no random access, so drain it into a local array,
+    // pick the victims there and put the survivors back.
+    // Workers may keep dequeuing concurrently, they simply see a shorter queue.
+    int capacity = mpmcGetCapacity(dispatcher->shared);
+    ConnectionStruct* drained = dispatcher->drained;
+    int size = 0, removed = 0;
+    while(size < capacity && (drained[size] = mpmcDequeue(dispatcher->shared)) != NULL)
+    {
+        sem_trywait(&dispatcher->items); // Survivors get their wake-up posted again below.
+        atomic_fetch_sub(&dispatcher->size, 1);
+        size++;
+    }
+
+    while(removed < to_remove && size > 0)
+    {
+        // The last survivor fills the hole, so a victim costs O(1).
+        int rand_index = randInt(size - 1);
+        victims[removed++] = drained[rand_index];
+        drained[rand_index] = drained[--size];
+    }
+
+    pthread_mutex_lock(&dispatcher->push_lock); // We are a producer again.
+    for(int i = 0; i < size; i++)
+    {
+        mpmcEnqueue(dispatcher->shared, drained[i]); // Cannot fail, we only put back what we took.
+        atomic_fetch_add(&dispatcher->size, 1);
+        sem_post(&dispatcher->items);
+    }
+    pthread_mutex_unlock(&dispatcher->push_lock);
+    return removed;
+}
+
+int dispatchDropRandom(Dispatcher dispatcher, int to_remove, ConnectionStruct *victims)
+{
+    if(dispatcher->mode == DISPATCH_SHARED)
+    {
+        return dispatchDropRandomShared(dispatcher, to_remove, victims);
+    }
+    if(dispatchIsHeap(dispatcher))
+    {
+        int removed = 0;
+        pthread_mutex_lock(&dispatcher->heap_lock);
+        while(removed < to_remove && dispatcher->heap_size > 0)
+        {
+            victims[removed++] = heapRemoveAt(dispatcher, randInt(dispatcher->heap_size - 1));
+            atomic_fetch_sub(&dispatcher->size, 1);
+            sem_trywait(&dispatcher->items);
+        }
+        pthread_mutex_unlock(&dispatcher->heap_lock);
+        return removed;
+    }
+
+    // Freeze all the deques (always locked in index order) and treat them as one
+    // array: a global index is mapped to a deque by walking the deque sizes.
+    int size = 0, removed = 0;
+    for(int i = 0; i < dispatcher->workers; i++)
+    {
+        pthread_mutex_lock(&dispatcher->deques[i].lock);
+        size += dispatcher->deques[i].size;
+    }
+
+    while(removed < to_remove && size > 0)
+    {
+        int rand_index = randInt(size - 1);
+        RunQueue* rq = dispatcher->deques;
+        while(rand_index >= rq->size)
+        {
+            rand_index -= rq->size;
+            rq++;
+        }
+        victims[removed++] = rqSwapRemove(rq, rand_index);
+        atomic_fetch_sub(&dispatcher->size, 1);
+        sem_trywait(&dispatcher->items);
+        size--;
+    }
+
+    for(int i = dispatcher->workers - 1; i >= 0; i--)
+    {
+        pthread_mutex_unlock(&dispatcher->deques[i].lock);
+    }
+    return removed;
+}
+
+void dispatchSetActive(Dispatcher dispatcher, int active)
+{
+    atomic_store(&dispatcher->active, active < 1 ? 1 : active > dispatcher->workers ? dispatcher->workers : active);
+}
+
+bool dispatchSetNodes(Dispatcher dispatcher, const int *nodes)
+{
+    if(dispatcher->mode != DISPATCH_STEAL)
+    {
+        return false;
+    }
+    int *copy = malloc(dispatcher->workers * sizeof(*copy));
+    if(!copy)
+    {
+        return false;
+    }
+    memcpy(copy, nodes, dispatcher->workers * sizeof(*copy));
+    dispatcher->nodes = copy;
+    return true;
+}
+
+int dispatchGetSize(Dispatcher dispatcher)
+{
+    return atomic_load(&dispatcher->size);
+}
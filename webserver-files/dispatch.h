@@ -0,0 +1,79 @@
+#ifndef _DISPATCH_INC
+#define _DISPATCH_INC
+
+#include "connection.h"
+#include "config.h"
+
+// ********** Dispatcher ********** //
+// Holds the requests that were admitted by the acceptor and are waiting
+// for a worker thread. Depending on the DispatchMode it is either one
+// shared lock-free MpmcQueue, or a deque per worker: the acceptor places
+// every request on one deque, the owner pops from its head and idle
+// workers steal from the tails of their peers, or one min-heap on the
+// dispatch_key of the requests (see sjf.h and edf.h) under a lock.
+// * The dispatcher stores references, entries are NOT copied.
+typedef struct dispatcher* Dispatcher;
+
+/**
+ * Create a dispatcher for workers threads that can hold capacity requests in total.
+ * Return NULL if allocation failed.
+ */
+Dispatcher dispatchCreate(DispatchMode mode, PlacementMode placement, int workers, int capacity);
+
+/**
+ * Destroy the dispatcher. Requests still inside are NOT freed.
+ * Must not race with any other dispatcher call.
+ */
+void dispatchDestroy(Dispatcher dispatcher);
+
+/**
+ * Add a request and wake up one worker. Never waits for room, only for other producers.
+ * Should only be called after the request was admitted.
+ * Return CONNECTION_FULL if there is no room for it,
+ * Otherwise return CONNECTION_SUCCESS.
+ */
+ConnectionRes dispatchPush(Dispatcher dispatcher, ConnectionStruct info);
+
+/**
+ * Take the next request for worker_id, waiting until there is one.
+ * If stolen is not NULL, set it to whether the request came from another worker's deque.
+ */
+ConnectionStruct dispatchPop(Dispatcher dispatcher, int worker_id, bool *stolen);
+
+/**
+ * Remove the oldest waiting request and return it.
+ * Return NULL if there are no waiting requests.
+ */
+ConnectionStruct dispatchDropOldest(Dispatcher dispatcher);
+
+/**
+ * Remove up to to_remove waiting requests, chosen at random, into victims.
+ * The cost depends on the mode: the shared queue is drained and refilled once, O(n) in total,
+ * on the deques each victim costs O(workers), the walk to the deque that holds it, and in the
+ * sjf or edf heap O(log n).
+ * The survivors do not keep their order: some of the newest take the places of the victims.
+ * Return the number of requests removed.
+ */
+int dispatchDropRandom(Dispatcher dispatcher, int to_remove, ConnectionStruct *victims);
+
+/**
+ * Place new requests only on the deques of workers [0, active) (DISPATCH_STEAL, the other modes
+ * have no per-worker queue). The requests left on the other deques are stolen by the active
+ * workers. May be called from any thread.
+ */
+void dispatchSetActive(Dispatcher dispatcher, int active);
+
+/**
+ * Group the deques by NUMA node (DISPATCH_STEAL only): nodes[i] is the node of worker i, and an
+ * idle worker steals from the workers of its own node before the others.
+ * Must be called before the workers start. Return false in the other modes or if allocation failed.
+ */
+bool dispatchSetNodes(Dispatcher dispatcher, const int *nodes);
+
+/**
+ * Return the number of waiting requests.
+ * * The value is a snapshot and may be stale by the time it is used.
+ */
+int dispatchGetSize(Dispatcher dispatcher);
+
+#endif
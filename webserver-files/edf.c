@@ -0,0 +1,114 @@
+#include "edf.h"
+#include "request.h"
+#include "timing.h"
+#include "response.h"
+#include <stdatomic.h>
+
+#define EDF_UNSET_MS 60000
+#define EDF_DRAIN_MAX (64 * 1024) // Unread bytes a rejected request may leave behind.
+
+struct edf
+{
+    long default_ms;
+    atomic_long assigned;
+    atomic_long from_header;
+    atomic_long expired;
+    atomic_long met;
+    atomic_long missed;
+};
+
+
+/**
+ * Return the X-Request-Deadline of the request cd is about to read, from the part of
+ * its head that already arrived, or 0 if it has none (yet).
+ */
+static long edfPeekDeadline(ConnectionStruct cd)
+{
+    char head[MAXBUF];
+    int len = requestPeek(cd, head, sizeof(head));
+    int head_len = requestHeadLength(head, len);
+    head[head_len ? head_len : len] = '\0'; // Not into the body or the next request.
+
+    char *save = NULL;
+    for(char *line = strtok_r(head, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+    {
+        if(!strncasecmp(line, REQUEST_DEADLINE_HEADER, sizeof(REQUEST_DEADLINE_HEADER) - 1))
+        {
+            long deadline_ms = atol(line + sizeof(REQUEST_DEADLINE_HEADER) - 1);
+            return deadline_ms > 0 ? deadline_ms : 0;
+        }
+    }
+    return 0;
+}
+
+Edf edfCreate(int default_ms)
+{
+    Edf edf = calloc(1, sizeof(*edf));
+    if(!edf)
+    {
+        return NULL;
+    }
+    edf->default_ms = default_ms;
+    return edf;
+}
+
+void edfAssign(Edf edf, ConnectionStruct cd)
+{
+    long deadline_ms = cd->request ? cd->request->deadline_ms : edfPeekDeadline(cd);
+    if(deadline_ms > 0)
+    {
+        atomic_fetch_add_explicit(&edf->from_header, 1, memory_order_relaxed);
+    }
+    else
+    {
+        deadline_ms = edf->default_ms;
+    }
+    atomic_fetch_add_explicit(&edf->assigned, 1, memory_order_relaxed);
+
+    long long arrival_us = cd->arrival_ns / TIMING_NS_PER_US;
+    cd->deadline_us = deadline_ms > 0 ? arrival_us + (long long)deadline_ms * 1000 : 0;
+    cd->dispatch_key = cd->deadline_us ? cd->deadline_us : arrival_us + (long long)EDF_UNSET_MS * 1000;
+}
+
+bool edfExpired(Edf edf, ConnectionStruct cd)
+{
+    return cd->deadline_us && cd->dispatch_ns / TIMING_NS_PER_US >= cd->deadline_us;
+}
+
+void edfReject(Edf edf, ConnectionStruct cd)
+{
+    // Drop what the client sent first: closing a socket with unread data resets the
+    // connection, and the client might never see the 503.
+    char buf[MAXBUF];
+    ssize_t n = 0, drained = 0;
+    while(drained < EDF_DRAIN_MAX && (n = recv(cd->connfd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+    {
+        drained += n;
+    }
+
+    ResponseBuilder *resp = respThreadBuilder();
+    respStatus(resp, "HTTP/1.0", "503 Service Unavailable");
+    respAppend(resp, "Content-Length: 0\r\nConnection: close\r\n", sizeof("Content-Length: 0\r\nConnection: close\r\n") - 1);
+    respEnd(resp);
+    respSend(cd->connfd, resp, NULL, 0);
+    atomic_fetch_add_explicit(&edf->expired, 1, memory_order_relaxed);
+}
+
+void edfRecord(Edf edf, ConnectionStruct cd)
+{
+    if(!cd->deadline_us)
+    {
+        return;
+    }
+    long long now_us = timingNow() / TIMING_NS_PER_US;
+    atomic_fetch_add_explicit(now_us <= cd->deadline_us ? &edf->met : &edf->missed, 1, memory_order_relaxed);
+}
+
+void edfGetStats(Edf edf, EdfStats *stats)
+{
+    stats->assigned = atomic_load_explicit(&edf->assigned, memory_order_relaxed);
+    stats->from_header = atomic_load_explicit(&edf->from_header, memory_order_relaxed);
+    stats->expired = atomic_load_explicit(&edf->expired, memory_order_relaxed);
+    stats->met = atomic_load_explicit(&edf->met, memory_order_relaxed);
+    stats->missed = atomic_load_explicit(&edf->missed, memory_order_relaxed);
+}
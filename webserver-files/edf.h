@@ -0,0 +1,61 @@
+#ifndef _EDF_INC
+#define _EDF_INC
+
+#include "connection.h"
+
+// ********** Earliest Deadline First ********** //
+// With --dispatch=edf every request carries a deadline: the milliseconds its client waits for
+// the response, from its X-Request-Deadline header (e.g. the timeout of a proxy in front of
+// the server), or --deadline by default. The waiting requests are served earliest deadline
+// first, and a request whose deadline passed while it waited is answered with a bare 503
+// instead of being read and served: nobody reads its response anymore.
+//  - The deadline is found right before the request is queued: the event loops already parsed
+//    its headers, otherwise they are peeked from the socket like in sjf.h.
+//  - A request without a deadline (no header and --deadline=0) never expires, it is ordered as
+//    if its deadline were EDF_UNSET_MS after its arrival.
+typedef struct edf* Edf;
+
+typedef struct edf_stats
+{
+    long assigned;    // Requests queued.
+    long from_header; // Of them, with the deadline of their client.
+    long expired;     // Answered with a 503 at dispatch.
+    long met;         // Served before their deadline.
+    long missed;      // Served, but after their deadline.
+} EdfStats;
+
+// The scheduler of the server, NULL unless --dispatch=edf.
+extern Edf edf;
+
+/**
+ * Create the scheduler, with default_ms as the deadline of requests that do not give one
+ * (0: they have none). Return NULL if allocation failed.
+ */
+Edf edfCreate(int default_ms);
+
+/**
+ * Find the deadline of cd and set cd->deadline_us and cd->dispatch_key. Never blocks.
+ */
+void edfAssign(Edf edf, ConnectionStruct cd);
+
+/**
+ * Return true if the deadline of cd passed before it was dispatched (cd->dispatch).
+ */
+bool edfExpired(Edf edf, ConnectionStruct cd);
+
+/**
+ * Answer cd with a 503 without reading its request. The caller then closes it.
+ */
+void edfReject(Edf edf, ConnectionStruct cd);
+
+/**
+ * Count cd, whose response just ended, as met or missed.
+ */
+void edfRecord(Edf edf, ConnectionStruct cd);
+
+/**
+ * Fill stats with a snapshot of the scheduler counters.
+ */
+void edfGetStats(Edf edf, EdfStats *stats);
+
+#endif
@@ -0,0 +1,677 @@
+#define _GNU_SOURCE // accept4
+#include "evloop.h"
+#include "request.h"
+#include "server.h"
+#include "pool.h"
+#include "config.h"
+#include "idle.h"
+#include "zerocopy.h"
+#include "stats.h"
+#include "latency.h"
+#include "timing.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+
+#define EV_MAX_EVENTS 256
+#define EV_PIPELINE_MAX 16 // Responses queued on one connection before they are written.
+
+typedef enum EvState_t
+{
+    EV_READING = 0, // Collecting the request headers.
+    EV_WRITING      // Flushing the queued responses.
+} EvState;
+
+// One response queued on a connection.
+typedef struct ev_resp
+{
+    char* out;          // Headers (or a whole error response), taken from the loop's buffers.
+    int out_len;
+    char* body;         // The file of a static response: memory-mapped, or in the content cache.
+    size_t body_len;
+    CacheEntry cached;  // The cache entry body belongs to, or NULL.
+    int file_fd;        // A large file sent with sendfile() instead of body (body_len bytes), or -1.
+} EvResp;
+
+// The state of one connection owned by a loop.
+typedef struct ev_conn
+{
+    int fd;
+    EvState state;
+    ConnectionStruct cd;
+    char in[MAXLINE];   // Bytes read and not answered yet: the current request, and any pipelined after it.
+    int in_len;
+    EvResp resp[EV_PIPELINE_MAX]; // Responses of pipelined requests, written in order.
+    int resp_count;
+    int resp_done;      // Responses that were written completely.
+    size_t resp_off;    // Bytes of resp[resp_done] written so far (headers, then body).
+    bool keep_alive;    // Go on with the next request once the responses are written.
+    bool renew;         // The next request is not the first one on this connection.
+    IdleNode idle;      // In the loop's idle list while waiting for a request.
+    struct ev_conn* next_free;
+    struct ev_conn* next_parked;
+} EvConn;
+
+// A response buffer while it is not in use.
+typedef struct ev_buf
+{
+    struct ev_buf* next_free;
+} EvBuf;
+
+typedef struct ev_loop
+{
+    int epfd;
+    int listenfd;
+    pthread_t thread;
+    struct thread_stats stats;
+    struct request_info req; // Scratch space to parse requests into.
+    EvConn* free_conns;      // Recycled connection states (only this loop touches them).
+    EvBuf* free_bufs;        // Recycled response buffers.
+    IdleList idle;           // Connections waiting for (the rest of) a request, oldest first.
+    RoomWaiter room;         // Woken up when a full system (block policy) has room again.
+    EvConn* parked;          // Dynamic requests the system had no room for, oldest first.
+    EvConn* parked_tail;
+} EvLoop;
+
+// ********** Connection state ********** //
+
+static EvConn* evConnAlloc(EvLoop* loop)
+{
+    EvConn* conn = loop->free_conns;
+    if(conn)
+    {
+        loop->free_conns = conn->next_free;
+    }
+    else if(!(conn = malloc(sizeof(*conn))))
+    {
+        return NULL;
+    }
+    conn->state = EV_READING;
+    conn->in_len = 0;
+    conn->resp_count = conn->resp_done = 0;
+    conn->resp_off = 0;
+    conn->keep_alive = conn->renew = false;
+    conn->idle.prev = conn->idle.next = NULL;
+    return conn;
+}
+
+static char* evBufAlloc(EvLoop* loop)
+{
+    EvBuf* buf = loop->free_bufs;
+    if(buf)
+    {
+        loop->free_bufs = buf->next_free;
+        return (char*)buf;
+    }
+    return malloc(REQUEST_ERROR_BUFSIZE);
+}
+
+static void evBufFree(EvLoop* loop, char* out)
+{
+    EvBuf* buf = (EvBuf*)out;
+    buf->next_free = loop->free_bufs;
+    loop->free_bufs = buf;
+}
+
+/**
+ * Release the queued responses of a connection.
+ */
+static void evConnClearResponses(EvLoop* loop, EvConn* conn)
+{
+    for(int i = 0; i < conn->resp_count; i++)
+    {
+        EvResp* resp = &conn->resp[i];
+        if(resp->out)
+        {
+            evBufFree(loop, resp->out);
+        }
+        if(resp->cached)
+        {
+            cacheRelease(resp->cached);
+        }
+        else if(resp->body)
+        {
+            munmap(resp->body, resp->body_len);
+        }
+        if(resp->file_fd >= 0)
+        {
+            close(resp->file_fd);
+        }
+    }
+    conn->resp_count = conn->resp_done = 0;
+    conn->resp_off = 0;
+}
+
+/**
+ * Release the state of a connection. If close_fd, also close the socket
+ * (which removes it from the epoll set) and release its record.
+ */
+static void evConnFree(EvLoop* loop, EvConn* conn, bool close_fd)
+{
+    evConnClearResponses(loop, conn);
+    idleListRemove(&loop->idle, &conn->idle);
+    if(close_fd)
+    {
+        close(conn->fd);
+        serverFreeRequest(conn->cd);
+    }
+    conn->next_free = loop->free_conns;
+    loop->free_conns = conn;
+}
+
+// ********** Request handling ********** //
+
+/**
+ * Write as much of the queued responses as the socket takes, all of them in one sendmsg()
+ * (up to a file sent with sendfile(), its headers wait for it with MSG_MORE).
+ * Return true when everything was written (or the connection broke, which cancels keep-alive).
+ */
+static bool evFlush(EvConn* conn)
+{
+    while(conn->resp_done < conn->resp_count)
+    {
+        EvResp* first = &conn->resp[conn->resp_done];
+        ssize_t written = 0;
+        if(first->file_fd >= 0 && conn->resp_off >= (size_t)first->out_len)
+        {
+            // Its headers are out, the file goes from the page cache to the socket:
+            off_t offset = conn->resp_off - first->out_len;
+            written = zcopySend(conn->fd, first->file_fd, &offset, first->body_len - offset, ZERO_COPY_SENDFILE);
+            if(written == 0)
+            {
+                written = -1; // The file shrank since stat().
+                errno = EIO;
+            }
+        }
+        else
+        {
+            struct iovec iov[2 * EV_PIPELINE_MAX];
+            struct msghdr msg;
+            int iovcnt = 0;
+            bool more = false;
+            size_t skip = conn->resp_off; // Only the first pending response is partly written.
+            for(int i = conn->resp_done; i < conn->resp_count && !more; i++)
+            {
+                EvResp* resp = &conn->resp[i];
+                if(skip < (size_t)resp->out_len)
+                {
+                    iov[iovcnt].iov_base = resp->out + skip;
+                    iov[iovcnt++].iov_len = resp->out_len - skip;
+                    skip = 0;
+                }
+                else
+                {
+                    skip -= resp->out_len;
+                }
+                more = resp->file_fd >= 0;
+                if(!more && skip < resp->body_len)
+                {
+                    iov[iovcnt].iov_base = resp->body + skip;
+                    iov[iovcnt++].iov_len = resp->body_len - skip;
+                }
+                skip = 0;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            written = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        }
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN)
+            {
+                return false; // Wait for EPOLLOUT.
+            }
+            // Give up on this client, including a dynamic request waiting for its turn:
+            conn->keep_alive = false;
+            poolFreeBuffer(conn_pool, POOL_BUF_REQUEST, conn->cd->request);
+            conn->cd->request = NULL;
+            return true;
+        }
+        statsAddSent(written);
+
+        size_t left = written;
+        while(left > 0)
+        {
+            EvResp* resp = &conn->resp[conn->resp_done];
+            size_t rest = resp->out_len + resp->body_len - conn->resp_off;
+            if(left < rest)
+            {
+                conn->resp_off += left;
+                break;
+            }
+            left -= rest;
+            conn->resp_done++;
+            conn->resp_off = 0;
+        }
+    }
+    return true;
+}
+
+/**
+ * Hand the dynamic request in cd->request to the worker threads. The loop forgets the connection.
+ * If the system is full under the block policy, the connection is parked (without reading from
+ * it) until evResumeParked() finds room for it, so the loop goes on serving its other clients.
+ */
+static void evSubmitDynamic(EvLoop* loop, EvConn* conn)
+{
+    // The worker (and the CGI child) use plain blocking I/O on it:
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) & ~O_NONBLOCK);
+    idleListRemove(&loop->idle, &conn->idle);
+    // Those parked before it go first, the loop is already waiting for room for them:
+    if(loop->parked || !serverOfferRequest(conn->cd, &loop->room))
+    {
+        conn->next_parked = NULL;
+        if(loop->parked_tail)
+        {
+            loop->parked_tail->next_parked = conn;
+        }
+        else
+        {
+            loop->parked = conn;
+        }
+        loop->parked_tail = conn;
+        return;
+    }
+    evConnFree(loop, conn, false);
+}
+
+/**
+ * Called when loop->room.wake_fd is readable: submit the parked connections in order,
+ * until the system is full again.
+ */
+static void evResumeParked(EvLoop* loop)
+{
+    uint64_t count;
+    while(read(loop->room.wake_fd, &count, sizeof(count)) < 0 && errno == EINTR);
+    while(loop->parked && serverOfferRequest(loop->parked->cd, &loop->room))
+    {
+        EvConn* conn = loop->parked;
+        if(!(loop->parked = conn->next_parked))
+        {
+            loop->parked_tail = NULL;
+        }
+        evConnFree(loop, conn, false);
+    }
+}
+
+/**
+ * Prepare the response of a static request into resp. Return false if the connection should be dropped.
+ */
+static bool evPrepareStatic(EvLoop* loop, EvConn* conn, EvResp* resp)
+{
+    RequestInfo req = &loop->req;
+    if((resp->cached = requestCacheAcquire(req)))
+    {
+        resp->body = (char*)cacheEntryData(resp->cached, &resp->body_len);
+        resp->out_len = requestStaticHeaders(conn->cd, &loop->stats, req, resp->out);
+        return true;
+    }
+    int srcfd = requestOpenStatic(req);
+    if(srcfd < 0)
+    {
+        resp->out_len = requestErrorResponse(conn->cd, &loop->stats, req, resp->out);
+        return true;
+    }
+    if(requestZeroCopy(req))
+    {
+        // Kept open until sent. ZERO_COPY_SPLICE would need a blocking socket, sendfile() does not.
+        resp->file_fd = srcfd;
+        resp->body_len = req->filesize;
+        resp->out_len = requestStaticHeaders(conn->cd, &loop->stats, req, resp->out);
+        return true;
+    }
+    if(req->filesize > 0)
+    {
+        resp->body = mmap(NULL, req->filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+        if(resp->body == MAP_FAILED)
+        {
+            resp->body = NULL;
+            close(srcfd);
+            return false;
+        }
+        resp->body_len = req->filesize;
+    }
+    close(srcfd);
+    resp->out_len = requestStaticHeaders(conn->cd, &loop->stats, req, resp->out);
+    return true;
+}
+
+/**
+ * Queue the response of the static, statistics or error request in loop->req.
+ * Return false if the connection should be dropped.
+ */
+static bool evQueueResponse(EvLoop* loop, EvConn* conn)
+{
+    EvResp* resp = &conn->resp[conn->resp_count];
+    resp->body = NULL;
+    resp->body_len = 0;
+    resp->cached = NULL;
+    resp->file_fd = -1;
+    if(!(resp->out = evBufAlloc(loop)))
+    {
+        return false;
+    }
+    conn->resp_count++; // From now on it is released with the others.
+    if(loop->req.kind == REQUEST_STATIC)
+    {
+        return evPrepareStatic(loop, conn, resp);
+    }
+    if(loop->req.kind == REQUEST_STATS)
+    {
+        // Released with munmap() like a mapped file:
+        if(!(resp->body = requestStatsBody(&loop->req, &resp->body_len)))
+        {
+            return false;
+        }
+        resp->out_len = requestStatsHeaders(conn->cd, &loop->req, resp->body_len, resp->out);
+        return true;
+    }
+    resp->out_len = requestErrorResponse(conn->cd, &loop->stats, &loop->req, resp->out);
+    return true;
+}
+
+/**
+ * Parse the complete request head of head_len bytes at the start of conn->in, consume it
+ * and queue its response.
+ * Return false if the connection was handed to the workers or dropped.
+ */
+static bool evHandleRequest(EvLoop* loop, EvConn* conn, int head_len)
+{
+    if(conn->renew)
+    {
+        serverRenewRequest(conn->cd);
+    }
+    conn->renew = true;
+
+    char* line_end = memchr(conn->in, '\n', head_len);
+    char next = conn->in[head_len]; // The first byte of a pipelined request, if any.
+    *line_end = '\0';
+    conn->in[head_len] = '\0';
+    conn->cd->dispatch_ns = timingNow();
+    requestParse(conn->in, &loop->req);
+    requestParseHeaders(conn->cd, line_end + 1, &loop->req);
+    conn->in[head_len] = next;
+    conn->in_len -= head_len;
+    memmove(conn->in, conn->in + head_len, conn->in_len);
+    conn->keep_alive = loop->req.keep_alive;
+
+    if(loop->req.kind == REQUEST_DYNAMIC)
+    {
+        ConnectionStruct cd = conn->cd;
+        if(!(cd->request = poolAllocBuffer(conn_pool, POOL_BUF_REQUEST)))
+        {
+            evConnFree(loop, conn, true);
+            return false;
+        }
+        *cd->request = loop->req;
+        if(conn->resp_count == 0)
+        {
+            evSubmitDynamic(loop, conn);
+            return false;
+        }
+        return true; // The worker takes over the socket once the responses before it are written.
+    }
+
+    if(!evQueueResponse(loop, conn))
+    {
+        evConnFree(loop, conn, true);
+        return false;
+    }
+    latencyRecord(conn->cd, loop->req.kind); // Its response is written at once unless the socket is full.
+    return true;
+}
+
+/**
+ * Answer the complete requests buffered in conn->in in order, and write their responses
+ * together, until the connection has to wait.
+ * Return true if it waits for more input, false if it waits for EPOLLOUT or was released.
+ */
+static bool evProcess(EvLoop* loop, EvConn* conn)
+{
+    while(1)
+    {
+        int head_len;
+        while(conn->resp_count < EV_PIPELINE_MAX && (conn->resp_count == 0 || conn->keep_alive) &&
+              (head_len = requestHeadLength(conn->in, conn->in_len)) > 0)
+        {
+            idleListRemove(&loop->idle, &conn->idle);
+            if(!evHandleRequest(loop, conn, head_len))
+            {
+                return false;
+            }
+        }
+
+        if(conn->resp_count == 0)
+        {
+            if(!conn->idle.next) // Not waiting already: the keep-alive timeout starts now.
+            {
+                idleListPush(&loop->idle, &conn->idle, conn, idleNowMs() + server_config.keepalive_timeout_ms);
+            }
+            conn->state = EV_READING;
+            return true;
+        }
+
+        conn->state = EV_WRITING;
+        if(!evFlush(conn))
+        {
+            return false;
+        }
+        evConnClearResponses(loop, conn);
+        if(conn->cd->request)
+        {
+            evSubmitDynamic(loop, conn);
+            return false;
+        }
+        if(!conn->keep_alive)
+        {
+            evConnFree(loop, conn, true);
+            return false;
+        }
+    }
+}
+
+/**
+ * Read whatever is available (edge-triggered: until EAGAIN) and answer the requests in it.
+ */
+static void evRead(EvLoop* loop, EvConn* conn)
+{
+    while(1)
+    {
+        if(conn->in_len == sizeof(conn->in) - 1)
+        {
+            evConnFree(loop, conn, true); // The request head does not fit, drop the client.
+            return;
+        }
+        ssize_t n = read(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - 1 - conn->in_len);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno != EAGAIN)
+            {
+                evConnFree(loop, conn, true);
+            }
+            return;
+        }
+        if(n == 0)
+        {
+            evConnFree(loop, conn, true); // The client left before sending a whole request.
+            return;
+        }
+        conn->in_len += n;
+        if(!evProcess(loop, conn))
+        {
+            return;
+        }
+    }
+}
+
+static void evAccept(EvLoop* loop)
+{
+    while(1)
+    {
+        int connfd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(connfd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if(errno != EAGAIN)
+            {
+                fprintf(stderr, "Error: event loop accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+
+        EvConn* conn = evConnAlloc(loop);
+        ConnectionStruct cd = conn ? serverNewRequest(connfd) : NULL;
+        if(!cd)
+        {
+            if(conn)
+            {
+                conn->next_free = loop->free_conns;
+                loop->free_conns = conn;
+            }
+            close(connfd);
+            continue;
+        }
+        conn->fd = connfd;
+        conn->cd = cd;
+        idleListPush(&loop->idle, &conn->idle, conn, idleNowMs() + server_config.keepalive_timeout_ms);
+
+        // Data that is already there is reported right away, even in edge-triggered mode.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+        {
+            evConnFree(loop, conn, true);
+        }
+    }
+}
+
+static void* evloopThread(void* args)
+{
+    EvLoop* loop = (EvLoop*)args;
+    struct epoll_event events[EV_MAX_EVENTS];
+
+    while(1)
+    {
+        int n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, idleListWaitMs(&loop->idle, idleNowMs()));
+        if(n < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+
+        for(int i = 0; i < n; i++)
+        {
+            if(events[i].data.ptr == &loop->room)
+            {
+                evResumeParked(loop);
+                continue;
+            }
+            EvConn* conn = (EvConn*)events[i].data.ptr;
+            if(conn == NULL)
+            {
+                evAccept(loop);
+                continue;
+            }
+            if(conn->state == EV_READING || evProcess(loop, conn))
+            {
+                evRead(loop, conn);
+            }
+        }
+
+        // Close the connections that stayed idle for too long:
+        long long now = idleNowMs();
+        EvConn* expired = NULL;
+        while((expired = idleListPopExpired(&loop->idle, now)))
+        {
+            evConnFree(loop, expired, true);
+        }
+    }
+    return NULL;
+}
+
+void evloopRaiseFdLimit()
+{
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void evloopRun(int listenfd, int loops, int first_thread_id)
+{
+    EvLoop* ev_loops = calloc(loops, sizeof(*ev_loops));
+    if(!ev_loops)
+    {
+        perror("Error: event loops allocation failed");
+        return;
+    }
+
+    signal(SIGPIPE, SIG_IGN); // A client that hangs up must only fail its own write.
+    evloopRaiseFdLimit();
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    for(int i = 0; i < loops; i++)
+    {
+        EvLoop* loop = &ev_loops[i];
+        loop->listenfd = listenfd;
+        loop->stats.thread_id = first_thread_id + i;
+        statsRegisterThread(&loop->stats);
+        idleListInit(&loop->idle);
+        if((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        {
+            perror("Error: epoll_create1 failed");
+            return;
+        }
+        // Every loop waits on the listening socket, EPOLLEXCLUSIVE wakes only one of them per connection.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+        {
+            perror("Error: epoll_ctl on the listening socket failed");
+            return;
+        }
+        if((loop->room.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        {
+            perror("Error: eventfd failed");
+            return;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->room;
+        if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->room.wake_fd, &ev) < 0)
+        {
+            perror("Error: epoll_ctl on the eventfd failed");
+            return;
+        }
+    }
+
+    for(int i = 1; i < loops; i++)
+    {
+        if(pthread_create(&ev_loops[i].thread, NULL, evloopThread, &ev_loops[i]) != 0)
+        {
+            fprintf(stderr, "Error: event loop number %d failed to create: %s\n", i, strerror(errno));
+        }
+    }
+    evloopThread(&ev_loops[0]);
+}
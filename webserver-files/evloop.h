@@ -0,0 +1,30 @@
+#ifndef _EVLOOP_INC
+#define _EVLOOP_INC
+
+#include "connection.h"
+
+// ********** Event Loop Engine ********** //
+// Edge-triggered epoll loops that accept, read and write without blocking.
+// Every loop thread waits on the (non-blocking) listening socket and on its own
+// connections. A loop reads a request, parses it with requestParse() and:
+//  - static files and errors are answered by the loop itself, non-blocking,
+//  - dynamic (CGI) requests are switched back to blocking mode and offered
+//    to the worker threads through serverOfferRequest(). If the system is full
+//    under the block policy, the loop parks them until it is woken up.
+// Requests a client pipelines are answered in order, and their responses are
+// written together with one writev().
+// So a slow client only costs a few KB of state, not a worker thread.
+
+/**
+ * Run loops event loop threads on listenfd. The calling thread becomes one of them.
+ * The ThreadStats of the loops get ids first_thread_id, first_thread_id + 1, ...
+ * Only returns if the loops could not be started.
+ */
+void evloopRun(int listenfd, int loops, int first_thread_id);
+
+/**
+ * Raise the open files limit as far as allowed, every connection costs an fd.
+ */
+void evloopRaiseFdLimit();
+
+#endif
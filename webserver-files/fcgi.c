@@ -0,0 +1,310 @@
+#include "fcgi.h"
+#include "spawn.h"
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#define FCGI_MAX_PROGRAMS 16
+#define FCGI_PARAMS_MAX (3 * MAXLINE + 64)
+
+typedef enum FcgiResult_t
+{
+    FCGI_DONE = 0, // The whole answer was read.
+    FCGI_LOST,     // The process broke before any output, the request can be retried.
+    FCGI_CUT       // The process broke after some output was forwarded.
+} FcgiResult;
+
+typedef struct fcgi_proc
+{
+    pid_t pid;
+    int fd;        // Our end of its socket, -1 while it is not running.
+    bool busy;     // Serving a request, or being started, by a worker.
+} FcgiProc;
+
+typedef struct fcgi_program
+{
+    char path[MAXLINE];
+    pthread_cond_t freed; // Signaled when one of its processes is done with a request.
+    FcgiProc *procs;
+} FcgiProgram;
+
+struct fcgi_pool
+{
+    pthread_mutex_t lock; // Protects the programs and the busy flags, only held to pick a process.
+    int procs;            // Processes per program.
+    FcgiProgram programs[FCGI_MAX_PROGRAMS];
+    int programs_num;
+};
+
+// ********** Frames ********** //
+
+/**
+ * Read exactly len bytes. Return false on end of file or an error.
+ */
+static bool fcgiReadFull(int fd, void *buf, size_t len)
+{
+    for(size_t done = 0; done < len; )
+    {
+        ssize_t n = read(fd, (char *)buf + done, len - done);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * Send exactly len bytes to the socket fd. Return false if it broke.
+ */
+static bool fcgiSendAll(int fd, const void *buf, size_t len, int flags)
+{
+    for(size_t done = 0; done < len; )
+    {
+        ssize_t n = send(fd, (const char *)buf + done, len - done, flags | MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n <= 0)
+        {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+ssize_t fcgiReadFrame(int fd, char *buf, size_t size)
+{
+    uint32_t len = 0;
+    if(!fcgiReadFull(fd, &len, sizeof(len)) || (len = ntohl(len)) > size || !fcgiReadFull(fd, buf, len))
+    {
+        return -1;
+    }
+    return len;
+}
+
+bool fcgiWriteFrame(int fd, const char *buf, size_t len)
+{
+    uint32_t header = htonl(len);
+    return fcgiSendAll(fd, &header, sizeof(header), len > 0 ? MSG_MORE : 0) && fcgiSendAll(fd, buf, len, 0);
+}
+
+// ********** Processes ********** //
+
+bool fcgiIsPooled(const char *filename)
+{
+    size_t len = strlen(filename), suffix_len = strlen(FCGI_SUFFIX);
+    return len > suffix_len && !strcmp(filename + len - suffix_len, FCGI_SUFFIX);
+}
+
+/**
+ * Start a process of program into proc (which the caller marked busy). Without the lock.
+ */
+static bool fcgiStart(FcgiProgram *program, FcgiProc *proc)
+{
+    int sv[2];
+    char *argv[] = {program->path, NULL};
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        return false;
+    }
+    // The process outlives the requests: spawnProgram() makes sure it keeps no client socket open.
+    pid_t pid = spawnProgram(program->path, argv, environ, sv[1], FCGI_LISTEN_FD);
+    close(sv[1]);
+    if(pid < 0)
+    {
+        close(sv[0]);
+        return false;
+    }
+    proc->pid = pid;
+    proc->fd = sv[0];
+    return true;
+}
+
+/**
+ * Stop the process of proc (it broke or broke the protocol) and reap it. Without the lock.
+ */
+static void fcgiStop(FcgiProc *proc)
+{
+    close(proc->fd);
+    proc->fd = -1;
+    kill(proc->pid, SIGKILL); // Harmless if it already exited, it is not reaped yet.
+    while(waitpid(proc->pid, NULL, 0) < 0 && errno == EINTR);
+}
+
+/**
+ * Send one request to the process at fd, and forward its answer to out_fd.
+ */
+static FcgiResult fcgiExchange(int fd, const char *params, size_t params_len, int out_fd, CgiOutput *copy)
+{
+    char buf[MAXBUF];
+    bool forwarded = false, out_ok = true;
+    if(!fcgiWriteFrame(fd, params, params_len))
+    {
+        return FCGI_LOST;
+    }
+    while(1)
+    {
+        uint32_t left = 0;
+        if(!fcgiReadFull(fd, &left, sizeof(left)) || (left = ntohl(left)) > FCGI_FRAME_MAX)
+        {
+            return forwarded ? FCGI_CUT : FCGI_LOST;
+        }
+        if(left == 0)
+        {
+            return FCGI_DONE;
+        }
+        while(left > 0)
+        {
+            size_t chunk = left < sizeof(buf) ? left : sizeof(buf);
+            if(!fcgiReadFull(fd, buf, chunk))
+            {
+                return forwarded ? FCGI_CUT : FCGI_LOST;
+            }
+            // A client that left still gets its answer read, to keep the process in step.
+            out_ok = out_ok && out_fd >= 0 && fcgiSendAll(out_fd, buf, chunk, 0);
+            if(copy)
+            {
+                cgiCacheOutputAppend(copy, buf, chunk);
+            }
+            forwarded = true;
+            left -= chunk;
+        }
+    }
+}
+
+// ********** Pool ********** //
+
+/**
+ * Return the program at path, adding it if it is new, or NULL if the table is full. Under the lock.
+ */
+static FcgiProgram* fcgiProgramOf(FcgiPool pool, const char *path)
+{
+    for(int i = 0; i < pool->programs_num; i++)
+    {
+        if(!strcmp(pool->programs[i].path, path))
+        {
+            return &pool->programs[i];
+        }
+    }
+    if(pool->programs_num == FCGI_MAX_PROGRAMS || strlen(path) >= MAXLINE)
+    {
+        return NULL;
+    }
+    FcgiProgram *program = &pool->programs[pool->programs_num];
+    if(!(program->procs = malloc(pool->procs * sizeof(*program->procs))))
+    {
+        return NULL;
+    }
+    strcpy(program->path, path);
+    pthread_cond_init(&program->freed, NULL);
+    for(int i = 0; i < pool->procs; i++)
+    {
+        program->procs[i].pid = -1;
+        program->procs[i].fd = -1;
+        program->procs[i].busy = false;
+    }
+    pool->programs_num++;
+    return program;
+}
+
+/**
+ * Take a free process of program, preferring a running one. Waits while all of them are busy.
+ * Under the lock.
+ */
+static FcgiProc* fcgiAcquire(FcgiPool pool, FcgiProgram *program)
+{
+    while(1)
+    {
+        FcgiProc *stopped = NULL;
+        for(int i = 0; i < pool->procs; i++)
+        {
+            FcgiProc *proc = &program->procs[i];
+            if(proc->busy)
+            {
+                continue;
+            }
+            if(proc->fd >= 0)
+            {
+                proc->busy = true;
+                return proc;
+            }
+            stopped = stopped ? stopped : proc;
+        }
+        if(stopped)
+        {
+            stopped->busy = true; // The caller starts it.
+            return stopped;
+        }
+        pthread_cond_wait(&program->freed, &pool->lock);
+    }
+}
+
+FcgiPool fcgiCreate(int procs)
+{
+    FcgiPool pool = malloc(sizeof(*pool));
+    if(!pool)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->procs = procs;
+    pool->programs_num = 0;
+    return pool;
+}
+
+bool fcgiServe(FcgiPool pool, const char *filename, const char *query, const char *uri, int out_fd, CgiOutput *copy)
+{
+    char params[FCGI_PARAMS_MAX];
+    int params_len = snprintf(params, sizeof(params), "QUERY_STRING=%s%cSCRIPT_FILENAME=%s%cREQUEST_URI=%s%c",
+                              query, '\0', filename, '\0', uri, '\0');
+    if(params_len >= (int)sizeof(params))
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    FcgiProgram *program = fcgiProgramOf(pool, filename);
+    pthread_mutex_unlock(&pool->lock);
+    if(!program)
+    {
+        return false;
+    }
+
+    // A process that exited since its last request is noticed here: start another one, once.
+    FcgiResult result = FCGI_LOST;
+    for(int attempt = 0; attempt < 2 && result == FCGI_LOST; attempt++)
+    {
+        pthread_mutex_lock(&pool->lock);
+        // <CRITICAL>
+        FcgiProc *proc = fcgiAcquire(pool, program);
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&pool->lock);
+
+        if(proc->fd >= 0 || fcgiStart(program, proc))
+        {
+            if((result = fcgiExchange(proc->fd, params, params_len, out_fd, copy)) != FCGI_DONE)
+            {
+                fcgiStop(proc);
+            }
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        // <CRITICAL>
+        proc->busy = false;
+        pthread_cond_signal(&program->freed);
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&pool->lock);
+    }
+    if(result == FCGI_CUT && copy)
+    {
+        copy->dropped = true;
+    }
+    return result != FCGI_LOST;
+}
@@ -0,0 +1,62 @@
+#ifndef _FCGI_INC
+#define _FCGI_INC
+
+#include "segel.h"
+#include "cgicache.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// ********** Pooled CGI ********** //
+// Programs named *.fcgi are started once and then serve request after request, instead of
+// a fork and exec per request like the classic *.cgi programs. Every such program gets its
+// own processes (up to --cgi-pool of them), started on demand and started again when one exits.
+//
+// A pooled process talks to the server over a Unix socket on its file descriptor 0, in frames:
+// a 4 byte length in network byte order, then that many bytes.
+//  - The server sends one frame per request, holding its parameters as "NAME=value\0" strings
+//    (QUERY_STRING, SCRIPT_FILENAME and REQUEST_URI, like the environment of a classic CGI program).
+//  - The process answers with frames of output (what a classic CGI program writes to its
+//    stdout: its headers, an empty line and its body), and an empty frame ends the answer.
+// The environment of a pooled process has no QUERY_STRING, so a program can tell that it
+// was run as a classic CGI program (e.g. with --cgi-pool=0) and then answer once on stdout.
+#define FCGI_SUFFIX ".fcgi"
+#define FCGI_LISTEN_FD 0
+#define FCGI_FRAME_MAX (64 * 1024) // Larger output is sent in several frames.
+
+typedef struct fcgi_pool* FcgiPool;
+
+// The pooled programs of the server, NULL when --cgi-pool=0 (*.fcgi programs then run as classic CGI).
+extern FcgiPool fcgi_pool;
+
+/**
+ * Create a pool that runs up to procs processes for each pooled program.
+ * Return NULL on failure.
+ */
+FcgiPool fcgiCreate(int procs);
+
+/**
+ * Return true if the program at filename is run by the pool (its name ends with FCGI_SUFFIX).
+ */
+bool fcgiIsPooled(const char *filename);
+
+/**
+ * Run one request (the parameters of a classic CGI request) through a process of the program
+ * at filename, and write its output to out_fd (-1: nowhere) and, when copy is not NULL, into copy
+ * for the CGI response cache. Waits for a free process of that program.
+ * Return false if no process could answer (out_fd got nothing then), true otherwise, even if
+ * out_fd broke on the way (the rest of the output is then read and dropped, and copy is whole).
+ */
+bool fcgiServe(FcgiPool pool, const char *filename, const char *query, const char *uri, int out_fd, CgiOutput *copy);
+
+/**
+ * Read one frame of at most size bytes from fd into buf (for the pooled programs too).
+ * Return its length, or -1 on end of file, an error or a frame that does not fit.
+ */
+ssize_t fcgiReadFrame(int fd, char *buf, size_t size);
+
+/**
+ * Write one frame of len bytes (0: the end of an answer) to fd. Return false on failure.
+ */
+bool fcgiWriteFrame(int fd, const char *buf, size_t len);
+
+#endif
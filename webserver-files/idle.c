@@ -0,0 +1,195 @@
+#include "idle.h"
+#include "server.h"
+#include <sys/epoll.h>
+
+#define IDLE_MAX_EVENTS 256
+
+struct idle_watcher
+{
+    int epfd;
+    int timeout_ms;
+    pthread_t thread;
+    pthread_mutex_t lock; // Protects parked, and orders the epoll registration against the expiry.
+    IdleList parked;
+};
+
+// ********** Idle List ********** //
+
+long long idleNowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void idleListInit(IdleList *list)
+{
+    list->head.prev = list->head.next = &list->head;
+    list->size = 0;
+}
+
+void idleListPush(IdleList *list, IdleNode *node, void *owner, long long deadline)
+{
+    node->owner = owner;
+    node->deadline = deadline;
+    node->prev = list->head.prev;
+    node->next = &list->head;
+    list->head.prev->next = node;
+    list->head.prev = node;
+    list->size++;
+}
+
+void idleListRemove(IdleList *list, IdleNode *node)
+{
+    if(node->next == NULL)
+    {
+        return;
+    }
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = NULL;
+    list->size--;
+}
+
+void* idleListPopExpired(IdleList *list, long long now)
+{
+    IdleNode *first = list->head.next;
+    if(first == &list->head || first->deadline > now)
+    {
+        return NULL;
+    }
+    idleListRemove(list, first);
+    return first->owner;
+}
+
+int idleListWaitMs(IdleList *list, long long now)
+{
+    IdleNode *first = list->head.next;
+    if(first == &list->head)
+    {
+        return -1;
+    }
+    return first->deadline > now ? (int)(first->deadline - now) : 0;
+}
+
+// ********** Idle Watcher ********** //
+
+/**
+ * Return true if the peer closed its side without sending another request.
+ */
+static bool idleHungUp(int fd)
+{
+    char c;
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) <= 0;
+}
+
+static void* idleWatcherThread(void *args)
+{
+    IdleWatcher watcher = (IdleWatcher)args;
+    struct epoll_event events[IDLE_MAX_EVENTS];
+    ConnectionStruct cd = NULL;
+
+    while(1)
+    {
+        pthread_mutex_lock(&watcher->lock);
+        int wait_ms = idleListWaitMs(&watcher->parked, idleNowMs());
+        pthread_mutex_unlock(&watcher->lock);
+
+        int n = epoll_wait(watcher->epfd, events, IDLE_MAX_EVENTS, wait_ms);
+        if(n < 0 && errno != EINTR)
+        {
+            unix_error("idle watcher epoll_wait error");
+        }
+
+        for(int i = 0; i < n; i++)
+        {
+            cd = (ConnectionStruct)events[i].data.ptr;
+            pthread_mutex_lock(&watcher->lock);
+            // <CRITICAL>
+            idleListRemove(&watcher->parked, &cd->idle);
+            // <CRITICAL-END>
+            pthread_mutex_unlock(&watcher->lock);
+            epoll_ctl(watcher->epfd, EPOLL_CTL_DEL, cd->connfd, NULL);
+
+            if((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+               ((events[i].events & EPOLLRDHUP) && idleHungUp(cd->connfd)))
+            {
+                close(cd->connfd);
+                serverFreeRequest(cd);
+                continue;
+            }
+            serverRenewRequest(cd);
+            // Never wait for room here: every other parked connection would wait with us.
+            serverOfferRequest(cd, NULL);
+        }
+
+        long long now = idleNowMs();
+        pthread_mutex_lock(&watcher->lock);
+        // <CRITICAL>
+        while((cd = idleListPopExpired(&watcher->parked, now)))
+        {
+            close(cd->connfd); // Also removes it from the epoll set.
+            serverFreeRequest(cd);
+        }
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&watcher->lock);
+    }
+    return NULL;
+}
+
+IdleWatcher idleCreateWatcher(int timeout_ms)
+{
+    IdleWatcher watcher = malloc(sizeof(*watcher));
+    if(!watcher)
+    {
+        return NULL;
+    }
+    watcher->timeout_ms = timeout_ms;
+    idleListInit(&watcher->parked);
+    pthread_mutex_init(&watcher->lock, NULL);
+    if((watcher->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        free(watcher);
+        return NULL;
+    }
+    if(pthread_create(&watcher->thread, NULL, idleWatcherThread, watcher) != 0)
+    {
+        close(watcher->epfd);
+        free(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+
+void idlePark(IdleWatcher watcher, ConnectionStruct cd)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = cd;
+
+    pthread_mutex_lock(&watcher->lock);
+    // <CRITICAL>
+    // Registered under the lock, so the watcher can not expire (and close) cd in between.
+    idleListPush(&watcher->parked, &cd->idle, cd, idleNowMs() + watcher->timeout_ms);
+    bool parked = epoll_ctl(watcher->epfd, EPOLL_CTL_ADD, cd->connfd, &ev) == 0;
+    if(!parked)
+    {
+        idleListRemove(&watcher->parked, &cd->idle);
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&watcher->lock);
+
+    if(!parked)
+    {
+        close(cd->connfd);
+        serverFreeRequest(cd);
+    }
+}
+
+int idleGetSize(IdleWatcher watcher)
+{
+    pthread_mutex_lock(&watcher->lock);
+    int size = watcher->parked.size;
+    pthread_mutex_unlock(&watcher->lock);
+    return size;
+}
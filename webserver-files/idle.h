@@ -0,0 +1,75 @@
+#ifndef _IDLE_INC
+#define _IDLE_INC
+
+#include "connection.h"
+
+// ********** Idle Connections ********** //
+// A kept-alive connection waits for its next request without holding a worker thread.
+// Every idle connection carries an IdleNode with the deadline at which it is closed.
+// Since all the connections get the same timeout, an IdleList is simply kept in
+// deadline order by appending at the tail, and the expired ones are at the head.
+
+typedef struct idle_list
+{
+    IdleNode head; // Sentinel.
+    int size;
+} IdleList;
+
+/**
+ * Return the current monotonic time in milliseconds.
+ */
+long long idleNowMs();
+
+/**
+ * Initialize an empty list. The list is not thread safe.
+ */
+void idleListInit(IdleList *list);
+
+/**
+ * Append node (belonging to owner) with the given deadline. node must not be in a list.
+ */
+void idleListPush(IdleList *list, IdleNode *node, void *owner, long long deadline);
+
+/**
+ * Remove node from the list. Does nothing if node is not in a list.
+ */
+void idleListRemove(IdleList *list, IdleNode *node);
+
+/**
+ * Remove and return the owner of the first node whose deadline is at or before now.
+ * Return NULL if no node expired.
+ */
+void* idleListPopExpired(IdleList *list, long long now);
+
+/**
+ * Return the number of milliseconds until the first deadline (0 if it passed),
+ * or -1 if the list is empty.
+ */
+int idleListWaitMs(IdleList *list, long long now);
+
+// ********** Idle Watcher ********** //
+// Parks the idle connections of the thread-per-request engine: a thread waits on
+// all of them with epoll, submits a connection back to the workers (through
+// serverOfferRequest, which drops it rather than wait if the system is full under
+// the block policy) once its next request arrives, and closes the ones that hang up
+// or stay idle for longer than the timeout.
+typedef struct idle_watcher* IdleWatcher;
+
+/**
+ * Create a watcher and start its thread. Idle connections are closed after timeout_ms.
+ * Return NULL on failure.
+ */
+IdleWatcher idleCreateWatcher(int timeout_ms);
+
+/**
+ * Hand a connection that is waiting for its next request to the watcher.
+ * May be called by any thread. The watcher owns cd from now on.
+ */
+void idlePark(IdleWatcher watcher, ConnectionStruct cd);
+
+/**
+ * Return the number of connections currently parked.
+ */
+int idleGetSize(IdleWatcher watcher);
+
+#endif
@@ -0,0 +1,116 @@
+#include "inflight.h"
+#include <stdatomic.h>
+
+#define CACHE_LINE 64
+
+// One worker's row. It is cache line aligned so that workers never share a line.
+typedef struct inflight_row
+{
+    _Atomic(ConnectionStruct)* slots;
+    int* free_stack; // Indices of the free slots, only touched by the owner.
+    int free_top;
+    atomic_int used;
+} __attribute__((aligned(CACHE_LINE))) InflightRow;
+
+struct inflight_table
+{
+    int workers;
+    int slots_per_worker;
+    InflightRow* rows;
+};
+
+InflightTable inflightCreateTable(int workers, int slots_per_worker)
+{
+    InflightTable table = malloc(sizeof(*table));
+    if(!table)
+    {
+        return NULL;
+    }
+    if(posix_memalign((void**)&table->rows, CACHE_LINE, workers * sizeof(InflightRow)) != 0)
+    {
+        free(table);
+        return NULL;
+    }
+    table->workers = workers;
+    table->slots_per_worker = slots_per_worker;
+
+    for(int i = 0; i < workers; i++)
+    {
+        InflightRow* row = &table->rows[i];
+        row->slots = malloc(slots_per_worker * sizeof(*row->slots));
+        row->free_stack = malloc(slots_per_worker * sizeof(*row->free_stack));
+        if(!row->slots || !row->free_stack)
+        {
+            free(row->slots);
+            free(row->free_stack);
+            while(i--)
+            {
+                free(table->rows[i].slots);
+                free(table->rows[i].free_stack);
+            }
+            free(table->rows);
+            free(table);
+            return NULL;
+        }
+        for(int j = 0; j < slots_per_worker; j++)
+        {
+            atomic_init(&row->slots[j], NULL);
+            row->free_stack[j] = slots_per_worker - 1 - j; // Hand out slot 0 first.
+        }
+        row->free_top = slots_per_worker;
+        atomic_init(&row->used, 0);
+    }
+    return table;
+}
+
+void inflightDestroyTable(InflightTable table)
+{
+    if(table == NULL)
+    {
+        return;
+    }
+    for(int i = 0; i < table->workers; i++)
+    {
+        free(table->rows[i].slots);
+        free(table->rows[i].free_stack);
+    }
+    free(table->rows);
+    free(table);
+}
+
+int inflightAcquire(InflightTable table, int worker_id, ConnectionStruct info)
+{
+    InflightRow* row = &table->rows[worker_id];
+    if(row->free_top == 0)
+    {
+        return -1;
+    }
+    int slot = row->free_stack[--row->free_top];
+    atomic_store_explicit(&row->slots[slot], info, memory_order_release);
+    atomic_fetch_add_explicit(&row->used, 1, memory_order_relaxed);
+    return slot;
+}
+
+ConnectionStruct inflightRelease(InflightTable table, int worker_id, int slot)
+{
+    InflightRow* row = &table->rows[worker_id];
+    ConnectionStruct res = atomic_exchange_explicit(&row->slots[slot], NULL, memory_order_acq_rel);
+    row->free_stack[row->free_top++] = slot;
+    atomic_fetch_sub_explicit(&row->used, 1, memory_order_relaxed);
+    return res;
+}
+
+int inflightGetSize(InflightTable table)
+{
+    int res = 0;
+    for(int i = 0; i < table->workers; i++)
+    {
+        res += atomic_load_explicit(&table->rows[i].used, memory_order_relaxed);
+    }
+    return res;
+}
+
+int inflightGetWorkerSize(InflightTable table, int worker_id)
+{
+    return atomic_load_explicit(&table->rows[worker_id].used, memory_order_relaxed);
+}
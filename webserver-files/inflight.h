@@ -0,0 +1,48 @@
+#ifndef _INFLIGHT_INC
+#define _INFLIGHT_INC
+
+#include "connection.h"
+
+// ********** In-flight Table ********** //
+// Tracks the requests that workers are currently handling.
+// Every worker owns a fixed row of slots that only it writes to,
+// so taking and releasing a slot is O(1) and needs no lock.
+// Other threads may read the table (e.g. to count or list the requests).
+typedef struct inflight_table* InflightTable;
+
+/**
+ * Create a table with slots_per_worker slots for each of the workers.
+ * Return NULL if allocation failed.
+ */
+InflightTable inflightCreateTable(int workers, int slots_per_worker);
+
+/**
+ * Destroy the table. The referenced requests are NOT freed.
+ */
+void inflightDestroyTable(InflightTable table);
+
+/**
+ * Store a reference to info in a free slot of worker_id's row.
+ * Must only be called by worker_id itself.
+ * Return the slot index, or -1 if the row is full.
+ */
+int inflightAcquire(InflightTable table, int worker_id, ConnectionStruct info);
+
+/**
+ * Free the slot that inflightAcquire returned and return the request it held.
+ * Must only be called by worker_id itself.
+ */
+ConnectionStruct inflightRelease(InflightTable table, int worker_id, int slot);
+
+/**
+ * Return the number of requests currently in flight (over all the workers).
+ * * The value is a snapshot and may be stale by the time it is used.
+ */
+int inflightGetSize(InflightTable table);
+
+/**
+ * Return the number of requests currently in flight on worker_id.
+ */
+int inflightGetWorkerSize(InflightTable table, int worker_id);
+
+#endif
@@ -0,0 +1,196 @@
+#include "latency.h"
+#include "timing.h"
+#include <stdatomic.h>
+
+#define LATENCY_SUB_BITS 5  // 32 buckets per power of two, about 3% apart.
+#define LATENCY_MAX_EXP 40  // Longer than 2^40 us (12 days) is counted in the last bucket.
+#define LATENCY_BUCKETS ((LATENCY_MAX_EXP - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+typedef struct latency_hist
+{
+    atomic_long counts[LATENCY_STAGES][LATENCY_KINDS][LATENCY_BUCKETS];
+    atomic_long sum_us[LATENCY_STAGES][LATENCY_KINDS];
+    atomic_long max_us[LATENCY_STAGES][LATENCY_KINDS];
+} LatencyHist;
+
+static const char* latency_stage_names[LATENCY_STAGES] = {"wait", "service", "total"};
+static const char* latency_kind_names[LATENCY_KINDS] = {"static", "dynamic", "error"};
+
+// The histograms of the calling thread, NULL until its first request:
+static __thread LatencyHist *latency_own = NULL;
+// The histograms of all the threads, for the readers:
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static LatencyHist **latency_hists = NULL;
+static int latency_hists_num = 0;
+static int latency_hists_cap = 0;
+
+/**
+ * Return the bucket of us: exact below 2^LATENCY_SUB_BITS, then log-linear.
+ */
+static int latencyBucket(long us)
+{
+    if(us < (1 << LATENCY_SUB_BITS))
+    {
+        return us < 0 ? 0 : us;
+    }
+    int exp = 63 - __builtin_clzl(us);
+    if(exp >= LATENCY_MAX_EXP)
+    {
+        return LATENCY_BUCKETS - 1;
+    }
+    int sub = (us >> (exp - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1);
+    return ((exp - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) + sub;
+}
+
+/**
+ * Return the highest value that falls in bucket.
+ */
+static long latencyBucketValue(int bucket)
+{
+    if(bucket < (1 << LATENCY_SUB_BITS))
+    {
+        return bucket;
+    }
+    int exp = (bucket >> LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    long sub = bucket & ((1 << LATENCY_SUB_BITS) - 1);
+    return ((1L << exp) | (sub << (exp - LATENCY_SUB_BITS))) + (1L << (exp - LATENCY_SUB_BITS)) - 1;
+}
+
+/**
+ * Return the histograms of the calling thread, made and registered on the first call.
+ * Return NULL if allocation failed.
+ */
+static LatencyHist* latencyOwn()
+{
+    if(latency_own)
+    {
+        return latency_own;
+    }
+    LatencyHist *hist = calloc(1, sizeof(*hist));
+    if(!hist)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&latency_lock);
+    // <CRITICAL>
+    if(latency_hists_num == latency_hists_cap)
+    {
+        int cap = latency_hists_cap ? latency_hists_cap * 2 : 64;
+        LatencyHist **grown = realloc(latency_hists, cap * sizeof(*grown));
+        if(grown)
+        {
+            latency_hists = grown;
+            latency_hists_cap = cap;
+        }
+    }
+    if(latency_hists_num < latency_hists_cap)
+    {
+        latency_hists[latency_hists_num++] = hist;
+        latency_own = hist;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&latency_lock);
+    if(!latency_own)
+    {
+        free(hist);
+    }
+    return latency_own;
+}
+
+/**
+ * Add us to the histogram of stage and kind. Only the owner of hist writes it.
+ */
+static void latencyAdd(LatencyHist *hist, LatencyStage stage, RequestKind kind, long us)
+{
+    us = us < 0 ? 0 : us; // Stamped on different CPUs, a stage of a few ns may come out below 0 with the TSC.
+    atomic_long *count = &hist->counts[stage][kind][latencyBucket(us)];
+    atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&hist->sum_us[stage][kind],
+                          atomic_load_explicit(&hist->sum_us[stage][kind], memory_order_relaxed) + us, memory_order_relaxed);
+    if(us > atomic_load_explicit(&hist->max_us[stage][kind], memory_order_relaxed))
+    {
+        atomic_store_explicit(&hist->max_us[stage][kind], us, memory_order_relaxed);
+    }
+}
+
+void latencyRecord(ConnectionStruct cd, RequestKind kind)
+{
+    LatencyHist *hist;
+    if(kind < 0 || kind >= LATENCY_KINDS || !(hist = latencyOwn()))
+    {
+        return;
+    }
+    long long end_ns = timingNow();
+    latencyAdd(hist, LATENCY_WAIT, kind, (cd->dispatch_ns - cd->arrival_ns) / TIMING_NS_PER_US);
+    latencyAdd(hist, LATENCY_SERVICE, kind, (end_ns - cd->dispatch_ns) / TIMING_NS_PER_US);
+    latencyAdd(hist, LATENCY_TOTAL, kind, (end_ns - cd->arrival_ns) / TIMING_NS_PER_US);
+}
+
+void latencyGetStats(LatencyStage stage, RequestKind kind, LatencyStats *stats)
+{
+    static const long per_mille[] = {500, 900, 990, 999};
+    long *results[] = {&stats->p50_us, &stats->p90_us, &stats->p99_us, &stats->p999_us};
+    long counts[LATENCY_BUCKETS] = {0};
+    memset(stats, 0, sizeof(*stats));
+
+    pthread_mutex_lock(&latency_lock);
+    // <CRITICAL>
+    for(int i = 0; i < latency_hists_num; i++)
+    {
+        LatencyHist *hist = latency_hists[i];
+        for(int b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            counts[b] += atomic_load_explicit(&hist->counts[stage][kind][b], memory_order_relaxed);
+        }
+        stats->sum_us += atomic_load_explicit(&hist->sum_us[stage][kind], memory_order_relaxed);
+        long max_us = atomic_load_explicit(&hist->max_us[stage][kind], memory_order_relaxed);
+        stats->max_us = max_us > stats->max_us ? max_us : stats->max_us;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&latency_lock);
+
+    for(int b = 0; b < LATENCY_BUCKETS; b++)
+    {
+        stats->count += counts[b];
+    }
+    long seen = 0;
+    int q = 0;
+    for(int b = 0; b < LATENCY_BUCKETS && q < 4; b++)
+    {
+        seen += counts[b];
+        // A quantile is the value of the request at rank ceil(quantile * count):
+        while(q < 4 && seen > 0 && seen >= (stats->count * per_mille[q] + 999) / 1000)
+        {
+            *results[q++] = latencyBucketValue(b) < stats->max_us ? latencyBucketValue(b) : stats->max_us;
+        }
+    }
+}
+
+const char* latencyStageName(LatencyStage stage)
+{
+    return stage >= 0 && stage < LATENCY_STAGES ? latency_stage_names[stage] : "none";
+}
+
+const char* latencyKindName(RequestKind kind)
+{
+    return kind >= 0 && kind < LATENCY_KINDS ? latency_kind_names[kind] : "none";
+}
+
+void latencyDump(FILE *out)
+{
+    fprintf(out, "Latency (us)    %10s %10s %10s %10s %10s %10s %10s\n", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for(int stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        for(int kind = 0; kind < LATENCY_KINDS; kind++)
+        {
+            LatencyStats stats;
+            latencyGetStats(stage, kind, &stats);
+            if(stats.count == 0)
+            {
+                continue;
+            }
+            fprintf(out, "%-7s %-7s %10ld %10ld %10ld %10ld %10ld %10ld %10ld\n", latency_stage_names[stage], latency_kind_names[kind],
+                    stats.count, stats.sum_us / stats.count, stats.p50_us, stats.p90_us, stats.p99_us, stats.p999_us, stats.max_us);
+        }
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef _LATENCY_INC
+#define _LATENCY_INC
+
+#include "request.h"
+
+// ********** Latency Histograms ********** //
+// Every request the server answers is timed in three stages:
+//  - wait:    from its arrival to its dispatch (a worker took it, or an event loop parsed it),
+//  - service: from its dispatch to the end of its response,
+//  - total:   from its arrival to the end of its response,
+// by the kind of the request (static, dynamic, error). Each thread that ends responses (workers,
+// event loops, the CGI reaper) records into histograms of its own, made on its first request:
+// only their owner writes them, with relaxed loads and stores, so recording takes no lock and
+// no atomic read-modify-write. The histograms of all the threads are merged when read, by the
+// /__stats endpoint (see stats.h) and by the dump to stderr when the server exits.
+// The buckets are log-linear as in HDR histograms: exact below 2^LATENCY_SUB_BITS us, then
+// 2^LATENCY_SUB_BITS buckets per power of two, so a percentile is within about 3% of the truth.
+// It is reported as the highest value of its bucket.
+//  - The response of an event loop ends when it is queued: it is written at once unless the
+//    socket is full.
+//  - A CGI request handed to the reaper (--cgi-async) ends when its program exits.
+typedef enum LatencyStage_t
+{
+    LATENCY_WAIT = 0,
+    LATENCY_SERVICE,
+    LATENCY_TOTAL,
+    LATENCY_STAGES
+} LatencyStage;
+
+#define LATENCY_KINDS (REQUEST_ERROR + 1) // Static, dynamic and error requests are timed, not REQUEST_STATS.
+
+typedef struct latency_stats
+{
+    long count;
+    long sum_us;
+    long p50_us;
+    long p90_us;
+    long p99_us;
+    long p999_us;
+    long max_us;
+} LatencyStats;
+
+/**
+ * Record the stages of cd, a request of kind whose response just ended (cd->arrival and
+ * cd->dispatch are set), in the histograms of the calling thread. Other kinds are ignored.
+ */
+void latencyRecord(ConnectionStruct cd, RequestKind kind);
+
+/**
+ * Fill stats with the merged histograms of stage for the requests of kind.
+ */
+void latencyGetStats(LatencyStage stage, RequestKind kind, LatencyStats *stats);
+
+/**
+ * Return the name of stage ("wait", "service", "total").
+ */
+const char* latencyStageName(LatencyStage stage);
+
+/**
+ * Return the name of kind ("static", "dynamic", "error").
+ */
+const char* latencyKindName(RequestKind kind);
+
+/**
+ * Write a table of the percentiles of every stage and kind that has requests to out.
+ */
+void latencyDump(FILE *out);
+
+#endif
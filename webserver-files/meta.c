@@ -0,0 +1,432 @@
+#include "meta.h"
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#define META_SHARDS 16
+#define META_BUCKETS 256       // Hash chains per shard.
+
+typedef struct meta_entry
+{
+    char *path;               // Normalized, the key.
+    unsigned long hash;
+    int error;                // The errno of stat() for a negative entry, else 0.
+    struct stat sbuf;         // Positive entries only.
+    int fd;                   // Open O_RDONLY for a readable regular file, else -1.
+    long long expires_ms;     // Negative entries only.
+    struct meta_entry *chain_next;
+    struct meta_entry *lru_prev; // Toward the most recently used.
+    struct meta_entry *lru_next; // Toward the least recently used.
+} *MetaEntry;
+
+typedef struct meta_shard
+{
+    pthread_mutex_t lock;
+    MetaEntry buckets[META_BUCKETS];
+    struct meta_entry lru;     // Sentinel: lru.lru_next is the most recently used entry.
+    unsigned long generation;  // Bumped by every invalidation: a miss that raced with one is not kept.
+    long entries;
+    long limit;
+    long open_files;
+    long negative_hits;
+    long evictions;
+    long invalidations;
+    atomic_long hits;          // Also read without the lock by metaHitRatio().
+    atomic_long misses;
+} MetaShard;
+
+struct meta_cache
+{
+    MetaShard shards[META_SHARDS];
+    int negative_ttl_ms;
+};
+
+// ********** Entries ********** //
+
+static long long metaNowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now); // A negative entry may live a tick longer.
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned long metaHash(const char *key)
+{
+    unsigned long hash = 14695981039346656037UL; // FNV-1a
+    for(; *key; key++)
+    {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211UL;
+    }
+    return hash;
+}
+
+static MetaShard* metaShardOf(MetaCache cache, unsigned long hash)
+{
+    return &cache->shards[hash % META_SHARDS];
+}
+
+static MetaEntry* metaBucketOf(MetaShard *shard, unsigned long hash)
+{
+    return &shard->buckets[(hash / META_SHARDS) % META_BUCKETS];
+}
+
+static MetaEntry metaFind(MetaShard *shard, const char *key, unsigned long hash)
+{
+    for(MetaEntry entry = *metaBucketOf(shard, hash); entry; entry = entry->chain_next)
+    {
+        if(entry->hash == hash && !strcmp(entry->path, key))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void metaLruPushFront(MetaShard *shard, MetaEntry entry)
+{
+    entry->lru_prev = &shard->lru;
+    entry->lru_next = shard->lru.lru_next;
+    shard->lru.lru_next->lru_prev = entry;
+    shard->lru.lru_next = entry;
+}
+
+static void metaLruRemove(MetaEntry entry)
+{
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void metaFree(MetaEntry entry)
+{
+    if(entry->fd >= 0)
+    {
+        close(entry->fd);
+    }
+    free(entry->path);
+    free(entry);
+}
+
+/**
+ * Put a new entry in the table of its shard, as the most recently used one. Under the shard lock.
+ */
+static void metaLink(MetaShard *shard, MetaEntry entry)
+{
+    MetaEntry *bucket = metaBucketOf(shard, entry->hash);
+    entry->chain_next = *bucket;
+    *bucket = entry;
+    metaLruPushFront(shard, entry);
+    shard->entries++;
+    shard->open_files += entry->fd >= 0;
+}
+
+/**
+ * Take an entry out of the table of its shard and free it. Under the shard lock.
+ */
+static void metaUnlink(MetaShard *shard, MetaEntry entry)
+{
+    MetaEntry *link = metaBucketOf(shard, entry->hash);
+    while(*link != entry)
+    {
+        link = &(*link)->chain_next;
+    }
+    *link = entry->chain_next;
+    metaLruRemove(entry);
+    shard->entries--;
+    shard->open_files -= entry->fd >= 0;
+    metaFree(entry);
+}
+
+/**
+ * Drop the least recently used entries until the shard is within its limit. Under the shard lock.
+ */
+static void metaEvict(MetaShard *shard)
+{
+    while(shard->entries > shard->limit)
+    {
+        metaUnlink(shard, shard->lru.lru_prev);
+        shard->evictions++;
+    }
+}
+
+/**
+ * Look path up in the file system for a new entry. Without any lock.
+ * Return NULL if there is no memory for it.
+ */
+static MetaEntry metaLoad(const char *key, unsigned long hash)
+{
+    MetaEntry entry = malloc(sizeof(*entry));
+    if(!entry || !(entry->path = strdup(key)))
+    {
+        free(entry);
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->fd = -1;
+    entry->error = 0;
+    entry->expires_ms = 0;
+    if(stat(key, &entry->sbuf) < 0)
+    {
+        entry->error = errno;
+        return entry;
+    }
+    if(S_ISREG(entry->sbuf.st_mode) && (entry->fd = open(key, O_RDONLY | O_CLOEXEC)) >= 0 &&
+       fstat(entry->fd, &entry->sbuf) < 0) // The file that was opened, if it was replaced meanwhile.
+    {
+        close(entry->fd);
+        entry->fd = -1;
+    }
+    return entry;
+}
+
+/**
+ * Answer a lookup from entry: copy its stat result to sbuf and/or duplicate its file to *fd
+ * (-1 when the file must be opened by path). Under the shard lock, so entry->fd stays open.
+ * Return 0, or the errno of the lookup.
+ */
+static int metaAnswer(MetaEntry entry, struct stat *sbuf, int *fd)
+{
+    if(entry->error)
+    {
+        return entry->error;
+    }
+    if(sbuf)
+    {
+        *sbuf = entry->sbuf;
+    }
+    if(fd)
+    {
+        *fd = entry->fd >= 0 ? fcntl(entry->fd, F_DUPFD_CLOEXEC, 0) : -1;
+    }
+    return 0;
+}
+
+/**
+ * Look path up through the cache, see metaStat() and metaOpen() (fd NULL or not).
+ * Return 0, or the errno of the lookup.
+ */
+static int metaGet(MetaCache cache, const char *path, struct stat *sbuf, int *fd)
+{
+    char key[MAXLINE];
+    int error = 0;
+    if(fd)
+    {
+        *fd = -1;
+    }
+    if(!watchNormalize(path, key, sizeof(key)))
+    {
+        if(sbuf && stat(path, sbuf) < 0)
+        {
+            return errno;
+        }
+        return 0; // Opened by path below.
+    }
+    unsigned long hash = metaHash(key);
+    MetaShard *shard = metaShardOf(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    // <CRITICAL>
+    MetaEntry entry = metaFind(shard, key, hash);
+    if(entry && entry->error && entry->expires_ms <= metaNowMs())
+    {
+        metaUnlink(shard, entry);
+        entry = NULL;
+    }
+    if(entry)
+    {
+        metaLruRemove(entry);
+        metaLruPushFront(shard, entry);
+        atomic_fetch_add_explicit(&shard->hits, 1, memory_order_relaxed);
+        shard->negative_hits += entry->error != 0;
+        error = metaAnswer(entry, sbuf, fd);
+    }
+    unsigned long generation = shard->generation;
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&shard->lock);
+    if(entry)
+    {
+        return error;
+    }
+
+    // A miss: look it up without the lock, and keep it unless the path changed meanwhile.
+    atomic_fetch_add_explicit(&shard->misses, 1, memory_order_relaxed);
+    if(!(entry = metaLoad(key, hash)))
+    {
+        if(sbuf && stat(path, sbuf) < 0)
+        {
+            return errno;
+        }
+        return 0;
+    }
+    bool keep = !entry->error || cache->negative_ttl_ms > 0;
+    entry->expires_ms = entry->error ? metaNowMs() + cache->negative_ttl_ms : 0;
+
+    pthread_mutex_lock(&shard->lock);
+    // <CRITICAL>
+    error = metaAnswer(entry, sbuf, fd);
+    if(keep && shard->generation == generation && !metaFind(shard, key, hash))
+    {
+        metaLink(shard, entry);
+        metaEvict(shard);
+        entry = NULL;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&shard->lock);
+    if(entry)
+    {
+        metaFree(entry);
+    }
+    return error;
+}
+
+int metaStat(MetaCache cache, const char *path, struct stat *sbuf)
+{
+    int error = metaGet(cache, path, sbuf, NULL);
+    if(error)
+    {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+int metaOpen(MetaCache cache, const char *path)
+{
+    int fd = -1;
+    int error = metaGet(cache, path, NULL, &fd);
+    if(error)
+    {
+        errno = error;
+        return -1;
+    }
+    return fd >= 0 ? fd : open(path, O_RDONLY | O_CLOEXEC);
+}
+
+void metaInvalidate(MetaCache cache, const char *path)
+{
+    char key[MAXLINE];
+    if(!watchNormalize(path, key, sizeof(key)))
+    {
+        return;
+    }
+    unsigned long hash = metaHash(key);
+    MetaShard *shard = metaShardOf(cache, hash);
+
+    pthread_mutex_lock(&shard->lock);
+    // <CRITICAL>
+    MetaEntry entry = metaFind(shard, key, hash);
+    if(entry)
+    {
+        metaUnlink(shard, entry);
+        shard->invalidations++;
+    }
+    shard->generation++;
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Drop every entry, when it is not known which paths changed.
+ */
+static void metaInvalidateAll(MetaCache cache)
+{
+    for(int i = 0; i < META_SHARDS; i++)
+    {
+        MetaShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        // <CRITICAL>
+        while(shard->lru.lru_next != &shard->lru)
+        {
+            metaUnlink(shard, shard->lru.lru_next);
+            shard->invalidations++;
+        }
+        shard->generation++;
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void metaGetStats(MetaCache cache, MetaStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    for(int i = 0; i < META_SHARDS; i++)
+    {
+        MetaShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        // <CRITICAL>
+        stats->hits += atomic_load(&shard->hits);
+        stats->misses += atomic_load(&shard->misses);
+        stats->negative_hits += shard->negative_hits;
+        stats->evictions += shard->evictions;
+        stats->invalidations += shard->invalidations;
+        stats->entries += shard->entries;
+        stats->open_files += shard->open_files;
+        stats->limit += shard->limit;
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+double metaHitRatio(MetaCache cache)
+{
+    long hits = 0, lookups = 0;
+    for(int i = 0; i < META_SHARDS; i++)
+    {
+        long shard_hits = atomic_load_explicit(&cache->shards[i].hits, memory_order_relaxed);
+        hits += shard_hits;
+        lookups += shard_hits + atomic_load_explicit(&cache->shards[i].misses, memory_order_relaxed);
+    }
+    return lookups ? (double)hits / lookups : 0;
+}
+
+// ********** Invalidation ********** //
+
+/**
+ * Drop the entry of the changed path, see watch.h.
+ */
+static void metaOnChange(void *owner, const char *path)
+{
+    MetaCache cache = (MetaCache)owner;
+    if(path)
+    {
+        metaInvalidate(cache, path);
+    }
+    else
+    {
+        metaInvalidateAll(cache);
+    }
+}
+
+MetaCache metaCreate(FileWatcher watcher, int max_entries, int negative_ttl_ms)
+{
+    // Without invalidation the cache would answer for changed paths, so it is all or nothing:
+    if(!watcher)
+    {
+        return NULL;
+    }
+    struct rlimit files;
+    if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur != RLIM_INFINITY &&
+       (rlim_t)max_entries > files.rlim_cur / 4)
+    {
+        max_entries = files.rlim_cur / 4;
+    }
+    MetaCache cache = calloc(1, sizeof(*cache));
+    if(!cache)
+    {
+        return NULL;
+    }
+    cache->negative_ttl_ms = negative_ttl_ms;
+    for(int i = 0; i < META_SHARDS; i++)
+    {
+        MetaShard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->lru.lru_prev = shard->lru.lru_next = &shard->lru;
+        shard->limit = max_entries / META_SHARDS > 0 ? max_entries / META_SHARDS : 1;
+        atomic_init(&shard->hits, 0);
+        atomic_init(&shard->misses, 0);
+    }
+    if(!watchAddHandler(watcher, metaOnChange, cache))
+    {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
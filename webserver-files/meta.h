@@ -0,0 +1,69 @@
+#ifndef _META_INC
+#define _META_INC
+
+#include "segel.h"
+#include "watch.h"
+#include <stdbool.h>
+
+// ********** Metadata Cache ********** //
+// Remembers what stat() said about the requested paths, and keeps the regular files
+// open, so a request for a known path costs no path walk: neither for its checks nor
+// to open the file it serves.
+//  - A path that does not exist (or can not be looked up) is remembered as a negative
+//    entry for a short time, so the 404 of a bot probing for files is cheap too.
+//  - The file watcher (see watch.h) drops the entries of the paths that change, and the
+//    negative ones of the files that appear.
+//  - The entries are spread over shards by the hash of their path, every shard has its
+//    own lock, hash table and LRU list, and gets an equal part of the entry limit.
+typedef struct meta_cache* MetaCache;
+
+typedef struct meta_stats
+{
+    long hits;          // Lookups answered from an entry (including the negative ones).
+    long negative_hits; // Hits on a negative entry.
+    long misses;        // Lookups that had to call stat().
+    long evictions;     // Entries dropped to stay within the entry limit.
+    long invalidations; // Entries dropped because their path changed.
+    long entries;       // Entries currently cached.
+    long open_files;    // Files the entries keep open.
+    long limit;         // The entry limit.
+} MetaStats;
+
+// The metadata cache of the server, NULL when it is off (--meta-cache=0).
+extern MetaCache meta_cache;
+
+/**
+ * Create a cache of at most max_entries paths under the root of watcher, that keeps
+ * negative entries for negative_ttl_ms (0: does not keep them). max_entries is lowered
+ * to a quarter of the open files limit, so the kept files leave room for the connections.
+ * Return NULL on failure (including when watcher is NULL: nothing would invalidate the entries).
+ */
+MetaCache metaCreate(FileWatcher watcher, int max_entries, int negative_ttl_ms);
+
+/**
+ * Like stat(path, sbuf): return 0, or -1 and set errno.
+ */
+int metaStat(MetaCache cache, const char *path, struct stat *sbuf);
+
+/**
+ * Like open(path, O_RDONLY | O_CLOEXEC): return a new descriptor (a duplicate of the one
+ * the entry keeps, it shares the file offset, use pread() and alike), or -1 and set errno.
+ */
+int metaOpen(MetaCache cache, const char *path);
+
+/**
+ * Drop the entry of path if there is one (e.g. the file changed or appeared).
+ */
+void metaInvalidate(MetaCache cache, const char *path);
+
+/**
+ * Fill stats with a snapshot of the cache counters.
+ */
+void metaGetStats(MetaCache cache, MetaStats *stats);
+
+/**
+ * Return hits / (hits + misses) so far, or 0 before the first lookup. Does not lock.
+ */
+double metaHitRatio(MetaCache cache);
+
+#endif
@@ -0,0 +1,159 @@
+#include "mpmc.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+
+typedef struct mpmc_cell
+{
+    atomic_size_t sequence;
+    ConnectionStruct info;
+} __attribute__((aligned(CACHE_LINE))) MpmcCell;
+
+struct mpmc_queue
+{
+    MpmcCell* cells;
+    size_t mask;
+    // The producer and consumer cursors are kept on separate lines so that
+    // the acceptor and the workers do not invalidate each other on every op.
+    atomic_size_t enqueue_pos __attribute__((aligned(CACHE_LINE)));
+    atomic_size_t dequeue_pos __attribute__((aligned(CACHE_LINE)));
+} __attribute__((aligned(CACHE_LINE)));
+
+static size_t roundUpPow2(size_t num)
+{
+    size_t res = 1;
+    while(res < num)
+    {
+        res <<= 1;
+    }
+    return res;
+}
+
+MpmcQueue mpmcCreateQueue(int capacity)
+{
+    if(capacity <= 0)
+    {
+        return NULL;
+    }
+
+    size_t size = roundUpPow2((size_t)capacity);
+    MpmcQueue queue = NULL;
+    MpmcCell* cells = NULL;
+    if(posix_memalign((void**)&queue, CACHE_LINE, sizeof(*queue)) != 0)
+    {
+        return NULL;
+    }
+    if(posix_memalign((void**)&cells, CACHE_LINE, size * sizeof(*cells)) != 0)
+    {
+        free(queue);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < size; i++)
+    {
+        atomic_init(&cells[i].sequence, i);
+        cells[i].info = NULL;
+    }
+    queue->cells = cells;
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+
+    return queue;
+}
+
+void mpmcDestroyQueue(MpmcQueue queue)
+{
+    if(queue == NULL)
+    {
+        return;
+    }
+    free(queue->cells);
+    free(queue);
+}
+
+ConnectionRes mpmcEnqueue(MpmcQueue queue, ConnectionStruct info)
+{
+    MpmcCell* cell;
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+
+    while(1)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0)
+        {
+            // The slot is free for this lap, try to claim it:
+            if(atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            return CONNECTION_FULL; // The consumer of the previous lap did not free this slot yet.
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    cell->info = info;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return CONNECTION_SUCCESS;
+}
+
+ConnectionStruct mpmcDequeue(MpmcQueue queue)
+{
+    MpmcCell* cell;
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+
+    while(1)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(diff == 0)
+        {
+            // The slot was published for this lap, try to claim it:
+            if(atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if(diff < 0)
+        {
+            return NULL; // Empty.
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    ConnectionStruct res = cell->info;
+    // Hand the slot over to the producer of the next lap:
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return res;
+}
+
+int mpmcGetSize(MpmcQueue queue)
+{
+    size_t tail = atomic_load_explicit(&queue->enqueue_pos, memory_order_acquire);
+    size_t head = atomic_load_explicit(&queue->dequeue_pos, memory_order_acquire);
+    if(tail <= head)
+    {
+        return 0;
+    }
+    return (int)(tail - head);
+}
+
+int mpmcGetCapacity(MpmcQueue queue)
+{
+    return (int)(queue->mask + 1);
+}
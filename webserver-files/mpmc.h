@@ -0,0 +1,55 @@
+#ifndef _MPMC_INC
+#define _MPMC_INC
+
+#include "connection.h"
+
+// ******** Bounded MPMC Queue ********* //
+// A fixed-capacity, lock-free multi-producer/multi-consumer queue
+// of ConnectionStruct references (Vyukov's bounded queue).
+// Every slot carries its own sequence number and sits on its own
+// cache line, so producers and consumers only meet on the slot they
+// are actually handing over.
+// * The queue stores references, entries are NOT copied.
+typedef struct mpmc_queue* MpmcQueue;
+
+/**
+ * Create a queue that can hold at least capacity entries.
+ * The real capacity is rounded up to the next power of two.
+ * Return NULL if capacity is not positive or allocation failed.
+ */
+MpmcQueue mpmcCreateQueue(int capacity);
+
+/**
+ * Destroy the queue. Entries still inside are NOT freed.
+ * Must not race with any enqueue/dequeue.
+ */
+void mpmcDestroyQueue(MpmcQueue queue);
+
+/**
+ * Enqueue a reference to info at the tail of the queue. Never blocks.
+ * Return CONNECTION_FULL if there is no free slot,
+ * Otherwise return CONNECTION_SUCCESS.
+ */
+ConnectionRes mpmcEnqueue(MpmcQueue queue, ConnectionStruct info);
+
+/**
+ * Dequeue the entry at the head of the queue. Never blocks.
+ * Return NULL if the queue is empty.
+ * * With several producers NULL is also returned while the head slot is claimed
+ *   but not yet published, even if a later slot already is. Producers that need
+ *   a published entry to be dequeueable must publish in order (one at a time).
+ */
+ConnectionStruct mpmcDequeue(MpmcQueue queue);
+
+/**
+ * Return the number of entries in the queue.
+ * * The value is a snapshot and may be stale by the time it is used.
+ */
+int mpmcGetSize(MpmcQueue queue);
+
+/**
+ * Return the real (rounded up) capacity of the queue.
+ */
+int mpmcGetCapacity(MpmcQueue queue);
+
+#endif
@@ -0,0 +1,89 @@
+#include "segel.h"
+#include "fcgi.h"
+#include <sys/time.h>
+#include <assert.h>
+#include <unistd.h>
+
+
+//
+// The pooled version of output.cgi (see fcgi.h): started once by the server
+// (--cgi-pool=N), it answers request after request from the same process.
+// Run as a classic CGI program (QUERY_STRING is set) it answers once on stdout.
+//
+
+double getSpinfor(const char *query)
+{
+  char buf[MAXLINE], *p;
+
+  /* Extract the argument, 5 seconds without one */
+  if (query == NULL || strlen(query) >= sizeof(buf))
+    return 5.0;
+  strcpy(buf, query);
+  p = strtok(buf, "&");
+  if (p == NULL)
+    return 5.0;
+  return atof(p);
+}
+
+double Time_GetSeconds() {
+    struct timeval t;
+    int rc = gettimeofday(&t, NULL);
+    assert(rc == 0);
+    return (double) ((double)t.tv_sec + (double)t.tv_usec / 1e6);
+}
+
+/* Find the value of name in the "NAME=value\0" parameters of a request */
+const char *getParam(const char *params, ssize_t len, const char *name)
+{
+  size_t name_len = strlen(name);
+  for (const char *p = params; p < params + len; p += strlen(p) + 1) {
+    if (!strncmp(p, name, name_len) && p[name_len] == '=')
+      return p + name_len + 1;
+  }
+  return NULL;
+}
+
+/* Spin, then format the whole CGI output (headers and body) into out */
+int answer(const char *query, int served, char *out)
+{
+  char content[MAXBUF];
+
+  double t1 = Time_GetSeconds();
+  usleep(getSpinfor(query) * 1e6);
+  double t2 = Time_GetSeconds();
+
+  /* Make the response body */
+  int len = snprintf(content, sizeof(content),
+                     "<p>Welcome to the pooled CGI program</p>\r\n"
+                     "<p>My only purpose is to waste time on the server!</p>\r\n"
+                     "<p>I spun for %.2f seconds</p>\r\n"
+                     "<p>Process %d served %d requests</p>\r\n",
+                     t2 - t1, (int)getpid(), served);
+
+  /* Generate the HTTP response */
+  return sprintf(out, "Content-length: %d\r\nContent-type: text/html\r\n\r\n%s", len, content);
+}
+
+int main(int argc, char *argv[])
+{
+  char params[FCGI_FRAME_MAX], out[2 * MAXBUF];
+  ssize_t len;
+  int served = 0;
+
+  if (getenv("QUERY_STRING") != NULL) {
+    /* Classic CGI: one request, the socket is stdout */
+    len = answer(getenv("QUERY_STRING"), 1, out);
+    fwrite(out, 1, len, stdout);
+    fflush(stdout);
+    exit(0);
+  }
+
+  /* Pooled: the server closes the socket to stop us */
+  while ((len = fcgiReadFrame(FCGI_LISTEN_FD, params, sizeof(params) - 1)) >= 0) {
+    params[len] = '\0';
+    int out_len = answer(getParam(params, len, "QUERY_STRING"), ++served, out);
+    if (!fcgiWriteFrame(FCGI_LISTEN_FD, out, out_len) || !fcgiWriteFrame(FCGI_LISTEN_FD, NULL, 0))
+      break;
+  }
+  exit(0);
+}
@@ -0,0 +1,289 @@
+#include "pool.h"
+#include "request.h"
+#include "reaper.h"
+#include <stdatomic.h>
+
+#define POOL_CACHE_MAX 32   // A thread cache holding more than this gives a batch back.
+#define POOL_CACHE_BATCH 16 // Records moved between a thread cache and the depot at once.
+
+// A free list chained through ConnectionStruct->pool_next.
+typedef struct pool_list
+{
+    ConnectionStruct head;
+    int count;
+} PoolList;
+
+// The calling thread's private cache. A thread only caches records of one pool,
+// records of any other pool go straight to (or come straight from) the depot.
+typedef struct pool_cache
+{
+    ConnPool owner;
+    PoolList free;
+} PoolCache;
+
+static __thread PoolCache thread_cache = {NULL, {NULL, 0}};
+
+// A free buffer, chained through its first bytes:
+typedef struct pool_free_buffer
+{
+    struct pool_free_buffer* next;
+} PoolFreeBuffer;
+
+static const size_t pool_buffer_sizes[POOL_BUFS] = {sizeof(struct request_info), sizeof(rio_t), sizeof(ReaperJob)};
+
+struct conn_pool
+{
+    struct connection_struct* slab;
+    int slab_size;
+    pthread_mutex_t depot_m;
+    PoolList depot; // Shared free records, protected by depot_m.
+    pthread_mutex_t buffers_m;
+    PoolFreeBuffer* buffers[POOL_BUFS]; // Free buffers of every kind, protected by buffers_m.
+    // Statistics. Relaxed atomics, they never order anything.
+    atomic_long hits;
+    atomic_long misses;
+    atomic_long buffer_misses;
+    atomic_long in_use;
+    atomic_long high_water;
+};
+
+static void listPush(PoolList* list, ConnectionStruct info)
+{
+    info->pool_next = list->head;
+    list->head = info;
+    list->count++;
+}
+
+static ConnectionStruct listPop(PoolList* list)
+{
+    ConnectionStruct res = list->head;
+    if(res)
+    {
+        list->head = res->pool_next;
+        res->pool_next = NULL;
+        list->count--;
+    }
+    return res;
+}
+
+/**
+ * Move up to count records from src to dst.
+ */
+static void listMove(PoolList* dst, PoolList* src, int count)
+{
+    while(count-- && src->head)
+    {
+        listPush(dst, listPop(src));
+    }
+}
+
+ConnPool poolCreate(int capacity)
+{
+    ConnPool pool = malloc(sizeof(*pool));
+    if(!pool)
+    {
+        return NULL;
+    }
+    if(!(pool->slab = malloc(capacity * sizeof(*pool->slab))))
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->slab_size = capacity;
+    pthread_mutex_init(&pool->depot_m, NULL);
+    pool->depot.head = NULL;
+    pool->depot.count = 0;
+    pthread_mutex_init(&pool->buffers_m, NULL);
+    for(int kind = 0; kind < POOL_BUFS; kind++)
+    {
+        pool->buffers[kind] = NULL;
+    }
+    for(int i = capacity - 1; i >= 0; i--)
+    {
+        listPush(&pool->depot, &pool->slab[i]);
+    }
+    atomic_init(&pool->hits, 0);
+    atomic_init(&pool->misses, 0);
+    atomic_init(&pool->buffer_misses, 0);
+    atomic_init(&pool->in_use, 0);
+    atomic_init(&pool->high_water, 0);
+    return pool;
+}
+
+void poolDestroy(ConnPool pool)
+{
+    if(pool == NULL)
+    {
+        return;
+    }
+    // Records adopted from misses live outside the slab and have to be freed one by one.
+    // Only the depot and this thread's cache can be reached from here, so cached records
+    // of other (already finished) threads are simply leaked.
+    if(thread_cache.owner == pool)
+    {
+        listMove(&pool->depot, &thread_cache.free, thread_cache.free.count);
+        thread_cache.owner = NULL;
+    }
+    ConnectionStruct it = NULL;
+    while((it = listPop(&pool->depot)))
+    {
+        if(it < pool->slab || it >= pool->slab + pool->slab_size)
+        {
+            free(it);
+        }
+    }
+    for(int kind = 0; kind < POOL_BUFS; kind++)
+    {
+        PoolFreeBuffer* buffer = NULL;
+        while((buffer = pool->buffers[kind]))
+        {
+            pool->buffers[kind] = buffer->next;
+            free(buffer);
+        }
+    }
+    pthread_mutex_destroy(&pool->buffers_m);
+    pthread_mutex_destroy(&pool->depot_m);
+    free(pool->slab);
+    free(pool);
+}
+
+static void poolCountAlloc(ConnPool pool)
+{
+    long in_use = atomic_fetch_add_explicit(&pool->in_use, 1, memory_order_relaxed) + 1;
+    long high_water = atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+    while(in_use > high_water &&
+          !atomic_compare_exchange_weak_explicit(&pool->high_water, &high_water, in_use,
+                                                 memory_order_relaxed, memory_order_relaxed));
+}
+
+ConnectionStruct poolAlloc(ConnPool pool)
+{
+    ConnectionStruct res = NULL;
+    if(thread_cache.owner == NULL)
+    {
+        thread_cache.owner = pool;
+    }
+
+    if(thread_cache.owner == pool && thread_cache.free.count == 0)
+    {
+        // Refill the cache with a whole batch, so the depot lock is taken once per batch:
+        pthread_mutex_lock(&pool->depot_m);
+        // <CRITICAL>
+        listMove(&thread_cache.free, &pool->depot, POOL_CACHE_BATCH);
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&pool->depot_m);
+    }
+
+    if(thread_cache.owner == pool)
+    {
+        res = listPop(&thread_cache.free);
+    }
+    else
+    {
+        pthread_mutex_lock(&pool->depot_m);
+        res = listPop(&pool->depot);
+        pthread_mutex_unlock(&pool->depot_m);
+    }
+
+    if(res)
+    {
+        atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+    }
+    else
+    {
+        if(!(res = malloc(sizeof(*res))))
+        {
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+    }
+    poolCountAlloc(pool);
+    res->pool_next = NULL;
+    return res;
+}
+
+void poolFree(ConnPool pool, ConnectionStruct info)
+{
+    if(info == NULL)
+    {
+        return;
+    }
+    atomic_fetch_sub_explicit(&pool->in_use, 1, memory_order_relaxed);
+    if(thread_cache.owner == NULL)
+    {
+        thread_cache.owner = pool;
+    }
+
+    if(thread_cache.owner != pool)
+    {
+        pthread_mutex_lock(&pool->depot_m);
+        listPush(&pool->depot, info);
+        pthread_mutex_unlock(&pool->depot_m);
+        return;
+    }
+
+    listPush(&thread_cache.free, info);
+    if(thread_cache.free.count > POOL_CACHE_MAX)
+    {
+        // Threads that mostly free (workers) hand whole batches back to threads that mostly allocate (acceptor):
+        pthread_mutex_lock(&pool->depot_m);
+        // <CRITICAL>
+        listMove(&pool->depot, &thread_cache.free, POOL_CACHE_BATCH);
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&pool->depot_m);
+    }
+}
+
+void* poolAllocBuffer(ConnPool pool, PoolBuffer kind)
+{
+    pthread_mutex_lock(&pool->buffers_m);
+    // <CRITICAL>
+    PoolFreeBuffer* res = pool->buffers[kind];
+    if(res)
+    {
+        pool->buffers[kind] = res->next;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&pool->buffers_m);
+    if(res)
+    {
+        return res;
+    }
+    atomic_fetch_add_explicit(&pool->buffer_misses, 1, memory_order_relaxed);
+    return malloc(pool_buffer_sizes[kind]);
+}
+
+void poolFreeBuffer(ConnPool pool, PoolBuffer kind, void *buffer)
+{
+    if(buffer == NULL)
+    {
+        return;
+    }
+    PoolFreeBuffer* node = (PoolFreeBuffer*)buffer;
+    pthread_mutex_lock(&pool->buffers_m);
+    // <CRITICAL>
+    node->next = pool->buffers[kind];
+    pool->buffers[kind] = node;
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&pool->buffers_m);
+}
+
+void poolGetStats(ConnPool pool, PoolStats *stats)
+{
+    stats->hits = atomic_load_explicit(&pool->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&pool->misses, memory_order_relaxed);
+    stats->buffer_misses = atomic_load_explicit(&pool->buffer_misses, memory_order_relaxed);
+    stats->in_use = atomic_load_explicit(&pool->in_use, memory_order_relaxed);
+    stats->high_water = atomic_load_explicit(&pool->high_water, memory_order_relaxed);
+    stats->capacity = pool->slab_size + stats->misses;
+}
+
+/**
+ * Return the number of records a pool needs so that a server with threads_num
+ * threads besides the acceptor never misses: every admitted request, the one being
+ * admitted, and a full cache in every thread (those + acceptor).
+ */
+int poolCapacityFor(int threads_num, int q_size)
+{
+    return q_size + 1 + (threads_num + 1) * (POOL_CACHE_MAX + 1);
+}
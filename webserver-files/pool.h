@@ -0,0 +1,91 @@
+#ifndef _POOL_INC
+#define _POOL_INC
+
+#include "connection.h"
+
+// ********** Connection Pool ********** //
+// A pre-sized pool of ConnectionStruct records.
+// All the records are carved out of one slab when the pool is created and
+// are chained through their intrusive pool_next link while they are free.
+// Every thread keeps a small private cache of free records, and only touches
+// the shared depot (under a lock) to move a whole batch at a time.
+// If the pool runs dry it falls back to malloc (a miss); such records join the
+// pool when they are freed, so the pool grows to the real high-water mark.
+// The pool also lends out the buffers a request may need besides its record: the parsed request an
+// event loop hands to a worker, the bytes a worker read past the current request (pipelining),
+// and the state of the reaper while the CGI program of the request runs.
+// They are far larger than a record, so they are only taken while in use, from a free list per kind
+// shared by all the threads. A miss calls malloc, and the buffer joins the pool when it is freed.
+typedef struct conn_pool* ConnPool;
+
+typedef enum PoolBuffer_t
+{
+    POOL_BUF_REQUEST = 0, // A struct request_info (see request.h), for ConnectionStruct->request.
+    POOL_BUF_RIO,         // A rio_t, for ConnectionStruct->rio.
+    POOL_BUF_REAPER,      // A ReaperJob (see reaper.h), while the reaper watches the CGI program of a request.
+    POOL_BUFS
+} PoolBuffer;
+
+typedef struct pool_stats
+{
+    long hits;       // Allocations served from the pool.
+    long misses;     // Allocations that had to call malloc.
+    long buffer_misses; // Buffer allocations that had to call malloc (every buffer misses once).
+    long in_use;     // Records currently allocated.
+    long high_water; // Highest in_use seen so far.
+    long capacity;   // Records owned by the pool (slab + records adopted from misses).
+} PoolStats;
+
+/**
+ * Create a pool holding capacity pre-allocated records.
+ * Return NULL if allocation failed.
+ */
+ConnPool poolCreate(int capacity);
+
+/**
+ * Destroy the pool and the slab.
+ * Must only be called once no thread uses the pool or any of its records.
+ */
+void poolDestroy(ConnPool pool);
+
+/**
+ * Take a record from the pool.
+ * Return NULL only if the pool is empty and malloc failed too.
+ */
+ConnectionStruct poolAlloc(ConnPool pool);
+
+/**
+ * Return a record to the pool. Any thread may free a record allocated by another thread.
+ */
+void poolFree(ConnPool pool, ConnectionStruct info);
+
+/**
+ * Take a buffer of kind from the pool.
+ * Return NULL only if the pool has no free one and malloc failed too.
+ */
+void* poolAllocBuffer(ConnPool pool, PoolBuffer kind);
+
+/**
+ * Return a buffer of kind to the pool. Does nothing if buffer is NULL.
+ */
+void poolFreeBuffer(ConnPool pool, PoolBuffer kind, void *buffer);
+
+/**
+ * Fill stats with a snapshot of the pool counters.
+ */
+void poolGetStats(ConnPool pool, PoolStats *stats);
+
+/**
+ * Return a capacity with which a server of a q_size queue, and threads_num threads that take or
+ * free records besides the acceptor (the workers, the event loops, the idle watcher and the reaper),
+ * never has to call malloc for a record that counts in the system.
+ * The connections held outside of the system are not bounded by q_size: the kept-alive ones waiting
+ * for their next request, and the ones an event loop still reads a request from. Past the capacity
+ * they fall back to malloc, which /__stats counts (records_pool_misses_total).
+ */
+int poolCapacityFor(int threads_num, int q_size);
+
+// The pool of the server's records:
+extern ConnPool conn_pool;
+
+#endif
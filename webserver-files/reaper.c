@@ -0,0 +1,289 @@
+#include "reaper.h"
+#include "server.h"
+#include "request.h"
+#include "pool.h"
+#include "stats.h"
+#include "idle.h"
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#define REAPER_MAX_EVENTS 64
+
+struct cgi_reaper
+{
+    int epfd;
+    pthread_t thread;
+    pthread_mutex_t lock; // Protects the stats.
+    ReaperStats stats;
+};
+
+static int reaperPidfdOpen(pid_t pid)
+{
+    return syscall(__NR_pidfd_open, pid, 0); // Close on exec.
+}
+
+static void reaperJobInit(ReaperJob *job, ConnectionStruct cd)
+{
+    job->cd = cd;
+    job->pidfd = -1;
+    job->start_ms = idleNowMs();
+    job->watched = false;
+    job->copy = cd->cgi_pipe >= 0;
+    job->client_ok = true;
+    job->buf_off = job->buf_len = 0;
+    if(job->copy)
+    {
+        cgiCacheOutputInit(cgi_cache, &job->output);
+    }
+}
+
+static int reaperFd(ReaperJob *job, ReaperWait wait)
+{
+    return wait == REAPER_WAIT_EXIT ? job->pidfd : wait == REAPER_WAIT_OUTPUT ? job->cd->cgi_pipe : job->cd->connfd;
+}
+
+/**
+ * Watch the descriptor of job for wait, instead of the one it was watched for so far.
+ * Return false on failure.
+ */
+static bool reaperWaitFor(CgiReaper reaper, ReaperJob *job, ReaperWait wait)
+{
+    if(job->watched)
+    {
+        epoll_ctl(reaper->epfd, EPOLL_CTL_DEL, reaperFd(job, job->wait), NULL);
+    }
+    job->wait = wait;
+    struct epoll_event ev;
+    ev.events = wait == REAPER_WAIT_CLIENT ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = job;
+    // A program that already exited (or output or room that is already there) is reported right away.
+    job->watched = epoll_ctl(reaper->epfd, EPOLL_CTL_ADD, reaperFd(job, wait), &ev) == 0;
+    return job->watched;
+}
+
+/**
+ * Send what is buffered to the client and read more of the output, until one of them would block.
+ * A client that left does not stop the copy, the output is made (and cached) anyway.
+ * Return what job waits for next: REAPER_WAIT_EXIT once the whole output was read.
+ */
+static ReaperWait reaperCopy(ReaperJob *job)
+{
+    ConnectionStruct cd = job->cd;
+    while(1)
+    {
+        while(job->client_ok && job->buf_off < job->buf_len)
+        {
+            ssize_t sent = send(cd->connfd, job->buf + job->buf_off, job->buf_len - job->buf_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if(sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                return REAPER_WAIT_CLIENT;
+            }
+            if(sent < 0)
+            {
+                job->client_ok = false;
+                break;
+            }
+            statsAddSent(sent);
+            job->buf_off += sent;
+        }
+
+        ssize_t n = read(cd->cgi_pipe, job->buf, sizeof(job->buf));
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(n < 0 && errno == EAGAIN)
+        {
+            return REAPER_WAIT_OUTPUT;
+        }
+        if(n <= 0)
+        {
+            job->output.dropped |= n < 0;
+            return REAPER_WAIT_EXIT;
+        }
+        cgiCacheOutputAppend(&job->output, job->buf, n);
+        job->buf_off = 0;
+        job->buf_len = n;
+    }
+}
+
+/**
+ * Copy the rest of the output of job, waiting for it (or for the client) on this thread.
+ */
+static void reaperCopyAll(ReaperJob *job)
+{
+    ReaperWait wait;
+    while((wait = reaperCopy(job)) != REAPER_WAIT_EXIT)
+    {
+        struct pollfd pfd = {reaperFd(job, wait), wait == REAPER_WAIT_CLIENT ? POLLOUT : POLLIN, 0};
+        poll(&pfd, 1, -1);
+    }
+}
+
+static void reaperClosePipe(ReaperJob *job)
+{
+    close(job->cd->cgi_pipe);
+    job->cd->cgi_pipe = -1;
+}
+
+/**
+ * Reap the program of job (it exited, or could not be watched), store its output if it was copied,
+ * finish its request and count it.
+ */
+static void reaperFinish(CgiReaper reaper, ReaperJob *job)
+{
+    int status = 0;
+    while(waitpid(job->cd->cgi_pid, &status, 0) < 0 && errno == EINTR);
+    long elapsed_ms = idleNowMs() - job->start_ms;
+    bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+    if(job->copy)
+    {
+        RequestInfo req = job->cd->request;
+        if(!failed && !job->output.dropped)
+        {
+            cgiCacheStore(cgi_cache, req->filename, req->cgiargs, req->uri, &job->output);
+        }
+        cgiCacheOutputFree(&job->output);
+    }
+    job->cd->cgi_pid = 0;
+    serverFinishRequest(job->cd);
+
+    pthread_mutex_lock(&reaper->lock);
+    // <CRITICAL>
+    reaper->stats.finished++;
+    reaper->stats.running--;
+    reaper->stats.failed += failed;
+    reaper->stats.total_ms += elapsed_ms;
+    if(elapsed_ms > reaper->stats.max_ms)
+    {
+        reaper->stats.max_ms = elapsed_ms;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&reaper->lock);
+}
+
+static void* reaperThread(void *arg)
+{
+    CgiReaper reaper = (CgiReaper)arg;
+    struct epoll_event events[REAPER_MAX_EVENTS];
+    while(1)
+    {
+        int n = epoll_wait(reaper->epfd, events, REAPER_MAX_EVENTS, -1);
+        if(n < 0 && errno != EINTR)
+        {
+            unix_error("reaper epoll_wait error");
+        }
+        for(int i = 0; i < n; i++)
+        {
+            ReaperJob *job = (ReaperJob*)events[i].data.ptr;
+            if(job->wait != REAPER_WAIT_EXIT)
+            {
+                ReaperWait wait = reaperCopy(job);
+                if(wait == job->wait)
+                {
+                    continue;
+                }
+                bool watched = reaperWaitFor(reaper, job, wait);
+                if(wait == REAPER_WAIT_EXIT)
+                {
+                    reaperClosePipe(job); // Only once it left the epoll set.
+                }
+                if(watched)
+                {
+                    continue;
+                }
+                if(job->cd->cgi_pipe >= 0)
+                {
+                    reaperCopyAll(job);
+                    reaperClosePipe(job);
+                }
+            }
+            else
+            {
+                // A pidfd is readable once its process exited.
+                epoll_ctl(reaper->epfd, EPOLL_CTL_DEL, job->pidfd, NULL);
+            }
+            close(job->pidfd);
+            reaperFinish(reaper, job);
+            poolFreeBuffer(conn_pool, POOL_BUF_REAPER, job);
+        }
+    }
+    return NULL;
+}
+
+CgiReaper reaperCreate()
+{
+    // Without pidfds (before Linux 5.3) the workers keep waiting for their programs:
+    int probe = reaperPidfdOpen(getpid());
+    if(probe < 0)
+    {
+        return NULL;
+    }
+    close(probe);
+
+    CgiReaper reaper = calloc(1, sizeof(*reaper));
+    if(!reaper)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&reaper->lock, NULL);
+    if((reaper->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        free(reaper);
+        return NULL;
+    }
+    if(pthread_create(&reaper->thread, NULL, reaperThread, reaper) != 0)
+    {
+        close(reaper->epfd);
+        free(reaper);
+        return NULL;
+    }
+    return reaper;
+}
+
+void reaperWatch(CgiReaper reaper, ConnectionStruct cd)
+{
+    ReaperJob local;
+    ReaperJob *job = poolAllocBuffer(conn_pool, POOL_BUF_REAPER);
+    ReaperJob *run = job ? job : &local;
+    reaperJobInit(run, cd);
+
+    pthread_mutex_lock(&reaper->lock);
+    // <CRITICAL>
+    reaper->stats.started++;
+    reaper->stats.running++;
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&reaper->lock);
+
+    // The program is not reaped before we do, so its pid can not be reused meanwhile.
+    if(job && (job->pidfd = reaperPidfdOpen(cd->cgi_pid)) >= 0)
+    {
+        if(reaperWaitFor(reaper, job, job->copy ? REAPER_WAIT_OUTPUT : REAPER_WAIT_EXIT))
+        {
+            return;
+        }
+        close(job->pidfd);
+    }
+    if(run->copy)
+    {
+        reaperCopyAll(run);
+        reaperClosePipe(run);
+    }
+    reaperFinish(reaper, run);
+    poolFreeBuffer(conn_pool, POOL_BUF_REAPER, job);
+}
+
+void reaperGetStats(CgiReaper reaper, ReaperStats *stats)
+{
+    pthread_mutex_lock(&reaper->lock);
+    // <CRITICAL>
+    *stats = reaper->stats;
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&reaper->lock);
+}
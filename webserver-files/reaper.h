@@ -0,0 +1,75 @@
+#ifndef _REAPER_INC
+#define _REAPER_INC
+
+#include "connection.h"
+#include "cgicache.h"
+
+// ********** CGI Reaper ********** //
+// A classic CGI program writes its output straight to the client socket, so once it is
+// started the worker thread has nothing left to do but wait for it to exit. Instead the
+// worker hands the connection over here and goes back to the queue: a thread waits on a
+// pidfd of every running program with epoll, and when one exits it reaps it, closes its
+// connection and releases the request (which counts as in the system until then, so the
+// overload policy still bounds the programs that run at the same time).
+// With the CGI response cache the program writes to a pipe (cd->cgi_pipe) instead: the thread
+// also copies its output to the client, without blocking on a slow one, and into the cache,
+// where it is stored once the program exited.
+typedef struct cgi_reaper* CgiReaper;
+
+typedef enum ReaperWait_t
+{
+    REAPER_WAIT_EXIT = 0, // For the program to exit (its pidfd).
+    REAPER_WAIT_OUTPUT,   // For more of its output (the pipe).
+    REAPER_WAIT_CLIENT    // For room in the client socket, to send the rest of buf.
+} ReaperWait;
+
+// What the reaper keeps about one program, lent by the connection pool (POOL_BUF_REAPER).
+typedef struct reaper_job
+{
+    ConnectionStruct cd;
+    int pidfd;
+    long long start_ms;
+    ReaperWait wait;  // What its one descriptor in the epoll set is watched for.
+    bool watched;     // It has one.
+    // When the output goes through the reaper (copy):
+    bool copy;
+    bool client_ok;   // No send to the client failed yet.
+    CgiOutput output; // For the CGI response cache.
+    size_t buf_off;   // buf[buf_off, buf_len) is still to be sent.
+    size_t buf_len;
+    char buf[MAXBUF];
+} ReaperJob;
+
+typedef struct reaper_stats
+{
+    long started;  // Programs handed over.
+    long finished; // Programs reaped.
+    long failed;   // Reaped programs that exited with an error or were killed.
+    long running;  // Handed over and not reaped yet.
+    long total_ms; // Run time of the reaped programs, from the hand-over to their exit.
+    long max_ms;   // The longest of them.
+} ReaperStats;
+
+// The reaper of the server, NULL when the workers wait for their programs (--cgi-async=off,
+// or pidfds are not supported).
+extern CgiReaper cgi_reaper;
+
+/**
+ * Create a reaper and start its thread. Return NULL on failure.
+ */
+CgiReaper reaperCreate();
+
+/**
+ * Take over cd, whose CGI program (cd->cgi_pid) writes its output to cd->connfd, or to the pipe
+ * cd->cgi_pipe to be copied (then cd->request says which request it answers): once the program
+ * exits, close the connection and release the request (see serverFinishRequest()).
+ * If the program can not be watched, copy its output and wait for it right away and do the same.
+ */
+void reaperWatch(CgiReaper reaper, ConnectionStruct cd);
+
+/**
+ * Fill stats with a snapshot of the reaper counters.
+ */
+void reaperGetStats(CgiReaper reaper, ReaperStats *stats);
+
+#endif
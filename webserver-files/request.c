@@ -2,8 +2,25 @@
 // request.c: Does the bulk of the work for the web server.
 //
 
+#define _GNU_SOURCE // pipe2
 #include "segel.h"
 #include "request.h"
+#include "config.h"
+#include "pool.h"
+#include "zerocopy.h"
+#include "response.h"
+#include "meta.h"
+#include "fcgi.h"
+#include "spawn.h"
+#include "cgicache.h"
+#include "reaper.h"
+#include "codel.h"
+#include "sjf.h"
+#include "edf.h"
+#include "scale.h"
+#include "stats.h"
+#include "latency.h"
+#include "timing.h"
 
 #define STAT_REQ_ARRIVAL "Stat-Req-Arrival:: "
 #define STAT_REQ_DISPATCH "Stat-Req-Dispatch:: "
@@ -11,79 +28,217 @@
 #define STAT_THREAD_COUNT "Stat-Thread-Count:: "
 #define STAT_THREAD_STATIC "Stat-Thread-Static:: "
 #define STAT_THREAD_DYNAMIC "Stat-Thread-Dynamic:: "
+#define STAT_THREAD_LOCAL "Stat-Thread-Local:: "
+#define STAT_THREAD_STEALS "Stat-Thread-Steals:: "
+#define STAT_THREAD_REUSED "Stat-Thread-Reused:: "
+#define STAT_CONN_REQUESTS "Stat-Conn-Requests:: "
+#define STAT_CACHE_HIT_RATIO "Stat-Cache-Hit-Ratio:: "
+#define STAT_META_HIT_RATIO "Stat-Meta-Hit-Ratio:: "
+#define STAT_CGI_HIT_RATIO "Stat-Cgi-Hit-Ratio:: "
+#define STAT_CODEL_ACCEPTED "Stat-Codel-Accepted:: "
+#define STAT_CODEL_DROPPED "Stat-Codel-Dropped:: "
+#define STAT_SJF_CLASS "Stat-Sjf-Class:: "
+#define STAT_SJF_P50 "Stat-Sjf-Class-P50:: "
+#define STAT_SJF_P99 "Stat-Sjf-Class-P99:: "
+#define STAT_EDF_EXPIRED "Stat-Edf-Expired:: "
+#define STAT_EDF_MISSED "Stat-Edf-Missed:: "
+#define STAT_SCALE_WORKERS "Stat-Scale-Workers:: "
+#define STAT_SCALE_RESIZES "Stat-Scale-Resizes:: "
+
+static void requestParseHeaderLine(const char *line, RequestInfo req);
+static void requestSetError(RequestInfo req, const char *cause, const char *errnum,
+                            const char *shortmsg, const char *longmsg);
 
-// requestError(      fd,    filename,        "404",    "Not found", "OS-HW3 Server could not find this file");
-void requestError(ConnectionStruct cd, ThreadStats t_stats, char *cause, char *errnum, char *shortmsg, char *longmsg)
+//
+// The response is HTTP/1.1 only for an HTTP/1.1 request.
+//
+static const char *requestProtocol(RequestInfo req)
 {
-    char buf[MAXLINE], body[MAXBUF];
-
-    // Create the body of the error message
-    sprintf(body, "<html><title>OS-HW3 Error</title>");
-    sprintf(body, "%s<body bgcolor="
-                  "fffff"
-                  ">\r\n",
-            body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr>OS-HW3 Web Server\r\n", body);
-
-    // Write out the header information for this response
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(cd->connfd, buf, strlen(buf));
-    printf("%s", buf);
-
-    sprintf(buf, "Content-Type: text/html\r\n");
-    Rio_writen(cd->connfd, buf, strlen(buf));
-    printf("%s", buf);
+    return strcmp(req->version, "HTTP/1.1") ? "HTTP/1.0" : "HTTP/1.1";
+}
 
-    sprintf(buf, "Content-Length: %lu\r\n", strlen(body));
-    Rio_writen(cd->connfd, buf, strlen(buf));
-    printf("%s", buf);
+//
+// Appends the Connection header (and the keep-alive limits).
+//
+static void requestConnectionHeaders(ConnectionStruct cd, RequestInfo req, ResponseBuilder *resp)
+{
+    if (!req->keep_alive)
+    {
+        respAppend(resp, "Connection: close\r\n", sizeof("Connection: close\r\n") - 1);
+        return;
+    }
+    respAppend(resp, "Connection: keep-alive\r\n", sizeof("Connection: keep-alive\r\n") - 1);
+    respAppend(resp, "Keep-Alive: timeout=", sizeof("Keep-Alive: timeout=") - 1);
+    respAppendNumber(resp, (server_config.keepalive_timeout_ms + 999) / 1000, 1);
+    respHeaderLong(resp, ", max=", server_config.keepalive_max - cd->conn_requests);
+}
 
-    sprintf(buf, STAT_REQ_ARRIVAL "%lu.%06lu\r\n", (unsigned long)cd->arrival.tv_sec, cd->arrival.tv_usec);
-    Rio_writen(cd->connfd, buf, strlen(buf));
-    printf("%s", buf);
+//
+// Appends "name<ratio with four decimals>\r\n", as "%.4f".
+//
+static void requestRatioHeader(ResponseBuilder *resp, const char *name, double ratio)
+{
+    long fixed = (long)(ratio * 10000 + 0.5);
+    respAppend(resp, name, strlen(name));
+    respAppendNumber(resp, fixed / 10000, 1);
+    respAppend(resp, ".", 1);
+    respAppendNumber(resp, fixed % 10000, 4);
+    respAppend(resp, "\r\n", 2);
+}
 
-    unsigned long diff_time = ((cd->dispatch.tv_sec * 1000000) + cd->dispatch.tv_usec % 1000000) \
-                            - ((cd->arrival.tv_sec * 1000000) + cd->arrival.tv_usec % 1000000); // in miliseconds
-    sprintf(buf, STAT_REQ_DISPATCH "%lu.%06lu\r\n", (diff_time / 1000000), (diff_time % 1000000));
-    Rio_writen(cd->connfd, buf, strlen(buf));
-    printf("%s", buf);
+//
+// Counts the request in the thread statistics.
+//
+static void requestCountStats(ConnectionStruct cd, ThreadStats t_stats, RequestKind kind)
+{
+    t_stats->thread_count++;
+    if (kind == REQUEST_STATIC)
+    {
+        t_stats->thread_static++;
+    }
+    else if (kind == REQUEST_DYNAMIC)
+    {
+        t_stats->thread_dynamic++;
+    }
+    if (cd->conn_requests > 1)
+    {
+        t_stats->thread_reused++;
+    }
+}
 
-    sprintf(buf, STAT_THREAD_ID "%d\r\n", t_stats->thread_id);
-    Rio_writen(cd->connfd, buf, strlen(buf));
-    printf("%s", buf);
+//
+// Counts the request, and appends the Stat-* section unless --stat-headers=off.
+//
+static void requestStatHeaders(ConnectionStruct cd, ThreadStats t_stats, RequestKind kind, ResponseBuilder *resp)
+{
+    requestCountStats(cd, t_stats, kind);
+    if (!server_config.stat_headers)
+    {
+        return;
+    }
+    long long arrival_us = timingToWall(cd->arrival_ns) / TIMING_NS_PER_US; // The time of day it arrived.
+    long long wait_us = (cd->dispatch_ns - cd->arrival_ns) / TIMING_NS_PER_US; // Monotonic, never negative.
+    wait_us = wait_us < 0 ? 0 : wait_us;
+    respHeaderTime(resp, STAT_REQ_ARRIVAL, arrival_us / 1000000, arrival_us % 1000000);
+    respHeaderTime(resp, STAT_REQ_DISPATCH, wait_us / 1000000, wait_us % 1000000);
+    respHeaderLong(resp, STAT_THREAD_ID, t_stats->thread_id);
+    respHeaderLong(resp, STAT_THREAD_COUNT, t_stats->thread_count);
+    respHeaderLong(resp, STAT_THREAD_STATIC, t_stats->thread_static);
+    respHeaderLong(resp, STAT_THREAD_DYNAMIC, t_stats->thread_dynamic);
+    respHeaderLong(resp, STAT_THREAD_LOCAL, t_stats->thread_local_hits);
+    respHeaderLong(resp, STAT_THREAD_STEALS, t_stats->thread_steals);
+    respHeaderLong(resp, STAT_THREAD_REUSED, t_stats->thread_reused);
+    respHeaderLong(resp, STAT_CONN_REQUESTS, cd->conn_requests);
+    if (kind == REQUEST_STATIC && content_cache)
+    {
+        requestRatioHeader(resp, STAT_CACHE_HIT_RATIO, cacheHitRatio(content_cache));
+    }
+    if (meta_cache)
+    {
+        requestRatioHeader(resp, STAT_META_HIT_RATIO, metaHitRatio(meta_cache));
+    }
+    if (kind == REQUEST_DYNAMIC && cgi_cache)
+    {
+        requestRatioHeader(resp, STAT_CGI_HIT_RATIO, cgiCacheHitRatio(cgi_cache));
+    }
+    if (codel)
+    {
+        CodelStats codel_stats;
+        codelGetStats(codel, &codel_stats);
+        respHeaderLong(resp, STAT_CODEL_ACCEPTED, codel_stats.accepted);
+        respHeaderLong(resp, STAT_CODEL_DROPPED, codel_stats.dropped);
+    }
+    if (sjf && cd->sjf_class >= 0)
+    {
+        // The latency of the earlier requests of the same class (this one is not over yet):
+        SjfClassStats class_stats;
+        sjfGetClassStats(sjf, cd->sjf_class, &class_stats);
+        respHeader(resp, STAT_SJF_CLASS, sjfClassName(cd->sjf_class));
+        respHeaderTime(resp, STAT_SJF_P50, class_stats.p50_us / 1000000, class_stats.p50_us % 1000000);
+        respHeaderTime(resp, STAT_SJF_P99, class_stats.p99_us / 1000000, class_stats.p99_us % 1000000);
+    }
+    if (edf)
+    {
+        EdfStats edf_stats;
+        edfGetStats(edf, &edf_stats);
+        respHeaderLong(resp, STAT_EDF_EXPIRED, edf_stats.expired);
+        respHeaderLong(resp, STAT_EDF_MISSED, edf_stats.missed);
+    }
+    if (scaler)
+    {
+        ScaleStats scale_stats;
+        scaleGetStats(scaler, &scale_stats);
+        respHeaderLong(resp, STAT_SCALE_WORKERS, scale_stats.active);
+        respHeaderLong(resp, STAT_SCALE_RESIZES, scale_stats.grows + scale_stats.shrinks);
+    }
+}
 
-    sprintf(buf, STAT_THREAD_COUNT "%d\r\n", ++t_stats->thread_count);
-    Rio_writen(cd->connfd, buf, strlen(buf));
-    printf("%s", buf);
+//
+// Builds a whole error response for req (cause, errnum, shortmsg and longmsg).
+//
+static void requestBuildError(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req, ResponseBuilder *resp)
+{
+    char body[MAXBUF], status[MAXLINE];
 
-    sprintf(buf, STAT_THREAD_STATIC "%d\r\n", t_stats->thread_static);
-    Rio_writen(cd->connfd, buf, strlen(buf));
-    printf("%s", buf);
+    // Create the body of the error message
+    int body_len = snprintf(body, sizeof(body),
+                            "<html><title>OS-HW3 Error</title><body bgcolor=fffff>\r\n"
+                            "%s: %s\r\n"
+                            "<p>%s: %.4096s\r\n"
+                            "<hr>OS-HW3 Web Server\r\n",
+                            req->errnum, req->shortmsg, req->longmsg, req->cause);
+    if (body_len >= (int)sizeof(body))
+    {
+        body_len = sizeof(body) - 1;
+    }
 
-    sprintf(buf, STAT_THREAD_DYNAMIC "%d\r\n\r\n", t_stats->thread_dynamic);
-    Rio_writen(cd->connfd, buf, strlen(buf));
-    printf("%s", buf);
+    // Write out the header information for this response
+    snprintf(status, sizeof(status), "%s %s", req->errnum, req->shortmsg);
+    respStatus(resp, requestProtocol(req), status);
+    respHeader(resp, "Content-Type: ", "text/html");
+    respHeaderLong(resp, "Content-Length: ", body_len);
+    requestConnectionHeaders(cd, req, resp);
+    requestStatHeaders(cd, t_stats, REQUEST_ERROR, resp);
+    respEnd(resp);
+    printf("%s", resp->buf);
 
     // Write out the content
-    Rio_writen(cd->connfd, body, strlen(body));
     printf("%s", body);
+    respAppend(resp, body, body_len);
+}
+
+int requestErrorResponse(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req, char *buf)
+{
+    ResponseBuilder resp;
+    respInit(&resp, buf, REQUEST_ERROR_BUFSIZE);
+    requestBuildError(cd, t_stats, req, &resp);
+    return resp.len;
+}
+
+void requestError(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req)
+{
+    ResponseBuilder *resp = respThreadBuilder();
+    requestBuildError(cd, t_stats, req, resp);
+    respSend(cd->connfd, resp, NULL, 0);
 }
 
 //
-// Reads and discards everything up to an empty text line
+// Reads everything up to an empty text line, only the Connection header is used.
+// Returns false if the client left (or broke) before the empty line.
 //
-void requestReadhdrs(rio_t *rp)
+bool requestReadhdrs(rio_t *rp, RequestInfo req)
 {
     char buf[MAXLINE];
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    while (strcmp(buf, "\r\n"))
+    while (rio_readlineb(rp, buf, MAXLINE) > 0)
     {
-        Rio_readlineb(rp, buf, MAXLINE);
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+        {
+            return true;
+        }
+        requestParseHeaderLine(buf, req);
     }
-    return;
+    return false;
 }
 
 //
@@ -144,97 +299,493 @@ void requestGetFiletype(char *filename, char *filetype)
         strcpy(filetype, "text/plain");
 }
 
-void requestServeDynamic(ConnectionStruct cd, ThreadStats t_stats, char *filename, char *cgiargs)
+//
+// Sends the output of the CGI program on fd to out_fd (-1: nowhere) as it comes, and keeps a copy.
+//
+static void requestCopyOutput(int fd, int out_fd, CgiOutput *copy)
+{
+    char buf[MAXBUF];
+    bool out_ok = out_fd >= 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) != 0)
+    {
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            copy->dropped = true;
+            return;
+        }
+        // A client that left does not stop the copy, the output is made anyway.
+        for (ssize_t done = 0, sent; out_ok && done < n; done += sent)
+        {
+            if ((sent = send(out_fd, buf + done, n - done, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+            {
+                sent = 0;
+            }
+            else if (sent < 0)
+            {
+                out_ok = false;
+            }
+            else
+            {
+                statsAddSent(sent);
+            }
+        }
+        cgiCacheOutputAppend(copy, buf, n);
+    }
+}
+
+//
+// Starts the classic CGI program at filename, its stdout being out_fd. Returns its pid, or -1.
+//
+static pid_t requestStartCgi(const char *filename, const char *cgiargs, int out_fd)
+{
+    char *emptylist[] = {NULL};
+    char **env = spawnEnv("QUERY_STRING", cgiargs);
+    pid_t pid = env ? spawnProgram(filename, emptylist, env, out_fd, STDOUT_FILENO) : -1;
+    free(env);
+    if (pid < 0)
+    {
+        fprintf(stderr, "Warning: could not run %s: %s\n", filename, strerror(errno));
+    }
+    return pid;
+}
+
+//
+// Runs the CGI program at filename and waits for it. Its output goes to out_fd (-1: nowhere) and
+// into copy for the CGI response cache. Returns false if it could not be started.
+//
+static bool requestRunCgi(const char *filename, const char *cgiargs, const char *uri, int out_fd, CgiOutput *copy)
+{
+    int pipefd[2];
+
+    // A pooled program answers from one of its running processes:
+    if (fcgi_pool && fcgiIsPooled(filename) && fcgiServe(fcgi_pool, filename, cgiargs, uri, out_fd, copy))
+    {
+        return true;
+    }
+
+    // When the CGI process writes to stdout, it will instead go to us.
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+    {
+        return false;
+    }
+    pid_t to_wait = requestStartCgi(filename, cgiargs, pipefd[1]);
+    close(pipefd[1]);
+    if (to_wait >= 0)
+    {
+        requestCopyOutput(pipefd[0], out_fd, copy);
+    }
+    close(pipefd[0]);
+    if (to_wait < 0)
+    {
+        return false;
+    }
+
+    int status = 0;
+    WaitPid(to_wait, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        copy->dropped = true;
+    }
+    return true;
+}
+
+//
+// Starts the classic CGI program of req with its output on a pipe, for the reaper to copy to the client
+// and into the CGI response cache (see reaper.h) once the worker hands cd over. Keeps req in cd->request
+// until then. Returns false if the worker has to run it itself (a pooled program, or no buffer for req).
+//
+static bool requestStartCgiCopy(ConnectionStruct cd, RequestInfo req)
+{
+    int pipefd[2];
+
+    if ((fcgi_pool && fcgiIsPooled(req->filename)) ||
+        (cd->request != req && !(cd->request = poolAllocBuffer(conn_pool, POOL_BUF_REQUEST))))
+    {
+        return false;
+    }
+    if (cd->request != req)
+    {
+        *cd->request = *req;
+    }
+    if (pipe2(pipefd, O_CLOEXEC) < 0)
+    {
+        return true; // Answered with the headers only, as when the program can not be started.
+    }
+    pid_t to_wait = requestStartCgi(req->filename, req->cgiargs, pipefd[1]);
+    close(pipefd[1]);
+    if (to_wait < 0)
+    {
+        close(pipefd[0]);
+        return true;
+    }
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK); // The reaper copies from many programs at once.
+    cd->cgi_pid = to_wait; // The worker hands the connection to the reaper.
+    cd->cgi_pipe = pipefd[0];
+    return true;
+}
+
+bool requestRefreshCgi(const char *filename, const char *cgiargs, const char *uri, CgiOutput *output)
+{
+    return requestRunCgi(filename, cgiargs, uri, -1, output);
+}
+
+void requestServeDynamic(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req)
 {
-    char buf[MAXLINE], *emptylist[] = {NULL};
+    char *filename = req->filename, *cgiargs = req->cgiargs;
+    long age = 0;
+    CgiEntry cached = cgi_cache ? cgiCacheAcquire(cgi_cache, filename, cgiargs, &age) : NULL;
 
     // The server does only a little bit of the header.
-    // The CGI script has to finish writing out the header.
-    unsigned long diff_time = ((cd->dispatch.tv_sec * 1000000) + cd->dispatch.tv_usec % 1000000) \
-                            - ((cd->arrival.tv_sec * 1000000) + cd->arrival.tv_usec % 1000000); // in miliseconds
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
-    sprintf(buf, "%s" STAT_REQ_ARRIVAL "%lu.%06lu\r\n", buf, (long unsigned)cd->arrival.tv_sec, cd->arrival.tv_usec);
-    sprintf(buf, "%s" STAT_REQ_DISPATCH "%lu.%06lu\r\n", buf, (diff_time / 1000000), (diff_time % 1000000));
-    sprintf(buf, "%s" STAT_THREAD_ID "%d\r\n", buf, t_stats->thread_id);
-    sprintf(buf, "%s" STAT_THREAD_COUNT "%d\r\n", buf, ++t_stats->thread_count);
-    sprintf(buf, "%s" STAT_THREAD_STATIC "%d\r\n", buf, t_stats->thread_static);
-    sprintf(buf, "%s" STAT_THREAD_DYNAMIC "%d\r\n", buf, ++t_stats->thread_dynamic);
-    Rio_writen(cd->connfd, buf, strlen(buf));
+    // The CGI script (or the copy of its output) has to finish writing out the header.
+    ResponseBuilder *resp = respThreadBuilder();
+    respStatus(resp, requestProtocol(req), "200 OK");
+    requestConnectionHeaders(cd, req, resp); // Always close: only the CGI program knows the length of its output.
+    if (cached)
+    {
+        respHeaderLong(resp, "Age: ", age);
+    }
+    requestStatHeaders(cd, t_stats, REQUEST_DYNAMIC, resp);
+    if (cached)
+    {
+        size_t size = 0;
+        const char *data = cgiCacheEntryData(cached, &size);
+        respSend(cd->connfd, resp, data, size);
+        cgiCacheRelease(cached);
+        return;
+    }
+    if (!respSend(cd->connfd, resp, NULL, 0))
+    {
+        return; // The client left, do not run the program for nobody.
+    }
 
-    pid_t to_wait = -1;
-    if ((to_wait = Fork()) == 0)
+    if (!cgi_cache)
+    {
+        // A pooled program answers from one of its running processes:
+        if (fcgi_pool && fcgiIsPooled(filename) && fcgiServe(fcgi_pool, filename, cgiargs, req->uri, cd->connfd, NULL))
+        {
+            return;
+        }
+        // When the CGI process writes to stdout, it will instead go to the socket.
+        pid_t to_wait = requestStartCgi(filename, cgiargs, cd->connfd);
+        if (to_wait > 0 && cgi_reaper)
+        {
+            cd->cgi_pid = to_wait; // The worker hands the connection to the reaper.
+        }
+        else if (to_wait > 0)
+        {
+            WaitPid(to_wait, NULL, 0);
+        }
+        return;
+    }
+    if (cgi_reaper && requestStartCgiCopy(cd, req))
     {
-        /* Child process */
-        Setenv("QUERY_STRING", cgiargs, 1);
-        /* When the CGI process writes to stdout, it will instead go to the socket */
-        Dup2(cd->connfd, STDOUT_FILENO);
-        Execve(filename, emptylist, environ);
+        return;
     }
-    WaitPid(to_wait, NULL, 0);
+    CgiOutput output;
+    cgiCacheOutputInit(cgi_cache, &output);
+    if (requestRunCgi(filename, cgiargs, req->uri, cd->connfd, &output) && !output.dropped)
+    {
+        cgiCacheStore(cgi_cache, filename, cgiargs, req->uri, &output);
+    }
+    cgiCacheOutputFree(&output);
 }
 
-void requestServeStatic(ConnectionStruct cd, ThreadStats t_stats, char *filename, int filesize)
+//
+// Builds the headers of a static response.
+//
+static void requestBuildStatic(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req, ResponseBuilder *resp)
+{
+    char filetype[MAXLINE];
+
+    respStatus(resp, requestProtocol(req), "200 OK");
+    if (req->cached)
+    {
+        int len = 0;
+        const char *headers = cacheEntryHeaders(req->cached, &len);
+        respAppend(resp, headers, len);
+    }
+    else
+    {
+        requestGetFiletype(req->filename, filetype);
+        respHeaderLong(resp, "Content-Length: ", req->filesize);
+        respHeader(resp, "Content-Type: ", filetype);
+    }
+    requestConnectionHeaders(cd, req, resp);
+    requestStatHeaders(cd, t_stats, REQUEST_STATIC, resp);
+    respEnd(resp);
+}
+
+int requestStaticHeaders(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req, char *buf)
+{
+    ResponseBuilder resp;
+    respInit(&resp, buf, MAXBUF);
+    requestBuildStatic(cd, t_stats, req, &resp);
+    return resp.len;
+}
+
+int requestOpenStatic(RequestInfo req)
+{
+    int fd = meta_cache ? metaOpen(meta_cache, req->filename) : open(req->filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        int error = errno;
+        if (meta_cache)
+        {
+            // The file went away (or changed) after the cached stat(), before the watcher told the cache:
+            metaInvalidate(meta_cache, req->filename);
+        }
+        if (error == ENOENT)
+        {
+            requestSetError(req, req->filename, "404", "Not found", "OS-HW3 Server could not find this file");
+        }
+        else
+        {
+            requestSetError(req, req->filename, "500", "Internal Server Error", "OS-HW3 Server could not open this file");
+        }
+        errno = error;
+    }
+    return fd;
+}
+
+bool requestZeroCopy(RequestInfo req)
+{
+    return server_config.zero_copy != ZERO_COPY_OFF && req->filesize > 0 &&
+           req->filesize >= (off_t)server_config.zero_copy_min_kb * 1024;
+}
+
+CacheEntry requestCacheAcquire(RequestInfo req)
+{
+    char filetype[MAXLINE];
+    if (!content_cache)
+    {
+        return NULL;
+    }
+    requestGetFiletype(req->filename, filetype);
+    req->cached = cacheAcquire(content_cache, req->filename, req->filesize, filetype);
+    return req->cached;
+}
+
+void requestServeStatic(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req)
 {
     int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
-
-    requestGetFiletype(filename, filetype);
-
-    srcfd = Open(filename, O_RDONLY, 0);
-
-    // Rather than call read() to read the file into memory,
-    // which would require that we allocate a buffer, we memory-map the file
-    srcp = (char *)Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
-    Close(srcfd);
-    
-    // put together response
-    unsigned long diff_time = ((cd->dispatch.tv_sec * 1000000) + cd->dispatch.tv_usec % 1000000) \
-                            - ((cd->arrival.tv_sec * 1000000) + cd->arrival.tv_usec % 1000000); // in miliseconds
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    sprintf(buf, "%sServer: OS-HW3 Web Server\r\n", buf);
-    sprintf(buf, "%sContent-Length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-Type: %s\r\n", buf, filetype);
-    sprintf(buf, "%s" STAT_REQ_ARRIVAL "%lu.%06lu\r\n", buf, (long unsigned)cd->arrival.tv_sec, cd->arrival.tv_usec);
-    sprintf(buf, "%s" STAT_REQ_DISPATCH "%lu.%06lu\r\n", buf, (diff_time / 1000000), (diff_time % 1000000));
-    sprintf(buf, "%s" STAT_THREAD_ID "%d\r\n", buf, t_stats->thread_id);
-    sprintf(buf, "%s" STAT_THREAD_COUNT "%d\r\n", buf, ++t_stats->thread_count);
-    sprintf(buf, "%s" STAT_THREAD_STATIC "%d\r\n", buf, ++t_stats->thread_static);
-    sprintf(buf, "%s" STAT_THREAD_DYNAMIC "%d\r\n\r\n", buf, t_stats->thread_dynamic);
-
-    Rio_writen(cd->connfd, buf, strlen(buf));
-
-    //  Writes out to the client socket the memory-mapped file
-    Rio_writen(cd->connfd, srcp, filesize);
-    Munmap(srcp, filesize);
+    char *srcp = NULL;
+    size_t filesize = req->filesize;
+    bool sent = false;
+    ResponseBuilder *resp = respThreadBuilder();
+
+    // A cached file is sent straight from memory:
+    CacheEntry cached = requestCacheAcquire(req);
+    if (cached)
+    {
+        size_t size = 0;
+        const char *data = cacheEntryData(cached, &size);
+        requestBuildStatic(cd, t_stats, req, resp);
+        sent = respSend(cd->connfd, resp, data, size);
+        cacheRelease(cached);
+        req->cached = NULL;
+    }
+    else
+    {
+        if ((srcfd = requestOpenStatic(req)) < 0)
+        {
+            requestError(cd, t_stats, req);
+            return;
+        }
+        requestBuildStatic(cd, t_stats, req, resp);
+        if (requestZeroCopy(req))
+        {
+            // A large file goes from the page cache to the socket, the headers wait for it (MSG_MORE):
+            sent = zcopySendMore(cd->connfd, resp->buf, resp->len) &&
+                   zcopySendAll(cd->connfd, srcfd, filesize, server_config.zero_copy);
+            Close(srcfd);
+            if (sent)
+            {
+                statsAddSent(resp->len + filesize);
+            }
+        }
+        else
+        {
+            // Rather than call read() to read the file into memory,
+            // which would require that we allocate a buffer, we memory-map the file
+            if (filesize > 0)
+            {
+                srcp = (char *)Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+            }
+            Close(srcfd);
+
+            // The headers and the memory-mapped file go out together
+            sent = respSend(cd->connfd, resp, srcp, filesize);
+            if (srcp)
+            {
+                Munmap(srcp, filesize);
+            }
+        }
+    }
+
+    if (!sent)
+    {
+        shutdown(cd->connfd, SHUT_RDWR); // Do not keep a connection with a cut response alive.
+    }
 }
 
-// handle a request
-void requestHandle(ConnectionStruct cd, ThreadStats t_stats)
+//
+// Builds the headers of a statistics response.
+//
+static void requestBuildStats(ConnectionStruct cd, RequestInfo req, size_t body_len, ResponseBuilder *resp)
+{
+    respStatus(resp, requestProtocol(req), "200 OK");
+    respHeaderLong(resp, "Content-Length: ", (long)body_len);
+    respHeader(resp, "Content-Type: ", statsContentType(req->uri));
+    respHeader(resp, "Cache-Control: ", "no-store");
+    requestConnectionHeaders(cd, req, resp);
+    respEnd(resp);
+}
+
+char* requestStatsBody(RequestInfo req, size_t *len)
+{
+    return statsRender(req->uri, len);
+}
+
+int requestStatsHeaders(ConnectionStruct cd, RequestInfo req, size_t body_len, char *buf)
+{
+    ResponseBuilder resp;
+    respInit(&resp, buf, MAXBUF);
+    requestBuildStats(cd, req, body_len, &resp);
+    return resp.len;
+}
+
+void requestServeStats(ConnectionStruct cd, RequestInfo req)
+{
+    size_t len = 0;
+    char *body = requestStatsBody(req, &len);
+    ResponseBuilder *resp = respThreadBuilder();
+    if (!body)
+    {
+        shutdown(cd->connfd, SHUT_RDWR);
+        return;
+    }
+    requestBuildStats(cd, req, len, resp);
+    if (!respSend(cd->connfd, resp, body, len))
+    {
+        shutdown(cd->connfd, SHUT_RDWR);
+    }
+    munmap(body, len);
+}
+
+static void requestSetError(RequestInfo req, const char *cause, const char *errnum,
+                            const char *shortmsg, const char *longmsg)
+{
+    req->kind = REQUEST_ERROR;
+    req->cause = cause;
+    req->errnum = errnum;
+    req->shortmsg = shortmsg;
+    req->longmsg = longmsg;
+}
+
+// look for the Connection header
+static void requestParseHeaderLine(const char *line, RequestInfo req)
+{
+    if (!strncasecmp(line, REQUEST_DEADLINE_HEADER, sizeof(REQUEST_DEADLINE_HEADER) - 1))
+    {
+        long deadline_ms = atol(line + sizeof(REQUEST_DEADLINE_HEADER) - 1);
+        req->deadline_ms = deadline_ms > 0 ? deadline_ms : 0;
+        return;
+    }
+    if (strncasecmp(line, "Connection:", 11))
+    {
+        return;
+    }
+    // A comma separated list of options, e.g. "Connection: keep-alive, Upgrade".
+    for (const char *token = line + 11; *token; token += strcspn(token, ","))
+    {
+        token += strspn(token, " \t,");
+        if (!strncasecmp(token, "close", 5))
+        {
+            req->keep_alive = false;
+        }
+        else if (!strncasecmp(token, "keep-alive", 10))
+        {
+            req->keep_alive = true;
+        }
+    }
+}
+
+// keep the connection only if both sides want it
+static void requestDecideKeepAlive(ConnectionStruct cd, RequestInfo req)
+{
+    bool rejected = req->kind == REQUEST_ERROR && req->cause == req->method; // Not a GET, may have a body.
+    req->keep_alive = req->keep_alive && !rejected && req->kind != REQUEST_DYNAMIC &&
+                      cd->conn_requests < server_config.keepalive_max;
+}
+
+void requestParseHeaders(ConnectionStruct cd, char *headers, RequestInfo req)
+{
+    char *save = NULL;
+    for (char *line = strtok_r(headers, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+    {
+        requestParseHeaderLine(line, req);
+    }
+    requestDecideKeepAlive(cd, req);
+}
+
+// parse a request line
+int requestHeadLength(const char *buf, int len)
+{
+    for(int i = 0; i < len; i++)
+    {
+        if(buf[i] != '\n')
+        {
+            continue;
+        }
+        // An empty line is "\n" or "\r\n" right after a '\n'.
+        if(i + 1 < len && buf[i + 1] == '\n')
+        {
+            return i + 2;
+        }
+        if(i + 2 < len && buf[i + 1] == '\r' && buf[i + 2] == '\n')
+        {
+            return i + 3;
+        }
+    }
+    return 0;
+}
+
+void requestParse(char *line, RequestInfo req)
 {
-    int is_static;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    int is_static;
 
-    Rio_readinitb(&rio, cd->connfd);
-    Rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, uri, version);
+    req->method[0] = req->uri[0] = req->version[0] = '\0';
+    req->filename[0] = req->cgiargs[0] = '\0';
+    req->filesize = 0;
+    req->cached = NULL;
+    req->deadline_ms = 0;
+    sscanf(line, "%31s %8191s %31s", req->method, req->uri, req->version);
+    req->keep_alive = !strcmp(req->version, "HTTP/1.1"); // Until a Connection header says otherwise.
 
-    printf("%s %s %s\n", method, uri, version);
+    printf("%s %s %s\n", req->method, req->uri, req->version);
 
-    if (strcasecmp(method, "GET"))
+    if (strcasecmp(req->method, "GET") || req->uri[0] == '\0')
+    {
+        requestSetError(req, req->method, "501", "Not Implemented", "OS-HW3 Server does not implement this method");
+        req->keep_alive = false; // The rest of the request is not read.
+        return;
+    }
+    if (statsIsRequest(req->uri))
     {
-        requestError(cd, t_stats, method, "501", "Not Implemented", "OS-HW3 Server does not implement this method");
+        req->kind = REQUEST_STATS;
         return;
     }
-    requestReadhdrs(&rio);
 
-    is_static = requestParseURI(uri, filename, cgiargs);
-    if (stat(filename, &sbuf) < 0)
+    is_static = requestParseURI(req->uri, req->filename, req->cgiargs);
+    if ((meta_cache ? metaStat(meta_cache, req->filename, &sbuf) : stat(req->filename, &sbuf)) < 0)
     {
-        requestError(cd, t_stats, filename, "404", "Not found", "OS-HW3 Server could not find this file");
+        requestSetError(req, req->filename, "404", "Not found", "OS-HW3 Server could not find this file");
         return;
     }
 
@@ -242,18 +793,158 @@ void requestHandle(ConnectionStruct cd, ThreadStats t_stats)
     {
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
         {
-            requestError(cd, t_stats, filename, "403", "Forbidden", "OS-HW3 Server could not read this file");
+            requestSetError(req, req->filename, "403", "Forbidden", "OS-HW3 Server could not read this file");
             return;
         }
-        requestServeStatic(cd, t_stats, filename, sbuf.st_size);
+        req->kind = REQUEST_STATIC;
+        req->filesize = sbuf.st_size;
     }
     else
     {
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode))
         {
-            requestError(cd, t_stats, filename, "403", "Forbidden", "OS-HW3 Server could not run this CGI program");
+            requestSetError(req, req->filename, "403", "Forbidden", "OS-HW3 Server could not run this CGI program");
             return;
         }
-        requestServeDynamic(cd, t_stats, filename, cgiargs);
+        req->kind = REQUEST_DYNAMIC;
     }
 }
+
+int requestPeek(ConnectionStruct cd, char *buf, int size)
+{
+    int len = 0;
+    if (cd->rio && cd->rio->rio_cnt > 0)
+    {
+        // Pipelined behind the previous request, already read from the socket.
+        len = cd->rio->rio_cnt < size - 1 ? cd->rio->rio_cnt : size - 1;
+        memcpy(buf, cd->rio->rio_bufptr, len);
+    }
+    else
+    {
+        len = recv(cd->connfd, buf, size - 1, MSG_PEEK | MSG_DONTWAIT);
+    }
+    if (len < 0)
+    {
+        len = 0;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+RequestKind requestClassify(const char *line, off_t *size)
+{
+    char method[REQUEST_METHOD_LEN], uri[MAXLINE], filename[MAXLINE], cgiargs[MAXLINE];
+    struct stat sbuf;
+
+    *size = 0;
+    if (sscanf(line, "%31s %8191s", method, uri) != 2 || strcasecmp(method, "GET"))
+    {
+        return REQUEST_ERROR;
+    }
+    int is_static = requestParseURI(uri, filename, cgiargs);
+    if ((meta_cache ? metaStat(meta_cache, filename, &sbuf) : stat(filename, &sbuf)) < 0)
+    {
+        return REQUEST_ERROR;
+    }
+    if (!is_static)
+    {
+        return REQUEST_DYNAMIC;
+    }
+    *size = sbuf.st_size;
+    return REQUEST_STATIC;
+}
+
+// answer a parsed request
+void requestServe(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req)
+{
+    switch (req->kind)
+    {
+    case REQUEST_STATIC:
+        requestServeStatic(cd, t_stats, req);
+        break;
+    case REQUEST_DYNAMIC:
+        requestServeDynamic(cd, t_stats, req);
+        break;
+    case REQUEST_STATS:
+        requestServeStats(cd, req);
+        break;
+    default:
+        requestError(cd, t_stats, req);
+        break;
+    }
+    if (cd->cgi_pid == 0)
+    {
+        latencyRecord(cd, req->kind); // Otherwise when the reaper finishes it.
+    }
+}
+
+/**
+ * Keep the bytes rio read past the current request (pipelined requests) in cd->rio
+ * for the next call of requestHandle(), or drop cd->rio once it is consumed.
+ */
+static void requestKeepBuffer(ConnectionStruct cd, rio_t *rio, bool keep_alive)
+{
+    if (!keep_alive || rio->rio_cnt == 0)
+    {
+        poolFreeBuffer(conn_pool, POOL_BUF_RIO, cd->rio);
+        cd->rio = NULL;
+        return;
+    }
+    if (cd->rio == rio)
+    {
+        return;
+    }
+    if (!(cd->rio = poolAllocBuffer(conn_pool, POOL_BUF_RIO)))
+    {
+        return; // The pipelined requests are lost, the client will time out on them.
+    }
+    *cd->rio = *rio;
+    cd->rio->rio_bufptr = cd->rio->rio_buf + (rio->rio_bufptr - rio->rio_buf);
+}
+
+// handle a request
+bool requestHandle(ConnectionStruct cd, ThreadStats t_stats)
+{
+    char buf[MAXLINE];
+    struct request_info req;
+    rio_t local_rio;
+    rio_t *rio = cd->rio;
+
+    if (cd->request)
+    {
+        requestServe(cd, t_stats, cd->request);
+        return cd->request->keep_alive;
+    }
+
+    if (!rio)
+    {
+        rio = &local_rio;
+        Rio_readinitb(rio, cd->connfd);
+    }
+    if (rio_readlineb(rio, buf, MAXLINE) <= 0)
+    {
+        return false; // The client left without sending a request (e.g. a kept-alive connection).
+    }
+    requestParse(buf, &req);
+
+    if (req.kind == REQUEST_ERROR && req.cause == req.method)
+    {
+        // Not a GET, do not bother reading the headers.
+        requestError(cd, t_stats, &req);
+        latencyRecord(cd, REQUEST_ERROR);
+        return false;
+    }
+    if (!requestReadhdrs(rio, &req))
+    {
+        return false;
+    }
+    requestDecideKeepAlive(cd, &req);
+    requestKeepBuffer(cd, rio, req.keep_alive);
+    requestServe(cd, t_stats, &req);
+    return req.keep_alive;
+}
+
+bool requestPipelined(ConnectionStruct cd)
+{
+    return cd->rio && requestHeadLength(cd->rio->rio_bufptr, cd->rio->rio_cnt) > 0;
+}
@@ -2,7 +2,146 @@
 #define __REQUEST_H__
 
 #include "connection.h"
+#include "cache.h"
+#include "cgicache.h"
+#include "response.h"
 
-void requestHandle(ConnectionStruct cd, ThreadStats t_stats);
+#define REQUEST_METHOD_LEN 32
+#define REQUEST_ERROR_BUFSIZE RESPONSE_BUFSIZE // Room for a whole error response.
+#define REQUEST_DEADLINE_HEADER "X-Request-Deadline:" // Milliseconds the client waits for the response.
+
+typedef enum RequestKind_t
+{
+    REQUEST_STATIC = 0,
+    REQUEST_DYNAMIC,
+    REQUEST_ERROR,
+    REQUEST_STATS    // GET STATS_PATH, see stats.h.
+} RequestKind;
+
+// A request line that was already parsed and checked against the file system.
+// It tells how the request is to be answered, so that engines that do their own
+// I/O (e.g. the event loop) can reuse the parsing and the response formatting.
+typedef struct request_info
+{
+    RequestKind kind;
+    char method[REQUEST_METHOD_LEN];
+    char version[REQUEST_METHOD_LEN];
+    char uri[MAXLINE];
+    char filename[MAXLINE];
+    char cgiargs[MAXLINE];
+    off_t filesize;        // REQUEST_STATIC only.
+    CacheEntry cached;     // REQUEST_STATIC only: the file in the content cache, see requestCacheAcquire().
+    bool keep_alive;       // Wait for another request on the connection after this response.
+    long deadline_ms;      // Given by REQUEST_DEADLINE_HEADER, 0 if not.
+    // REQUEST_ERROR only:
+    const char *errnum;
+    const char *shortmsg;
+    const char *longmsg;
+    const char *cause;     // Points into this struct (method or filename).
+} *RequestInfo;
+
+/**
+ * Read one request from cd->connfd and answer it (blocking).
+ * If cd->request is set, the request was already read and parsed (e.g. by
+ * the event loop) and only the answer is written.
+ * Bytes read past the request are kept in cd->rio for the next call (pipelining).
+ * Return true if the connection is kept alive for another request, false if it is to be closed.
+ */
+bool requestHandle(ConnectionStruct cd, ThreadStats t_stats);
+
+/**
+ * Return true if the client already sent a whole next request on cd (pipelining),
+ * so requestHandle() answers it without waiting.
+ */
+bool requestPipelined(ConnectionStruct cd);
+
+/**
+ * Return the length of the request head in buf (up to and including the empty line),
+ * or 0 if the head is not complete yet.
+ */
+int requestHeadLength(const char *buf, int len);
+
+/**
+ * Parse a request line ("GET /uri HTTP/1.x") into req and decide how to answer it.
+ */
+void requestParse(char *line, RequestInfo req);
+
+/**
+ * Copy into buf (size bytes, NUL terminated) what the client already sent on cd and the next
+ * requestHandle() reads first, without consuming it and without waiting for more.
+ * Return its length, 0 if nothing arrived yet or the client closed the connection.
+ */
+int requestPeek(ConnectionStruct cd, char *buf, int size);
+
+/**
+ * Classify a request line without answering it (nothing is printed or counted): return
+ * its kind, and set size to the size of its file if it is static (0 otherwise).
+ */
+RequestKind requestClassify(const char *line, off_t *size);
+
+/**
+ * Parse the header lines of a request (after requestParse() of its request line) and
+ * decide req->keep_alive: the client asks for it (HTTP/1.1, or a Connection header),
+ * the response has a known length and cd did not reach the --keepalive limit.
+ * headers is modified.
+ */
+void requestParseHeaders(ConnectionStruct cd, char *headers, RequestInfo req);
+
+/**
+ * Answer a parsed request on cd->connfd (blocking).
+ */
+void requestServe(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req);
+
+/**
+ * Look the file of a static request up in the content cache (loading it on a miss), and keep
+ * the entry in req->cached so requestStaticHeaders() uses its precomputed headers.
+ * Return the entry, to be released with cacheRelease(), or NULL to serve the file from disk.
+ */
+CacheEntry requestCacheAcquire(RequestInfo req);
+
+/**
+ * Open the file of a static request (read only, close on exec), through the metadata cache
+ * (see meta.h) when it is on. Return the descriptor, or -1 and set errno: then req is turned
+ * into the error to answer instead (404 if the file is gone, 500 otherwise), and the path is
+ * dropped from the metadata cache.
+ */
+int requestOpenStatic(RequestInfo req);
+
+/**
+ * Return true if the file of a static request (not in the content cache) is large enough
+ * to be sent with zero copy (--zero-copy, --zero-copy-min), see zerocopy.h.
+ */
+bool requestZeroCopy(RequestInfo req);
+
+/**
+ * Run the CGI program at filename with cgiargs for a refresh of the CGI response cache (see
+ * cgicache.h), collecting its output into output only. Return false if it could not be run.
+ */
+bool requestRefreshCgi(const char *filename, const char *cgiargs, const char *uri, CgiOutput *output);
+
+/**
+ * Format the status line and headers of a static response into buf (at least MAXBUF bytes).
+ * Return the length of the formatted headers.
+ */
+int requestStaticHeaders(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req, char *buf);
+
+/**
+ * Format the statistics a REQUEST_STATS asks for (see statsRender()).
+ * Return the body, to be released with munmap(), and set len to its length, or NULL on failure.
+ */
+char* requestStatsBody(RequestInfo req, size_t *len);
+
+/**
+ * Format the status line and headers of a statistics response with a body of body_len bytes
+ * into buf (at least MAXBUF bytes). Return the length of the formatted headers.
+ * The statistics are not requests of the workload: they are not counted and get no Stat-* headers.
+ */
+int requestStatsHeaders(ConnectionStruct cd, RequestInfo req, size_t body_len, char *buf);
+
+/**
+ * Format a whole error response (headers and body) for req into buf (at least REQUEST_ERROR_BUFSIZE bytes).
+ * Return the length of the response.
+ */
+int requestErrorResponse(ConnectionStruct cd, ThreadStats t_stats, RequestInfo req, char *buf);
 
 #endif
@@ -0,0 +1,145 @@
+#include "response.h"
+#include "stats.h"
+#include <sys/uio.h>
+
+#define RESP_SERVER_LINE "Server: OS-HW3 Web Server\r\n"
+#define RESP_DATE_LEN 64
+
+static __thread char resp_thread_buf[RESPONSE_BUFSIZE];
+static __thread ResponseBuilder resp_thread_builder;
+// The Date header of the current second, formatted by this thread:
+static __thread time_t resp_date_sec = -1;
+static __thread char resp_date_line[RESP_DATE_LEN];
+static __thread int resp_date_len;
+
+void respInit(ResponseBuilder *resp, char *buf, int cap)
+{
+    resp->buf = buf;
+    resp->len = 0;
+    resp->cap = cap;
+    resp->truncated = false;
+    buf[0] = '\0';
+}
+
+ResponseBuilder* respThreadBuilder()
+{
+    respInit(&resp_thread_builder, resp_thread_buf, sizeof(resp_thread_buf));
+    return &resp_thread_builder;
+}
+
+void respAppend(ResponseBuilder *resp, const char *text, int len)
+{
+    if(resp->len + len >= resp->cap) // Keep room for the terminating '\0'.
+    {
+        resp->truncated = true;
+        len = resp->cap - 1 - resp->len;
+    }
+    memcpy(resp->buf + resp->len, text, len);
+    resp->len += len;
+    resp->buf[resp->len] = '\0';
+}
+
+void respAppendNumber(ResponseBuilder *resp, unsigned long long value, int min_digits)
+{
+    char digits[24];
+    int pos = sizeof(digits);
+    do
+    {
+        digits[--pos] = '0' + value % 10;
+        value /= 10;
+        min_digits--;
+    } while(value > 0 || min_digits > 0);
+    respAppend(resp, digits + pos, sizeof(digits) - pos);
+}
+
+static void respDate(ResponseBuilder *resp)
+{
+    time_t now = time(NULL);
+    if(now != resp_date_sec)
+    {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        resp_date_len = strftime(resp_date_line, sizeof(resp_date_line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        resp_date_sec = now;
+    }
+    respAppend(resp, resp_date_line, resp_date_len);
+}
+
+void respStatus(ResponseBuilder *resp, const char *protocol, const char *status)
+{
+    respAppend(resp, protocol, strlen(protocol));
+    respAppend(resp, " ", 1);
+    respAppend(resp, status, strlen(status));
+    respAppend(resp, "\r\n" RESP_SERVER_LINE, sizeof("\r\n" RESP_SERVER_LINE) - 1);
+    respDate(resp);
+}
+
+void respHeader(ResponseBuilder *resp, const char *name, const char *value)
+{
+    respAppend(resp, name, strlen(name));
+    respAppend(resp, value, strlen(value));
+    respAppend(resp, "\r\n", 2);
+}
+
+void respHeaderLong(ResponseBuilder *resp, const char *name, long long value)
+{
+    respAppend(resp, name, strlen(name));
+    if(value < 0)
+    {
+        respAppend(resp, "-", 1);
+        value = -value;
+    }
+    respAppendNumber(resp, value, 1);
+    respAppend(resp, "\r\n", 2);
+}
+
+void respHeaderTime(ResponseBuilder *resp, const char *name, unsigned long sec, unsigned long usec)
+{
+    respAppend(resp, name, strlen(name));
+    respAppendNumber(resp, sec, 1);
+    respAppend(resp, ".", 1);
+    respAppendNumber(resp, usec, 6);
+    respAppend(resp, "\r\n", 2);
+}
+
+int respEnd(ResponseBuilder *resp)
+{
+    respAppend(resp, "\r\n", 2);
+    return resp->len;
+}
+
+bool respSend(int fd, ResponseBuilder *resp, const char *body, size_t body_len)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    iov[0].iov_base = resp->buf;
+    iov[0].iov_len = resp->len;
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = body ? body_len : 0;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    while(iov[0].iov_len + iov[1].iov_len > 0)
+    {
+        // sendmsg() is writev() with flags: a client that left must not raise SIGPIPE.
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(sent <= 0)
+        {
+            return false;
+        }
+        statsAddSent(sent);
+        for(int i = 0; i < 2; i++)
+        {
+            size_t step = (size_t)sent < iov[i].iov_len ? (size_t)sent : iov[i].iov_len;
+            iov[i].iov_base = (char *)iov[i].iov_base + step;
+            iov[i].iov_len -= step;
+            sent -= step;
+        }
+    }
+    return true;
+}
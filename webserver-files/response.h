@@ -0,0 +1,75 @@
+#ifndef _RESPONSE_INC
+#define _RESPONSE_INC
+
+#include "segel.h"
+#include <stdbool.h>
+
+#define RESPONSE_BUFSIZE (2 * MAXBUF) // Room for the headers and a small body (e.g. an error page).
+
+// ********** Response Builder ********** //
+// Appends the status line and the headers of a response into a buffer, each piece
+// copied once at the end of what is already there (no "%s" of the buffer into itself).
+// The status line comes with the constant Server header and a Date header that every
+// thread formats once per second. A response is then sent with its body in one
+// gather write. What does not fit is dropped and marks the builder truncated.
+typedef struct response_builder
+{
+    char *buf;
+    int len;
+    int cap;
+    bool truncated;
+} ResponseBuilder;
+
+/**
+ * Start building into buf of cap bytes.
+ */
+void respInit(ResponseBuilder *resp, char *buf, int cap);
+
+/**
+ * Return the builder of the calling thread, emptied, over a buffer of RESPONSE_BUFSIZE bytes.
+ * It is reused by the next call on the same thread.
+ */
+ResponseBuilder* respThreadBuilder();
+
+/**
+ * Append the status line (e.g. "HTTP/1.1", "200 OK"), then the Server and Date headers.
+ */
+void respStatus(ResponseBuilder *resp, const char *protocol, const char *status);
+
+/**
+ * Append len bytes of text as they are (e.g. precomputed header lines).
+ */
+void respAppend(ResponseBuilder *resp, const char *text, int len);
+
+/**
+ * Append value in decimal, padded with zeros to at least min_digits.
+ */
+void respAppendNumber(ResponseBuilder *resp, unsigned long long value, int min_digits);
+
+/**
+ * Append "name: value\r\n". name already ends with its separator, e.g. "Content-Type: ".
+ */
+void respHeader(ResponseBuilder *resp, const char *name, const char *value);
+
+/**
+ * Append "name<value>\r\n" with value in decimal.
+ */
+void respHeaderLong(ResponseBuilder *resp, const char *name, long long value);
+
+/**
+ * Append "name<sec>.<usec, 6 digits>\r\n".
+ */
+void respHeaderTime(ResponseBuilder *resp, const char *name, unsigned long sec, unsigned long usec);
+
+/**
+ * Append the empty line that ends the headers. Return the length of the headers.
+ */
+int respEnd(ResponseBuilder *resp);
+
+/**
+ * Send the built headers and then body_len bytes of body (may be NULL) to the blocking socket fd,
+ * in one system call unless the socket takes less. Return false if the connection broke.
+ */
+bool respSend(int fd, ResponseBuilder *resp, const char *body, size_t body_len);
+
+#endif
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE // sched_getaffinity
+#include "scale.h"
+#include "timing.h"
+#include <stdatomic.h>
+#include <sched.h>
+#include <math.h>
+
+#define SCALE_SAMPLE_MS 25       // The requests in service are sampled this often...
+#define SCALE_SAMPLES 10         // ...and the pool is resized at most once per this many samples.
+#define SCALE_PERIOD_MS (SCALE_SAMPLE_MS * SCALE_SAMPLES)
+#define SCALE_TARGET_UTIL 0.75   // Grow to keep the busy workers at this share of the pool.
+#define SCALE_FULL_UTIL 0.9      // Requests queue behind a pool this busy: grow even under the target delay.
+#define SCALE_IDLE_UTIL 0.5      // A period under this (and with no queue) is calm.
+#define SCALE_CALM_PERIODS 8     // Shrink after this many calm periods in a row.
+
+struct scaler
+{
+    pthread_mutex_t lock;   // Guards active for the parked workers, and the resizes.
+    pthread_cond_t resized; // The parked workers wait on it.
+    pthread_t thread;
+    Dispatcher dispatcher;
+    atomic_int active;
+    int min;
+    int max;
+    long long target_us;
+    int calm_periods;
+    // Updated by the workers, taken by the controller every period:
+    atomic_int busy;
+    atomic_long dispatched;
+    atomic_long wait_us;
+    atomic_long completed;
+    atomic_long service_us;
+    // Written by the controller:
+    atomic_long grows;
+    atomic_long shrinks;
+    atomic_long last_delay_us;
+    atomic_int last_utilization_pct;
+    _Atomic double last_needed;
+};
+
+static long long scaleNow()
+{
+    return timingNow() / TIMING_NS_PER_US;
+}
+
+/**
+ * Read the first two numbers of path into first and second (second may be NULL).
+ * Return the number of values read, or 0 if path is missing. "max" reads as -1.
+ */
+static int scaleReadValues(const char *path, long *first, long *second)
+{
+    FILE *file = fopen(path, "r");
+    if(!file)
+    {
+        return 0;
+    }
+    char buf[64] = {0};
+    int res = 0;
+    if(fgets(buf, sizeof(buf), file))
+    {
+        char *end = buf;
+        if(!strncmp(buf, "max", 3))
+        {
+            *first = -1; // No limit.
+            end += 3;
+        }
+        else
+        {
+            *first = strtol(buf, &end, 10);
+        }
+        res = end != buf;
+        if(res && second)
+        {
+            char *next = end;
+            *second = strtol(end, &next, 10);
+            res += next != end;
+        }
+    }
+    fclose(file);
+    return res;
+}
+
+int scaleCpuQuota()
+{
+    int cpus = 1;
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        cpus = CPU_COUNT(&set);
+    }
+
+    long quota = -1, period = 0;
+    if(scaleReadValues("/sys/fs/cgroup/cpu.max", &quota, &period) != 2)
+    {
+        // cgroup v1:
+        quota = -1;
+        if(scaleReadValues("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", &quota, NULL) != 1 ||
+           scaleReadValues("/sys/fs/cgroup/cpu/cpu.cfs_period_us", &period, NULL) != 1)
+        {
+            quota = -1;
+        }
+    }
+    if(quota > 0 && period > 0)
+    {
+        int quota_cpus = (int)((quota + period - 1) / period);
+        cpus = quota_cpus < cpus ? quota_cpus : cpus;
+    }
+    return cpus > 0 ? cpus : 1;
+}
+
+/**
+ * Set the number of active workers to new_active, and wake the parked ones it includes.
+ */
+static void scaleResize(Scaler scaler, int new_active, long long delay_us, int utilization_pct, double needed)
+{
+    int old_active = atomic_load(&scaler->active);
+    pthread_mutex_lock(&scaler->lock);
+    // <CRITICAL>
+    atomic_store(&scaler->active, new_active);
+    dispatchSetActive(scaler->dispatcher, new_active);
+    pthread_cond_broadcast(&scaler->resized);
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&scaler->lock);
+
+    atomic_fetch_add(new_active > old_active ? &scaler->grows : &scaler->shrinks, 1);
+    fprintf(stderr, "Autoscale: %d -> %d workers (queue delay %.1f ms, utilization %d%%, %.1f busy by Little's law)\n",
+            old_active, new_active, delay_us / 1000.0, utilization_pct, needed);
+}
+
+/**
+ * Decide the size of the pool from the last period. Only the controller thread calls it.
+ */
+static void scaleControl(Scaler scaler, double busy_samples)
+{
+    long dispatched = atomic_exchange(&scaler->dispatched, 0);
+    long wait_us = atomic_exchange(&scaler->wait_us, 0);
+    long completed = atomic_exchange(&scaler->completed, 0);
+    long service_us = atomic_exchange(&scaler->service_us, 0);
+    int active = atomic_load(&scaler->active);
+    int queued = dispatchGetSize(scaler->dispatcher);
+
+    // Little's law: the requests in service are the dispatch rate times the mean service time.
+    // The samples also see the requests that did not complete in the period (e.g. slow CGI programs).
+    double rate = dispatched / (SCALE_PERIOD_MS / 1000.0);
+    double needed = completed ? rate * (service_us / (double)completed) / 1000000.0 : 0;
+    needed = busy_samples > needed ? busy_samples : needed;
+    double utilization = needed / active;
+    long long delay_us = dispatched ? wait_us / dispatched : 0;
+
+    atomic_store(&scaler->last_delay_us, delay_us);
+    atomic_store(&scaler->last_utilization_pct, (int)(utilization * 100));
+    atomic_store(&scaler->last_needed, needed);
+
+    int target = (int)ceil(needed / SCALE_TARGET_UTIL);
+    int new_active = active;
+    if(delay_us > scaler->target_us || (queued > 0 && utilization >= SCALE_FULL_UTIL))
+    {
+        int step = active / 4 > 1 ? active / 4 : 1;
+        new_active = target > active + step ? target : active + step;
+        scaler->calm_periods = 0;
+    }
+    else if(queued == 0 && delay_us < scaler->target_us / 2 && utilization < SCALE_IDLE_UTIL)
+    {
+        if(++scaler->calm_periods >= SCALE_CALM_PERIODS)
+        {
+            int step = active / 8 > 1 ? active / 8 : 1;
+            new_active = target > active - step ? target : active - step;
+            scaler->calm_periods = 0;
+        }
+    }
+    else
+    {
+        scaler->calm_periods = 0;
+    }
+
+    new_active = new_active < scaler->min ? scaler->min : new_active > scaler->max ? scaler->max : new_active;
+    if(new_active != active)
+    {
+        scaleResize(scaler, new_active, delay_us, (int)(utilization * 100), needed);
+    }
+}
+
+static void* scaleThread(void *arg)
+{
+    Scaler scaler = (Scaler)arg;
+    struct timespec sample = {0, SCALE_SAMPLE_MS * 1000000L};
+    while(1)
+    {
+        long busy_sum = 0;
+        for(int i = 0; i < SCALE_SAMPLES; i++)
+        {
+            nanosleep(&sample, NULL);
+            busy_sum += atomic_load_explicit(&scaler->busy, memory_order_relaxed);
+        }
+        scaleControl(scaler, (double)busy_sum / SCALE_SAMPLES);
+    }
+    return NULL;
+}
+
+Scaler scaleCreate(Dispatcher dispatcher, int initial, int min, int max, int target_ms)
+{
+    Scaler scaler = calloc(1, sizeof(*scaler));
+    if(!scaler)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&scaler->lock, NULL);
+    pthread_cond_init(&scaler->resized, NULL);
+    scaler->dispatcher = dispatcher;
+    scaler->min = min;
+    scaler->max = max;
+    scaler->target_us = (long long)target_ms * 1000;
+    atomic_init(&scaler->active, initial);
+    dispatchSetActive(dispatcher, initial);
+    if(pthread_create(&scaler->thread, NULL, scaleThread, scaler) != 0)
+    {
+        free(scaler);
+        return NULL;
+    }
+    return scaler;
+}
+
+void scaleWaitActive(Scaler scaler, int worker_id)
+{
+    if(worker_id < atomic_load_explicit(&scaler->active, memory_order_relaxed))
+    {
+        return;
+    }
+    pthread_mutex_lock(&scaler->lock);
+    // <CRITICAL>
+    while(worker_id >= atomic_load(&scaler->active))
+    {
+        pthread_cond_wait(&scaler->resized, &scaler->lock);
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&scaler->lock);
+}
+
+long long scaleBegin(Scaler scaler, ConnectionStruct cd)
+{
+    long long dispatch_us = cd->dispatch_ns / TIMING_NS_PER_US;
+    atomic_fetch_add_explicit(&scaler->busy, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&scaler->dispatched, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&scaler->wait_us, dispatch_us - cd->arrival_ns / TIMING_NS_PER_US, memory_order_relaxed);
+    return dispatch_us;
+}
+
+void scaleEnd(Scaler scaler, long long begin_us)
+{
+    atomic_fetch_sub_explicit(&scaler->busy, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&scaler->completed, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&scaler->service_us, scaleNow() - begin_us, memory_order_relaxed);
+}
+
+void scaleGetStats(Scaler scaler, ScaleStats *stats)
+{
+    stats->active = atomic_load(&scaler->active);
+    stats->min = scaler->min;
+    stats->max = scaler->max;
+    stats->busy = atomic_load_explicit(&scaler->busy, memory_order_relaxed);
+    stats->grows = atomic_load(&scaler->grows);
+    stats->shrinks = atomic_load(&scaler->shrinks);
+    stats->queue_delay_us = atomic_load(&scaler->last_delay_us);
+    stats->utilization_pct = atomic_load(&scaler->last_utilization_pct);
+    stats->needed = atomic_load(&scaler->last_needed);
+}
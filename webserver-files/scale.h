@@ -0,0 +1,72 @@
+#ifndef _SCALE_INC
+#define _SCALE_INC
+
+#include "connection.h"
+#include "dispatch.h"
+
+// ********** Worker Pool Autoscaling ********** //
+// With --autoscale=on the number of active worker threads follows the load between
+// --threads-min and --threads-max. All the threads up to the maximum are created at start,
+// the ones beyond the active count park until the pool grows back to them.
+// A controller thread looks at the last SCALE_PERIOD_MS:
+//  - the queueing delay of the dispatched requests (arrival to dispatch),
+//  - the number of requests in service, sampled, and by Little's law (dispatch rate times the
+//    mean service time): the workers that the load keeps busy,
+// and grows the pool to keep them at about SCALE_TARGET_UTIL of it once requests wait for
+// longer than --autoscale-target, or shrinks it after SCALE_CALM_PERIODS quiet periods.
+// Every resize is logged to stderr and counted in ScaleStats.
+typedef struct scaler* Scaler;
+
+#define SCALE_THREADS_PER_CPU 4 // Default --threads-max: the workers also wait for CGI programs.
+
+typedef struct scale_stats
+{
+    int active;          // Workers taking requests.
+    int min;
+    int max;
+    int busy;            // Requests in service right now.
+    long grows;          // Resizes up.
+    long shrinks;        // Resizes down.
+    long queue_delay_us; // Mean wait of the requests dispatched in the last period.
+    int utilization_pct; // Busy share of the active workers in the last period.
+    double needed;       // Busy workers by Little's law in the last period.
+} ScaleStats;
+
+// The controller of the worker pool, NULL unless --autoscale=on.
+extern Scaler scaler;
+
+/**
+ * Return the number of CPUs this process may use: its affinity mask, capped by the CPU quota
+ * of its cgroup (v2 cpu.max or v1 cpu.cfs_quota_us), rounded up. At least 1.
+ */
+int scaleCpuQuota();
+
+/**
+ * Create the controller of max worker threads, initial of them active, and start its thread.
+ * The requests are placed on the active workers of dispatcher only.
+ * Return NULL on failure.
+ */
+Scaler scaleCreate(Dispatcher dispatcher, int initial, int min, int max, int target_ms);
+
+/**
+ * Park the calling worker while worker_id is not active. Returns at once otherwise.
+ */
+void scaleWaitActive(Scaler scaler, int worker_id);
+
+/**
+ * Count cd, just dispatched (cd->arrival and cd->dispatch are set), as in service.
+ * Return the start of its service, to be passed to scaleEnd().
+ */
+long long scaleBegin(Scaler scaler, ConnectionStruct cd);
+
+/**
+ * Count the request that started its service at begin_us as done.
+ */
+void scaleEnd(Scaler scaler, long long begin_us);
+
+/**
+ * Fill stats with a snapshot of the pool and of the last control period.
+ */
+void scaleGetStats(Scaler scaler, ScaleStats *stats);
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4
 #include "segel.h"
 
 /************************** 
@@ -220,7 +221,8 @@ int Accept(int s, struct sockaddr *addr, socklen_t *addrlen)
 {
     int rc;
 
-    if ((rc = accept(s, addr, addrlen)) < 0)
+    /* Server sockets are close-on-exec, CGI programs must not inherit them */
+    if ((rc = accept4(s, addr, addrlen, SOCK_CLOEXEC)) < 0)
         unix_error("Accept error");
     return rc;
 }
@@ -507,7 +509,7 @@ int open_listenfd(int port)
     struct sockaddr_in serveraddr;
   
     /* Create a socket descriptor */
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    if ((listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
       fprintf(stderr, "socket failed\n");
       return -1;
     }
@@ -1,6 +1,30 @@
 #include "segel.h"
 #include "request.h"
 #include "connection.h"
+#include "server.h"
+#include "dispatch.h"
+#include "config.h"
+#include "inflight.h"
+#include "pool.h"
+#include "evloop.h"
+#include "uring.h"
+#include "idle.h"
+#include "cache.h"
+#include "cgicache.h"
+#include "meta.h"
+#include "watch.h"
+#include "fcgi.h"
+#include "reaper.h"
+#include "codel.h"
+#include "sjf.h"
+#include "edf.h"
+#include "scale.h"
+#include "affinity.h"
+#include "stats.h"
+#include "latency.h"
+#include "timing.h"
+#include <stdatomic.h>
+#include <netinet/tcp.h>
 
 #define MIN_PORT 1025
 #define POLICY_POS 4
@@ -19,14 +43,67 @@
 // ******************************************//
 // Global mutex lock and condition variables:
 pthread_mutex_t global_m;
-pthread_cond_t  cond;
 pthread_cond_t  cond_policy;
 // ******************************************//
+// Admission counters (no lock needed):
+// in_system:      Requests admitted and not finished yet (waiting + in flight).
+//                 Incremented by the acceptor, decremented when a request completes or is dropped.
+// policy_waiting: How many wait for room: the acceptor while it sleeps on cond_policy, and the
+//                 queued RoomWaiters. Completing workers only take global_m when it is not 0.
+atomic_int      in_system;
+atomic_int      policy_waiting;
+// The event loops waiting for room, first come first served (under global_m):
+RoomWaiter*     room_waiters_head = NULL;
+RoomWaiter*     room_waiters_tail = NULL;
+// ******************************************//
+// Pool of the ConnectionStruct records and of their request buffers, so no request calls malloc/free:
+ConnPool        conn_pool;
+atomic_int      next_job_id;
+// ******************************************//
+// Kept-alive connections of the worker threads wait here for their next request
+// (NULL if keep-alive is off, the event loops keep their idle connections themselves):
+IdleWatcher     idle_watcher = NULL;
+// ******************************************//
+// The hot static files, kept in memory (NULL if --cache=0):
+ContentCache    content_cache = NULL;
+// The stat() results of the requested paths, and their open files (NULL if --meta-cache=0):
+MetaCache       meta_cache = NULL;
+// Tells the caches which files under ./public changed:
+FileWatcher     file_watcher = NULL;
+// The long-lived processes of the *.fcgi programs (NULL if --cgi-pool=0):
+FcgiPool        fcgi_pool = NULL;
+// The outputs of the CGI programs, by program and query (NULL if --cgi-cache=0):
+CgiCache        cgi_cache = NULL;
+// Waits for the running CGI programs instead of the workers (NULL if --cgi-async=off):
+CgiReaper       cgi_reaper = NULL;
+// The queueing delay state of the codel schedalg (NULL for the other ones):
+Codel           codel = NULL;
+// Classifies the requests and keeps their latency per class (NULL unless --dispatch=sjf):
+Sjf             sjf = NULL;
+// Gives the requests their deadlines and counts the expired ones (NULL unless --dispatch=edf):
+Edf             edf = NULL;
+// Resizes the worker pool by load (NULL unless --autoscale=on):
+Scaler          scaler = NULL;
+// The CPUs and NUMA nodes of the worker threads (NULL unless --affinity is set):
+Affinity        affinity = NULL;
+// ******************************************//
+// Everything needed to admit a request, shared by the acceptor and the event loops:
+typedef struct admission
+{
+    Dispatcher to_do_queue;
+    InflightTable busy_table;
+    int q_size;
+    int workers;
+    bool skip_flag;
+    void (*overloadPolicy)(Dispatcher, InflightTable, int, ConnectionStruct, bool*);
+} Admission;
+static Admission admission;
+// ******************************************//
 // Struct to pass arguments to the thread_do_work routine handler:
 typedef struct thread_args
 {
-    ConnectionList to_do_list;
-    ConnectionList busy_list;
+    Dispatcher to_do_queue;
+    InflightTable busy_table;
     int thread_id;
 } ThreadArgs;
 
@@ -34,24 +111,30 @@ typedef struct thread_args
 
 void checkValidity(int port, int threads_num, int queue_size, char *argv[]);
 void* threadDoWork(void* args);
-void blockPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, ConnectionStruct cd, bool* skip_full_flag);
-void dhPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, ConnectionStruct cd, bool* skip_full_flag);
-void dtPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, ConnectionStruct cd, bool* skip_full_flag);
-void randomPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, ConnectionStruct cd, bool* skip_full_flag);
+void blockPolicy(Dispatcher to_do_queue, InflightTable busy_table, int q_size, ConnectionStruct cd, bool* skip_full_flag);
+void dhPolicy(Dispatcher to_do_queue, InflightTable busy_table, int q_size, ConnectionStruct cd, bool* skip_full_flag);
+void dtPolicy(Dispatcher to_do_queue, InflightTable busy_table, int q_size, ConnectionStruct cd, bool* skip_full_flag);
+void randomPolicy(Dispatcher to_do_queue, InflightTable busy_table, int q_size, ConnectionStruct cd, bool* skip_full_flag);
 
-static int randInt(int max);
 static int myCeil(double num);
+static bool admitRequest(int q_size);
+static void releaseRequest();
+static void dropRequest(ConnectionStruct cd, StatsDrop reason);
+static void serverSetCork(int fd, bool cork);
+static void* serverWaitExit(void* args);
 
 void getargs(int *port, int *threads_num, int *q_size, int argc, char *argv[])
 {
     if (argc < 5) 
     {
-        fprintf(stderr, "Usage: %s <port> <threads> <queue-size> <schedalg>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <port> <threads> <queue-size> <schedalg> [--option=value ...]\n", argv[0]);
+        configPrintUsage(stderr);
         exit(1);
     }
     *port = atoi(argv[1]);
     *threads_num = atoi(argv[2]);
     *q_size = atoi(argv[3]);
+    configParseOptions(argc, argv, POLICY_POS + 1);
 }
 
 void checkValidity(int port, int threads_num, int queue_size, char *argv[])
@@ -72,26 +155,220 @@ void checkValidity(int port, int threads_num, int queue_size, char *argv[])
         exit(1);
     }
     if(strcmp(argv[POLICY_POS], "block") && strcmp(argv[POLICY_POS], "dt") \
-    && strcmp(argv[POLICY_POS], "dh") && strcmp(argv[POLICY_POS], "random"))
+    && strcmp(argv[POLICY_POS], "dh") && strcmp(argv[POLICY_POS], "random") && strcmp(argv[POLICY_POS], "codel"))
     {
-        fprintf(stderr, "Error: schedalg must be one of the following: block|dt|dh|random\n");
+        fprintf(stderr, "Error: schedalg must be one of the following: block|dt|dh|random|codel\n");
         exit(1);
     }
 }
 
 
+ConnectionStruct serverNewRequest(int connfd)
+{
+    ConnectionStruct cd = poolAlloc(conn_pool);
+    if(!cd)
+    {
+        return NULL;
+    }
+    cd->job_id = atomic_fetch_add(&next_job_id, 1);
+    cd->connfd = connfd;
+    cd->conn_requests = 1;
+    cd->request = NULL;
+    cd->rio = NULL;
+    cd->cgi_pid = 0;
+    cd->cgi_pipe = -1;
+    cd->sjf_class = -1;
+    cd->deadline_us = 0;
+    cd->idle.prev = cd->idle.next = NULL;
+    cd->arrival_ns = timingNow();
+    statsCountAccept();
+    return cd;
+}
+
+void serverRenewRequest(ConnectionStruct cd)
+{
+    poolFreeBuffer(conn_pool, POOL_BUF_REQUEST, cd->request);
+    cd->request = NULL;
+    cd->job_id = atomic_fetch_add(&next_job_id, 1);
+    cd->conn_requests++;
+    cd->arrival_ns = timingNow();
+    cd->dispatch_ns = cd->arrival_ns; // A pipelined request served in place never waits in a queue.
+}
+
+/**
+ * Queue waiter for room unless it is already queued. Call with global_m held.
+ */
+static void roomWaiterPush(RoomWaiter* waiter)
+{
+    if(waiter->waiting)
+    {
+        return;
+    }
+    waiter->waiting = true;
+    waiter->next = NULL;
+    if(room_waiters_tail)
+    {
+        room_waiters_tail->next = waiter;
+    }
+    else
+    {
+        room_waiters_head = waiter;
+    }
+    room_waiters_tail = waiter;
+}
+
+/**
+ * Admit cd and queue it, see serverSubmitRequest(). If may_block is false, the block policy
+ * does not wait for room: it refuses cd (return false) and queues waiter, or without a waiter
+ * drops cd as dt does. Return true if cd was taken (queued or dropped).
+ */
+static bool serverAdmitRequest(ConnectionStruct cd, bool may_block, RoomWaiter* waiter)
+{
+    bool skip_full_flag = false;
+
+    // Make sure there is enough space in the to_do_queue.
+    // In the common (not overloaded) case this is a single atomic op and global_m is not taken:
+    if(!admitRequest(admission.q_size))
+    {
+        bool dropped = false;
+        bool refused = false;
+        pthread_mutex_lock(&global_m);
+        // <CRITICAL>
+        if(!may_block && admission.overloadPolicy == blockPolicy)
+        {
+            // Counted before the check, like the acceptor in blockPolicy(): a request that
+            // leaves after the check sees the count, and takes global_m to wake the waiter.
+            if(waiter && !waiter->waiting)
+            {
+                atomic_fetch_add(&policy_waiting, 1);
+            }
+            refused = !admitRequest(admission.q_size);
+            if(!waiter)
+            {
+                dropped = refused;
+                refused = false;
+                if(dropped)
+                {
+                    dropRequest(cd, STATS_DROP_DT);
+                }
+            }
+            else if(refused)
+            {
+                statsCountBlock();
+                roomWaiterPush(waiter);
+            }
+            else if(!waiter->waiting)
+            {
+                atomic_fetch_sub(&policy_waiting, 1);
+            }
+        }
+        else
+        {
+            // If the policy does not skip the request, it returns with the request counted in in_system.
+            admission.overloadPolicy(admission.to_do_queue, admission.busy_table, admission.q_size, cd, &skip_full_flag);
+            dropped = admission.skip_flag || skip_full_flag;
+        }
+        // <CRITICAL-END>
+        pthread_mutex_unlock(&global_m);
+        if(refused)
+        {
+            return false;
+        }
+        if(dropped)
+        {
+            return true;
+        }
+    }
+
+    // If we get here, there is enough space for one more connection in the buffer (to_do_queue).
+    if(sjf)
+    {
+        sjfClassify(sjf, cd); // Its place in the queue.
+    }
+    else if(edf)
+    {
+        edfAssign(edf, cd);
+    }
+    // Add the ConnectionStruct to the to_do_queue, this does not take global_m:
+    if(dispatchPush(admission.to_do_queue, cd) != CONNECTION_SUCCESS)
+    {
+        // Can only happen if the accounting above is broken.
+        fprintf(stderr, "Error: failed pushing the request into queue: queue is full\n");
+        releaseRequest();
+        dropRequest(cd, STATS_DROP_FULL);
+    }
+    return true;
+}
+
+void serverSubmitRequest(ConnectionStruct cd)
+{
+    serverAdmitRequest(cd, true, NULL);
+}
+
+bool serverOfferRequest(ConnectionStruct cd, RoomWaiter* waiter)
+{
+    return serverAdmitRequest(cd, false, waiter);
+}
+
+void serverFreeRequest(ConnectionStruct cd)
+{
+    poolFreeBuffer(conn_pool, POOL_BUF_REQUEST, cd->request);
+    cd->request = NULL;
+    poolFreeBuffer(conn_pool, POOL_BUF_RIO, cd->rio);
+    cd->rio = NULL;
+    poolFree(conn_pool, cd);
+}
+
+void serverGetLoad(ServerLoad *load)
+{
+    PoolStats pool_stats;
+    poolGetStats(conn_pool, &pool_stats);
+    load->waiting = dispatchGetSize(admission.to_do_queue);
+    load->in_flight = inflightGetSize(admission.busy_table);
+    load->in_system = atomic_load(&in_system);
+    load->capacity = admission.q_size;
+    load->workers = admission.workers;
+    load->records_in_use = pool_stats.in_use;
+    load->records_high_water = pool_stats.high_water;
+    load->records_misses = pool_stats.misses;
+    load->buffer_misses = pool_stats.buffer_misses;
+}
+
 int main(int argc, char *argv[])
 {
-    int listenfd, connfd, port, threads_num, q_size, clientlen;
+    int listenfd, connfd, port, threads_num, workers_max, q_size, clientlen;
     bool skip_flag = false;
     struct sockaddr_in clientaddr;
-    // to_do_list: List of requests waiting to be processed by a worker thread (buffer).
-    // busy_list:  List of requests currently being worked on by a worker thread.
-    ConnectionList to_do_list, busy_list;
-    void (*overloadPolicy)(ConnectionList, ConnectionList, int, ConnectionStruct, bool*) = NULL;
+    // to_do_queue: Requests waiting to be processed by a worker thread (buffer).
+    // busy_table:  Slots of the requests currently being worked on by the worker threads.
+    Dispatcher to_do_queue;
+    InflightTable busy_table;
+    void (*overloadPolicy)(Dispatcher, InflightTable, int, ConnectionStruct, bool*) = NULL;
 
     getargs(&port, &threads_num, &q_size, argc, argv);
     checkValidity(port, threads_num, q_size, argv); // If this fails the server will close.
+    if(!timingInit(server_config.clock))
+    {
+        fprintf(stderr, "Warning: the TSC is not invariant or not in step on every CPU, using CLOCK_MONOTONIC\n");
+    }
+
+    // With autoscaling, threads_num is the initial size and every thread up to workers_max is created:
+    workers_max = threads_num;
+    if(server_config.autoscale)
+    {
+        if(server_config.threads_max == 0)
+        {
+            int quota_max = scaleCpuQuota() * SCALE_THREADS_PER_CPU;
+            server_config.threads_max = quota_max > threads_num ? quota_max : threads_num;
+        }
+        if(server_config.threads_min > server_config.threads_max)
+        {
+            server_config.threads_min = server_config.threads_max;
+        }
+        threads_num = threads_num < server_config.threads_min ? server_config.threads_min :
+                      threads_num > server_config.threads_max ? server_config.threads_max : threads_num;
+        workers_max = server_config.threads_max;
+    }
 
     if(!strcmp(argv[POLICY_POS], "block"))
     {
@@ -110,67 +387,191 @@ int main(int argc, char *argv[])
     {
         overloadPolicy = randomPolicy;
     }
+    else if(!strcmp(argv[POLICY_POS], "codel"))
+    {
+        // The workers drop by queueing delay (see codel.h), a full queue drops the newest request:
+        if(!(codel = codelCreate(server_config.codel_target_ms, server_config.codel_interval_ms)))
+        {
+            perror("Error: codel creation failed");
+            return 1;
+        }
+        overloadPolicy = dtPolicy;
+        skip_flag = true;
+    }
     
     // Initialize locks and condition variables:
     pthread_mutex_init(&global_m, NULL);
-    pthread_cond_init(&cond, NULL);
     pthread_cond_init(&cond_policy, NULL);
-
-    // Create the lists:
-    if(!(to_do_list = connCreateList()))
+    statsInit();
+
+    // Every thread created from here on leaves SIGINT and SIGTERM to serverWaitExit():
+    static sigset_t exit_signals;
+    pthread_t exit_thread;
+    sigemptyset(&exit_signals);
+    sigaddset(&exit_signals, SIGINT);
+    sigaddset(&exit_signals, SIGTERM);
+    if(pthread_sigmask(SIG_BLOCK, &exit_signals, NULL) != 0 ||
+       pthread_create(&exit_thread, NULL, serverWaitExit, &exit_signals) != 0)
+    {
+        pthread_sigmask(SIG_UNBLOCK, &exit_signals, NULL);
+        fprintf(stderr, "Warning: no latency dump on exit: %s\n", strerror(errno));
+    }
+    atomic_init(&in_system, 0);
+    atomic_init(&policy_waiting, 0);
+    atomic_init(&next_job_id, 0);
+
+    // Create the record pool, the queue and the in-flight table.
+    // Besides the workers, the event loops, the idle watcher and the reaper keep records in their caches:
+    int pool_threads = workers_max + (server_config.engine == ENGINE_THREADS ? 0 : server_config.loops) + 2;
+    if(!(conn_pool = poolCreate(poolCapacityFor(pool_threads, q_size))))
+    {
+        perror("Error: conn_pool creation failed");
+        return 1;
+    }
+    if(server_config.dispatch == DISPATCH_SJF && !(sjf = sjfCreate(server_config.sjf_max_wait_ms)))
     {
-        perror("Error: to_do_list creation failed");
+        perror("Error: sjf creation failed");
         return 1;
     }
-    if(!(busy_list = connCreateList()))
+    if(server_config.dispatch == DISPATCH_EDF && !(edf = edfCreate(server_config.deadline_ms)))
     {
-        perror("Error: busy_list creation failed");
-        connDestroyList(to_do_list);
+        perror("Error: edf creation failed");
+        return 1;
+    }
+    if(!(to_do_queue = dispatchCreate(server_config.dispatch, server_config.placement, workers_max, q_size)))
+    {
+        perror("Error: to_do_queue creation failed");
+        poolDestroy(conn_pool);
+        return 1;
+    }
+    if(server_config.affinity && !(affinity = affinityCreate(server_config.affinity)))
+    {
+        fprintf(stderr, "Warning: --affinity=%s is malformed or has no usable CPU, the workers are not pinned\n", server_config.affinity);
+    }
+    if(affinity && server_config.numa && server_config.dispatch != DISPATCH_STEAL)
+    {
+        fprintf(stderr, "Warning: --numa=on only groups the deques of --dispatch=steal\n");
+    }
+    else if(affinity && server_config.numa)
+    {
+        int *nodes = malloc(workers_max * sizeof(*nodes));
+        for(int i = 0; nodes && i < workers_max; i++)
+        {
+            nodes[i] = affinityWorkerNode(affinity, i);
+        }
+        if(!nodes || !dispatchSetNodes(to_do_queue, nodes))
+        {
+            perror("Warning: grouping the workers by NUMA node failed");
+        }
+        free(nodes);
+    }
+    if(!(busy_table = inflightCreateTable(workers_max, 1)))
+    {
+        perror("Error: busy_table creation failed");
+        dispatchDestroy(to_do_queue);
+        poolDestroy(conn_pool);
         return 1;
     }
     
+    // The worker threads park their kept-alive connections in the idle watcher:
+    if(server_config.engine == ENGINE_THREADS && server_config.keepalive_max > 1 &&
+       !(idle_watcher = idleCreateWatcher(server_config.keepalive_timeout_ms)))
+    {
+        perror("Warning: idle watcher creation failed, keep-alive is off");
+        server_config.keepalive_max = 1;
+    }
+
+    if((server_config.cache_kb > 0 || server_config.meta_entries > 0 || server_config.cgi_cache_ttl > 0) &&
+       !(file_watcher = watchCreate("./public")))
+    {
+        perror("Warning: file watcher creation failed, the caches are off");
+    }
+    if(server_config.cache_kb > 0 &&
+       !(content_cache = cacheCreate(file_watcher, (size_t)server_config.cache_kb * 1024,
+                                     (size_t)server_config.cache_max_file_kb * 1024)))
+    {
+        perror("Warning: content cache creation failed, static files are served from disk");
+    }
+    if(server_config.meta_entries > 0 &&
+       !(meta_cache = metaCreate(file_watcher, server_config.meta_entries, server_config.meta_negative_ttl_ms)))
+    {
+        perror("Warning: metadata cache creation failed, every request looks its path up");
+    }
+
+    if(server_config.cgi_pool > 0 && !(fcgi_pool = fcgiCreate(server_config.cgi_pool)))
+    {
+        perror("Warning: CGI pool creation failed, *.fcgi programs run with a fork per request");
+    }
+    if(server_config.cgi_cache_ttl > 0 &&
+       !(cgi_cache = cgiCacheCreate(file_watcher, (size_t)server_config.cgi_cache_kb * 1024,
+                                    server_config.cgi_cache_ttl, server_config.cgi_cache_stale, requestRefreshCgi)))
+    {
+        perror("Warning: CGI response cache creation failed, every CGI request runs its program");
+    }
+    if(server_config.cgi_async && !(cgi_reaper = reaperCreate()))
+    {
+        perror("Warning: CGI reaper creation failed, the workers wait for their CGI programs");
+    }
+
     // Open the listening socket:
     listenfd = Open_listenfd(port);
+    if(sjf || edf)
+    {
+        // Accept a connection once its request arrived, so the acceptor can peek at it to queue it:
+        int defer_sec = 1;
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_sec, sizeof(defer_sec));
+    }
     
     // Allocate threads array and args structs array:
-    pthread_t *threads = (pthread_t*)malloc(threads_num * sizeof(*threads)); // Allocate space for the thread identifiers
-    ThreadArgs *t_args = (ThreadArgs*)malloc(threads_num * sizeof(*t_args)); // Alocate space for the arguments of the threads
+    pthread_t *threads = (pthread_t*)malloc(workers_max * sizeof(*threads)); // Allocate space for the thread identifiers
+    ThreadArgs *t_args = (ThreadArgs*)malloc(workers_max * sizeof(*t_args)); // Alocate space for the arguments of the threads
     if(threads == NULL)
     {
         perror("Error: threads allocation failed");
-        connDestroyList(to_do_list);
-        connDestroyList(busy_list);
+        dispatchDestroy(to_do_queue);
+        inflightDestroyTable(busy_table);
         return 1;
     }
     if(t_args == NULL)
     {
         perror("Error: t_args allocation failed");
-        connDestroyList(to_do_list);
-        connDestroyList(busy_list);
+        dispatchDestroy(to_do_queue);
+        inflightDestroyTable(busy_table);
         free(threads);
         return 1;
     }
 
-    //  Actually create the threads:
-    for(int i = 0; i < threads_num; i++)
+    //  Actually create the threads (the ones beyond threads_num park until the pool grows):
+    for(int i = 0; i < workers_max; i++)
     {
         // Insert the arguments
-        t_args[i].to_do_list = to_do_list;
-        t_args[i].busy_list = busy_list;
+        t_args[i].to_do_queue = to_do_queue;
+        t_args[i].busy_table = busy_table;
         t_args[i].thread_id = i;
 
+        // Pin it from the start, so that its stack and stats are allocated on its NUMA node:
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if(affinity && !affinityApply(affinity, &attr, i))
+        {
+            fprintf(stderr, "Warning: thread number %d could not be pinned\n", i);
+        }
+
         // Create the thread
-        if(pthread_create(&threads[i], NULL, threadDoWork, &t_args[i]) != 0)
+        int created = pthread_create(&threads[i], &attr, threadDoWork, &t_args[i]);
+        pthread_attr_destroy(&attr);
+        if(created != 0)
         {
             fprintf(stderr, "Error: thread number %d failed to create: %s\n", i, strerror(errno));
             pthread_mutex_lock(&global_m);
-            threads_num--; // Try to work with one less thread if failed to create.
+            workers_max--; // Try to work with one less thread if failed to create.
+            threads_num = threads_num < workers_max ? threads_num : workers_max;
             pthread_mutex_unlock(&global_m);
-            if(threads_num == 0)
+            if(workers_max == 0)
             {
                 fprintf(stderr, "Error: no thread managed to be created, aborting server creation.\n");
-                connDestroyList(to_do_list);
-                connDestroyList(busy_list);
+                dispatchDestroy(to_do_queue);
+                inflightDestroyTable(busy_table);
                 free(threads);
                 free(t_args);
                 exit(1);
@@ -178,74 +579,174 @@ int main(int argc, char *argv[])
         }
     }
 
-    int job_id = 0;
+    if(server_config.autoscale && !(scaler = scaleCreate(to_do_queue, threads_num,
+                                                         server_config.threads_min < workers_max ? server_config.threads_min : workers_max,
+                                                         workers_max, server_config.autoscale_target_ms)))
+    {
+        fprintf(stderr, "Warning: autoscaler creation failed, all %d workers are active\n", workers_max);
+    }
+
+    admission.to_do_queue = to_do_queue;
+    admission.busy_table = busy_table;
+    admission.q_size = q_size;
+    admission.workers = workers_max;
+    admission.skip_flag = skip_flag;
+    admission.overloadPolicy = overloadPolicy;
+
+    if(server_config.engine == ENGINE_URING)
+    {
+        // Returns only if io_uring is not usable here, then the epoll loops take over.
+        uringRun(listenfd, server_config.loops, workers_max);
+        fprintf(stderr, "Warning: io_uring is not available, falling back to --engine=epoll\n");
+        server_config.engine = ENGINE_EPOLL;
+    }
+    if(server_config.engine == ENGINE_EPOLL)
+    {
+        // The event loops accept, read and answer the static requests themselves,
+        // only the requests that block (CGI) are submitted to the worker threads.
+        evloopRun(listenfd, server_config.loops, workers_max);
+        return 1; // evloopRun only returns on a fatal error.
+    }
+
     while (1) 
     {
-        bool skip_full_flag = false;
         clientlen = sizeof(clientaddr);
         connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *) &clientlen);
         
-        ConnectionStruct cd = (ConnectionStruct)malloc(sizeof(*cd));
+        if(idle_watcher)
+        {
+            // The headers and the body of a response are separate writes. On a kept-alive
+            // connection nothing flushes them, so do not let Nagle hold the second one back.
+            int one = 1;
+            setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        ConnectionStruct cd = serverNewRequest(connfd);
         if(!cd)
         {
             perror("Error: connection struct allocation fail");
+            Close(connfd);
             continue;
         }
-        cd->job_id = job_id++;
-        cd->connfd = connfd;
-        gettimeofday(&(cd->arrival), NULL); // This function is obsolete, better to use clock_gettime instead.
-        
+        serverSubmitRequest(cd);
+    }
+}
+
+static int myCeil(double num)
+{
+    int inum = (int)num;
+    if((double)inum == num)
+    {
+        return inum;
+    }
+    return num + 1;
+}
+
+/**
+ * Count one more request in the system if it stays within q_size.
+ * Return false (and count nothing) if the system is full.
+ */
+static bool admitRequest(int q_size)
+{
+    int curr = atomic_load(&in_system);
+    while(curr < q_size)
+    {
+        if(atomic_compare_exchange_weak(&in_system, &curr, curr + 1))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Count one request out of the system (finished or dropped), and wake up the acceptor
+ * if it is blocked on a full system, and the first event loop waiting for room.
+ */
+static void releaseRequest()
+{
+    atomic_fetch_sub(&in_system, 1);
+    // Both atomics are sequentially consistent: either we see the count, or the waiter
+    // counted itself after our decrement and will see the new in_system value before sleeping.
+    if(atomic_load(&policy_waiting) > 0)
+    {
         pthread_mutex_lock(&global_m);
         // <CRITICAL>
-        // Make sure there is enough space in the to_do_list:
-        if(connGetSize(to_do_list) + connGetSize(busy_list) + 1 > q_size)
+        pthread_cond_signal(&cond_policy);
+        RoomWaiter* waiter = room_waiters_head;
+        if(waiter)
         {
-            overloadPolicy(to_do_list, busy_list, q_size, cd, &skip_full_flag);
-            if(skip_flag || skip_full_flag)
+            if(!(room_waiters_head = waiter->next))
             {
-                // <CRITICAL-END>
-                pthread_mutex_unlock(&global_m);
-                continue;
+                room_waiters_tail = NULL;
+            }
+            waiter->waiting = false;
+            atomic_fetch_sub(&policy_waiting, 1);
+            uint64_t one = 1;
+            if(write(waiter->wake_fd, &one, sizeof(one)) < 0)
+            {
+                perror("Error: waking up an event loop failed");
             }
         }
-        // If we get here, there is enough space for one more connection in the buffer (to_do_list).
-        // Add the ConnectionStruct to the to_do_list:
-        ConnectionRes res = connPushTail(to_do_list, cd);
-        if(res == CONNECTION_OUT_OF_MEMORY)
-        {
-            fprintf(stderr, "Error: failed pushing the request into queue: allocation fail\n");
-            Close(connfd);
-            free(cd);
-            continue;
-        }
-        pthread_cond_signal(&cond);
         // <CRITICAL-END>
         pthread_mutex_unlock(&global_m);
     }
 }
 
-static int randInt(int max)
+/**
+ * Close a request that will not be served, count it under reason and release its record.
+ */
+static void dropRequest(ConnectionStruct cd, StatsDrop reason)
 {
-    int res = 0;
-    static int feed = 251640;
-    srand(time(NULL)*(++feed));
-    res = (rand()*feed) % (max + 1);
-    return abs(res);
+    statsCountDrop(reason, 1);
+    Close(cd->connfd);
+    serverFreeRequest(cd);
 }
 
-static int myCeil(double num)
+void serverFinishRequest(ConnectionStruct cd)
 {
-    int inum = (int)num;
-    if((double)inum == num)
+    latencyRecord(cd, REQUEST_DYNAMIC);
+    if(sjf)
     {
-        return inum;
+        sjfRecord(sjf, cd);
     }
-    return num + 1;
+    if(edf)
+    {
+        edfRecord(edf, cd);
+    }
+    Close(cd->connfd);
+    releaseRequest();
+    serverFreeRequest(cd);
+}
+
+/**
+ * Wait for one of the signals in args (blocked in every other thread), dump the latency
+ * histograms to stderr and exit.
+ */
+static void* serverWaitExit(void* args)
+{
+    int sig = 0;
+    while(sigwait((sigset_t*)args, &sig) != 0);
+    fprintf(stderr, "Caught %s, exiting\n", strsignal(sig));
+    latencyDump(stderr);
+    exit(0);
+}
+
+/**
+ * Hold back (or flush) partial segments of responses written to fd.
+ */
+static void serverSetCork(int fd, bool cork)
+{
+    int value = cork;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
 }
 
 void* threadDoWork(void* args)
 {
     ConnectionStruct res = NULL;
+    bool stolen = false;
+    bool keep_alive = false;
+    int slot = -1;
+    long long service_begin = 0;
     ThreadArgs *t_args = ((ThreadArgs*)args);
     ThreadStats t_stats = (ThreadStats)malloc(sizeof(*t_stats));
     if(!t_stats)
@@ -257,49 +758,114 @@ void* threadDoWork(void* args)
     // Initialize thread stats:
     t_stats->thread_id = t_args->thread_id;
     t_stats->thread_count = t_stats->thread_static = t_stats->thread_dynamic = 0;
+    t_stats->thread_local_hits = t_stats->thread_steals = t_stats->thread_reused = 0;
+    statsRegisterThread(t_stats);
 
     while(1)
     {
-        pthread_mutex_lock(&global_m);
-        while(connGetSize(t_args->to_do_list) == 0)
+        if(scaler)
         {
-            pthread_cond_wait(&cond, &global_m);
+            scaleWaitActive(scaler, t_args->thread_id); // Parked while the pool is smaller than us.
+        }
+        // Pull the request from the to do queue, waiting for one if needed (does not take global_m):
+        res = dispatchPop(t_args->to_do_queue, t_args->thread_id, &stolen);
+        if(stolen)
+        {
+            t_stats->thread_steals++;
+        }
+        else
+        {
+            t_stats->thread_local_hits++;
+        }
+        res->dispatch_ns = timingNow();
+        if(codel && codelShouldDrop(codel, res->arrival_ns, res->dispatch_ns, dispatchGetSize(t_args->to_do_queue)))
+        {
+            releaseRequest();
+            dropRequest(res, STATS_DROP_CODEL); // It waited in a standing queue for too long.
+            continue;
+        }
+        if(edf && edfExpired(edf, res))
+        {
+            edfReject(edf, res); // Its client gave up already, do not serve it.
+            releaseRequest();
+            dropRequest(res, STATS_DROP_EDF);
+            continue;
         }
-        // <CRITICAL>
-        // Pull the request from the to do list:
-        res = connGetFirst(t_args->to_do_list);
-        connPopHead(t_args->to_do_list, false);
-        // Push the request to the busy list, embedded with the dispatch time:
-        gettimeofday(&(res->dispatch), NULL); // This function is obsolete, better to use clock_gettime instead.
-        connPushHead(t_args->busy_list, res);
-        // <CRITICAL-END>
-        pthread_mutex_unlock(&global_m);
 
-        requestHandle(res, t_stats); // PROCESS THE REQUEST.
-        Close(res->connfd);
+        if(scaler)
+        {
+            service_begin = scaleBegin(scaler, res);
+        }
+
+        // Mark the request as in flight on this worker (O(1), lock-free):
+        slot = inflightAcquire(t_args->busy_table, t_args->thread_id, res);
+
+        keep_alive = requestHandle(res, t_stats); // PROCESS THE REQUEST.
+        if(keep_alive && requestPipelined(res))
+        {
+            // The client already sent its next requests: answer them right away, and cork the
+            // socket so their responses leave in as few segments as possible.
+            serverSetCork(res->connfd, true);
+            while(keep_alive && requestPipelined(res))
+            {
+                serverRenewRequest(res);
+                keep_alive = requestHandle(res, t_stats);
+            }
+            serverSetCork(res->connfd, false);
+        }
+        if(scaler)
+        {
+            scaleEnd(scaler, service_begin);
+        }
+        if(res->cgi_pid > 0)
+        {
+            // Its CGI program still writes the response: the reaper closes it when the program exits.
+            inflightRelease(t_args->busy_table, t_args->thread_id, slot);
+            reaperWatch(cgi_reaper, res);
+            continue;
+        }
+        if(sjf)
+        {
+            sjfRecord(sjf, res);
+        }
+        if(edf)
+        {
+            edfRecord(edf, res);
+        }
+        if(!keep_alive)
+        {
+            Close(res->connfd);
+        }
         
-        pthread_mutex_lock(&global_m);
-        // <CRITICAL>
-        connRemoveById(t_args->busy_list, res->job_id);
-        pthread_cond_signal(&cond_policy);
-        // <CRITICAL-END>
-        pthread_mutex_unlock(&global_m);
+        inflightRelease(t_args->busy_table, t_args->thread_id, slot);
+        releaseRequest();
+        if(keep_alive)
+        {
+            idlePark(idle_watcher, res); // Wait for the next request without holding this thread.
+        }
+        else
+        {
+            serverFreeRequest(res);
+        }
     }
     
     return NULL;
 }
 
 // ***** Block Policy ***** //
-void blockPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, ConnectionStruct cd, bool* skip_full_flag)
+void blockPolicy(Dispatcher to_do_queue, InflightTable busy_table, int q_size, ConnectionStruct cd, bool* skip_full_flag)
 {
     #if CURRENTLY_DEBUGGING == 1
         printf("Block policy entry -->\n");
     #endif
 
-    while(connGetSize(to_do_list) + connGetSize(busy_list) + 1 > q_size)
+    statsCountBlock();
+    atomic_fetch_add(&policy_waiting, 1);
+    while(!admitRequest(q_size))
     {
         pthread_cond_wait(&cond_policy, &global_m);
     }
+    atomic_fetch_sub(&policy_waiting, 1);
 
     #if CURRENTLY_DEBUGGING == 1
         printf("<-- Block policy exit\n");
@@ -307,24 +873,26 @@ void blockPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size
 }
 
 // ****** DH Policy ****** //
-void dhPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, ConnectionStruct cd, bool* skip_full_flag)
+// Drops the oldest waiting request, the head of the queue: it has waited longest, so its client is the
+// most likely to have given up on it already.
+void dhPolicy(Dispatcher to_do_queue, InflightTable busy_table, int q_size, ConnectionStruct cd, bool* skip_full_flag)
 {
     #if CURRENTLY_DEBUGGING == 1
         printf("DH policy entry -->\n");
     #endif
-    if(connGetSize(to_do_list) == 0)
+    ConnectionStruct oldest = dispatchDropOldest(to_do_queue);
+    if(oldest == NULL)
     {
         #if CURRENTLY_DEBUGGING == 1
             printf("<-- DH policy exit (dropped current request)\n");
         #endif
 
-        Close(cd->connfd);
-        free(cd);
+        dropRequest(cd, STATS_DROP_DH);
         *skip_full_flag = true;
         return;
     }
-    Close(connGetLast(to_do_list)->connfd);
-    connPopTail(to_do_list, true);
+    // The new request takes the place of the dropped one in in_system.
+    dropRequest(oldest, STATS_DROP_DH);
 
     #if CURRENTLY_DEBUGGING == 1
         printf("<-- DH policy exit (dropped oldest request)\n");
@@ -332,14 +900,13 @@ void dhPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, C
 }
 
 // ****** DT Policy ****** //
-void dtPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, ConnectionStruct cd, bool* skip_full_flag)
+void dtPolicy(Dispatcher to_do_queue, InflightTable busy_table, int q_size, ConnectionStruct cd, bool* skip_full_flag)
 {
     #if CURRENTLY_DEBUGGING == 1
         printf("DT policy entry -->\n");
     #endif
 
-    Close(cd->connfd);
-    free(cd);
+    dropRequest(cd, STATS_DROP_DT);
 
     #if CURRENTLY_DEBUGGING == 1
         printf("<-- DT policy exit (dropped current request)\n");
@@ -347,49 +914,48 @@ void dtPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, C
 }
 
 // **** Random Policy **** //
-void randomPolicy(ConnectionList to_do_list, ConnectionList busy_list, int q_size, ConnectionStruct cd, bool* skip_full_flag)
+void randomPolicy(Dispatcher to_do_queue, InflightTable busy_table, int q_size, ConnectionStruct cd, bool* skip_full_flag)
 {
     #if CURRENTLY_DEBUGGING == 1
         printf("RANDOM policy entry -->\n");
     #endif
 
-    int size = connGetSize(to_do_list);
+    // Only the acceptor runs the policies, so one buffer (sized for the whole queue) is reused.
+    static ConnectionStruct* victims = NULL;
+    int size = dispatchGetSize(to_do_queue);
     int to_remove = myCeil((double)size/4);
-    ConnectionStruct tmp = NULL;
+    int removed = 0;
+
+    if(victims == NULL)
+    {
+        victims = (ConnectionStruct*)malloc(q_size * sizeof(*victims));
+    }
+    if(size > 0 && victims)
+    {
+        removed = dispatchDropRandom(to_do_queue, to_remove, victims);
+    }
     
-    if(size == 0)
+    if(removed == 0)
     {
         #if CURRENTLY_DEBUGGING == 1
             printf("<-- RANDOM policy exit\n");
         #endif
 
-        Close(cd->connfd);
-        free(cd);
+        dropRequest(cd, STATS_DROP_RANDOM);
         *skip_full_flag = true;
         return;
     }
 
-    int rand_index = 0;
-    int job_id = -1;
-
     #if CURRENTLY_DEBUGGING == 1
-        printf("RANDOM: %d/%d to remove\n", to_remove, size);
+        printf("RANDOM: %d/%d removed\n", removed, size);
     #endif
 
-    while(to_remove)
+    for(int i = 0; i < removed; i++)
     {
-        rand_index = randInt(size-1);
-        tmp = connGetIthElement(to_do_list, rand_index);
-        job_id = tmp->job_id;
-        Close(tmp->connfd);
-        connRemoveById(to_do_list, job_id);
-        size--;
-        to_remove--;
-
-        #if CURRENTLY_DEBUGGING == 1
-            printf("RANDOM: index %d removed (%d left)\n", rand_index, to_remove);
-        #endif
+        dropRequest(victims[i], STATS_DROP_RANDOM);
     }
+    // The new request takes the place of one of the dropped ones in in_system.
+    atomic_fetch_sub(&in_system, removed - 1);
 
     #if CURRENTLY_DEBUGGING == 1
         printf("<-- RANDOM policy exit\n");
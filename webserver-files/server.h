@@ -0,0 +1,77 @@
+#ifndef _SERVER_INC
+#define _SERVER_INC
+
+#include "connection.h"
+
+// ********** Server Core ********** //
+// The admission side of the server, shared by all the engines
+// (the blocking acceptor in server.c, the idle watcher and the event loops).
+
+typedef struct server_load
+{
+    int waiting;             // Requests in the to do queue.
+    int in_flight;           // Requests a worker is on (the busy table).
+    int in_system;           // Admitted and not finished: waiting, in flight, and running CGI programs.
+    int capacity;            // The most requests in the system (<queue-size>).
+    int workers;             // Worker threads.
+    long records_in_use;     // Connection records allocated, the idle kept-alive connections included.
+    long records_high_water;
+    long records_misses;     // Records the pool did not have, allocated with malloc.
+    long buffer_misses;      // The same for the buffers it lends out.
+} ServerLoad;
+
+/**
+ * Allocate a record for a new connection, with a fresh job id and arrival time.
+ * Return NULL if allocation failed.
+ */
+ConnectionStruct serverNewRequest(int connfd);
+
+/**
+ * Start the next request on a kept-alive connection: count it in cd->conn_requests
+ * and give it a fresh job id and arrival time.
+ */
+void serverRenewRequest(ConnectionStruct cd);
+
+/**
+ * Admit a request (applying the overload policy if the system is full)
+ * and hand it to the worker threads. May block under the block policy.
+ * Takes ownership of cd: it is either queued or dropped (and closed).
+ */
+void serverSubmitRequest(ConnectionStruct cd);
+
+// A thread that must not block (an event loop) waits for room in the system with one of these:
+// serverOfferRequest() queues it when it refuses a request, and once a request leaves
+// the system the first queued waiter is taken off and 1 is added to its wake_fd (an eventfd).
+typedef struct room_waiter
+{
+    int wake_fd;
+    bool waiting;               // Queued (only touched under global_m).
+    struct room_waiter* next;
+} RoomWaiter;
+
+/**
+ * Like serverSubmitRequest(), but never blocks. Under the block policy a request that finds
+ * the system full is refused: return false, cd stays with the caller, and waiter (if it is
+ * not queued yet) is queued to be woken up once there is room. With no waiter the request
+ * is dropped (and closed) as under dt instead. Return true if cd was taken.
+ * For the threads that watch many connections.
+ */
+bool serverOfferRequest(ConnectionStruct cd, RoomWaiter* waiter);
+
+/**
+ * Close a request that was answered outside of the worker threads (its CGI program exited,
+ * see reaper.h) and release its record.
+ */
+void serverFinishRequest(ConnectionStruct cd);
+
+/**
+ * Release a record (and its parsed request, if any). Does not close the connection.
+ */
+void serverFreeRequest(ConnectionStruct cd);
+
+/**
+ * Fill load with a snapshot of the queue and of the requests in the system.
+ */
+void serverGetLoad(ServerLoad *load);
+
+#endif
@@ -0,0 +1,178 @@
+#include "sjf.h"
+#include "request.h"
+#include "timing.h"
+#include <stdatomic.h>
+
+#define SJF_SMALL_MAX (64 * 1024)
+#define SJF_MEDIUM_MAX (1024 * 1024)
+#define SJF_STATIC_BASE_US 20      // Parsing, opening and the headers of any static request.
+#define SJF_BYTES_PER_US 1000      // About 1 GB/s from the page cache to a local socket.
+#define SJF_DYNAMIC_INITIAL_US 10000
+#define SJF_COST_WEIGHT 16         // How far ahead of earlier arrivals a cheap request may go.
+#define SJF_AVERAGE_SHIFT 3        // The dynamic estimate moves by 1/8 of every new sample.
+#define SJF_SUB_BITS 3             // 8 latency buckets per power of two, about 12% apart.
+#define SJF_BUCKETS ((64 - SJF_SUB_BITS) << SJF_SUB_BITS)
+
+struct sjf
+{
+    long long max_wait_us;
+    atomic_long dynamic_us; // Running average service time of the dynamic requests.
+    atomic_long latency[SJF_CLASSES][SJF_BUCKETS];
+    atomic_long max_us[SJF_CLASSES];
+};
+
+static const char* sjf_class_names[SJF_CLASSES] = {"small", "medium", "large", "dynamic", "unknown"};
+
+
+/**
+ * Return the latency bucket of us: exact below 2^SJF_SUB_BITS, then log-linear.
+ */
+static int sjfBucket(long us)
+{
+    if(us < (1 << SJF_SUB_BITS))
+    {
+        return us < 0 ? 0 : us;
+    }
+    int exp = 63 - __builtin_clzl(us);
+    int sub = (us >> (exp - SJF_SUB_BITS)) & ((1 << SJF_SUB_BITS) - 1);
+    return ((exp - SJF_SUB_BITS + 1) << SJF_SUB_BITS) + sub;
+}
+
+/**
+ * Return the lowest latency that falls in bucket.
+ */
+static long sjfBucketValue(int bucket)
+{
+    if(bucket < (1 << SJF_SUB_BITS))
+    {
+        return bucket;
+    }
+    int exp = (bucket >> SJF_SUB_BITS) + SJF_SUB_BITS - 1;
+    long sub = bucket & ((1 << SJF_SUB_BITS) - 1);
+    return (1L << exp) | (sub << (exp - SJF_SUB_BITS));
+}
+
+/**
+ * Copy the request line cd is about to read into line (size bytes) without consuming it.
+ * Return false if it did not arrive in whole yet.
+ */
+static bool sjfPeekLine(ConnectionStruct cd, char *line, int size)
+{
+    if(requestPeek(cd, line, size) == 0)
+    {
+        return false;
+    }
+    char *end = strchr(line, '\n');
+    if(!end)
+    {
+        return false;
+    }
+    *end = '\0';
+    return true;
+}
+
+Sjf sjfCreate(int max_wait_ms)
+{
+    Sjf sjf = calloc(1, sizeof(*sjf));
+    if(!sjf)
+    {
+        return NULL;
+    }
+    sjf->max_wait_us = (long long)max_wait_ms * 1000;
+    atomic_init(&sjf->dynamic_us, SJF_DYNAMIC_INITIAL_US);
+    return sjf;
+}
+
+void sjfClassify(Sjf sjf, ConnectionStruct cd)
+{
+    RequestKind kind = REQUEST_ERROR;
+    off_t size = 0;
+    long cost_us = SJF_STATIC_BASE_US;
+    char line[MAXLINE];
+
+    if(cd->request)
+    {
+        kind = cd->request->kind;
+        size = cd->request->filesize;
+        cd->sjf_class = SJF_SMALL;
+    }
+    else if(sjfPeekLine(cd, line, sizeof(line)))
+    {
+        kind = requestClassify(line, &size);
+        cd->sjf_class = SJF_SMALL;
+    }
+    else
+    {
+        cd->sjf_class = SJF_UNKNOWN;
+    }
+
+    if(kind == REQUEST_DYNAMIC)
+    {
+        cd->sjf_class = SJF_DYNAMIC;
+        cost_us = atomic_load_explicit(&sjf->dynamic_us, memory_order_relaxed);
+    }
+    else if(kind == REQUEST_STATIC)
+    {
+        cd->sjf_class = size <= SJF_SMALL_MAX ? SJF_SMALL : size <= SJF_MEDIUM_MAX ? SJF_MEDIUM : SJF_LARGE;
+        cost_us += size / SJF_BYTES_PER_US;
+    }
+
+    long long delay_us = (long long)cost_us * SJF_COST_WEIGHT;
+    cd->dispatch_key = cd->arrival_ns / TIMING_NS_PER_US + (delay_us < sjf->max_wait_us ? delay_us : sjf->max_wait_us);
+}
+
+void sjfRecord(Sjf sjf, ConnectionStruct cd)
+{
+    if(cd->sjf_class < 0 || cd->sjf_class >= SJF_CLASSES)
+    {
+        return; // Not dispatched through the scheduler (e.g. served by an event loop).
+    }
+    long long now_ns = timingNow();
+    long latency_us = (now_ns - cd->arrival_ns) / TIMING_NS_PER_US;
+    atomic_fetch_add_explicit(&sjf->latency[cd->sjf_class][sjfBucket(latency_us)], 1, memory_order_relaxed);
+    long max_us = atomic_load_explicit(&sjf->max_us[cd->sjf_class], memory_order_relaxed);
+    while(latency_us > max_us
+          && !atomic_compare_exchange_weak(&sjf->max_us[cd->sjf_class], &max_us, latency_us));
+
+    if(cd->sjf_class == SJF_DYNAMIC)
+    {
+        // Racing updates may lose a sample, the average does not need all of them.
+        long service_us = (now_ns - cd->dispatch_ns) / TIMING_NS_PER_US;
+        long average_us = atomic_load_explicit(&sjf->dynamic_us, memory_order_relaxed);
+        average_us += (service_us - average_us) >> SJF_AVERAGE_SHIFT;
+        atomic_store_explicit(&sjf->dynamic_us, average_us, memory_order_relaxed);
+    }
+}
+
+void sjfGetClassStats(Sjf sjf, SjfClass class, SjfClassStats *stats)
+{
+    long counts[SJF_BUCKETS];
+    stats->count = 0;
+    for(int i = 0; i < SJF_BUCKETS; i++)
+    {
+        counts[i] = atomic_load_explicit(&sjf->latency[class][i], memory_order_relaxed);
+        stats->count += counts[i];
+    }
+    stats->max_us = atomic_load_explicit(&sjf->max_us[class], memory_order_relaxed);
+    stats->p50_us = stats->p99_us = 0;
+
+    long p50_rank = (stats->count + 1) / 2, p99_rank = (stats->count * 99 + 99) / 100;
+    long seen = 0;
+    for(int i = 0; i < SJF_BUCKETS && seen < p99_rank; i++)
+    {
+        if(seen < p50_rank && seen + counts[i] >= p50_rank)
+        {
+            stats->p50_us = sjfBucketValue(i);
+        }
+        seen += counts[i];
+        if(seen >= p99_rank)
+        {
+            stats->p99_us = sjfBucketValue(i);
+        }
+    }
+}
+
+const char* sjfClassName(SjfClass class)
+{
+    return class >= 0 && class < SJF_CLASSES ? sjf_class_names[class] : "none";
+}
@@ -0,0 +1,69 @@
+#ifndef _SJF_INC
+#define _SJF_INC
+
+#include "connection.h"
+
+// ********** Shortest Job First ********** //
+// With --dispatch=sjf the waiting requests are served by their estimated service time instead
+// of their arrival, so a few large downloads or slow CGI programs do not hold up all the small
+// requests queued behind them.
+//  - A request is classified right before it is queued. The event loops already parsed it,
+//    otherwise its request line is peeked from the socket (not consumed, and never waited for:
+//    connections are accepted once data arrived, but a client that did not send the whole
+//    line yet is queued as unknown, at the cost of a small file).
+//    A static request costs a fixed time plus its size at SJF_BYTES_PER_US, a dynamic one the
+//    running average of the CGI requests served so far.
+//  - Aging: the dispatch key is the arrival time plus the weighted estimate, capped at
+//    --sjf-max-wait. A request is never passed by one that arrived more than that after it.
+//  - The latency of every dispatched request (arrival to the end of its response) is recorded
+//    per size class, so its percentiles can be compared between the dispatch modes.
+typedef struct sjf* Sjf;
+
+typedef enum SjfClass_t
+{
+    SJF_SMALL = 0, // Static, up to SJF_SMALL_MAX bytes (and errors).
+    SJF_MEDIUM,    // Static, up to SJF_MEDIUM_MAX bytes.
+    SJF_LARGE,     // Static, larger.
+    SJF_DYNAMIC,   // CGI.
+    SJF_UNKNOWN,   // Its request line was not there yet.
+    SJF_CLASSES
+} SjfClass;
+
+typedef struct sjf_class_stats
+{
+    long count;  // Requests of the class served.
+    long p50_us; // Latency percentiles, from the arrival to the end of the response.
+    long p99_us;
+    long max_us;
+} SjfClassStats;
+
+// The scheduler of the server, NULL unless --dispatch=sjf.
+extern Sjf sjf;
+
+/**
+ * Create the scheduler: no request waits for more than max_wait_ms behind later ones.
+ * Return NULL if allocation failed.
+ */
+Sjf sjfCreate(int max_wait_ms);
+
+/**
+ * Estimate the service time of cd and set cd->sjf_class and cd->sjf_key. Never blocks.
+ */
+void sjfClassify(Sjf sjf, ConnectionStruct cd);
+
+/**
+ * Record the latency of cd, whose response just ended, in its class.
+ */
+void sjfRecord(Sjf sjf, ConnectionStruct cd);
+
+/**
+ * Fill stats with a snapshot of the latency of class.
+ */
+void sjfGetClassStats(Sjf sjf, SjfClass class, SjfClassStats *stats);
+
+/**
+ * Return the name of class ("small", "medium", ...).
+ */
+const char* sjfClassName(SjfClass class);
+
+#endif
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE // posix_spawn_file_actions_addclosefrom_np
+#include "spawn.h"
+#include <spawn.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define SPAWN_HAVE_CLOSEFROM 1
+#else
+#define SPAWN_HAVE_CLOSEFROM 0
+#endif
+
+char** spawnEnv(const char *name, const char *value)
+{
+    size_t name_len = strlen(name), count = 0;
+    for(char **var = environ; *var; var++)
+    {
+        count++;
+    }
+
+    // The pointers, then the one string of our own:
+    char **env = malloc((count + 2) * sizeof(char *) + name_len + strlen(value) + 2);
+    if(!env)
+    {
+        return NULL;
+    }
+    char *own = (char *)(env + count + 2);
+    sprintf(own, "%s=%s", name, value);
+
+    size_t i = 0;
+    for(char **var = environ; *var; var++)
+    {
+        if(strncmp(*var, name, name_len) || (*var)[name_len] != '=')
+        {
+            env[i++] = *var;
+        }
+    }
+    env[i++] = own;
+    env[i] = NULL;
+    return env;
+}
+
+pid_t spawnProgram(const char *path, char *const argv[], char *const envp[], int fd, int target_fd)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t sigs;
+    pid_t pid = -1;
+
+    int err = posix_spawn_file_actions_init(&actions);
+    if(err)
+    {
+        errno = err;
+        return -1;
+    }
+    if((err = posix_spawnattr_init(&attr)))
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        errno = err;
+        return -1;
+    }
+
+    // dup2() clears the close-on-exec flag of the copy (and of fd itself when it is already target_fd).
+    if(fd >= 0)
+    {
+        err = posix_spawn_file_actions_adddup2(&actions, fd, target_fd);
+    }
+#if SPAWN_HAVE_CLOSEFROM
+    if(!err)
+    {
+        err = posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+    }
+#endif
+
+    // The engines ignore SIGPIPE and the workers may block signals, none of it is the program's business.
+    sigemptyset(&sigs);
+    if(!err)
+    {
+        err = posix_spawnattr_setsigmask(&attr, &sigs);
+    }
+    sigaddset(&sigs, SIGPIPE);
+    if(!err)
+    {
+        err = posix_spawnattr_setsigdefault(&attr, &sigs);
+    }
+    if(!err)
+    {
+        err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    }
+    if(!err)
+    {
+        err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if(err)
+    {
+        errno = err;
+        return -1;
+    }
+    return pid;
+}
@@ -0,0 +1,30 @@
+#ifndef _SPAWN_INC
+#define _SPAWN_INC
+
+#include "segel.h"
+
+// ********** Program Launching ********** //
+// Starts the CGI programs with posix_spawn() instead of fork() and exec. fork() copies the
+// page tables of the whole server (its caches included) only for exec to throw them away,
+// while posix_spawn() borrows the address space until the exec, like vfork(). Nothing runs
+// in the child but what the file actions describe, so the environment of the program is
+// built beforehand instead of calling setenv() between fork() and exec.
+//
+// Every descriptor the server creates is close-on-exec. On top of that the child closes all
+// of them above stderr, so a program can never hold a client socket (or the listening one).
+
+/**
+ * Build the environment of a program: the one of the server with name set to value (an
+ * inherited name is replaced). The strings of the server are shared, not copied.
+ * Return a block to free() once the program started, or NULL on failure.
+ */
+char** spawnEnv(const char *name, const char *value);
+
+/**
+ * Start the program at path with argv and envp, without waiting for it. fd becomes its target_fd
+ * (no descriptor is passed when fd < 0), and it starts with the default signal handling.
+ * Return its pid, or -1 with errno set (also when the program could not be executed).
+ */
+pid_t spawnProgram(const char *path, char *const argv[], char *const envp[], int fd, int target_fd);
+
+#endif
@@ -0,0 +1,439 @@
+#include "stats.h"
+#include "server.h"
+#include "cache.h"
+#include "meta.h"
+#include "cgicache.h"
+#include "reaper.h"
+#include "codel.h"
+#include "sjf.h"
+#include "edf.h"
+#include "scale.h"
+#include "latency.h"
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define STATS_RATE_SECONDS 10       // The accept rate is the average of the last complete seconds.
+#define STATS_TEXT_INITIAL 16384
+
+typedef struct stats_second
+{
+    atomic_long second; // The second the count is of.
+    atomic_long count;
+} StatsSecond;
+
+static const char* stats_drop_names[STATS_DROPS] = {"dt", "dh", "random", "codel", "edf", "full"};
+
+static double stats_start;
+static atomic_long stats_accepted;
+static atomic_long stats_sent;
+static atomic_long stats_blocked;
+static atomic_long stats_dropped[STATS_DROPS];
+static StatsSecond stats_accept_seconds[STATS_RATE_SECONDS + 1]; // One more for the current second.
+static pthread_mutex_t stats_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadStats *stats_threads = NULL;
+static int stats_threads_num = 0;
+static int stats_threads_cap = 0;
+
+// The text of one answer, grown as needed:
+typedef struct stats_text
+{
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool json;
+    bool failed;           // An allocation failed, the text is incomplete.
+    const char *last_name; // Prometheus gives the HELP and TYPE of a metric once, before its first sample.
+} StatsText;
+
+static double statsNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static long statsSecond()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static void statsAppend(StatsText *text, const char *format, ...)
+{
+    while(!text->failed)
+    {
+        va_list args;
+        va_start(args, format);
+        int n = vsnprintf(text->buf + text->len, text->cap - text->len, format, args);
+        va_end(args);
+        if(n < 0)
+        {
+            text->failed = true;
+        }
+        else if((size_t)n < text->cap - text->len)
+        {
+            text->len += n;
+            return;
+        }
+        else
+        {
+            char *grown = realloc(text->buf, text->cap * 2 + n);
+            if(!grown)
+            {
+                text->failed = true;
+                return;
+            }
+            text->buf = grown;
+            text->cap = text->cap * 2 + n;
+        }
+    }
+}
+
+/**
+ * Append one sample of the metric webserver_<name>. labels is NULL or in the Prometheus form
+ * (key="value",...), the values must not hold quotes or commas.
+ * help is NULL for the _sum and _count samples of a summary, which belong to its family.
+ */
+static void statsSample(StatsText *text, const char *name, const char *type, const char *help,
+                        const char *labels, double value)
+{
+    char number[64];
+    if(value == (long long)value && value < 1e15 && value > -1e15)
+    {
+        snprintf(number, sizeof(number), "%lld", (long long)value);
+    }
+    else
+    {
+        snprintf(number, sizeof(number), "%.6g", value);
+    }
+
+    if(!text->json)
+    {
+        if(help && (!text->last_name || strcmp(text->last_name, name)))
+        {
+            statsAppend(text, "# HELP webserver_%s %s\n# TYPE webserver_%s %s\n", name, help, name, type);
+            text->last_name = name;
+        }
+        statsAppend(text, "webserver_%s%s%s%s %s\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "", number);
+        return;
+    }
+
+    statsAppend(text, "%s\n{\"name\":\"webserver_%s\",\"labels\":{", text->len > 1 ? "," : "", name);
+    for(const char *p = labels; p && *p; )
+    {
+        int key_len = strcspn(p, "=");
+        p += key_len + 1;
+        int value_len = strcspn(p + 1, "\"") + 2; // With its quotes.
+        statsAppend(text, "\"%.*s\":%.*s", key_len, p - key_len - 1, value_len, p);
+        p += value_len;
+        if(*p == ',')
+        {
+            statsAppend(text, ",");
+            p++;
+        }
+    }
+    statsAppend(text, "},\"value\":%s}", number);
+}
+
+void statsInit()
+{
+    stats_start = statsNow();
+}
+
+void statsRegisterThread(ThreadStats t_stats)
+{
+    pthread_mutex_lock(&stats_threads_lock);
+    // <CRITICAL>
+    if(stats_threads_num == stats_threads_cap)
+    {
+        int cap = stats_threads_cap ? stats_threads_cap * 2 : 64;
+        ThreadStats *grown = realloc(stats_threads, cap * sizeof(*grown));
+        if(grown)
+        {
+            stats_threads = grown;
+            stats_threads_cap = cap;
+        }
+    }
+    if(stats_threads_num < stats_threads_cap)
+    {
+        stats_threads[stats_threads_num++] = t_stats;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&stats_threads_lock);
+}
+
+void statsCountAccept()
+{
+    atomic_fetch_add_explicit(&stats_accepted, 1, memory_order_relaxed);
+
+    // The first accept of a second restarts its slot. An accept racing with the restart may be
+    // lost, the rate does not need all of them.
+    long now = statsSecond();
+    StatsSecond *slot = &stats_accept_seconds[now % (STATS_RATE_SECONDS + 1)];
+    long second = atomic_load_explicit(&slot->second, memory_order_relaxed);
+    if(second != now && atomic_compare_exchange_strong(&slot->second, &second, now))
+    {
+        atomic_store_explicit(&slot->count, 0, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&slot->count, 1, memory_order_relaxed);
+}
+
+void statsCountDrop(StatsDrop reason, int count)
+{
+    atomic_fetch_add_explicit(&stats_dropped[reason], count, memory_order_relaxed);
+}
+
+void statsCountBlock()
+{
+    atomic_fetch_add_explicit(&stats_blocked, 1, memory_order_relaxed);
+}
+
+void statsAddSent(long bytes)
+{
+    atomic_fetch_add_explicit(&stats_sent, bytes, memory_order_relaxed);
+}
+
+bool statsIsRequest(const char *uri)
+{
+    size_t len = sizeof(STATS_PATH) - 1;
+    return !strncmp(uri, STATS_PATH, len) && (uri[len] == '\0' || uri[len] == '?');
+}
+
+/**
+ * Return true if the query of uri asks for JSON.
+ */
+static bool statsWantsJson(const char *uri)
+{
+    const char *query = strchr(uri, '?');
+    return query && strstr(query, "format=json");
+}
+
+const char* statsContentType(const char *uri)
+{
+    return statsWantsJson(uri) ? "application/json" : "text/plain; version=0.0.4; charset=utf-8";
+}
+
+/**
+ * Return the accepts per second over the last STATS_RATE_SECONDS complete seconds (fewer at start).
+ */
+static double statsAcceptRate()
+{
+    long now = statsSecond(), count = 0;
+    for(int i = 0; i < STATS_RATE_SECONDS + 1; i++)
+    {
+        long second = atomic_load_explicit(&stats_accept_seconds[i].second, memory_order_relaxed);
+        if(second < now && second >= now - STATS_RATE_SECONDS)
+        {
+            count += atomic_load_explicit(&stats_accept_seconds[i].count, memory_order_relaxed);
+        }
+    }
+    double window = statsNow() - stats_start;
+    window = window < STATS_RATE_SECONDS ? (window < 1 ? 1 : window) : STATS_RATE_SECONDS;
+    return count / window;
+}
+
+static void statsRenderServer(StatsText *text)
+{
+    char labels[128];
+    statsSample(text, "uptime_seconds", "gauge", "Seconds since the server started.", NULL, statsNow() - stats_start);
+    statsSample(text, "accepted_total", "counter", "Connections accepted.", NULL, atomic_load(&stats_accepted));
+    statsSample(text, "accept_rate", "gauge", "Connections accepted per second, over the last seconds.", NULL, statsAcceptRate());
+    statsSample(text, "sent_bytes_total", "counter", "Bytes written to clients by the server.", NULL, atomic_load(&stats_sent));
+
+    // The ThreadStats of the workers and the event loops, added up:
+    long count = 0, static_count = 0, dynamic_count = 0, local = 0, steals = 0, reused = 0;
+    pthread_mutex_lock(&stats_threads_lock);
+    // <CRITICAL>
+    int threads = stats_threads_num;
+    for(int i = 0; i < stats_threads_num; i++)
+    {
+        count += stats_threads[i]->thread_count;
+        static_count += stats_threads[i]->thread_static;
+        dynamic_count += stats_threads[i]->thread_dynamic;
+        local += stats_threads[i]->thread_local_hits;
+        steals += stats_threads[i]->thread_steals;
+        reused += stats_threads[i]->thread_reused;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&stats_threads_lock);
+    statsSample(text, "threads", "gauge", "Threads that answer requests (workers and event loops).", NULL, threads);
+    statsSample(text, "requests_total", "counter", "Requests answered, by kind.", "kind=\"static\"", static_count);
+    statsSample(text, "requests_total", "counter", "Requests answered, by kind.", "kind=\"dynamic\"", dynamic_count);
+    statsSample(text, "requests_total", "counter", "Requests answered, by kind.", "kind=\"error\"", count - static_count - dynamic_count);
+    statsSample(text, "requests_reused_total", "counter", "Requests that came on a kept-alive connection.", NULL, reused);
+    statsSample(text, "requests_local_total", "counter", "Requests a worker took from its own deque or the shared queue.", NULL, local);
+    statsSample(text, "requests_stolen_total", "counter", "Requests a worker stole from the deque of another.", NULL, steals);
+
+    ServerLoad load;
+    serverGetLoad(&load);
+    statsSample(text, "queue_waiting", "gauge", "Requests waiting for a worker (the to do queue).", NULL, load.waiting);
+    statsSample(text, "queue_in_flight", "gauge", "Requests a worker is on (the busy table).", NULL, load.in_flight);
+    statsSample(text, "queue_in_system", "gauge", "Requests admitted and not finished.", NULL, load.in_system);
+    statsSample(text, "queue_capacity", "gauge", "The most requests admitted at once.", NULL, load.capacity);
+    statsSample(text, "queue_saturation_ratio", "gauge", "Requests in the system over the capacity, the overload policy acts at 1.",
+                NULL, load.capacity ? (double)load.in_system / load.capacity : 0);
+    statsSample(text, "workers", "gauge", "Worker threads.", NULL, load.workers);
+    statsSample(text, "records_in_use", "gauge", "Connection records allocated, idle kept-alive connections included.", NULL, load.records_in_use);
+    statsSample(text, "records_high_water", "gauge", "The most connection records allocated at once.", NULL, load.records_high_water);
+    statsSample(text, "records_pool_misses_total", "counter", "Connection records the pool did not have, allocated with malloc.", NULL, load.records_misses);
+    statsSample(text, "buffers_pool_misses_total", "counter", "Buffers (parsed requests, pipelined bytes, reaper jobs) the pool did not have, allocated with malloc.", NULL, load.buffer_misses);
+
+    for(int i = 0; i < STATS_DROPS; i++)
+    {
+        snprintf(labels, sizeof(labels), "policy=\"%s\"", stats_drop_names[i]);
+        statsSample(text, "dropped_total", "counter", "Requests dropped, by the policy that dropped them.", labels,
+                    atomic_load_explicit(&stats_dropped[i], memory_order_relaxed));
+    }
+    statsSample(text, "blocked_total", "counter", "Times a request waited for room under the block policy (in the acceptor or parked in an event loop).", NULL, atomic_load(&stats_blocked));
+}
+
+static void statsRenderModules(StatsText *text)
+{
+    char labels[128];
+    if(content_cache)
+    {
+        CacheStats cache;
+        cacheGetStats(content_cache, &cache);
+        statsSample(text, "cache_hits_total", "counter", "Static files served from the content cache.", NULL, cache.hits);
+        statsSample(text, "cache_misses_total", "counter", "Static files read from disk.", NULL, cache.misses);
+        statsSample(text, "cache_evictions_total", "counter", "Content cache entries dropped for room.", NULL, cache.evictions);
+        statsSample(text, "cache_invalidations_total", "counter", "Content cache entries dropped because their file changed.", NULL, cache.invalidations);
+        statsSample(text, "cache_entries", "gauge", "Files in the content cache.", NULL, cache.entries);
+        statsSample(text, "cache_bytes", "gauge", "Bytes in the content cache.", NULL, cache.bytes);
+        statsSample(text, "cache_limit_bytes", "gauge", "Size limit of the content cache.", NULL, cache.limit);
+    }
+    if(meta_cache)
+    {
+        MetaStats meta;
+        metaGetStats(meta_cache, &meta);
+        statsSample(text, "meta_hits_total", "counter", "Path lookups answered by the metadata cache.", NULL, meta.hits);
+        statsSample(text, "meta_negative_hits_total", "counter", "Of them, for a missing path.", NULL, meta.negative_hits);
+        statsSample(text, "meta_misses_total", "counter", "Path lookups that called stat().", NULL, meta.misses);
+        statsSample(text, "meta_entries", "gauge", "Paths in the metadata cache.", NULL, meta.entries);
+        statsSample(text, "meta_open_files", "gauge", "Files the metadata cache keeps open.", NULL, meta.open_files);
+    }
+    if(cgi_cache)
+    {
+        CgiCacheStats cgi;
+        cgiCacheGetStats(cgi_cache, &cgi);
+        statsSample(text, "cgi_cache_hits_total", "counter", "CGI requests answered from the cache.", NULL, cgi.hits);
+        statsSample(text, "cgi_cache_stale_hits_total", "counter", "Of them, with a stale output.", NULL, cgi.stale_hits);
+        statsSample(text, "cgi_cache_misses_total", "counter", "CGI requests that ran their program.", NULL, cgi.misses);
+        statsSample(text, "cgi_cache_refreshes_total", "counter", "Stale outputs refreshed in the background.", NULL, cgi.refreshes);
+        statsSample(text, "cgi_cache_entries", "gauge", "Outputs in the CGI response cache.", NULL, cgi.entries);
+        statsSample(text, "cgi_cache_bytes", "gauge", "Bytes in the CGI response cache.", NULL, cgi.bytes);
+    }
+    if(cgi_reaper)
+    {
+        ReaperStats reaper;
+        reaperGetStats(cgi_reaper, &reaper);
+        statsSample(text, "cgi_running", "gauge", "CGI programs running after their worker moved on.", NULL, reaper.running);
+        statsSample(text, "cgi_finished_total", "counter", "CGI programs reaped.", NULL, reaper.finished);
+        statsSample(text, "cgi_failed_total", "counter", "CGI programs that exited with an error or were killed.", NULL, reaper.failed);
+        statsSample(text, "cgi_max_seconds", "gauge", "The longest run of a reaped CGI program.", NULL, reaper.max_ms / 1000.0);
+    }
+    if(codel)
+    {
+        CodelStats codel_stats;
+        codelGetStats(codel, &codel_stats);
+        statsSample(text, "codel_accepted_total", "counter", "Requests codel let through to a worker.", NULL, codel_stats.accepted);
+        statsSample(text, "codel_episodes_total", "counter", "Times codel started dropping.", NULL, codel_stats.episodes);
+        statsSample(text, "codel_dropping", "gauge", "1 while codel drops.", NULL, codel_stats.dropping);
+        statsSample(text, "codel_sojourn_seconds", "gauge", "Queueing delay of the last dispatched request.", NULL, codel_stats.last_sojourn_us / 1e6);
+    }
+    if(sjf)
+    {
+        for(int class = 0; class < SJF_CLASSES; class++)
+        {
+            SjfClassStats class_stats;
+            sjfGetClassStats(sjf, class, &class_stats);
+            snprintf(labels, sizeof(labels), "class=\"%s\",quantile=\"0.5\"", sjfClassName(class));
+            statsSample(text, "sjf_latency_seconds", "summary", "Latency by sjf size class, arrival to end of response.", labels, class_stats.p50_us / 1e6);
+            snprintf(labels, sizeof(labels), "class=\"%s\",quantile=\"0.99\"", sjfClassName(class));
+            statsSample(text, "sjf_latency_seconds", "summary", "Latency by sjf size class, arrival to end of response.", labels, class_stats.p99_us / 1e6);
+            snprintf(labels, sizeof(labels), "class=\"%s\"", sjfClassName(class));
+            statsSample(text, "sjf_latency_seconds_count", "summary", NULL, labels, class_stats.count);
+        }
+    }
+    if(edf)
+    {
+        EdfStats edf_stats;
+        edfGetStats(edf, &edf_stats);
+        statsSample(text, "edf_from_header_total", "counter", "Requests that gave their own deadline.", NULL, edf_stats.from_header);
+        statsSample(text, "edf_met_total", "counter", "Requests served before their deadline.", NULL, edf_stats.met);
+        statsSample(text, "edf_missed_total", "counter", "Requests served after their deadline.", NULL, edf_stats.missed);
+    }
+    if(scaler)
+    {
+        ScaleStats scale;
+        scaleGetStats(scaler, &scale);
+        statsSample(text, "workers_active", "gauge", "Workers taking requests under autoscaling.", NULL, scale.active);
+        statsSample(text, "workers_min", "gauge", "Smallest pool under autoscaling.", NULL, scale.min);
+        statsSample(text, "workers_max", "gauge", "Largest pool under autoscaling.", NULL, scale.max);
+        statsSample(text, "autoscale_resizes_total", "counter", "Resizes of the worker pool.", "direction=\"grow\"", scale.grows);
+        statsSample(text, "autoscale_resizes_total", "counter", "Resizes of the worker pool.", "direction=\"shrink\"", scale.shrinks);
+        statsSample(text, "autoscale_queue_delay_seconds", "gauge", "Mean queueing delay of the last control period.", NULL, scale.queue_delay_us / 1e6);
+        statsSample(text, "autoscale_utilization_ratio", "gauge", "Busy share of the active workers in the last control period.", NULL, scale.utilization_pct / 100.0);
+        statsSample(text, "autoscale_needed_workers", "gauge", "Busy workers by Little's law in the last control period.", NULL, scale.needed);
+    }
+}
+
+static void statsRenderLatency(StatsText *text)
+{
+    static const char *quantiles[] = {"0.5", "0.9", "0.99", "0.999"};
+    char labels[128];
+    LatencyStats stats[LATENCY_STAGES][LATENCY_KINDS];
+    for(int stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        for(int kind = 0; kind < LATENCY_KINDS; kind++)
+        {
+            latencyGetStats(stage, kind, &stats[stage][kind]);
+            LatencyStats *s = &stats[stage][kind];
+            long values[] = {s->p50_us, s->p90_us, s->p99_us, s->p999_us};
+            for(int q = 0; q < 4; q++)
+            {
+                snprintf(labels, sizeof(labels), "stage=\"%s\",kind=\"%s\",quantile=\"%s\"",
+                         latencyStageName(stage), latencyKindName(kind), quantiles[q]);
+                statsSample(text, "latency_seconds", "summary", "Latency of the requests: wait (arrival to dispatch), service (dispatch to the end of the response) and total.",
+                            labels, values[q] / 1e6);
+            }
+            snprintf(labels, sizeof(labels), "stage=\"%s\",kind=\"%s\"", latencyStageName(stage), latencyKindName(kind));
+            statsSample(text, "latency_seconds_sum", "summary", NULL, labels, s->sum_us / 1e6);
+            statsSample(text, "latency_seconds_count", "summary", NULL, labels, s->count);
+        }
+    }
+    for(int stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        for(int kind = 0; kind < LATENCY_KINDS; kind++)
+        {
+            snprintf(labels, sizeof(labels), "stage=\"%s\",kind=\"%s\"", latencyStageName(stage), latencyKindName(kind));
+            statsSample(text, "latency_max_seconds", "gauge", "The longest stage of a request so far.", labels, stats[stage][kind].max_us / 1e6);
+        }
+    }
+}
+
+char* statsRender(const char *uri, size_t *len)
+{
+    StatsText text = {NULL, 0, STATS_TEXT_INITIAL, statsWantsJson(uri), false, NULL};
+    if(!(text.buf = malloc(text.cap)))
+    {
+        return NULL;
+    }
+    statsAppend(&text, text.json ? "[" : "");
+    statsRenderServer(&text);
+    statsRenderLatency(&text);
+    statsRenderModules(&text);
+    statsAppend(&text, text.json ? "\n]\n" : "");
+
+    // The engines release the body of a response with munmap():
+    char *res = text.failed ? MAP_FAILED : mmap(NULL, text.len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(res != MAP_FAILED)
+    {
+        memcpy(res, text.buf, text.len);
+        *len = text.len;
+    }
+    free(text.buf);
+    return res != MAP_FAILED ? res : NULL;
+}
@@ -0,0 +1,81 @@
+#ifndef _STATS_INC
+#define _STATS_INC
+
+#include "connection.h"
+
+// ********** Server Statistics ********** //
+// GET STATS_PATH answers with the live metrics of the whole server, without going through the
+// static or the CGI path: the ThreadStats of every worker and event loop added up, the queue
+// depths, the drops of the overload policies, the accept rate, the bytes sent, the latency
+// percentiles (see latency.h), and the state of every module that is on (caches, CGI reaper,
+// codel, sjf, edf, autoscaling).
+// The text is in the Prometheus exposition format, or in JSON with ?format=json:
+// an array of {"name", "labels", "value"} samples with the same names.
+//  - The counters here are process wide atomics, bumped once per accept, drop or write.
+//  - The ThreadStats are read without synchronization: a scrape may miss the requests in progress.
+//  - Bytes sent are the responses the server wrote itself and the CGI output it copied. The output
+//    a classic CGI program writes to the socket directly, and the one the pooled *.fcgi programs
+//    forward through fcgi.c (also linked into them), are not seen.
+#define STATS_PATH "/__stats"
+
+typedef enum StatsDrop_t
+{
+    STATS_DROP_DT = 0, // The new request, by dt (and codel on a full queue, and block when it can not wait).
+    STATS_DROP_DH,     // The oldest waiting request (or the new one if none waits), by dh.
+    STATS_DROP_RANDOM, // Waiting requests at random (or the new one if none waits), by random.
+    STATS_DROP_CODEL,  // A request that waited in a standing queue, at dispatch.
+    STATS_DROP_EDF,    // A request whose deadline passed, at dispatch.
+    STATS_DROP_FULL,   // The queue refused an admitted request.
+    STATS_DROPS
+} StatsDrop;
+
+/**
+ * Start the clock of the uptime and the rates. Called once, before the engines start.
+ */
+void statsInit();
+
+/**
+ * Add the counters of a thread that serves requests (a worker or an event loop).
+ * t_stats must stay valid for the life of the server.
+ */
+void statsRegisterThread(ThreadStats t_stats);
+
+/**
+ * Count an accepted connection.
+ */
+void statsCountAccept();
+
+/**
+ * Count count requests dropped for reason.
+ */
+void statsCountDrop(StatsDrop reason, int count);
+
+/**
+ * Count a request that waited for room under the block policy.
+ */
+void statsCountBlock();
+
+/**
+ * Count bytes written to clients.
+ */
+void statsAddSent(long bytes);
+
+/**
+ * Return true if uri asks for the statistics (STATS_PATH, with or without a query).
+ */
+bool statsIsRequest(const char *uri);
+
+/**
+ * Format the statistics asked for by uri, as JSON if its query says format=json.
+ * Return the text in anonymous memory from mmap(), to be released with munmap() like the
+ * memory-mapped files the engines send, and set len to its length.
+ * Return NULL if allocation failed.
+ */
+char* statsRender(const char *uri, size_t *len);
+
+/**
+ * Return the Content-Type of the text statsRender() makes for uri.
+ */
+const char* statsContentType(const char *uri);
+
+#endif
@@ -0,0 +1,112 @@
+#include "timing.h"
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TIMING_HAVE_TSC 1
+#else
+#define TIMING_HAVE_TSC 0
+#endif
+
+#define TIMING_CALIBRATE_NS (20 * 1000 * 1000) // How long the TSC rate is measured for.
+#define TIMING_CLOCKSOURCE "/sys/devices/system/clocksource/clocksource0/current_clocksource"
+
+static TimingMode timing_mode = TIMING_MONOTONIC;
+static long long timing_wall_offset = 0; // Time of day minus CLOCK_MONOTONIC.
+// The TSC at timingInit() and the monotonic time it stood for, and the ns per tick in 32.32 fixed point:
+static unsigned long long timing_tsc_base = 0;
+static long long timing_tsc_base_ns = 0;
+static unsigned long long timing_tsc_mult = 0;
+
+static const char* timing_names[] = {"monotonic", "coarse", "tsc"};
+
+static long long timingClock(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * TIMING_NS_PER_SEC + ts.tv_nsec;
+}
+
+#if TIMING_HAVE_TSC
+/**
+ * Return true if the CPU has an invariant TSC and the kernel clock runs on it.
+ */
+static bool timingTscUsable()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8)))
+    {
+        return false; // Not invariant: it changes rate with the frequency of its core.
+    }
+    char source[32] = "";
+    FILE *file = fopen(TIMING_CLOCKSOURCE, "r");
+    if(file)
+    {
+        if(!fgets(source, sizeof(source), file))
+        {
+            source[0] = '\0';
+        }
+        fclose(file);
+    }
+    return !strncmp(source, "tsc", 3); // The kernel found it stable and in step on every CPU.
+}
+
+/**
+ * Measure the rate of the TSC against CLOCK_MONOTONIC. Return false if it looks wrong.
+ */
+static bool timingTscCalibrate()
+{
+    struct timespec pause = {0, TIMING_CALIBRATE_NS};
+    long long start_ns = timingClock(CLOCK_MONOTONIC);
+    unsigned long long start_tsc = __rdtsc();
+    nanosleep(&pause, NULL);
+    long long end_ns = timingClock(CLOCK_MONOTONIC);
+    unsigned long long end_tsc = __rdtsc();
+    if(end_tsc <= start_tsc || end_ns <= start_ns)
+    {
+        return false;
+    }
+    timing_tsc_mult = (unsigned long long)(((double)(end_ns - start_ns) / (end_tsc - start_tsc)) * 4294967296.0);
+    timing_tsc_base = end_tsc;
+    timing_tsc_base_ns = end_ns;
+    return timing_tsc_mult > 0;
+}
+#endif
+
+bool timingInit(TimingMode mode)
+{
+    timing_wall_offset = timingClock(CLOCK_REALTIME) - timingClock(CLOCK_MONOTONIC);
+    timing_mode = mode == TIMING_TSC ? TIMING_MONOTONIC : mode;
+#if TIMING_HAVE_TSC
+    if(mode == TIMING_TSC && timingTscUsable() && timingTscCalibrate())
+    {
+        timing_mode = TIMING_TSC;
+    }
+#endif
+    return timing_mode == mode;
+}
+
+long long timingNow()
+{
+    switch(timing_mode)
+    {
+#if TIMING_HAVE_TSC
+    case TIMING_TSC:
+        // Every read comes after the base, on a CPU whose TSC is in step with the others.
+        return timing_tsc_base_ns + (long long)(((unsigned __int128)(__rdtsc() - timing_tsc_base) * timing_tsc_mult) >> 32);
+#endif
+    case TIMING_COARSE:
+        return timingClock(CLOCK_MONOTONIC_COARSE);
+    default:
+        return timingClock(CLOCK_MONOTONIC);
+    }
+}
+
+long long timingToWall(long long ns)
+{
+    return ns + timing_wall_offset;
+}
+
+const char* timingName()
+{
+    return timing_names[timing_mode];
+}
@@ -0,0 +1,42 @@
+#ifndef _TIMING_INC
+#define _TIMING_INC
+
+#include "config.h"
+
+// ********** Request Timestamps ********** //
+// Every stage of a request (arrival, dispatch, end of response) is stamped with timingNow():
+// nanoseconds as a 64-bit integer from a monotonic clock, so an NTP step or a settimeofday()
+// never makes a stage negative. The clock is chosen with --clock:
+//  - monotonic: clock_gettime(CLOCK_MONOTONIC), read from the vDSO without a system call.
+//  - coarse:    CLOCK_MONOTONIC_COARSE, cheaper still but only as fine as the kernel tick (1-4 ms).
+//  - tsc:       the CPU time stamp counter, scaled by a rate measured against CLOCK_MONOTONIC at
+//               start. Only on x86-64, if the CPU says it is invariant and the kernel keeps its
+//               own clock on it (so it is in step on every CPU), otherwise monotonic is used.
+// The timestamps only make sense relative to each other, timingToWall() gives the time of day
+// of one (e.g. for the Stat-Req-Arrival header).
+#define TIMING_NS_PER_US 1000LL
+#define TIMING_NS_PER_SEC 1000000000LL
+
+/**
+ * Select the clock of mode. Called once, before any timestamp is taken.
+ * Return false if mode is TIMING_TSC and the TSC cannot be used: CLOCK_MONOTONIC is used instead.
+ */
+bool timingInit(TimingMode mode);
+
+/**
+ * Return the current time in nanoseconds, on the selected monotonic clock.
+ */
+long long timingNow();
+
+/**
+ * Return the time of day (nanoseconds since the epoch) of the timestamp ns, by the offset
+ * between the two clocks at timingInit().
+ */
+long long timingToWall(long long ns);
+
+/**
+ * Return the name of the selected clock ("monotonic", "coarse", "tsc").
+ */
+const char* timingName();
+
+#endif
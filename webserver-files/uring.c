@@ -0,0 +1,1042 @@
+#define _GNU_SOURCE
+#include "uring.h"
+#include "evloop.h"
+#include "request.h"
+#include "server.h"
+#include "pool.h"
+#include "config.h"
+#include "idle.h"
+#include "stats.h"
+#include "latency.h"
+#include "timing.h"
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES    1024 // Submission queue size.
+#define URING_CQ_ENTRIES 8192 // Completion queue size, a multishot accept can post many completions.
+#define URING_BUFS       512  // Provided receive buffers per loop (a power of 2).
+#define URING_BUF_SIZE   2048
+#define URING_FILE_SLOTS 256  // Registered file slots for reading static files (slot 0 is the listening socket).
+#define UR_PIPELINE_MAX  8    // Responses queued on one connection before they are sent.
+// The longest chain of linked operations: open, read and close a small file per response, send, close.
+#define URING_CHAIN_MAX  (3 * UR_PIPELINE_MAX + 2)
+
+// What a completion is about, kept in the low bits of its user_data (the rest is the UrConn pointer).
+typedef enum UrTag_t
+{
+    UR_TAG_IGNORE = 0, // An intermediate step of a chain, the last step tells how the chain went.
+    UR_TAG_ACCEPT,
+    UR_TAG_RECV,
+    UR_TAG_DONE,       // The last step of a chain: closing the connection (or the send, if kept alive).
+    UR_TAG_TICK,       // The timeout that expires the idle connections.
+    UR_TAG_SENT,       // The send of a chain that goes on to close the connection.
+    UR_TAG_ROOM        // The read of the loop's eventfd: the system has room for the parked requests.
+} UrTag;
+
+#define UR_TAG_MASK 7ULL
+
+// One response queued on a connection.
+typedef struct ur_resp
+{
+    char* out;           // Headers (and the body of a small file, or a whole error response).
+    int out_len;
+    char* body;          // The file of a static response: in the content cache, or memory-mapped.
+    size_t body_len;     // Also the size of a small file, read into out after the headers.
+    CacheEntry cached;   // The cache entry body belongs to, or NULL.
+    int file_slot;       // The registered file slot a small file is read through, or 0.
+    char* path;          // The small file to open, kept at the end of out.
+} UrResp;
+
+// The state of one connection owned by a loop.
+typedef struct ur_conn
+{
+    int fd;
+    ConnectionStruct cd;
+    char in[MAXLINE];    // Bytes received and not answered yet: the current request, and any pipelined after it.
+    int in_len;
+    UrResp resp[UR_PIPELINE_MAX]; // Responses of pipelined requests, sent in order by one chain.
+    int resp_count;
+    struct iovec iov[2 * UR_PIPELINE_MAX];
+    struct msghdr msg;
+    bool keep_alive;     // Go on with the next request once the responses are sent.
+    bool renew;          // The next request is not the first one on this connection.
+    IdleNode idle;       // In the loop's idle list while waiting for a request.
+    struct ur_conn* next_free;
+    struct ur_conn* next_parked;
+} UrConn;
+
+// A response buffer while it is not in use.
+typedef struct ur_buf
+{
+    struct ur_buf* next_free;
+} UrBuf;
+
+typedef struct ur_loop
+{
+    int ring_fd;
+    unsigned char skip_success; // IOSQE_CQE_SKIP_SUCCESS if the kernel has it.
+    // Submission queue, shared with the kernel:
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;     // Queued entries, published to the kernel on submission.
+    struct io_uring_sqe* sqes;
+    // Completion queue, shared with the kernel:
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    // The mappings, to undo them:
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    size_t sqes_map_size;
+    // Provided receive buffers:
+    struct io_uring_buf_ring* buf_ring;
+    char* bufs;
+    unsigned short buf_tail;
+    // Free registered file slots:
+    int free_slots[URING_FILE_SLOTS];
+    int free_slots_num;
+
+    pthread_t thread;
+    struct thread_stats stats;
+    struct request_info req; // Scratch space to parse requests into.
+    UrConn* free_conns;      // Recycled connection states (only this loop touches them).
+    UrBuf* free_bufs;        // Recycled response buffers.
+    IdleList idle;           // Connections waiting for (the rest of) a request, oldest first.
+    struct __kernel_timespec tick; // The pending UR_TAG_TICK timeout, if tick_armed.
+    bool tick_armed;
+    RoomWaiter room;         // Woken up when a full system (block policy) has room again.
+    uint64_t room_count;     // What the pending UR_TAG_ROOM read reads.
+    UrConn* parked;          // Dynamic requests the system had no room for, oldest first.
+    UrConn* parked_tail;
+} UrLoop;
+
+// ********** System calls ********** //
+// There is no liburing here, the three io_uring system calls are used directly.
+
+static int urSetup(unsigned entries, struct io_uring_params* params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int urEnter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int urRegister(int ring_fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// ********** Ring setup ********** //
+
+/**
+ * Return true if the kernel supports every operation the loops queue.
+ */
+static bool urProbe(int ring_fd)
+{
+    static const int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG,
+                                 IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE, IORING_OP_TIMEOUT};
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if(!probe)
+    {
+        return false;
+    }
+    bool supported = urRegister(ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for(size_t i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++)
+    {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+static void urLoopDestroy(UrLoop* loop)
+{
+    if(loop->buf_ring)
+    {
+        munmap(loop->buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+    }
+    free(loop->bufs);
+    if(loop->sqes)
+    {
+        munmap(loop->sqes, loop->sqes_map_size);
+    }
+    if(loop->cq_map && loop->cq_map != loop->sq_map)
+    {
+        munmap(loop->cq_map, loop->cq_map_size);
+    }
+    if(loop->sq_map)
+    {
+        munmap(loop->sq_map, loop->sq_map_size);
+    }
+    if(loop->ring_fd >= 0)
+    {
+        close(loop->ring_fd);
+    }
+    if(loop->room.wake_fd >= 0)
+    {
+        close(loop->room.wake_fd);
+    }
+}
+
+/**
+ * Map the rings of loop->ring_fd. Return false on failure.
+ */
+static bool urMapRings(UrLoop* loop, struct io_uring_params* params)
+{
+    loop->sq_map_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    loop->cq_map_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params->features & IORING_FEAT_SINGLE_MMAP;
+    if(single_mmap && loop->cq_map_size > loop->sq_map_size)
+    {
+        loop->sq_map_size = loop->cq_map_size;
+    }
+
+    loop->sq_map = mmap(NULL, loop->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        loop->ring_fd, IORING_OFF_SQ_RING);
+    if(loop->sq_map == MAP_FAILED)
+    {
+        loop->sq_map = NULL;
+        return false;
+    }
+    loop->cq_map = single_mmap ? loop->sq_map
+                               : mmap(NULL, loop->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                      loop->ring_fd, IORING_OFF_CQ_RING);
+    if(loop->cq_map == MAP_FAILED)
+    {
+        loop->cq_map = NULL;
+        return false;
+    }
+    loop->sqes_map_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      loop->ring_fd, IORING_OFF_SQES);
+    if(loop->sqes == MAP_FAILED)
+    {
+        loop->sqes = NULL;
+        return false;
+    }
+
+    char* sq = loop->sq_map;
+    loop->sq_head = (unsigned*)(sq + params->sq_off.head);
+    loop->sq_tail = (unsigned*)(sq + params->sq_off.tail);
+    loop->sq_mask = *(unsigned*)(sq + params->sq_off.ring_mask);
+    loop->sq_entries = params->sq_entries;
+    loop->sq_local_tail = *loop->sq_tail;
+    unsigned* array = (unsigned*)(sq + params->sq_off.array);
+    for(unsigned i = 0; i < params->sq_entries; i++)
+    {
+        array[i] = i; // The entries are always queued in order.
+    }
+
+    char* cq = loop->cq_map;
+    loop->cq_head = (unsigned*)(cq + params->cq_off.head);
+    loop->cq_tail = (unsigned*)(cq + params->cq_off.tail);
+    loop->cq_mask = *(unsigned*)(cq + params->cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe*)(cq + params->cq_off.cqes);
+    return true;
+}
+
+/**
+ * Give the receive buffer bid (back) to the kernel.
+ */
+static void urRecycleBuf(UrLoop* loop, unsigned short bid)
+{
+    struct io_uring_buf* buf = &loop->buf_ring->bufs[loop->buf_tail & (URING_BUFS - 1)];
+    buf->addr = (unsigned long)(loop->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    loop->buf_tail++;
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Register the listening socket, the file slots and the receive buffers.
+ * Provided buffer rings came with multishot accept (Linux 5.19), so this also
+ * tells whether the accept can be multishot. Return false on failure.
+ */
+static bool urRegisterResources(UrLoop* loop, int listenfd)
+{
+    int files[URING_FILE_SLOTS + 1];
+    files[0] = listenfd;
+    for(int i = 1; i <= URING_FILE_SLOTS; i++)
+    {
+        files[i] = -1; // A sparse slot, filled by the openat of a static request.
+        loop->free_slots[loop->free_slots_num++] = i;
+    }
+    if(urRegister(loop->ring_fd, IORING_REGISTER_FILES, files, URING_FILE_SLOTS + 1) < 0)
+    {
+        return false;
+    }
+
+    loop->buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(loop->buf_ring == MAP_FAILED)
+    {
+        loop->buf_ring = NULL;
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)loop->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = 0;
+    if(urRegister(loop->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        return false;
+    }
+    if(!(loop->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE)))
+    {
+        return false;
+    }
+    for(int i = 0; i < URING_BUFS; i++)
+    {
+        urRecycleBuf(loop, i);
+    }
+    return true;
+}
+
+// ********** Submission ********** //
+
+/**
+ * Hand the queued entries to the kernel and, if wait, sleep until at least one completion.
+ */
+static void urSubmit(UrLoop* loop, bool wait)
+{
+    __atomic_store_n(loop->sq_tail, loop->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = loop->sq_local_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    if(urEnter(loop->ring_fd, to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0) < 0 &&
+       errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    {
+        unix_error("io_uring_enter error");
+    }
+}
+
+/**
+ * Make room for count entries, so that a chain is never split between two submissions.
+ */
+static void urReserve(UrLoop* loop, unsigned count)
+{
+    while(loop->sq_entries - (loop->sq_local_tail - __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE)) < count)
+    {
+        urSubmit(loop, false);
+    }
+}
+
+/**
+ * Return the next (cleared) submission entry. Room for it must have been reserved.
+ */
+static struct io_uring_sqe* urGetSqe(UrLoop* loop, int opcode, int fd, unsigned char flags, unsigned long long user_data)
+{
+    struct io_uring_sqe* sqe = &loop->sqes[loop->sq_local_tail++ & loop->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->flags = flags;
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+/**
+ * Return true if the kernel opens a file straight into a registered slot (file_index, Linux 5.15),
+ * which the chains of the small static files rely on. An older kernel would give the open a plain
+ * file descriptor and fail every such chain at its read. So try the same chain once: open
+ * /dev/null into a free slot, read it through the slot and close the slot.
+ * Called once the files are registered, before anything else is queued.
+ */
+static bool urProbeDirectOpen(UrLoop* loop)
+{
+    static const char path[] = "/dev/null";
+    int slot = loop->free_slots[loop->free_slots_num - 1];
+    int res[3] = {-1, -1, -1}; // By the user_data of the steps.
+    char byte;
+
+    urReserve(loop, 3);
+    struct io_uring_sqe* sqe = urGetSqe(loop, IORING_OP_OPENAT, AT_FDCWD, IOSQE_IO_LINK, 0);
+    sqe->addr = (unsigned long)path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = slot + 1;
+    sqe = urGetSqe(loop, IORING_OP_READ, slot, IOSQE_IO_LINK | IOSQE_FIXED_FILE, 1);
+    sqe->addr = (unsigned long)&byte;
+    sqe->len = 0; // Only the lookup of the slot is tried: a short read would cancel the close.
+    sqe = urGetSqe(loop, IORING_OP_CLOSE, 0, 0, 2);
+    sqe->file_index = slot + 1;
+
+    for(int seen = 0; seen < 3; )
+    {
+        urSubmit(loop, true);
+        unsigned head = *loop->cq_head;
+        for(; seen < 3 && head != __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE); head++, seen++)
+        {
+            struct io_uring_cqe* cqe = &loop->cqes[head & loop->cq_mask];
+            if(cqe->user_data < 3)
+            {
+                res[cqe->user_data] = cqe->res;
+            }
+        }
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if(res[0] > 0 && res[1] < 0)
+    {
+        close(res[0]); // The kernel ignored file_index and returned a file descriptor.
+    }
+    return res[0] == 0 && res[1] == 0 && res[2] == 0;
+}
+
+/**
+ * Create the ring of a loop. Return false if io_uring can not be used.
+ */
+static bool urLoopInit(UrLoop* loop, int listenfd)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
+    // Blocking: the ring polls it, and a write never waits for the counter to be read.
+    if((loop->room.wake_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+    {
+        return false;
+    }
+    if((loop->ring_fd = urSetup(URING_ENTRIES, &params)) < 0)
+    {
+        return false;
+    }
+    loop->skip_success = (params.features & IORING_FEAT_CQE_SKIP) ? IOSQE_CQE_SKIP_SUCCESS : 0;
+    return (params.features & IORING_FEAT_NODROP) && urProbe(loop->ring_fd) && urMapRings(loop, &params) &&
+           urRegisterResources(loop, listenfd) && urProbeDirectOpen(loop);
+}
+
+static void urArmAccept(UrLoop* loop)
+{
+    urReserve(loop, 1);
+    struct io_uring_sqe* sqe = urGetSqe(loop, IORING_OP_ACCEPT, 0, IOSQE_FIXED_FILE, UR_TAG_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/**
+ * Wait for loop->room.wake_fd, see RoomWaiter.
+ */
+static void urArmRoom(UrLoop* loop)
+{
+    urReserve(loop, 1);
+    struct io_uring_sqe* sqe = urGetSqe(loop, IORING_OP_READ, loop->room.wake_fd, 0, UR_TAG_ROOM);
+    sqe->addr = (unsigned long)&loop->room_count;
+    sqe->len = sizeof(loop->room_count);
+}
+
+/**
+ * Receive more of the request, into a provided buffer or (if they ran out) straight into conn->in.
+ */
+static void urArmRecv(UrLoop* loop, UrConn* conn, bool provided)
+{
+    urReserve(loop, 1);
+    struct io_uring_sqe* sqe = urGetSqe(loop, IORING_OP_RECV, conn->fd, provided ? IOSQE_BUFFER_SELECT : 0,
+                                        (unsigned long)conn | UR_TAG_RECV);
+    if(provided)
+    {
+        sqe->len = URING_BUF_SIZE;
+        sqe->buf_group = 0;
+    }
+    else
+    {
+        sqe->addr = (unsigned long)(conn->in + conn->in_len);
+        sqe->len = sizeof(conn->in) - 1 - conn->in_len;
+    }
+}
+
+/**
+ * Queue the responses of a connection as one chain: the open, read and close of every small
+ * file, one send of all the responses and, unless the connection goes on, its close.
+ * The last step reports UR_TAG_DONE.
+ */
+static void urQueueResponses(UrLoop* loop, UrConn* conn)
+{
+    unsigned char link = IOSQE_IO_LINK | loop->skip_success;
+    bool close_conn = !conn->keep_alive && !conn->cd->request; // A deferred dynamic request keeps it.
+    struct io_uring_sqe* sqe;
+    int iovcnt = 0;
+
+    urReserve(loop, URING_CHAIN_MAX);
+    for(int i = 0; i < conn->resp_count; i++)
+    {
+        UrResp* resp = &conn->resp[i];
+        conn->iov[iovcnt].iov_base = resp->out;
+        conn->iov[iovcnt++].iov_len = resp->out_len;
+        if(resp->body)
+        {
+            conn->iov[iovcnt].iov_base = resp->body;
+            conn->iov[iovcnt++].iov_len = resp->body_len;
+        }
+        if(!resp->file_slot)
+        {
+            continue;
+        }
+        conn->iov[iovcnt - 1].iov_len += resp->body_len;
+
+        sqe = urGetSqe(loop, IORING_OP_OPENAT, AT_FDCWD, link, UR_TAG_IGNORE);
+        sqe->addr = (unsigned long)resp->path;
+        sqe->open_flags = O_RDONLY;
+        sqe->file_index = resp->file_slot + 1; // Open straight into the slot, no file descriptor.
+
+        // A short read fails the chain, so a file that shrank since stat() is never sent.
+        sqe = urGetSqe(loop, IORING_OP_READ, resp->file_slot, link | IOSQE_FIXED_FILE, UR_TAG_IGNORE);
+        sqe->addr = (unsigned long)(resp->out + resp->out_len);
+        sqe->len = resp->body_len;
+
+        sqe = urGetSqe(loop, IORING_OP_CLOSE, 0, link, UR_TAG_IGNORE);
+        sqe->file_index = resp->file_slot + 1;
+    }
+
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = iovcnt;
+    // The send always completes with the bytes it sent (see urOnSent() and urOnDone()):
+    sqe = urGetSqe(loop, IORING_OP_SENDMSG, conn->fd, close_conn ? IOSQE_IO_LINK : 0,
+                   (unsigned long)conn | (close_conn ? UR_TAG_SENT : UR_TAG_DONE));
+    sqe->addr = (unsigned long)&conn->msg;
+    // MSG_WAITALL: a short send fails the chain instead of silently truncating the responses.
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    if(close_conn)
+    {
+        urGetSqe(loop, IORING_OP_CLOSE, conn->fd, 0, (unsigned long)conn | UR_TAG_DONE);
+    }
+}
+
+/**
+ * Make sure a timeout is pending for the oldest idle connection.
+ */
+static void urArmTick(UrLoop* loop)
+{
+    int wait_ms = idleListWaitMs(&loop->idle, idleNowMs());
+    if(loop->tick_armed || wait_ms < 0)
+    {
+        return;
+    }
+    loop->tick.tv_sec = wait_ms / 1000;
+    loop->tick.tv_nsec = (wait_ms % 1000) * 1000000LL;
+    urReserve(loop, 1);
+    struct io_uring_sqe* sqe = urGetSqe(loop, IORING_OP_TIMEOUT, -1, 0, UR_TAG_TICK);
+    sqe->addr = (unsigned long)&loop->tick;
+    sqe->len = 1;
+    loop->tick_armed = true;
+}
+
+// ********** Connection state ********** //
+
+static UrConn* urConnAlloc(UrLoop* loop)
+{
+    UrConn* conn = loop->free_conns;
+    if(conn)
+    {
+        loop->free_conns = conn->next_free;
+    }
+    else if(!(conn = malloc(sizeof(*conn))))
+    {
+        return NULL;
+    }
+    conn->in_len = 0;
+    conn->resp_count = 0;
+    conn->keep_alive = conn->renew = false;
+    conn->idle.prev = conn->idle.next = NULL;
+    return conn;
+}
+
+static char* urBufAlloc(UrLoop* loop)
+{
+    UrBuf* buf = loop->free_bufs;
+    if(buf)
+    {
+        loop->free_bufs = buf->next_free;
+        return (char*)buf;
+    }
+    return malloc(REQUEST_ERROR_BUFSIZE);
+}
+
+/**
+ * Release the queued responses of a connection.
+ */
+static void urConnClearResponses(UrLoop* loop, UrConn* conn)
+{
+    for(int i = 0; i < conn->resp_count; i++)
+    {
+        UrResp* resp = &conn->resp[i];
+        if(resp->out)
+        {
+            UrBuf* buf = (UrBuf*)resp->out;
+            buf->next_free = loop->free_bufs;
+            loop->free_bufs = buf;
+        }
+        if(resp->cached)
+        {
+            cacheRelease(resp->cached);
+        }
+        else if(resp->body)
+        {
+            munmap(resp->body, resp->body_len);
+        }
+        if(resp->file_slot)
+        {
+            // The slot may still hold the file, the next openat into it replaces it.
+            loop->free_slots[loop->free_slots_num++] = resp->file_slot;
+        }
+    }
+    conn->resp_count = 0;
+}
+
+/**
+ * Release the state of a connection. If close_fd, also close the socket and release its record.
+ */
+static void urConnFree(UrLoop* loop, UrConn* conn, bool close_fd)
+{
+    urConnClearResponses(loop, conn);
+    idleListRemove(&loop->idle, &conn->idle);
+    if(close_fd)
+    {
+        close(conn->fd);
+        serverFreeRequest(conn->cd);
+    }
+    conn->next_free = loop->free_conns;
+    loop->free_conns = conn;
+}
+
+// ********** Request handling ********** //
+
+/**
+ * Hand the dynamic request in cd->request to the worker threads. The loop forgets the connection.
+ * The socket was accepted in blocking mode, as the worker (and the CGI child) need.
+ * If the system is full under the block policy, the connection is parked (with no receive
+ * pending) until urOnRoom() finds room for it, so the loop goes on serving its other clients.
+ */
+static void urSubmitDynamic(UrLoop* loop, UrConn* conn)
+{
+    idleListRemove(&loop->idle, &conn->idle);
+    // Those parked before it go first, the loop is already waiting for room for them:
+    if(loop->parked || !serverOfferRequest(conn->cd, &loop->room))
+    {
+        conn->next_parked = NULL;
+        if(loop->parked_tail)
+        {
+            loop->parked_tail->next_parked = conn;
+        }
+        else
+        {
+            loop->parked = conn;
+        }
+        loop->parked_tail = conn;
+        return;
+    }
+    urConnFree(loop, conn, false);
+}
+
+/**
+ * Prepare a static response into resp. A cached file is sent from memory. Otherwise a file that
+ * fits in the response buffer is opened, read and closed by the response chain, and a larger one
+ * is memory-mapped here, as the epoll loops do.
+ * Return false if the connection should be dropped.
+ */
+static bool urPrepareStatic(UrLoop* loop, UrConn* conn, UrResp* resp)
+{
+    RequestInfo req = &loop->req;
+    size_t filesize = req->filesize;
+    size_t path_len = strlen(req->filename) + 1;
+    if((resp->cached = requestCacheAcquire(req)))
+    {
+        resp->body = (char*)cacheEntryData(resp->cached, &resp->body_len);
+    }
+    resp->out_len = requestStaticHeaders(conn->cd, &loop->stats, req, resp->out);
+    if(filesize == 0 || resp->cached)
+    {
+        return true;
+    }
+
+    if(resp->out_len + filesize + path_len <= REQUEST_ERROR_BUFSIZE && loop->free_slots_num > 0)
+    {
+        resp->file_slot = loop->free_slots[--loop->free_slots_num];
+        resp->body_len = filesize;
+        // Must outlive the scratch request until the openat is issued:
+        resp->path = resp->out + REQUEST_ERROR_BUFSIZE - path_len;
+        memcpy(resp->path, req->filename, path_len);
+        return true;
+    }
+
+    int srcfd = requestOpenStatic(req);
+    if(srcfd < 0)
+    {
+        return false;
+    }
+    resp->body = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+    close(srcfd);
+    if(resp->body == MAP_FAILED)
+    {
+        resp->body = NULL;
+        return false;
+    }
+    resp->body_len = filesize;
+    return true;
+}
+
+/**
+ * Parse the complete request head of head_len bytes at the start of conn->in, consume it
+ * and prepare its response.
+ * Return false if the connection was handed to the workers or dropped.
+ */
+static bool urHandleRequest(UrLoop* loop, UrConn* conn, int head_len)
+{
+    if(conn->renew)
+    {
+        serverRenewRequest(conn->cd);
+    }
+    conn->renew = true;
+
+    char* line_end = memchr(conn->in, '\n', head_len);
+    char next = conn->in[head_len]; // The first byte of a pipelined request, if any.
+    *line_end = '\0';
+    conn->in[head_len] = '\0';
+    conn->cd->dispatch_ns = timingNow();
+    requestParse(conn->in, &loop->req);
+    requestParseHeaders(conn->cd, line_end + 1, &loop->req);
+    conn->in[head_len] = next;
+    conn->in_len -= head_len;
+    memmove(conn->in, conn->in + head_len, conn->in_len);
+    conn->keep_alive = loop->req.keep_alive;
+
+    if(loop->req.kind == REQUEST_DYNAMIC)
+    {
+        ConnectionStruct cd = conn->cd;
+        if(!(cd->request = poolAllocBuffer(conn_pool, POOL_BUF_REQUEST)))
+        {
+            urConnFree(loop, conn, true);
+            return false;
+        }
+        *cd->request = loop->req;
+        if(conn->resp_count == 0)
+        {
+            urSubmitDynamic(loop, conn);
+            return false;
+        }
+        return true; // The worker takes over the socket once the responses before it are sent.
+    }
+
+    UrResp* resp = &conn->resp[conn->resp_count];
+    resp->body = NULL;
+    resp->body_len = 0;
+    resp->cached = NULL;
+    resp->file_slot = 0;
+    if(!(resp->out = urBufAlloc(loop)))
+    {
+        urConnFree(loop, conn, true);
+        return false;
+    }
+    conn->resp_count++; // From now on it is released with the others.
+    if(loop->req.kind == REQUEST_STATIC)
+    {
+        if(!urPrepareStatic(loop, conn, resp))
+        {
+            urConnFree(loop, conn, true);
+            return false;
+        }
+        latencyRecord(conn->cd, REQUEST_STATIC); // Its response is sent with the next submission.
+        return true;
+    }
+    if(loop->req.kind == REQUEST_STATS)
+    {
+        // Released with munmap() like a mapped file:
+        if(!(resp->body = requestStatsBody(&loop->req, &resp->body_len)))
+        {
+            urConnFree(loop, conn, true);
+            return false;
+        }
+        resp->out_len = requestStatsHeaders(conn->cd, &loop->req, resp->body_len, resp->out);
+        return true;
+    }
+    resp->out_len = requestErrorResponse(conn->cd, &loop->stats, &loop->req, resp->out);
+    latencyRecord(conn->cd, REQUEST_ERROR);
+    return true;
+}
+
+/**
+ * Answer the complete requests buffered in conn->in in order, with one chain,
+ * or wait for (the rest of) a request, at most --keepalive-timeout.
+ */
+static void urProcess(UrLoop* loop, UrConn* conn)
+{
+    int head_len;
+    while(conn->resp_count < UR_PIPELINE_MAX && (conn->resp_count == 0 || conn->keep_alive) &&
+          (head_len = requestHeadLength(conn->in, conn->in_len)) > 0)
+    {
+        idleListRemove(&loop->idle, &conn->idle);
+        if(!urHandleRequest(loop, conn, head_len))
+        {
+            return;
+        }
+    }
+
+    if(conn->resp_count > 0)
+    {
+        urQueueResponses(loop, conn);
+        return;
+    }
+    if(conn->in_len == sizeof(conn->in) - 1)
+    {
+        urConnFree(loop, conn, true); // The request head does not fit, drop the client.
+        return;
+    }
+    if(!conn->idle.next) // Not waiting already: the keep-alive timeout starts now.
+    {
+        idleListPush(&loop->idle, &conn->idle, conn, idleNowMs() + server_config.keepalive_timeout_ms);
+    }
+    urArmRecv(loop, conn, true);
+}
+
+static void urOnRecv(UrLoop* loop, UrConn* conn, int res, unsigned flags)
+{
+    int room = sizeof(conn->in) - 1 - conn->in_len;
+    if(flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(res > 0 && res <= room)
+        {
+            memcpy(conn->in + conn->in_len, loop->bufs + (size_t)bid * URING_BUF_SIZE, res);
+            conn->in_len += res;
+        }
+        urRecycleBuf(loop, bid);
+        if(res > room)
+        {
+            urConnFree(loop, conn, true); // The request head does not fit, drop the client.
+            return;
+        }
+    }
+    else if(res > 0)
+    {
+        conn->in_len += res; // Received straight into conn->in.
+    }
+
+    if(res == -ENOBUFS)
+    {
+        urArmRecv(loop, conn, false); // All the provided buffers are in use.
+        return;
+    }
+    if(res <= 0)
+    {
+        urConnFree(loop, conn, true); // The client left (or broke) before sending a whole request.
+        return;
+    }
+    urProcess(loop, conn);
+}
+
+static void urOnAccept(UrLoop* loop, int res, unsigned flags)
+{
+    if(!(flags & IORING_CQE_F_MORE))
+    {
+        urArmAccept(loop); // The multishot accept stopped (e.g. on an error), start it again.
+    }
+    if(res < 0)
+    {
+        if(res != -EINTR && res != -ECONNABORTED && res != -EAGAIN)
+        {
+            fprintf(stderr, "Error: io_uring accept failed: %s\n", strerror(-res));
+        }
+        return;
+    }
+
+    UrConn* conn = urConnAlloc(loop);
+    ConnectionStruct cd = conn ? serverNewRequest(res) : NULL;
+    if(!cd)
+    {
+        if(conn)
+        {
+            conn->next_free = loop->free_conns;
+            loop->free_conns = conn;
+        }
+        close(res);
+        return;
+    }
+    conn->fd = res;
+    conn->cd = cd;
+    urProcess(loop, conn);
+}
+
+/**
+ * The last step of a response chain completed. If the chain failed on the way,
+ * the close was cancelled and the connection is closed here.
+ * A connection that goes on once its responses were sent answers the requests it already
+ * received, or waits for the next one. A deferred dynamic request goes to the workers.
+ */
+static void urOnDone(UrLoop* loop, UrConn* conn, int res)
+{
+    if(res > 0)
+    {
+        statsAddSent(res); // The chain ended with its send, res is what it sent. A close gives 0.
+    }
+    if(conn->keep_alive || conn->cd->request)
+    {
+        if(res < 0)
+        {
+            urConnFree(loop, conn, true);
+            return;
+        }
+        urConnClearResponses(loop, conn);
+        if(conn->cd->request)
+        {
+            urSubmitDynamic(loop, conn);
+            return;
+        }
+        urProcess(loop, conn);
+        return;
+    }
+    if(res == -ECANCELED)
+    {
+        close(conn->fd);
+    }
+    serverFreeRequest(conn->cd);
+    urConnFree(loop, conn, false);
+}
+
+/**
+ * The send of a chain that closes the connection completed: count what it sent.
+ * The close is still pending, conn must not be touched.
+ */
+static void urOnSent(int res)
+{
+    if(res > 0)
+    {
+        statsAddSent(res);
+    }
+}
+
+/**
+ * The eventfd of the loop was written: submit the parked connections in order,
+ * until the system is full again, and wait for the next time.
+ */
+static void urOnRoom(UrLoop* loop)
+{
+    while(loop->parked && serverOfferRequest(loop->parked->cd, &loop->room))
+    {
+        UrConn* conn = loop->parked;
+        if(!(loop->parked = conn->next_parked))
+        {
+            loop->parked_tail = NULL;
+        }
+        urConnFree(loop, conn, false);
+    }
+    urArmRoom(loop);
+}
+
+/**
+ * Stop the connections that stayed idle for too long. Their receive is still pending,
+ * shutting the socket down completes it with 0 and the connection is freed there.
+ */
+static void urOnTick(UrLoop* loop)
+{
+    long long now = idleNowMs();
+    UrConn* expired = NULL;
+    loop->tick_armed = false;
+    while((expired = idleListPopExpired(&loop->idle, now)))
+    {
+        shutdown(expired->fd, SHUT_RDWR);
+    }
+}
+
+static void* uringThread(void* args)
+{
+    UrLoop* loop = (UrLoop*)args;
+    urArmAccept(loop);
+    urArmRoom(loop);
+
+    while(1)
+    {
+        urSubmit(loop, true);
+
+        unsigned head = *loop->cq_head;
+        while(head != __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe* cqe = &loop->cqes[head & loop->cq_mask];
+            unsigned long long user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __atomic_store_n(loop->cq_head, ++head, __ATOMIC_RELEASE);
+
+            UrConn* conn = (UrConn*)(unsigned long)(user_data & ~UR_TAG_MASK);
+            switch(user_data & UR_TAG_MASK)
+            {
+                case UR_TAG_ACCEPT:
+                    urOnAccept(loop, res, flags);
+                    break;
+                case UR_TAG_RECV:
+                    urOnRecv(loop, conn, res, flags);
+                    break;
+                case UR_TAG_DONE:
+                    urOnDone(loop, conn, res);
+                    break;
+                case UR_TAG_TICK:
+                    urOnTick(loop);
+                    break;
+                case UR_TAG_SENT:
+                    urOnSent(res);
+                    break;
+                case UR_TAG_ROOM:
+                    urOnRoom(loop);
+                    break;
+                default:
+                    break;
+            }
+        }
+        urArmTick(loop);
+    }
+    return NULL;
+}
+
+void uringRun(int listenfd, int loops, int first_thread_id)
+{
+    UrLoop* ur_loops = calloc(loops, sizeof(*ur_loops));
+    if(!ur_loops)
+    {
+        return;
+    }
+
+    for(int i = 0; i < loops; i++)
+    {
+        ur_loops[i].ring_fd = -1;
+        ur_loops[i].room.wake_fd = -1;
+    }
+    for(int i = 0; i < loops; i++)
+    {
+        UrLoop* loop = &ur_loops[i];
+        loop->stats.thread_id = first_thread_id + i;
+        idleListInit(&loop->idle);
+        if(!urLoopInit(loop, listenfd))
+        {
+            for(int j = 0; j <= i; j++)
+            {
+                urLoopDestroy(&ur_loops[j]);
+            }
+            free(ur_loops);
+            return;
+        }
+    }
+
+    for(int i = 0; i < loops; i++)
+    {
+        statsRegisterThread(&ur_loops[i].stats); // Only once every loop is up: a failed start falls back to epoll.
+    }
+    signal(SIGPIPE, SIG_IGN); // The sends use MSG_NOSIGNAL, the workers answering CGI requests do not.
+    evloopRaiseFdLimit();
+
+    for(int i = 1; i < loops; i++)
+    {
+        if(pthread_create(&ur_loops[i].thread, NULL, uringThread, &ur_loops[i]) != 0)
+        {
+            fprintf(stderr, "Error: io_uring loop number %d failed to create: %s\n", i, strerror(errno));
+        }
+    }
+    uringThread(&ur_loops[0]);
+}
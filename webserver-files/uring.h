@@ -0,0 +1,26 @@
+#ifndef _URING_INC
+#define _URING_INC
+
+#include "connection.h"
+
+// ********** io_uring Engine ********** //
+// The event loops of evloop.h, with every socket and file operation queued on
+// an io_uring instead of being issued one system call at a time:
+//  - a multishot accept on the (registered) listening socket,
+//  - receives into a ring of provided buffers,
+//  - the responses are one linked chain: open, read (through a registered
+//    file slot) and close each small file, send, close the connection; the
+//    responses of pipelined requests share the chain and a single sendmsg,
+//  - dynamic (CGI) requests go to the worker threads, as with the epoll loops,
+//    and wait for room parked on the loop, woken up by a read of its eventfd.
+// A loop submits everything it queued and waits for completions in one io_uring_enter().
+
+/**
+ * Run loops io_uring event loop threads on listenfd. The calling thread becomes one of them.
+ * The ThreadStats of the loops get ids first_thread_id, first_thread_id + 1, ...
+ * Returns only if io_uring (or one of the features above) is not available,
+ * before any loop was started, so the caller can fall back to another engine.
+ */
+void uringRun(int listenfd, int loops, int first_thread_id);
+
+#endif
@@ -0,0 +1,230 @@
+#include "watch.h"
+#include <sys/inotify.h>
+#include <dirent.h>
+
+#define WATCH_MAX_HANDLERS 4
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// A watched directory (the root or one of its subdirectories).
+typedef struct watch_dir
+{
+    int wd;
+    char *dir;
+} WatchDir;
+
+typedef struct watch_subscriber
+{
+    WatchHandler handler;
+    void *owner;
+} WatchSubscriber;
+
+struct file_watcher
+{
+    int inotify_fd;
+    pthread_t thread;
+    WatchDir *dirs;            // Only the watcher thread touches them once it runs.
+    int dirs_num;
+    int dirs_cap;
+    pthread_mutex_t lock;      // Protects the subscribers.
+    WatchSubscriber subscribers[WATCH_MAX_HANDLERS];
+    int subscribers_num;
+};
+
+bool watchNormalize(const char *path, char *key, size_t key_size)
+{
+    size_t len = 0;
+    for(const char *c = path; *c; c++)
+    {
+        if(*c == '/' && len > 0 && key[len - 1] == '/')
+        {
+            continue;
+        }
+        if(*c == '.' && c > path && c[-1] == '/' && (c[1] == '/' || c[1] == '\0' || (c[1] == '.' && (c[2] == '/' || c[2] == '\0'))))
+        {
+            return false;
+        }
+        if(len + 1 == key_size)
+        {
+            return false;
+        }
+        key[len++] = *c;
+    }
+    key[len] = '\0';
+    return true;
+}
+
+/**
+ * Watch dir and (recursively) its subdirectories. Return false if dir itself can not be watched.
+ */
+static bool watchDir(FileWatcher watcher, const char *dir)
+{
+    int wd = inotify_add_watch(watcher->inotify_fd, dir, WATCH_MASK);
+    if(wd < 0)
+    {
+        return false;
+    }
+    if(watcher->dirs_num == watcher->dirs_cap)
+    {
+        int cap = watcher->dirs_cap ? 2 * watcher->dirs_cap : 16;
+        WatchDir *dirs = realloc(watcher->dirs, cap * sizeof(*dirs));
+        if(!dirs)
+        {
+            return true; // Its events are ignored, the caches still check what they can (e.g. sizes).
+        }
+        watcher->dirs = dirs;
+        watcher->dirs_cap = cap;
+    }
+    watcher->dirs[watcher->dirs_num].wd = wd;
+    if(!(watcher->dirs[watcher->dirs_num].dir = strdup(dir)))
+    {
+        return true;
+    }
+    watcher->dirs_num++;
+
+    DIR *stream = opendir(dir);
+    if(!stream)
+    {
+        return true;
+    }
+    struct dirent *item;
+    char path[MAXLINE];
+    while((item = readdir(stream)))
+    {
+        if(item->d_type == DT_DIR && strcmp(item->d_name, ".") && strcmp(item->d_name, "..") &&
+           snprintf(path, sizeof(path), "%s/%s", dir, item->d_name) < (int)sizeof(path))
+        {
+            watchDir(watcher, path);
+        }
+    }
+    closedir(stream);
+    return true;
+}
+
+static const char* watchedDir(FileWatcher watcher, int wd)
+{
+    for(int i = 0; i < watcher->dirs_num; i++)
+    {
+        if(watcher->dirs[i].wd == wd)
+        {
+            return watcher->dirs[i].dir;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Tell every subscriber that path (NULL: any file) changed.
+ */
+static void watchNotify(FileWatcher watcher, const char *path)
+{
+    pthread_mutex_lock(&watcher->lock);
+    int num = watcher->subscribers_num;
+    pthread_mutex_unlock(&watcher->lock);
+    for(int i = 0; i < num; i++) // Subscribers are only ever added.
+    {
+        watcher->subscribers[i].handler(watcher->subscribers[i].owner, path);
+    }
+}
+
+static void* watchThread(void *args)
+{
+    FileWatcher watcher = (FileWatcher)args;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[MAXLINE];
+
+    while(1)
+    {
+        ssize_t len = read(watcher->inotify_fd, events, sizeof(events));
+        if(len <= 0)
+        {
+            if(len < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "Error: file watcher failed, changed files may be served stale: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        const struct inotify_event *event = NULL;
+        for(char *next = events; next < events + len; next += sizeof(*event) + event->len)
+        {
+            event = (const struct inotify_event*)next;
+            const char *dir = watchedDir(watcher, event->wd);
+            if(event->mask & IN_Q_OVERFLOW)
+            {
+                watchNotify(watcher, NULL); // Events were lost.
+                continue;
+            }
+            if(!dir || event->len == 0)
+            {
+                if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+                {
+                    watchNotify(watcher, NULL);
+                }
+                continue;
+            }
+            if(snprintf(path, sizeof(path), "%s/%s", dir, event->name) >= (int)sizeof(path))
+            {
+                continue;
+            }
+            if(!(event->mask & IN_ISDIR))
+            {
+                watchNotify(watcher, path);
+            }
+            else if(event->mask & (IN_CREATE | IN_MOVED_TO))
+            {
+                watchNotify(watcher, NULL); // A directory moved in may replace known files.
+                watchDir(watcher, path);
+            }
+            else if(event->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                watchNotify(watcher, NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+FileWatcher watchCreate(const char *root)
+{
+    FileWatcher watcher = calloc(1, sizeof(*watcher));
+    if(!watcher)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&watcher->lock, NULL);
+    if((watcher->inotify_fd = inotify_init1(IN_CLOEXEC)) < 0)
+    {
+        free(watcher);
+        return NULL;
+    }
+    if(!watchDir(watcher, root) || pthread_create(&watcher->thread, NULL, watchThread, watcher) != 0)
+    {
+        close(watcher->inotify_fd);
+        for(int i = 0; i < watcher->dirs_num; i++)
+        {
+            free(watcher->dirs[i].dir);
+        }
+        free(watcher->dirs);
+        free(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+
+bool watchAddHandler(FileWatcher watcher, WatchHandler handler, void *owner)
+{
+    pthread_mutex_lock(&watcher->lock);
+    // <CRITICAL>
+    bool added = watcher->subscribers_num < WATCH_MAX_HANDLERS;
+    if(added)
+    {
+        watcher->subscribers[watcher->subscribers_num].handler = handler;
+        watcher->subscribers[watcher->subscribers_num].owner = owner;
+        watcher->subscribers_num++;
+    }
+    // <CRITICAL-END>
+    pthread_mutex_unlock(&watcher->lock);
+    return added;
+}
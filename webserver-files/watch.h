@@ -0,0 +1,39 @@
+#ifndef _WATCH_INC
+#define _WATCH_INC
+
+#include "segel.h"
+#include <stdbool.h>
+
+// ********** File Watcher ********** //
+// A thread watches a directory tree with inotify and tells the caches built over it
+// which files changed, were replaced or were deleted, so they drop what they know of them.
+typedef struct file_watcher* FileWatcher;
+
+/**
+ * Called on the watcher thread with the path (under the watched root) of a file that changed,
+ * or with NULL when any file may have changed (lost events, directories moved around).
+ */
+typedef void (*WatchHandler)(void *owner, const char *path);
+
+// The watcher of ./public, NULL when no cache needs it (or it could not be created).
+extern FileWatcher file_watcher;
+
+/**
+ * Copy path to key in the form the handlers get it: without repeated slashes
+ * ("./public//a.html" is "./public/a.html"). Return false if it does not fit, or if
+ * it has "." or ".." components after the first one (the watcher never reports such a path).
+ */
+bool watchNormalize(const char *path, char *key, size_t key_size);
+
+/**
+ * Watch root and (recursively) its subdirectories. Return NULL on failure
+ * (including when root can not be watched).
+ */
+FileWatcher watchCreate(const char *root);
+
+/**
+ * Call handler(owner, path) on every change from now on. Return false if there is no room left.
+ */
+bool watchAddHandler(FileWatcher watcher, WatchHandler handler, void *owner);
+
+#endif
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE // splice
+#include "zerocopy.h"
+#include <sys/sendfile.h>
+
+#define ZCOPY_PIPE_SIZE (1 << 20) // Asked for, the kernel may keep the default 64 KB.
+
+// The pipe ZERO_COPY_SPLICE moves the pages through, one per thread.
+static __thread int zcopy_pipe[2] = {-1, -1};
+static __thread size_t zcopy_pipe_size = 0;
+
+static bool zcopyPipeOpen()
+{
+    if(zcopy_pipe[0] >= 0)
+    {
+        return true;
+    }
+    if(pipe2(zcopy_pipe, O_CLOEXEC) < 0)
+    {
+        return false;
+    }
+    int size = fcntl(zcopy_pipe[1], F_SETPIPE_SZ, ZCOPY_PIPE_SIZE);
+    if(size < 0)
+    {
+        size = fcntl(zcopy_pipe[1], F_GETPIPE_SZ);
+    }
+    zcopy_pipe_size = size > 0 ? size : 65536;
+    return true;
+}
+
+/**
+ * Throw the pipe away, after a failure left bytes in it.
+ */
+static void zcopyPipeClose()
+{
+    close(zcopy_pipe[0]);
+    close(zcopy_pipe[1]);
+    zcopy_pipe[0] = zcopy_pipe[1] = -1;
+}
+
+/**
+ * Move one pipe load of the file to the socket.
+ */
+static ssize_t zcopySplice(int sockfd, int srcfd, off_t *offset, size_t len)
+{
+    if(!zcopyPipeOpen())
+    {
+        return -1;
+    }
+    size_t chunk = len < zcopy_pipe_size ? len : zcopy_pipe_size;
+    ssize_t filled = splice(srcfd, offset, zcopy_pipe[1], NULL, chunk, SPLICE_F_MOVE);
+    if(filled <= 0)
+    {
+        return filled;
+    }
+    // SPLICE_F_MORE holds a partial segment back, only until the rest of the file follows:
+    unsigned int flags = SPLICE_F_MOVE | ((size_t)filled < len ? SPLICE_F_MORE : 0);
+    for(ssize_t left = filled; left > 0; )
+    {
+        ssize_t sent = splice(zcopy_pipe[0], NULL, sockfd, NULL, left, flags);
+        if(sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(sent <= 0)
+        {
+            int error = errno;
+            zcopyPipeClose();
+            errno = error;
+            return -1;
+        }
+        left -= sent;
+    }
+    return filled;
+}
+
+ssize_t zcopySend(int sockfd, int srcfd, off_t *offset, size_t len, ZeroCopyMode mode)
+{
+    if(mode == ZERO_COPY_SPLICE)
+    {
+        return zcopySplice(sockfd, srcfd, offset, len);
+    }
+    return sendfile(sockfd, srcfd, offset, len);
+}
+
+bool zcopySendAll(int sockfd, int srcfd, size_t len, ZeroCopyMode mode)
+{
+    off_t offset = 0;
+    while((size_t)offset < len)
+    {
+        ssize_t sent = zcopySend(sockfd, srcfd, &offset, len - offset, mode);
+        if(sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(sent <= 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool zcopySendMore(int sockfd, const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t sent = send(sockfd, buf, len, MSG_MORE | MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if(sent <= 0)
+        {
+            return false;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return true;
+}
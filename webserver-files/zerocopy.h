@@ -0,0 +1,36 @@
+#ifndef _ZEROCOPY_INC
+#define _ZEROCOPY_INC
+
+#include "segel.h"
+#include "config.h"
+
+// ********** Zero-Copy File Sending ********** //
+// Sends a file to a socket straight from the page cache, instead of mapping it
+// into the address space (and unmapping it, on every CPU that ran the thread) or
+// copying it through a user buffer:
+//  - ZERO_COPY_SENDFILE: sendfile(), the kernel moves the pages in one call,
+//  - ZERO_COPY_SPLICE:   splice() from the file into a pipe and from the pipe
+//    into the socket. The pipe belongs to the calling thread and is reused.
+// The headers of the response are sent first with MSG_MORE, so they leave in the
+// same segment as the beginning of the file.
+
+/**
+ * Send one chunk of at most len bytes of srcfd, from *offset on, to sockfd, and advance *offset.
+ * ZERO_COPY_SPLICE needs a blocking socket.
+ * Return the number of bytes sent, or -1 with errno set (EAGAIN if a non-blocking socket is full).
+ */
+ssize_t zcopySend(int sockfd, int srcfd, off_t *offset, size_t len, ZeroCopyMode mode);
+
+/**
+ * Send len bytes of srcfd from its start to the blocking socket sockfd.
+ * Return false if the connection broke (or the file shrank) on the way.
+ */
+bool zcopySendAll(int sockfd, int srcfd, size_t len, ZeroCopyMode mode);
+
+/**
+ * Send len bytes of buf with MSG_MORE (more data follows right away) to the blocking socket sockfd.
+ * Return false if the connection broke.
+ */
+bool zcopySendMore(int sockfd, const char *buf, size_t len);
+
+#endif